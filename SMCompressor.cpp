@@ -0,0 +1,210 @@
+#include <cstring>
+#include <algorithm>
+
+#include "SMCompressor.h"
+
+static inline uint32_t read32(const char *ptr) {
+    uint32_t val;
+    std::memcpy(&val, ptr, sizeof(val));
+    return val;
+}
+
+static inline uint32_t hash32(uint32_t val) {
+    return (val * 2654435761U) >> (32 - SMC_HASH_LOG);
+}
+
+static inline uint8_t *write_length(uint8_t *op, uint32_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+SMCompressor::SMCompressor(const char *dict, uint32_t dict_size) {
+    //окно LZ4 - 64 Кб, дальше хвоста словаря ссылаться нельзя
+    if (dict_size > SMC_MAX_DICT_SIZE) {
+        dict += dict_size - SMC_MAX_DICT_SIZE;
+        dict_size = SMC_MAX_DICT_SIZE;
+    }
+    _dict = dict;
+    _dict_size = dict_size;
+    _dict_table.assign(1U << SMC_HASH_LOG, 0);
+    for (uint32_t i = 0; i + SMC_MIN_MATCH <= dict_size; i++) {
+        _dict_table[hash32(read32(dict + i))] = i + 1;
+    }
+}
+
+uint32_t SMCompressor::bound(uint32_t size) {
+    return size + size / 255 + 16;
+}
+
+uint32_t SMCompressor::compress(const char *src, uint32_t size, char *dst, uint32_t capacity) const {
+    //позиции храним со сдвигом на 1, ноль - пустая ячейка
+    thread_local std::vector<uint32_t> table;
+    table.assign(1U << SMC_HASH_LOG, 0);
+
+    const char *ip = src;
+    const char *anchor = src;
+    const char *iend = src + size;
+    auto *op = (uint8_t *) dst;
+    auto *oend = (uint8_t *) dst + capacity;
+
+    if (size > SMC_MATCH_LIMIT) {
+        const char *mflimit = iend - SMC_MATCH_LIMIT;
+        const char *matchlimit = iend - SMC_LAST_LITERALS;
+        while (ip <= mflimit) {
+            uint32_t seq = read32(ip);
+            uint32_t hash = hash32(seq);
+            auto pos = (uint32_t) (ip - src);
+            const char *ref = nullptr;
+            const char *ref_limit = matchlimit;
+            uint32_t offset = 0;
+
+            uint32_t candidate = table[hash];
+            table[hash] = pos + 1;
+            if (candidate && pos - (candidate - 1) <= SMC_MAX_DISTANCE && read32(src + candidate - 1) == seq) {
+                ref = src + candidate - 1;
+                offset = pos - (candidate - 1);
+            } else if (_dict_size) {
+                //совпадение в словаре, он логически лежит прямо перед src
+                candidate = _dict_table[hash];
+                if (candidate && pos + _dict_size - (candidate - 1) <= SMC_MAX_DISTANCE &&
+                    read32(_dict + candidate - 1) == seq) {
+                    ref = _dict + candidate - 1;
+                    ref_limit = _dict + _dict_size;
+                    offset = pos + _dict_size - (candidate - 1);
+                }
+            }
+            if (ref == nullptr) {
+                ip++;
+                continue;
+            }
+
+            const char *mp = ip + SMC_MIN_MATCH;
+            const char *rp = ref + SMC_MIN_MATCH;
+            while (mp < matchlimit && rp < ref_limit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+            auto literals = (uint32_t) (ip - anchor);
+            auto match = (uint32_t) (mp - ip) - SMC_MIN_MATCH;
+
+            if (op + 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1 > oend) {
+                return 0;
+            }
+            uint8_t *token = op++;
+            *token = (uint8_t) (std::min(literals, 15U) << 4);
+            if (literals >= 15) {
+                op = write_length(op, literals - 15);
+            }
+            std::memcpy(op, anchor, literals);
+            op += literals;
+            *op++ = (uint8_t) (offset & 0xff);
+            *op++ = (uint8_t) (offset >> 8);
+            *token |= (uint8_t) std::min(match, 15U);
+            if (match >= 15) {
+                op = write_length(op, match - 15);
+            }
+
+            ip = mp;
+            anchor = ip;
+            table[hash32(read32(ip - 2))] = (uint32_t) (ip - 2 - src) + 1;
+        }
+    }
+
+    //хвост всегда литералами
+    auto literals = (uint32_t) (iend - anchor);
+    if (op + 1 + literals / 255 + 1 + literals > oend) {
+        return 0;
+    }
+    uint8_t *token = op++;
+    *token = (uint8_t) (std::min(literals, 15U) << 4);
+    if (literals >= 15) {
+        op = write_length(op, literals - 15);
+    }
+    std::memcpy(op, anchor, literals);
+    op += literals;
+    return (uint32_t) ((char *) op - dst);
+}
+
+int64_t SMCompressor::decompress(const char *src, uint32_t size, char *dst, uint32_t capacity,
+                                 const char *dict, uint32_t dict_size) {
+    if (dict_size > SMC_MAX_DICT_SIZE) {
+        dict += dict_size - SMC_MAX_DICT_SIZE;
+        dict_size = SMC_MAX_DICT_SIZE;
+    }
+    auto *ip = (const uint8_t *) src;
+    auto *iend = ip + size;
+    auto *op = (uint8_t *) dst;
+    auto *ostart = op;
+    auto *oend = op + capacity;
+
+    while (ip < iend) {
+        uint32_t token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            uint8_t byte;
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                byte = *ip++;
+                literals += byte;
+            } while (byte == 255);
+        }
+        if (literals > (size_t) (iend - ip) || literals > (size_t) (oend - op)) {
+            return -1;
+        }
+        std::memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15) {
+            uint8_t byte;
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                byte = *ip++;
+                match += byte;
+            } while (byte == 255);
+        }
+        match += SMC_MIN_MATCH;
+        if (offset == 0 || match > (size_t) (oend - op)) {
+            return -1;
+        }
+
+        auto produced = (size_t) (op - ostart);
+        const uint8_t *mp;
+        if (offset > produced) {
+            //начало совпадения в словаре
+            size_t back = offset - produced;
+            if (back > dict_size) {
+                return -1;
+            }
+            size_t from_dict = std::min(back, match);
+            std::memcpy(op, dict + dict_size - back, from_dict);
+            op += from_dict;
+            match -= from_dict;
+            mp = ostart;
+        } else {
+            mp = op - offset;
+        }
+        //области могут перекрываться, копируем побайтно
+        while (match--) {
+            *op++ = *mp++;
+        }
+    }
+    return op - ostart;
+}
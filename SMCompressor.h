@@ -0,0 +1,33 @@
+#ifndef SMC_SMCOMPRESSOR_H
+#define SMC_SMCOMPRESSOR_H
+
+#include <cstdint>
+#include <vector>
+
+#define SMC_HASH_LOG 12
+#define SMC_MIN_MATCH 4
+#define SMC_MAX_DISTANCE 65535
+#define SMC_LAST_LITERALS 5
+#define SMC_MATCH_LIMIT 12
+#define SMC_MAX_DICT_SIZE 65536
+
+// Блочный формат LZ4: выход читается LZ4_decompress_safe_usingDict
+class SMCompressor {
+public:
+    explicit SMCompressor(const char *dict = nullptr, uint32_t dict_size = 0);
+
+    static uint32_t bound(uint32_t size);
+
+    uint32_t compress(const char *src, uint32_t size, char *dst, uint32_t capacity) const;
+
+    static int64_t decompress(const char *src, uint32_t size, char *dst, uint32_t capacity,
+                              const char *dict = nullptr, uint32_t dict_size = 0);
+
+private:
+    const char *_dict;
+    uint32_t _dict_size;
+    std::vector<uint32_t> _dict_table;
+};
+
+
+#endif //SMC_SMCOMPRESSOR_H
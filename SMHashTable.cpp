@@ -1,66 +1,757 @@
 #include <vector>
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <csignal>
+#include <cerrno>
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <functional>
+#include <random>
+#include <unordered_map>
 
 
 #include "SMHashTable.h"
+#include "SMCompressor.h"
+#include "SMTrace.h"
 
-SMHashTable::SMHashTable(std::string name, int key_count, int data_count, int data_block_size) :
-        _key_count(key_count), _data_count(data_count), _data_block_size(data_block_size), _name(std::move(name)) {
-    // https://man7.org/linux/man-pages/man3/shm_open.3.html
-    bool created = false;
-    _mem_descriptor = shm_open(_name.c_str(), O_RDWR, ALLPERMS);
+static long futex(uint32_t *addr, int op, uint32_t val, const struct timespec *timeout) {
+    //сегмент общий для процессов, поэтому без FUTEX_PRIVATE_FLAG
+    return syscall(SYS_futex, addr, op, val, timeout, nullptr, 0);
+}
+
+static void run_parallel(uint32_t threads, const std::function<void(uint32_t)> &task) {
+    std::vector<std::thread> pool;
+    for (uint32_t t = 1; t < threads; t++) {
+        pool.emplace_back(task, t);
+    }
+    task(0);
+    for (auto &thread : pool) {
+        thread.join();
+    }
+}
+
+static bool process_dead(uint32_t pid) {
+    return pid != 0 && kill((pid_t) pid, 0) != 0 && errno == ESRCH;
+}
+
+static uint32_t random_seed(uint32_t except) {
+    std::random_device random;
+    uint32_t seed;
+    do {
+        seed = random();
+    } while (seed == except);
+    return seed;
+}
+
+static int64_t now_ns() {
+    struct timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+SMHashTable::SMHashTable(std::string name, uint64_t key_count, uint64_t data_count, uint32_t data_block_size, open_mode mode,
+                         uint32_t features, uint64_t table_buckets) :
+        SMSegment(std::move(name), mode),
+        _key_count(key_count), _data_count(data_count), _data_block_size(data_block_size) {
+    _superblock_ptr = nullptr;
+    _service_ptr = nullptr;
+    _versions_ptr = nullptr;
+    _filter_ptr = nullptr;
     if (_mem_descriptor == -1) {
-        _mem_descriptor = shm_open(_name.c_str(), O_RDWR | O_CREAT, ALLPERMS);
-        created = true;
-    }
-    //расчет объема памяти
-    _service_size = sizeof(pthread_mutex_t);
-    _header_size = sizeof(struct header);
-    _header_len = _header_size * key_count;
-    _data_len = data_block_size * data_count;
-    _memory_size = _header_len + data_count + _data_len;
-    ftruncate(_mem_descriptor, _memory_size);
-
-    _service_ptr =  (struct service *)mmap(nullptr, _memory_size, PROT_READ | PROT_WRITE, MAP_SHARED, _mem_descriptor, 0);
+        return;
+    }
+
+    struct superblock sb{};
+    if (_created) {
+        //номера блоков и корзин 32-битные, объем сегмента - нет
+        if (key_count == 0 || key_count + table_buckets > SMHT_MAX_BLOCKS || data_count == 0 ||
+            data_count > SMHT_MAX_BLOCKS) {
+            std::cerr << _name << ": key_count + table_buckets and data_count must be in 1.." << SMHT_MAX_BLOCKS
+                      << std::endl;
+            destroy(_name);
+            detach();
+            return;
+        }
+        //расчет объема памяти, делается только при создании и сохраняется в суперблоке
+        sb.magic = SMHT_MAGIC;
+        sb.version = SMHT_LAYOUT_VERSION;
+        sb.hash_id = hash_method_id;
+        sb.features = features & SMHT_SUPPORTED_FEATURES;
+        sb.key_count = key_count;
+        sb.table_buckets = table_buckets;
+        sb.data_count = data_count;
+        sb.data_block_size = data_block_size;
+        sb.header_size = sizeof(struct header);
+        //массивы по корзинам общие: сначала корзины основной таблицы, за ними запас именованных
+        uint64_t buckets = sb.key_count + sb.table_buckets;
+        sb.service_offset = int_ceil_divide(sizeof(struct superblock), SMHT_ALIGN) * SMHT_ALIGN;
+        //каталог лежит до заголовков, очистка сегмента его не трогает
+        sb.catalog_offset = sb.service_offset + int_ceil_divide(sizeof(struct service), SMHT_ALIGN) * SMHT_ALIGN;
+        sb.versions_offset = sb.catalog_offset +
+                             (sb.table_buckets ? int_ceil_divide(sizeof(struct catalog), SMHT_ALIGN) * SMHT_ALIGN : 0);
+        sb.header_offset = sb.versions_offset + int_ceil_divide(sizeof(uint32_t) * buckets, SMHT_ALIGN) * SMHT_ALIGN;
+        //фильтр: на корзину слово из 7 отпечатков ключей и счетчика тех, что не поместились
+        sb.filter_offset = int_ceil_divide(sb.header_offset + sb.header_size * buckets, SMHT_ALIGN) * SMHT_ALIGN;
+        //биты обращения к корзинам для вытеснения во второй уровень
+        sb.access_offset = sb.filter_offset +
+                           ((sb.features & SMHT_FEATURE_FILTER) ? sizeof(uint64_t) * buckets : 0);
+        sb.memory_map_offset = sb.access_offset + ((sb.features & SMHT_FEATURE_SPILL) ? buckets : 0);
+        sb.chunks_offset = int_ceil_divide(sb.memory_map_offset + sb.data_count, SMHT_ALIGN) * SMHT_ALIGN;
+        sb.dict_offset = sb.chunks_offset +
+                         int_ceil_divide(sb.data_count, SMHT_CHUNK_BLOCKS) * sizeof(struct chunk);
+        sb.dict_offset = int_ceil_divide(sb.dict_offset, SMHT_ALIGN) * SMHT_ALIGN;
+        sb.dict_capacity = (sb.features & SMHT_FEATURE_COMPRESSION) ? SMC_MAX_DICT_SIZE : 0;
+        //последовательности корзин и журнал их прошлых состояний для снимков
+        sb.snapshot_offset = int_ceil_divide(sb.dict_offset + sb.dict_capacity, SMHT_ALIGN) * SMHT_ALIGN;
+        bool snapshots = sb.features & SMHT_FEATURE_SNAPSHOTS;
+        sb.undo_offset = int_ceil_divide(sb.snapshot_offset + (snapshots ? sizeof(struct bucket_version) * buckets : 0),
+                                         SMHT_ALIGN) * SMHT_ALIGN;
+        sb.undo_capacity = snapshots ? sb.data_block_size * sb.data_count / SMHT_UNDO_SHARE / SMHT_UNDO_ALIGN *
+                                       SMHT_UNDO_ALIGN : 0;
+        //узлы упорядоченного индекса, номер 0 значит "нет узла"
+        sb.index_offset = int_ceil_divide(sb.undo_offset + sb.undo_capacity, SMHT_ALIGN) * SMHT_ALIGN;
+        sb.index_nodes = (sb.features & SMHT_FEATURE_ORDERED) ?
+                         std::max<uint64_t>(SMHT_INDEX_DEPTH, sb.data_block_size * sb.data_count /
+                                                              SMHT_INDEX_SHARE / SMHT_INDEX_NODE) : 0;
+        sb.data_offset = int_ceil_divide(sb.index_offset + sb.index_nodes * SMHT_INDEX_NODE, SMHT_ALIGN) * SMHT_ALIGN;
+        sb.memory_size = sb.data_offset + sb.data_block_size * sb.data_count;
+        //арены выравниваем по SMHT_CHUNK_BLOCKS, их не больше SMHT_MAX_ARENAS
+        sb.arena_blocks = int_ceil_divide(sb.data_count, std::max<uint64_t>(1, std::min<uint64_t>(
+                SMHT_MAX_ARENAS, sb.data_count / SMHT_CHUNK_BLOCKS)));
+        sb.arena_blocks = std::max<uint64_t>(1, int_ceil_divide(sb.arena_blocks, SMHT_CHUNK_BLOCKS)) * SMHT_CHUNK_BLOCKS;
+        sb.arena_count = std::max<uint64_t>(1, int_ceil_divide(sb.data_count, sb.arena_blocks));
+        sb.spill_capacity = (sb.features & SMHT_FEATURE_SPILL) ? SMHT_SPILL_CAPACITY : 0;
+    } else if (!read_superblock(&sb)) {
+        detach();
+        return;
+    }
+
+    _key_count = sb.key_count;
+    _bucket_total = sb.key_count + sb.table_buckets;
+    _data_count = sb.data_count;
+    _data_block_size = sb.data_block_size;
+    _memory_size = sb.memory_size;
+    _features = sb.features;
+    _arena_count = sb.arena_count;
+    _arena_blocks = sb.arena_blocks;
+    _chunk_count = int_ceil_divide(_data_count, SMHT_CHUNK_BLOCKS);
+    _service_size = sb.catalog_offset - sb.service_offset;
+    _header_size = sb.header_size;
+    _header_len = _header_size * _bucket_total;
+    _data_len = _data_block_size * _data_count;
+    _spill_capacity = sb.spill_capacity;
+    _undo_capacity = sb.undo_capacity;
+    _index_nodes = sb.index_nodes;
+
+    void *ptr = map(_memory_size);
+    if (ptr == nullptr) {
+        return;
+    }
+    _superblock_ptr = (struct superblock *) ptr;
+    _service_ptr = (struct service *) ((char *) ptr + sb.service_offset);
+    //версии корзин, нечетная - цепочку сейчас меняют
+    _versions_ptr = (uint32_t *) ((char *) ptr + sb.versions_offset);
     //Указатель на начало памяти, тут хранятся ключи хеш таблицы
-    _header_ptr = (char *) _service_ptr + _service_size;
+    _header_ptr = (char *) ptr + sb.header_offset;
+    //фильтр промахов, есть только с SMHT_FEATURE_FILTER
+    _filter_ptr = (uint64_t *) ((char *) ptr + sb.filter_offset);
+    _access_ptr = (uint8_t *) ptr + sb.access_offset;
     //карта распределения памяти
-    _memory_map_ptr = (char *) _header_ptr + _header_len;
+    _memory_map_ptr = (char *) ptr + sb.memory_map_offset;
+    //сводка по кускам карты: сколько свободно и самая длинная дырка
+    _chunks_ptr = (struct chunk *) ((char *) ptr + sb.chunks_offset);
+    //словарь для сжатия значений
+    _dict_ptr = (char *) ptr + sb.dict_offset;
+    //снимки, есть только с SMHT_FEATURE_SNAPSHOTS
+    _snapshot_ptr = (struct bucket_version *) ((char *) ptr + sb.snapshot_offset);
+    _undo_ptr = (char *) ptr + sb.undo_offset;
+    //упорядоченный индекс, есть только с SMHT_FEATURE_ORDERED
+    _index_ptr = (char *) ptr + sb.index_offset;
     //Сегмент с данными
-    _data_ptr = (char *) _memory_map_ptr + data_count;
+    _data_ptr = (char *) ptr + sb.data_offset;
+    //каталог именованных таблиц, есть только при table_buckets
+    if (sb.table_buckets) {
+        _catalog_ptr = (struct catalog *) ((char *) ptr + sb.catalog_offset);
+    }
+    //файлы второго уровня создатель открывает до публикации суперблока
+    if ((_features & SMHT_FEATURE_SPILL) && !open_spill()) {
+        munmap(_segment_ptr, _segment_size);
+        _segment_ptr = nullptr;
+        detach();
+        return;
+    }
 
-    if(created){
+    if(_created){
         auto *service = (struct service *)_service_ptr;
-        pthread_mutexattr_t attr;
-
-        if (pthread_mutexattr_init(&attr)) {
-            std::cerr << errno << std::endl;
+        init_mutex(&service->memory_mutex, true);
+        for (auto &mutex : service->bucket_mutex) {
+            init_mutex(&mutex, true);
         }
-        if (pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)) {
-            std::cerr << errno << std::endl;
+        for (uint32_t i = 0; i < _arena_count; i++) {
+            init_mutex(&service->arenas[i].mutex, true);
+            service->arenas[i].hint = i * _arena_blocks;
         }
-        if (pthread_mutex_init(&service->memory_mutex, &attr)) {
-            std::cerr << errno << std::endl;
+        init_mutex(&service->limbo_mutex, true);
+        //эпоха 0 у слота читателя значит "слот свободен"
+        service->epoch = 1;
+        service->hot.sample = SMHT_HOT_SAMPLE;
+        service->hot.since = now_ns();
+        init_mutex(&service->spill_mutex, true);
+        service->spill_threshold = SMHT_SPILL_LARGE;
+        //смещение 0 в val_offset значит "пусто", поэтому файл начинается с пропуска
+        service->spill_tail[0] = service->spill_tail[1] = SMHT_SPILL_ALIGN;
+        if (_catalog_ptr) {
+            init_mutex(&_catalog_ptr->mutex, true);
+            _catalog_ptr->next = sb.key_count;
         }
+        //семя корзин свое у каждого сегмента: подобрать ключи в одну цепочку заранее нельзя
+        uint32_t seed = random_seed(0);
+        service->seeds = seed | (uint64_t) seed << 32;
+        service->chain_limit = SMHT_CHAIN_LIMIT;
+        init_mutex(&service->undo_mutex, true);
+        service->undo_sequence = 1;
+        init_mutex(&service->index_mutex, true);
+        index_reset();
+        rebuild_summary();
+        std::memcpy(_superblock_ptr, &sb, sizeof(struct superblock));
+        publish(_superblock_ptr);
     }
     unlock(&_service_ptr->memory_mutex);
 }
 
+SMHashTable::SMHashTable(std::string name) : SMHashTable(std::move(name), 0, 0, 0, ATTACH) {
+}
+
+SMHashTable::SMHashTable(SMHashTable *space, const struct table_entry &entry) :
+        SMSegment(space->_name + "/" + entry.name, *space),
+        _key_count(entry.count), _data_count(space->_data_count), _data_block_size(space->_data_block_size) {
+    //все общее с сегментом, кроме диапазона корзин
+    _space = space;
+    _bucket_base = entry.base;
+    _bucket_total = space->_bucket_total;
+    _memory_size = space->_memory_size;
+    _features = space->_features;
+    _arena_count = space->_arena_count;
+    _arena_blocks = space->_arena_blocks;
+    _chunk_count = space->_chunk_count;
+    _service_size = space->_service_size;
+    _header_size = space->_header_size;
+    _header_len = space->_header_len;
+    _data_len = space->_data_len;
+    _superblock_ptr = space->_superblock_ptr;
+    _service_ptr = space->_service_ptr;
+    _versions_ptr = space->_versions_ptr;
+    _header_ptr = space->_header_ptr;
+    _filter_ptr = space->_filter_ptr;
+    _access_ptr = space->_access_ptr;
+    _memory_map_ptr = space->_memory_map_ptr;
+    _chunks_ptr = space->_chunks_ptr;
+    _dict_ptr = space->_dict_ptr;
+    _data_ptr = space->_data_ptr;
+    _catalog_ptr = space->_catalog_ptr;
+    _snapshot_ptr = space->_snapshot_ptr;
+    _undo_ptr = space->_undo_ptr;
+    _undo_capacity = space->_undo_capacity;
+    _index_ptr = space->_index_ptr;
+    _index_nodes = space->_index_nodes;
+    for (uint32_t g = 0; g < 2; g++) {
+        _spill_fd[g] = space->_spill_fd[g];
+        _spill_ptr[g] = space->_spill_ptr[g];
+    }
+    _spill_capacity = space->_spill_capacity;
+}
+
+bool SMHashTable::read_superblock(struct superblock *sb) {
+    if (!wait_ready(sb, sizeof(struct superblock))) {
+        return false;
+    }
+    if (sb->magic != SMHT_MAGIC) {
+        std::cerr << _name << ": bad magic" << std::endl;
+        return false;
+    }
+    if (sb->version != SMHT_LAYOUT_VERSION) {
+        std::cerr << _name << ": unsupported layout version " << sb->version << std::endl;
+        return false;
+    }
+    if (sb->hash_id != hash_method_id) {
+        std::cerr << _name << ": unsupported hash function " << sb->hash_id << std::endl;
+        return false;
+    }
+    if (sb->features & ~SMHT_SUPPORTED_FEATURES) {
+        std::cerr << _name << ": unsupported features " << std::hex << sb->features << std::dec << std::endl;
+        return false;
+    }
+    if (sb->header_size != sizeof(struct header)) {
+        std::cerr << _name << ": header size mismatch" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+SMHashTable::~SMHashTable() {
+    stopSpillCompactor();
+    //переполнение очереди живет в процессе: что не поместилось в очередь, остается занятым до verify(repair)
+    if (!_overflow.empty()) {
+        lock(&_service_ptr->limbo_mutex);
+        reclaim(false);
+        unlock(&_service_ptr->limbo_mutex);
+        if (!_overflow.empty()) {
+            std::cerr << "SMHashTable: " << _overflow.size() << " retired blocks are left allocated" << std::endl;
+        }
+    }
+    //брошенный перенос продолжит следующий rehash() или писатель
+    _rehash_stop = true;
+    {
+        std::lock_guard<std::mutex> guard(_rehasher_mutex);
+        if (_rehasher.joinable()) {
+            _rehasher.join();
+        }
+    }
+    //файлы второго уровня именованной таблицы принадлежат сегменту
+    for (uint32_t g = 0; g < 2 && !_space; g++) {
+        if (_spill_ptr[g]) {
+            munmap(_spill_ptr[g], _spill_capacity);
+        }
+        if (_spill_fd[g] != -1) {
+            close(_spill_fd[g]);
+        }
+    }
+}
+
+bool SMHashTable::destroy(const std::string &name) {
+    for (uint32_t g = 0; g < 2; g++) {
+        unlink(spill_path(name, g).c_str());
+    }
+    return SMSegment::destroy(name);
+}
+
+std::shared_ptr<SMHashTable> SMHashTable::openTable(const std::string &table, uint64_t key_count) {
+    if (_space) {
+        return _space->openTable(table, key_count);
+    }
+    if (!_catalog_ptr || table.empty() || table.size() >= SMHT_TABLE_NAME) {
+        return nullptr;
+    }
+    lock(&_catalog_ptr->mutex);
+    struct table_entry *entry = find_table(table);
+    if (entry == nullptr && key_count) {
+        //место в каталоге: свободная запись или удаленная без корзин, по цепочке проб от хеша имени
+        uint32_t hash = hash_method(table.c_str(), table.size());
+        struct table_entry *slot = nullptr;
+        for (uint32_t probe = 0; !slot && probe < SMHT_TABLE_SLOTS; probe++) {
+            struct table_entry *e = &_catalog_ptr->entries[(hash + probe) % SMHT_TABLE_SLOTS];
+            if (e->state == SMHT_TABLE_FREE || (e->state == SMHT_TABLE_DROPPED && e->count == 0)) {
+                slot = e;
+            }
+        }
+        //корзины из наименьшего подходящего освобожденного диапазона, иначе из нерозданного запаса
+        struct table_entry *hole = nullptr;
+        for (auto &e : _catalog_ptr->entries) {
+            if (e.state == SMHT_TABLE_DROPPED && e.count >= key_count && (!hole || e.count < hole->count)) {
+                hole = &e;
+            }
+        }
+        uint64_t base = SMHT_NOT_FOUND;
+        if (slot && hole) {
+            base = hole->base;
+            hole->base += key_count;
+            hole->count -= key_count;
+        } else if (slot && _catalog_ptr->next + key_count <= _bucket_total) {
+            base = _catalog_ptr->next;
+            _catalog_ptr->next += key_count;
+        }
+        if (base != SMHT_NOT_FOUND) {
+            slot->hash = hash;
+            slot->base = base;
+            slot->count = key_count;
+            std::memset(slot->name, 0, sizeof(slot->name));
+            std::memcpy(slot->name, table.c_str(), table.size());
+            //состояние последним: упавший здесь процесс потеряет только выданные корзины
+            __atomic_store_n(&slot->state, SMHT_TABLE_LIVE, __ATOMIC_RELEASE);
+            _catalog_ptr->tables++;
+            entry = slot;
+        }
+    }
+    std::shared_ptr<SMHashTable> result;
+    if (entry) {
+        result.reset(new SMHashTable(this, *entry));
+    }
+    unlock(&_catalog_ptr->mutex);
+    return result;
+}
+
+bool SMHashTable::dropTable(const std::string &table) {
+    if (_space) {
+        return _space->dropTable(table);
+    }
+    if (!_catalog_ptr) {
+        return false;
+    }
+    lock(&_catalog_ptr->mutex);
+    struct table_entry *entry = find_table(table);
+    if (entry == nullptr) {
+        //удаление, прерванное падением, доделываем
+        uint32_t hash = hash_method(table.c_str(), table.size());
+        for (uint32_t probe = 0; probe < SMHT_TABLE_SLOTS; probe++) {
+            struct table_entry *e = &_catalog_ptr->entries[(hash + probe) % SMHT_TABLE_SLOTS];
+            if (e->state == SMHT_TABLE_FREE) {
+                break;
+            }
+            if (e->state == SMHT_TABLE_DROPPING && table == e->name) {
+                entry = e;
+                break;
+            }
+        }
+    } else {
+        //новые открытия таблицу уже не найдут, а корзины не раздадут, пока в них остались элементы
+        __atomic_store_n(&entry->state, SMHT_TABLE_DROPPING, __ATOMIC_RELEASE);
+        _catalog_ptr->tables--;
+    }
+    if (entry == nullptr) {
+        unlock(&_catalog_ptr->mutex);
+        return false;
+    }
+    struct table_entry copy = *entry;
+    unlock(&_catalog_ptr->mutex);
+
+    SMHashTable(this, copy).clear_buckets();
+
+    lock(&_catalog_ptr->mutex);
+    __atomic_store_n(&entry->state, SMHT_TABLE_DROPPED, __ATOMIC_RELEASE);
+    unlock(&_catalog_ptr->mutex);
+    return true;
+}
+
+std::vector<std::string> SMHashTable::tables() {
+    std::vector<std::string> result;
+    if (!_catalog_ptr) {
+        return result;
+    }
+    lock(&_catalog_ptr->mutex);
+    for (auto &e : _catalog_ptr->entries) {
+        if (e.state == SMHT_TABLE_LIVE) {
+            result.emplace_back(e.name);
+        }
+    }
+    unlock(&_catalog_ptr->mutex);
+    return result;
+}
+
+struct SMHashTable::table_entry *SMHashTable::find_table(const std::string &table) {
+    //под мьютексом каталога; пробы идут до первой никогда не занятой записи
+    uint32_t hash = hash_method(table.c_str(), table.size());
+    for (uint32_t probe = 0; probe < SMHT_TABLE_SLOTS; probe++) {
+        struct table_entry *e = &_catalog_ptr->entries[(hash + probe) % SMHT_TABLE_SLOTS];
+        if (e->state == SMHT_TABLE_FREE) {
+            return nullptr;
+        }
+        if (e->state == SMHT_TABLE_LIVE && e->hash == hash && table == e->name) {
+            return e;
+        }
+    }
+    return nullptr;
+}
+
+void SMHashTable::clear_buckets() {
+    //по одному ключу через обычное удаление: остальные таблицы сегмента продолжают работать
+    std::vector<std::string> keys;
+    for (uint64_t bucket = _bucket_base; bucket < _bucket_base + _key_count; bucket++) {
+        lock(bucket_mutex(bucket));
+        auto *header = get_header(bucket);
+        while (header && header->val_offset) {
+            keys.emplace_back((char *) _data_ptr + (long) header->key_offset, header->key_size - 1);
+            header = header->linked_item ? (struct header *) ((long) header->linked_item + (long) _data_ptr) : nullptr;
+        }
+        unlock(bucket_mutex(bucket));
+        for (auto &key : keys) {
+            unset(key);
+        }
+        keys.clear();
+    }
+}
+
+SMHashTable::read_guard::read_guard(SMHashTable *table) : _table(table), _slot(table->enter_reader()) {
+}
+
+SMHashTable::read_guard::~read_guard() {
+    _table->leave_reader(_slot);
+}
+
+SMHashTable::read_guard SMHashTable::pin() {
+    return read_guard(this);
+}
+
+SMHashTable::snapshot_handle::snapshot_handle(SMHashTable *table) : _table(table), _slot(SMHT_SNAPSHOTS),
+                                                                   _sequence(0), _seeds(0) {
+    if (!(table->_features & SMHT_FEATURE_SNAPSHOTS)) {
+        return;
+    }
+    //под всеми блокировками корзин недописанных изменений нет: сделанное до снимка уже в корзинах,
+    //а писатели после него увидят его слот и сохранят корзину до изменения
+    struct service *service = table->_service_ptr;
+    table->lock_buckets();
+    table->lock(&service->undo_mutex);
+    table->snapshot_oldest();
+    for (uint32_t i = 0; i < SMHT_SNAPSHOTS; i++) {
+        struct snapshot_slot *slot = &service->snapshot_slots[i];
+        if (slot->pid == 0) {
+            slot->broken = 0;
+            slot->sequence = service->undo_sequence;
+            __atomic_store_n(&slot->pid, (uint32_t) getpid(), __ATOMIC_RELEASE);
+            __atomic_add_fetch(&service->snapshots, 1, __ATOMIC_SEQ_CST);
+            _slot = i;
+            _sequence = slot->sequence;
+            _seeds = __atomic_load_n(&service->seeds, __ATOMIC_ACQUIRE);
+            break;
+        }
+    }
+    table->unlock(&service->undo_mutex);
+    table->unlock_buckets();
+}
+
+SMHashTable::snapshot_handle::~snapshot_handle() {
+    if (_slot == SMHT_SNAPSHOTS) {
+        return;
+    }
+    struct service *service = _table->_service_ptr;
+    _table->lock(&service->undo_mutex);
+    __atomic_store_n(&service->snapshot_slots[_slot].pid, 0, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&service->snapshots, 1, __ATOMIC_SEQ_CST);
+    _table->undo_reclaim();
+    _table->unlock(&service->undo_mutex);
+}
+
+bool SMHashTable::snapshot_handle::valid() {
+    return _slot < SMHT_SNAPSHOTS &&
+           !__atomic_load_n(&_table->_service_ptr->snapshot_slots[_slot].broken, __ATOMIC_ACQUIRE);
+}
+
+bool SMHashTable::snapshot_handle::get(const std::string &key, std::string *value) {
+    if (!valid()) {
+        return false;
+    }
+    //корзины по семени на момент снимка; если тогда шло перехеширование, ключ лежал в одной из двух
+    std::vector<std::pair<std::string, std::string>> items;
+    uint32_t buckets[2] = {_table->bucket_for(key.c_str(), key.size(), (uint32_t) (_seeds >> 32)),
+                           _table->bucket_for(key.c_str(), key.size(), (uint32_t) _seeds)};
+    for (uint32_t i = 0; i < (buckets[0] == buckets[1] ? 1U : 2U); i++) {
+        items.clear();
+        if (!_table->snapshot_bucket(buckets[i], _slot, _sequence, items)) {
+            return false;
+        }
+        for (auto &item : items) {
+            if (item.first == key) {
+                value->swap(item.second);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool SMHashTable::snapshot_handle::forEach(
+        const std::function<void(const std::string &, const std::string &)> &callback) {
+    if (!valid()) {
+        return false;
+    }
+    std::vector<std::pair<std::string, std::string>> items;
+    for (uint64_t bucket = _table->_bucket_base; bucket < _table->_bucket_base + _table->_key_count; bucket++) {
+        if (!_table->snapshot_bucket(bucket, _slot, _sequence, items)) {
+            return false;
+        }
+        for (auto &item : items) {
+            callback(item.first, item.second);
+        }
+        items.clear();
+    }
+    return true;
+}
+
+SMHashTable::snapshot_handle SMHashTable::snapshot() {
+    return snapshot_handle(this);
+}
+
+SMHashTable::range_iterator::range_iterator(SMHashTable *table, std::string from, std::string to, bool prefix) :
+        _table(table), _from(std::move(from)), _to(std::move(to)), _prefix(prefix),
+        _done(!(table->_features & SMHT_FEATURE_ORDERED)), _position(0) {
+    if (!_done && (__atomic_load_n(&table->_service_ptr->index_broken, __ATOMIC_ACQUIRE) & 1)) {
+        table->index_rebuild();
+    }
+}
+
+bool SMHashTable::range_iterator::next(std::string *key, std::string *value) {
+    while (true) {
+        if (_position == _keys.size()) {
+            if (_done) {
+                return false;
+            }
+            fill();
+            continue;
+        }
+        const std::string &found = _keys[_position++];
+        if (_prefix ? found.compare(0, _to.size(), _to) != 0 : found >= _to) {
+            _done = true;
+            _keys.clear();
+            _position = 0;
+            return false;
+        }
+        key->assign(found, SMHT_INDEX_PREFIX, std::string::npos);
+        //в дереве бывают ключи недописанного set и уже удаленные: отдаем только те, что есть в корзинах
+        if (value) {
+            value->resize(value->capacity());
+            int64_t length;
+            while ((length = _table->get(*key, &(*value)[0], value->size() + 1)) > (int64_t) value->size()) {
+                value->resize(length);
+            }
+            if (length >= 0) {
+                value->resize(length);
+                return true;
+            }
+        } else {
+            struct header header{};
+            if (_table->find_header(key->c_str(), key->size(), &header)) {
+                return true;
+            }
+        }
+    }
+}
+
+void SMHashTable::range_iterator::fill() {
+    //лист за раз; следующий читается от разделителя справа, ключи до него уже выданы
+    std::string fence;
+    _keys.clear();
+    _position = 0;
+    while (!_table->index_read(_from, &_keys, &fence)) {
+        //дерево очистили после упавшего писателя: перестраиваем и читаем лист от того же места
+        _table->index_rebuild();
+    }
+    if (fence.empty() || (_prefix ? fence.compare(0, _to.size(), _to) > 0 : fence >= _to)) {
+        _done = true;
+    }
+    _from.swap(fence);
+}
+
+SMHashTable::range_iterator SMHashTable::range(const std::string &prefix) {
+    std::string from = index_key(prefix.data(), prefix.size(), _bucket_base);
+    return range_iterator(this, from, from, true);
+}
+
+SMHashTable::range_iterator SMHashTable::range(const std::string &lo, const std::string &hi) {
+    //пустой hi - до ключей следующей таблицы
+    return range_iterator(this, index_key(lo.data(), lo.size(), _bucket_base),
+                          hi.empty() ? index_key("", 0, _bucket_base + 1) : index_key(hi.data(), hi.size(), _bucket_base),
+                          false);
+}
+
 bool SMHashTable::set(const std::string &key, const std::string &val) {
+    SMC_TRACE_SCOPE(SMTR_OP_SET);
+    SMC_PROBE(set, key.c_str(), key.size(), val.size());
+    hot_sample(SMHT_OP_SET, key.c_str(), key.size());
+    if ((_features & SMHT_FEATURE_ORDERED) && key.size() + SMHT_INDEX_PREFIX > SMHT_INDEX_KEY_MAX) {
+        return false;
+    }
     uint32_t val_size = val.size() + 1; // +1 for zero byte
-    uint32_t key_size = key.size() + 1;
+    uint32_t raw_size = val_size;
+    uint32_t flags = 0;
+    const char *val_ptr = val.c_str();
+
+    if ((_features & SMHT_FEATURE_COMPRESSION) && val_size >= SMHT_COMPRESSION_MIN) {
+        //сжимаем вместе с нулевым байтом, распаковка сразу дает строку
+        thread_local std::string buffer;
+        uint32_t dict_size;
+        auto compressor = current_compressor(&dict_size);
+        buffer.resize(SMCompressor::bound(val_size));
+        uint32_t compressed = compressor->compress(val_ptr, val_size, &buffer[0], buffer.size());
+        if (compressed && compressed < val_size) {
+            val_ptr = buffer.data();
+            val_size = compressed;
+            flags = SMHT_ENTRY_COMPRESSED;
+            if (dict_size) {
+                flags |= SMHT_ENTRY_DICTIONARY;
+            }
+        }
+    }
+
+    bool spill = (_features & SMHT_FEATURE_SPILL) && _service_ptr->spill_threshold &&
+                 val_size >= _service_ptr->spill_threshold;
+
+    //адрес в хеш таблице, цепочку меняем под блокировкой корзины
+    uint32_t bucket;
+    uint32_t old;
+    for (uint32_t attempt = 0;; attempt++) {
+        lock_key(key.c_str(), key.size(), &bucket, &old);
+        if (__atomic_load_n(&_service_ptr->sealed, __ATOMIC_ACQUIRE)) {
+            unlock_pair(bucket, old);
+            return false;
+        }
+        struct intent *intent = get_intent(bucket);
+        intent_begin(intent, bucket);
+        begin_update(bucket);
+        //ключ попадает в индекс до того, как станет виден в корзине: обход сверяет ключи индекса с таблицей
+        bool added = false;
+        bool result = index_add(key, &added) &&
+                      set_item(intent, get_header(bucket), key, val_ptr, val_size, raw_size, flags, spill);
+        if (result) {
+            snapshot_preserve(bucket);
+            intent_commit(intent);
+        } else {
+            intent_rollback(intent);
+            if (added) {
+                index_remove(key);
+            }
+        }
+        end_update(bucket);
+        intent_end(intent);
+        if (result && old != bucket) {
+            //идет перехеширование: новая копия уже видна, копию в корзине старого семени убираем
+            unset_in(old, key);
+        }
+        uint32_t chain = result ? chain_length(bucket) : 0;
+        unlock_pair(bucket, old);
+        retire_pending();
+        if (result || spill || !(_features & SMHT_FEATURE_SPILL)) {
+            if (result && (_features & SMHT_FEATURE_SPILL)) {
+                //только что записанное - горячее, вытеснение пропустит корзину один круг
+                __atomic_store_n(&_access_ptr[bucket], 1, __ATOMIC_RELAXED);
+            }
+            if (result) {
+                check_chain(chain, old != bucket);
+            }
+            return result;
+        }
+        //места нет: вытесняем холодные значения, не помогло - в файл идет само значение, в сегменте только ключ
+        uint64_t need = int_ceil_divide(((uint64_t) val_size + key.size() + 1 + sizeof(void *)), _data_block_size);
+        if (attempt + 1 >= SMHT_SPILL_RETRIES || spill_cold(need) == 0) {
+            spill = true;
+        }
+    }
+}
 
-    //адрес в хеш таблице
-    struct header *header = get_header(key.c_str(), key.size());
+bool SMHashTable::set_item(struct intent *intent, struct header *header, const std::string &key,
+                           const char *val_ptr, uint32_t val_size, uint32_t raw_size, uint32_t flags, bool spill) {
+    //новые блоки пишем сразу, они еще ничьи; общие заголовки меняются только в intent_commit
+    uint32_t key_size = key.size() + 1;
+    //значение лежит вслед за ключом или в файле второго уровня, тогда в сегменте только ключ
+    uint32_t stored = spill ? 0 : val_size;
+    auto store = [&](void *val_dimension) -> uint64_t {
+        if (spill) {
+            return spill_append(val_ptr, val_size, &flags);
+        }
+        std::memcpy(val_dimension, val_ptr, val_size);
+        return (long) val_dimension - (long) _data_ptr;
+    };
     if (!header->val_offset) {
         //место в хеш таблице свободно, пишем
-        uint32_t need_memory_blocks = int_ceil_divide((val_size + key_size + sizeof(void *)), _data_block_size);
-        void *memory_block = find_memory_block(need_memory_blocks);
+        uint32_t need_memory_blocks = int_ceil_divide((stored + key_size + sizeof(void *)), _data_block_size);
+        void *memory_block = find_memory_block(intent, need_memory_blocks);
         if (memory_block == nullptr) {
             return false;
         }
@@ -69,72 +760,86 @@ bool SMHashTable::set(const std::string &key, const std::string &val) {
         void *key_dimension = (void *) ((long) data_dimension + sizeof(void *));
         void *val_dimension = (void *) ((long) key_dimension + key_size);
 
-        header->key_offset = (void *) ((long) key_dimension - (long) _data_ptr);
-        header->key_size = key_size;
-        header->val_offset = (void *) ((long) val_dimension - (long) _data_ptr);
-        header->val_size = val_size;
-        header->linked_item = nullptr;
-
         ulong data_dimension_val = ((long) header - (long) _header_ptr);
         data_dimension_val |= 1UL << 63; //set last bit to 1
         *(uint64_t *) (data_dimension) = data_dimension_val;
 
+        //сначала данные, потом заголовок: читатель не должен увидеть недописанный ключ
         std::memcpy(key_dimension, key.c_str(), key_size);
-        std::memcpy(val_dimension, val.c_str(), val_size);
+        uint64_t val_offset = store(val_dimension);
+        if (val_offset == SMHT_SPILL_NONE) {
+            return false;
+        }
+
+        struct header image{};
+        image.key_offset = (void *) ((long) key_dimension - (long) _data_ptr);
+        image.key_size = key_size;
+        image.val_offset = (void *) val_offset;
+        image.val_size = val_size;
+        image.flags = flags;
+        image.raw_size = raw_size;
+        image.linked_item = nullptr;
+        intent_write_header(intent, header, image);
+        filter_add(header, key.c_str(), key.size());
     } else {
-        //место в хеш таблице занято
-        char *key_ptr = (char *) ((void *) ((long) header->key_offset + (long) _data_ptr));
-        if (std::strcmp(key_ptr, key.c_str()) == 0) {
-            //ключ существует, обновляем value
-            uint32_t need_blocks_for_old_data = int_ceil_divide(
-                    (header->val_size + header->key_size + sizeof(void *)), _data_block_size);
+        //место в хеш таблице занято, ключ ищем по всей цепочке
+        struct header *existing = header;
+        while (existing && std::strcmp((char *) ((long) existing->key_offset + (long) _data_ptr), key.c_str()) != 0) {
+            existing = existing->linked_item ? (struct header *) ((long) existing->linked_item + (long) _data_ptr)
+                                             : nullptr;
+        }
+        if (existing) {
+            header = existing;
+            //ключ существует, пишем значение в новый блок, старый отдаем после переключения заголовка:
+            //читатели могут еще держать указатель на старое значение
+            uint32_t need_blocks_for_old_data = data_blocks(header);
             uint32_t need_blocks_for_cur_data = int_ceil_divide(
-                    (val_size + key_size + sizeof(void *)), _data_block_size);
-
-            void *data_offset = (void *) ((((long) header->key_offset - sizeof(void *)) / _data_block_size) +
-                                          (long) _memory_map_ptr);
-
-            //TODO: dont rewrite all data if new block is smaller or equal
-            if (need_blocks_for_old_data != need_blocks_for_cur_data) {
-                //нужно перевыделить память
-                //очищаем старую память
-                free_memory_block((void *) data_offset, need_blocks_for_old_data);
-
-                //занимаем новую память
-                data_offset = find_memory_block(need_blocks_for_cur_data);
-                if (data_offset == nullptr) {
-                    return false;
-                }
+                    (stored + key_size + sizeof(void *)), _data_block_size);
 
+            void *old_data_offset = (void *) ((((long) header->key_offset - sizeof(void *)) / _data_block_size) +
+                                              (long) _memory_map_ptr);
+            void *data_offset = find_memory_block(intent, need_blocks_for_cur_data);
+            if (data_offset == nullptr) {
+                return false;
             }
             void *data_dimension =
                     (char *) _data_ptr + (((long) data_offset - (long) _memory_map_ptr) * _data_block_size);
             void *key_dimension = (void *) ((long) data_dimension + sizeof(void *));
             void *val_dimension = (void *) ((long) key_dimension + key_size);
-            header->key_offset = (void *) ((long) key_dimension - (long) _data_ptr);
-            header->val_offset = (void *) ((long) val_dimension - (long) _data_ptr);
-            header->val_size = val_size;
 
             ulong data_dimension_val = ((long) header - (long) _header_ptr);
             data_dimension_val |= 1UL << 63; //set last bit to 1
             *(uint64_t *) (data_dimension) = data_dimension_val;
 
             std::memcpy(key_dimension, key.c_str(), key_size);
-            std::memcpy(val_dimension, val.c_str(), val_size);
+            uint64_t val_offset = store(val_dimension);
+            if (val_offset == SMHT_SPILL_NONE) {
+                return false;
+            }
+            spill_forget(header);
+
+            struct header image = *header;
+            image.key_offset = (void *) ((long) key_dimension - (long) _data_ptr);
+            image.val_offset = (void *) val_offset;
+            image.val_size = val_size;
+            image.flags = flags;
+            image.raw_size = raw_size;
+            intent_write_header(intent, header, image);
+
+            intent_retire(intent, old_data_offset, need_blocks_for_old_data);
         } else {
             //коллизия, ключ не существует, пишем в связный список
             uint32_t need_blocks_for_header = int_ceil_divide(_header_size, _data_block_size);
             //нельзя чтобы блок попал в самое начало памяти, иначе linked_item будет 0
-            void *header_memblock = find_memory_block(need_blocks_for_header, need_blocks_for_header);
+            void *header_memblock = find_memory_block(intent, need_blocks_for_header, need_blocks_for_header);
             if (header_memblock == nullptr) {
                 return false;
             }
 
-            uint32_t need_memory_blocks = int_ceil_divide((val_size + key_size + sizeof(void *)), _data_block_size);
-            void *memory_block = find_memory_block(need_memory_blocks);
+            uint32_t need_memory_blocks = int_ceil_divide((stored + key_size + sizeof(void *)), _data_block_size);
+            void *memory_block = find_memory_block(intent, need_memory_blocks);
             if (memory_block == nullptr) {
-                //не нашли память под данные, освобождаем занятую память под заголовок
-                free_memory_block(header_memblock, need_blocks_for_header);
+                //память под заголовок вернет откат журнала
                 return false;
             }
 
@@ -142,21 +847,21 @@ bool SMHashTable::set(const std::string &key, const std::string &val) {
                     (struct header *) ((long) _data_ptr +
                                        (((long) header_memblock - (long) _memory_map_ptr) * _data_block_size));
 
-            //бежим по цепочке пока не найдем крайний элемент, его и делаем активным
-            while (header->linked_item) {
-                header = (struct header *) ((long) header->linked_item + (long) _data_ptr);
-            }
-            header->linked_item = (void *) ((long) new_header - (long) _data_ptr);
-
             void *data_dimension =
                     (char *) _data_ptr + (((long) memory_block - (long) _memory_map_ptr) * _data_block_size);
             void *key_dimension = (void *) ((long) data_dimension + sizeof(void *));
             void *val_dimension = (void *) ((long) key_dimension + key_size);
+            uint64_t val_offset = store(val_dimension);
+            if (val_offset == SMHT_SPILL_NONE) {
+                return false;
+            }
 
             new_header->key_offset = (void *) ((long) key_dimension - (long) _data_ptr);
             new_header->key_size = key_size;
-            new_header->val_offset = (void *) ((long) val_dimension - (long) _data_ptr);
+            new_header->val_offset = (void *) val_offset;
             new_header->val_size = val_size;
+            new_header->flags = flags;
+            new_header->raw_size = raw_size;
             new_header->linked_item = nullptr;
 
             ulong data_dimension_val = ((long) new_header - (long) _header_ptr);
@@ -164,7 +869,13 @@ bool SMHashTable::set(const std::string &key, const std::string &val) {
             *(uint64_t *) (data_dimension) = data_dimension_val;
 
             std::memcpy(key_dimension, key.c_str(), key_size);
-            std::memcpy(val_dimension, val.c_str(), val_size);
+
+            filter_add(header, key.c_str(), key.size());
+            //бежим по цепочке пока не найдем крайний элемент, к нему цепляем уже заполненный заголовок
+            while (header->linked_item) {
+                header = (struct header *) ((long) header->linked_item + (long) _data_ptr);
+            }
+            intent_write(intent, &header->linked_item, (uint64_t) ((long) new_header - (long) _data_ptr));
             return true;
         }
     }
@@ -172,74 +883,420 @@ bool SMHashTable::set(const std::string &key, const std::string &val) {
 }
 
 char *SMHashTable::get_value(const std::string &key) {
-    auto *header = get_header(key.c_str(), key.size());
-    if (header->val_offset) {
-        //хеш существует
-        if (std::strcmp(key.c_str(), (char *) ((void *) ((long) header->key_offset + (long) _data_ptr))) == 0) {
-            //ключ верный, возвращаем
-            return (char *) ((void *) ((long) header->val_offset + (long) _data_ptr));
-        } else {
-            //коллизия, ищем ключ
-            while (header->linked_item) {
-                header = (struct header *) ((long) header->linked_item + (long) _data_ptr);
-                if (std::strcmp(key.c_str(), (char *) ((void *) ((long) header->key_offset + (long) _data_ptr))) ==
-                    0) {
-                    return (char *) ((void *) ((long) header->val_offset + (long) _data_ptr));
-                }
-            }
+    SMC_TRACE_SCOPE(SMTR_OP_GET);
+    SMC_PROBE(get, key.c_str(), key.size());
+    hot_sample(SMHT_OP_GET, key.c_str(), key.size());
+    struct header header;
+    if (!find_header(key.c_str(), key.size(), &header)) {
+        return &eol;
+    }
+    char *val = value_ptr(&header);
+    if (header.flags & SMHT_ENTRY_COMPRESSED) {
+        //сжатое значение распаковываем в буфер потока, он живет до следующего вызова
+        thread_local std::string buffer;
+        buffer.resize(header.raw_size);
+        if (decompress(&header, &buffer[0], buffer.size()) < 0) {
             return &eol;
         }
-    } else {
-        //хеша нет
-        return &eol;
+        return &buffer[0];
     }
+    return val;
 }
 
-int SMHashTable::unset(const std::string &key) {
-    auto *header = get_header(key.c_str(), key.size());
-    if (header->val_offset) {
-        //хеш существует
-        if (std::strcmp(key.c_str(), (char *) ((void *) ((long) header->key_offset + (long) _data_ptr))) == 0) {
-            //ключ верный
-            if (header->linked_item) {
-                //есть связанные элементы
-                //нужно переместить связанный на место текущего
-                auto next_header = (struct header *) ((long) header->linked_item + (long) _data_ptr);
-                uint32_t need_memory_blocks = int_ceil_divide(
-                        (header->val_size + header->key_size + sizeof(void *)),
-                        _data_block_size);
+char *SMHashTable::get_value(const std::string &key, size_t *length, bool *shared) {
+    SMC_TRACE_SCOPE(SMTR_OP_GET);
+    SMC_PROBE(get, key.c_str(), key.size());
+    hot_sample(SMHT_OP_GET, key.c_str(), key.size());
+    struct header header;
+    if (!find_header(key.c_str(), key.size(), &header)) {
+        return nullptr;
+    }
+    *length = header.raw_size - 1;
+    if (header.flags & SMHT_ENTRY_COMPRESSED) {
+        thread_local std::string buffer;
+        buffer.resize(header.raw_size);
+        if (decompress(&header, &buffer[0], buffer.size()) < 0) {
+            return nullptr;
+        }
+        if (shared != nullptr) {
+            *shared = false;
+        }
+        return &buffer[0];
+    }
+    if (shared != nullptr) {
+        *shared = true;
+    }
+    return value_ptr(&header);
+}
 
-                void *current_data_offset = (void *) (
-                        (((long) header->key_offset - sizeof(void *)) / _data_block_size) +
-                        (long) _memory_map_ptr);
-                void *next_header_offset = (void *) (
-                        (((long) header->linked_item) / _data_block_size) +
-                        (long) _memory_map_ptr);
+int64_t SMHashTable::get(const std::string &key, char *buffer, size_t size) {
+    SMC_TRACE_SCOPE(SMTR_OP_GET);
+    SMC_PROBE(get, key.c_str(), key.size());
+    hot_sample(SMHT_OP_GET, key.c_str(), key.size());
+    struct header header;
+    if (!find_header(key.c_str(), key.size(), &header)) {
+        return -1;
+    }
+    //как snprintf: если буфер мал, ничего не пишем и возвращаем нужную длину
+    int64_t length = header.raw_size - 1;
+    if (size < header.raw_size) {
+        return length;
+    }
+    if (header.flags & SMHT_ENTRY_COMPRESSED) {
+        if (decompress(&header, buffer, size) < 0) {
+            return -1;
+        }
+    } else {
+        std::memcpy(buffer, value_ptr(&header), header.raw_size);
+    }
+    return length;
+}
 
-                //освобождаем память под данные
-                free_memory_block(current_data_offset, need_memory_blocks);
-                free_memory_block(next_header_offset, int_ceil_divide(_header_size, _data_block_size));
+std::shared_ptr<SMCompressor> SMHashTable::current_compressor(uint32_t *dict_size) {
+    //компрессор общий для потоков экземпляра и пересоздается с новым словарем;
+    //прежний живет, пока им еще сжимают
+    uint32_t size = __atomic_load_n(&_service_ptr->dict_size, __ATOMIC_ACQUIRE);
+    std::lock_guard<std::mutex> guard(_compressor_mutex);
+    if (!_compressor || _compressor_dict_size != size) {
+        _compressor = std::make_shared<SMCompressor>((char *) _dict_ptr, size);
+        _compressor_dict_size = size;
+    }
+    *dict_size = _compressor_dict_size;
+    return _compressor;
+}
 
-                //в данных меняем смещение заголовка
-                long *next_data = (long *) ((void *) ((long) next_header->key_offset - sizeof(void *) +
-                                                      (long) _data_ptr));
-                *next_data = *(long *) ((void *) ((long) header->key_offset - sizeof(void *) + (long) _data_ptr));
+bool SMHashTable::bulk_load_items(std::vector<bulk_item> &items, uint32_t threads) {
+    if (threads == 0) {
+        threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+    threads = std::max<size_t>(1, std::min<size_t>({threads, _key_count, items.size()}));
+    auto parallel = [threads](const std::function<void(uint32_t)> &task) {
+        run_parallel(threads, task);
+    };
 
-                //перемещаем связанный заголовок на место текущего
-                std::memcpy(header, next_header, _header_size);
-                return 1;
-            } else {
-                //одиночный элемент, самый простой вариант
-                uint32_t need_memory_blocks = int_ceil_divide(
-                        (header->val_size + header->key_size + sizeof(void *)),
-                        _data_block_size);
-                void *current_data_offset = (void *) (
-                        (((long) header->key_offset - sizeof(void *)) / _data_block_size) +
+    lock(&_service_ptr->memory_mutex);
+    lock_buckets();
+    //заливаем только в пустую таблицу: занятых блоков нет, значит и цепочек нет
+    uint64_t free = 0;
+    for (uint32_t c = 0; c < _chunk_count; c++) {
+        free += _chunks_ptr[c].free;
+    }
+    //у живого снимка корзины пустые, а заливка мимо журнала
+    bool empty = free == _data_count && !_service_ptr->sealed && !_service_ptr->snapshots;
+    if (empty) {
+        //упавшую заливку восстановление откатывает очисткой, таблица до нее была пуста
+        maintenance_begin(SMHT_MAINTENANCE_BULK);
+        wait_readers();
+    }
+    lock_arenas();
+    bool result = empty;
+    uint32_t dict_size = 0;
+    std::shared_ptr<SMCompressor> compressor;
+    if (result && (_features & SMHT_FEATURE_COMPRESSION)) {
+        compressor = current_compressor(&dict_size);
+    }
+
+    std::vector<std::vector<bulk_item>> parts(threads);
+    std::vector<std::string> packed(threads);
+    std::vector<uint32_t> first_block(threads + 1);
+    if (result) {
+        parallel([&](uint32_t t) {
+            for (size_t i = items.size() * t / threads; i < items.size() * (t + 1) / threads; i++) {
+                items[i].bucket = get_bucket(items[i].key.data(), items[i].key.size());
+            }
+        });
+        //поток владеет непрерывным диапазоном корзин, цепочки никто кроме него не трогает
+        std::vector<size_t> sizes(threads);
+        for (auto &item : items) {
+            sizes[(item.bucket - _bucket_base) * threads / _key_count]++;
+        }
+        for (uint32_t t = 0; t < threads; t++) {
+            parts[t].reserve(sizes[t]);
+        }
+        for (auto &item : items) {
+            parts[(item.bucket - _bucket_base) * threads / _key_count].push_back(item);
+        }
+        parallel([&](uint32_t t) {
+            bulk_prepare(parts[t], packed[t], &first_block[t + 1], compressor.get(), dict_size);
+        });
+        //каждому потоку свой непрерывный кусок карты, дальше память раздается сдвигом указателя
+        for (uint32_t t = 0; t < threads; t++) {
+            first_block[t + 1] += first_block[t];
+        }
+        result = first_block[threads] <= _data_count && index_fits(items);
+    }
+    if (result) {
+        parallel([&](uint32_t t) {
+            bulk_write(parts[t], first_block[t]);
+        });
+        rebuild_summary();
+        if (_features & SMHT_FEATURE_ORDERED) {
+            //сегмент был пуст, в дереве могли остаться только ключи недописанных set - начинаем его заново;
+            //повторы ключа ничего не меняют
+            lock(&_service_ptr->index_mutex);
+            index_reset();
+            bool added;
+            for (auto &item : items) {
+                index_insert(index_key(item.key.data(), item.key.size(), _bucket_base), &added);
+            }
+            unlock(&_service_ptr->index_mutex);
+        }
+    }
+    unlock_arenas();
+    if (empty) {
+        release_readers();
+        maintenance_end();
+    }
+    unlock_buckets();
+    unlock(&_service_ptr->memory_mutex);
+    return result;
+}
+
+void SMHashTable::bulk_prepare(std::vector<bulk_item> &items, std::string &packed, uint32_t *total,
+                               const SMCompressor *compressor, uint32_t dict_size) {
+    //сортировка подсчетом по корзинам потока, порядок повторов сохраняется;
+    //дальше элементы читаются подряд, а не вразброс по исходному массиву
+    uint32_t low = UINT32_MAX;
+    uint32_t high = 0;
+    for (auto &item : items) {
+        low = std::min(low, item.bucket);
+        high = std::max(high, item.bucket);
+    }
+    if (!items.empty()) {
+        std::vector<uint32_t> position(high - low + 2);
+        for (auto &item : items) {
+            position[item.bucket - low + 1]++;
+        }
+        for (size_t i = 1; i < position.size(); i++) {
+            position[i] += position[i - 1];
+        }
+        std::vector<bulk_item> sorted(items.size());
+        for (auto &item : items) {
+            sorted[position[item.bucket - low]++] = item;
+        }
+        items.swap(sorted);
+    }
+
+    std::vector<uint64_t> packed_offset;
+    std::vector<size_t> order;
+    *total = 0;
+    for (size_t begin = 0, end; begin < items.size(); begin = end) {
+        end = begin;
+        while (end < items.size() && items[end].bucket == items[begin].bucket) {
+            end++;
+        }
+        //повтор ключа дальше в той же корзине перекрывает этот: устойчивая сортировка номеров по ключу,
+        //из равных остается последний
+        order.clear();
+        for (size_t i = begin; i < end; i++) {
+            items[i].skip = false;
+            order.push_back(i);
+        }
+        std::stable_sort(order.begin(), order.end(), [&items](size_t a, size_t b) {
+            return items[a].key < items[b].key;
+        });
+        for (size_t k = 0; k + 1 < order.size(); k++) {
+            items[order[k]].skip = items[order[k]].key == items[order[k + 1]].key;
+        }
+        bool first = true;
+        for (size_t i = begin; i < end; i++) {
+            struct bulk_item &item = items[i];
+            if (item.skip) {
+                continue;
+            }
+            item.raw_size = item.val.size() + 1;
+            item.flags = 0;
+            if ((_features & SMHT_FEATURE_COMPRESSION) && item.raw_size >= SMHT_COMPRESSION_MIN) {
+                //сжимаем вместе с нулевым байтом, как в set()
+                thread_local std::string raw;
+                raw.assign(item.val.data(), item.val.size());
+                size_t offset = packed.size();
+                packed.resize(offset + SMCompressor::bound(item.raw_size));
+                uint32_t compressed = compressor->compress(raw.c_str(), item.raw_size, &packed[offset],
+                                                           packed.size() - offset);
+                if (compressed && compressed < item.raw_size) {
+                    packed.resize(offset + compressed);
+                    packed_offset.push_back(offset);
+                    item.val = std::string_view(nullptr, compressed);
+                    item.flags = SMHT_ENTRY_COMPRESSED | (dict_size ? SMHT_ENTRY_DICTIONARY : 0);
+                } else {
+                    packed.resize(offset);
+                }
+            }
+            uint32_t val_size = (item.flags & SMHT_ENTRY_COMPRESSED) ? item.val.size() : item.raw_size;
+            item.blocks = int_ceil_divide((val_size + item.key.size() + 1 + sizeof(void *)), _data_block_size);
+            //первый ключ корзины лежит в таблице заголовков, остальным нужен заголовок в данных
+            item.header_blocks = first ? 0 : int_ceil_divide(_header_size, _data_block_size);
+            *total += item.blocks + item.header_blocks;
+            first = false;
+        }
+    }
+    //буфер больше не растет, можно ссылаться на сжатые значения
+    size_t next = 0;
+    for (auto &item : items) {
+        if (!item.skip && (item.flags & SMHT_ENTRY_COMPRESSED)) {
+            item.val = std::string_view(packed.data() + packed_offset[next++], item.val.size());
+        }
+    }
+}
+
+void SMHashTable::bulk_write(std::vector<bulk_item> &items, uint32_t first_block) {
+    uint32_t cursor = first_block;
+    struct header *tail = nullptr;
+    for (size_t i = 0; i < items.size(); i++) {
+        struct bulk_item &item = items[i];
+        if (item.skip) {
+            continue;
+        }
+        struct header *bucket_header = get_header(item.bucket);
+        struct header *header = bucket_header;
+        if (item.header_blocks) {
+            //заголовок коллизии кладем перед данными, первым в куске потока всегда идут данные
+            header = (struct header *) ((long) _data_ptr + (long) cursor * _data_block_size);
+            cursor += item.header_blocks;
+            tail->linked_item = (void *) ((long) header - (long) _data_ptr);
+        } else {
+            begin_update(item.bucket);
+        }
+        uint32_t key_size = item.key.size() + 1;
+        void *data_dimension = (char *) _data_ptr + (long) cursor * _data_block_size;
+        void *key_dimension = (void *) ((long) data_dimension + sizeof(void *));
+        void *val_dimension = (void *) ((long) key_dimension + key_size);
+        cursor += item.blocks;
+
+        ulong data_dimension_val = ((long) header - (long) _header_ptr);
+        data_dimension_val |= 1UL << 63;
+        *(uint64_t *) (data_dimension) = data_dimension_val;
+        std::memcpy(key_dimension, item.key.data(), item.key.size());
+        ((char *) key_dimension)[item.key.size()] = 0;
+        std::memcpy(val_dimension, item.val.data(), item.val.size());
+        if (!(item.flags & SMHT_ENTRY_COMPRESSED)) {
+            ((char *) val_dimension)[item.val.size()] = 0;
+        }
+
+        header->key_offset = (void *) ((long) key_dimension - (long) _data_ptr);
+        header->key_size = key_size;
+        header->val_offset = (void *) ((long) val_dimension - (long) _data_ptr);
+        header->val_size = (item.flags & SMHT_ENTRY_COMPRESSED) ? item.val.size() : item.raw_size;
+        header->flags = item.flags;
+        header->raw_size = item.raw_size;
+        header->linked_item = nullptr;
+        filter_add(bucket_header, item.key.data(), item.key.size());
+        tail = header;
+
+        //корзина закончилась - отпускаем ее версию
+        size_t next = i + 1;
+        while (next < items.size() && items[next].skip) {
+            next++;
+        }
+        if (next == items.size() || items[next].bucket != item.bucket) {
+            end_update(item.bucket);
+        }
+    }
+    //карта куска заполняется одним проходом
+    std::memset((char *) _memory_map_ptr + first_block, 1, cursor - first_block);
+}
+
+bool SMHashTable::setCompressionDictionary(const std::string &dict) {
+    if (!(_features & SMHT_FEATURE_COMPRESSION) || dict.empty()) {
+        return false;
+    }
+    lock(&_service_ptr->memory_mutex);
+    //словарь задается один раз, иначе уже сжатые им значения не распаковать
+    bool result = _service_ptr->dict_size == 0;
+    if (result) {
+        uint32_t size = std::min(dict.size(), (size_t) SMC_MAX_DICT_SIZE);
+        std::memcpy(_dict_ptr, dict.data() + dict.size() - size, size);
+        __atomic_store_n(&_service_ptr->dict_size, size, __ATOMIC_RELEASE);
+    }
+    unlock(&_service_ptr->memory_mutex);
+    return result;
+}
+
+int SMHashTable::unset(const std::string &key) {
+    SMC_TRACE_SCOPE(SMTR_OP_UNSET);
+    SMC_PROBE(unset, key.c_str(), key.size());
+    hot_sample(SMHT_OP_UNSET, key.c_str(), key.size());
+    uint32_t bucket;
+    uint32_t old;
+    lock_key(key.c_str(), key.size(), &bucket, &old);
+    if (__atomic_load_n(&_service_ptr->sealed, __ATOMIC_ACQUIRE)) {
+        unlock_pair(bucket, old);
+        return 0;
+    }
+    int result = unset_in(bucket, key);
+    if (old != bucket) {
+        int stale = unset_in(old, key);
+        result = result ? result : stale;
+    }
+    if (result) {
+        index_remove(key);
+    }
+    unlock_pair(bucket, old);
+    retire_pending();
+    return result;
+}
+
+int SMHashTable::unset_in(uint32_t bucket, const std::string &key) {
+    //под блокировкой корзины
+    struct intent *intent = get_intent(bucket);
+    intent_begin(intent, bucket);
+    begin_update(bucket);
+    int result = unset_item(intent, get_header(bucket), key);
+    if (result) {
+        snapshot_preserve(bucket);
+        intent_commit(intent);
+        filter_remove(bucket, key);
+    }
+    end_update(bucket);
+    intent_end(intent);
+    return result;
+}
+
+int SMHashTable::unset_item(struct intent *intent, struct header *header, const std::string &key) {
+    //только планирует изменения в журнале, цепочка меняется в intent_commit
+    if (header->val_offset) {
+        //хеш существует
+        if (std::strcmp(key.c_str(), (char *) ((void *) ((long) header->key_offset + (long) _data_ptr))) == 0) {
+            //ключ верный
+            if (header->linked_item) {
+                //есть связанные элементы
+                //нужно переместить связанный на место текущего
+                auto next_header = (struct header *) ((long) header->linked_item + (long) _data_ptr);
+                uint32_t need_memory_blocks = data_blocks(header);
+                spill_forget(header);
+
+                void *current_data_offset = (void *) (
+                        (((long) header->key_offset - sizeof(void *)) / _data_block_size) +
+                        (long) _memory_map_ptr);
+                void *next_header_offset = (void *) (
+                        (((long) header->linked_item) / _data_block_size) +
+                        (long) _memory_map_ptr);
+
+                //в данных меняем смещение заголовка
+                long *next_data = (long *) ((void *) ((long) next_header->key_offset - sizeof(void *) +
+                                                      (long) _data_ptr));
+                intent_write(intent, next_data,
+                             *(uint64_t *) ((void *) ((long) header->key_offset - sizeof(void *) + (long) _data_ptr)));
+
+                //перемещаем связанный заголовок на место текущего
+                intent_write_header(intent, header, *next_header);
+
+                //память отдаем только после того, как блоки отцеплены от цепочки
+                intent_retire(intent, current_data_offset, need_memory_blocks);
+                intent_retire(intent, next_header_offset, int_ceil_divide(_header_size, _data_block_size));
+                return 1;
+            } else {
+                //одиночный элемент, самый простой вариант
+                uint32_t need_memory_blocks = data_blocks(header);
+                spill_forget(header);
+                void *current_data_offset = (void *) (
+                        (((long) header->key_offset - sizeof(void *)) / _data_block_size) +
                         (long) _memory_map_ptr);
-                //освобождаем память под данные
-                free_memory_block(current_data_offset, need_memory_blocks);
                 //Чистим заголовок
-                std::memset(header, 0, _header_size);
+                intent_write_header(intent, header, {});
+                //освобождаем память под данные
+                intent_retire(intent, current_data_offset, need_memory_blocks);
                 return 2;
             }
 
@@ -255,9 +1312,8 @@ int SMHashTable::unset(const std::string &key) {
                     if (header->linked_item) {
                         //есть связанные элементы
                         auto next_header = (struct header *) ((long) header->linked_item + (long) _data_ptr);
-                        uint32_t need_memory_blocks = int_ceil_divide(
-                                (header->val_size + header->key_size + sizeof(void *)),
-                                _data_block_size);
+                        uint32_t need_memory_blocks = data_blocks(header);
+                        spill_forget(header);
 
                         void *current_data_offset = (void *) (
                                 (((long) header->key_offset - sizeof(void *)) / _data_block_size) +
@@ -266,24 +1322,24 @@ int SMHashTable::unset(const std::string &key) {
                                 (((long) header->linked_item) / _data_block_size) +
                                 (long) _memory_map_ptr);
 
-                        //освобождаем память под данные
-                        free_memory_block(current_data_offset, need_memory_blocks);
-                        //освобождаем память под заголовок
-                        free_memory_block(next_header_offset, int_ceil_divide(_header_size, _data_block_size));
                         //в данных меняем смещение заголовка
                         long *next_data = (long *) ((void *) ((long) next_header->key_offset - sizeof(void *) +
                                                               (long) _data_ptr));
-                        *next_data = *(long *) ((void *) ((long) header->key_offset - sizeof(void *) +
-                                                          (long) _data_ptr));
+                        intent_write(intent, next_data, *(uint64_t *) ((void *) (
+                                (long) header->key_offset - sizeof(void *) + (long) _data_ptr)));
 
                         //перемещаем связанный заголовок на место текущего
-                        std::memcpy(header, next_header, _header_size);
+                        intent_write_header(intent, header, *next_header);
+
+                        //освобождаем память под данные
+                        intent_retire(intent, current_data_offset, need_memory_blocks);
+                        //освобождаем память под заголовок
+                        intent_retire(intent, next_header_offset, int_ceil_divide(_header_size, _data_block_size));
                         return 3;
                     } else {
                         //Удаляем
-                        uint32_t need_memory_blocks = int_ceil_divide(
-                                (header->val_size + header->key_size + sizeof(void *)),
-                                _data_block_size);
+                        uint32_t need_memory_blocks = data_blocks(header);
+                        spill_forget(header);
 
                         //вычисляем смещения занятой памяти в таблице
                         void *data_offset = (void *) (
@@ -293,15 +1349,14 @@ int SMHashTable::unset(const std::string &key) {
                                 (((long) prev_header->linked_item) / _data_block_size) +
                                 (long) _memory_map_ptr);
 
+                        //удаляем из связного списка
+                        intent_write(intent, &prev_header->linked_item, 0);
+                        //заголовок не чистим: до конца эпохи его еще могут читать
+
                         //освобождаем память под данные
-                        free_memory_block(data_offset, need_memory_blocks);
+                        intent_retire(intent, data_offset, need_memory_blocks);
                         //освобождаем память под заголовок
-                        free_memory_block(header_offset, int_ceil_divide(_header_size, _data_block_size));
-
-                        //чистим заголовок (пофиг, он в сегменте данных, они освобождены)
-                        std::memset(header, 0, _header_size);
-                        //удаляем из связного списка
-                        prev_header->linked_item = nullptr;
+                        intent_retire(intent, header_offset, int_ceil_divide(_header_size, _data_block_size));
                         return 4;
                     }
                 }
@@ -313,31 +1368,105 @@ int SMHashTable::unset(const std::string &key) {
 }
 
 void SMHashTable::clear() {
-    std::memset(_header_ptr, 0, _memory_size);
+    if (_catalog_ptr) {
+        //целиком сегмент чистим, только пока в нем нет других таблиц; каталог держим до конца
+        lock(&_catalog_ptr->mutex);
+        if (_space || _catalog_ptr->tables) {
+            unlock(&_catalog_ptr->mutex);
+            clear_buckets();
+            return;
+        }
+    }
+    lock(&_service_ptr->memory_mutex);
+    lock_buckets();
+    if (__atomic_load_n(&_service_ptr->snapshots, __ATOMIC_ACQUIRE)) {
+        //живым снимкам нужны прежние состояния корзин: удаляем по одному ключу, как в именованной таблице
+        unlock_buckets();
+        unlock(&_service_ptr->memory_mutex);
+        if (_catalog_ptr) {
+            unlock(&_catalog_ptr->mutex);
+        }
+        clear_buckets();
+        return;
+    }
+    maintenance_begin(SMHT_MAINTENANCE_CLEAR);
+    wait_readers();
+    lock_arenas();
+    reset();
+    unlock_arenas();
+    release_readers();
+    maintenance_end();
+    unlock_buckets();
+    unlock(&_service_ptr->memory_mutex);
+    if (_catalog_ptr) {
+        unlock(&_catalog_ptr->mutex);
+    }
+}
+
+void SMHashTable::reset() {
+    //вызывается под всеми блокировками без читателей; повторный вызов после падения дочищает таблицу
+    //суперблок и служебную область не трогаем, в ней лежит мьютекс
+    auto page_size = (size_t) sysconf(_SC_PAGESIZE);
+    size_t from = (long) _header_ptr - (long) _superblock_ptr;
+    size_t aligned = std::min(int_ceil_divide(from, page_size) * page_size, (size_t) _memory_size);
+    //до границы страницы чистим руками, остальные страницы отдаем обратно ядру
+    std::memset((char *) _superblock_ptr + from, 0, aligned - from);
+    release_pages((char *) _superblock_ptr + aligned, _memory_size - aligned);
+    //словарь лежит в очищенной области
+    _service_ptr->dict_size = 0;
+    spill_reset();
+    //последовательности корзин обнулены вместе с областью, снимков нет - журнал пуст
+    _service_ptr->undo_head = _service_ptr->undo_tail = 0;
+    index_reset();
+    rebuild_summary();
+    for (uint32_t i = 0; i < _arena_count; i++) {
+        _service_ptr->arenas[i].hint = i * _arena_blocks;
+    }
+    //версии лежат вне очищенной области и только растут: читатель без guard перечитает цепочку;
+    //нечетную версию, оставленную упавшей заливкой, делаем четной
+    for (uint32_t i = 0; i < _bucket_total; i++) {
+        __atomic_store_n(&_versions_ptr[i], (_versions_ptr[i] + 2) & ~1U, __ATOMIC_SEQ_CST);
+        wake(i);
+    }
 }
 
-uint32_t SMHashTable::getFreeMemorySize() {
+uint64_t SMHashTable::getFreeMemorySize() {
+    //счетчики свободных блоков ведутся по кускам карты, саму карту не читаем
     uint32_t counter = 0;
-    for (auto i = (uint64_t) _memory_map_ptr; i < (uint64_t) _data_ptr; i++) {
-        if (*(char *) i == 0) {
-            counter++;
-        }
+    for (uint32_t c = 0; c < _chunk_count; c++) {
+        counter += _chunks_ptr[c].free;
     }
     meminfo.free = counter * _data_block_size;
     return meminfo.free;
 }
 
-uint32_t SMHashTable::getLongestFreeBlockSize() {
+uint64_t SMHashTable::getLongestFreeBlockSize() {
     uint32_t counter = 0;
     uint32_t longest = 0;
-    for (auto i = (uint64_t) _memory_map_ptr; i < (uint64_t) _data_ptr; i++) {
-        if (*(char *) i == 0) {
-            counter++;
-        } else {
+    for (uint32_t c = 0; c < _chunk_count; c++) {
+        uint32_t begin = c * SMHT_CHUNK_BLOCKS;
+        uint32_t end = std::min(begin + SMHT_CHUNK_BLOCKS, (uint32_t) _data_count);
+        //полностью занятые и полностью свободные куски не сканируем
+        if (_chunks_ptr[c].free == 0) {
             if (longest < counter) {
                 longest = counter;
             }
             counter = 0;
+            continue;
+        }
+        if (_chunks_ptr[c].free == end - begin) {
+            counter += end - begin;
+            continue;
+        }
+        for (auto i = (uint64_t) _memory_map_ptr + begin; i < (uint64_t) _memory_map_ptr + end; i++) {
+            if (*(char *) i == 0) {
+                counter++;
+            } else {
+                if (longest < counter) {
+                    longest = counter;
+                }
+                counter = 0;
+            }
         }
     }
     if (longest < counter) {
@@ -347,14 +1476,14 @@ uint32_t SMHashTable::getLongestFreeBlockSize() {
     return meminfo.max_free_block;
 }
 
-uint32_t SMHashTable::getLongestAllocatedBlockSize() {
+uint64_t SMHashTable::getLongestAllocatedBlockSize() {
     uint32_t counter = 0;
     uint32_t longest = 0;
     uint32_t segments = 0;
-    for (auto i = (uint64_t) _memory_map_ptr; i < (uint64_t) _data_ptr; i++) {
-        if (*(char *) i == 1) {
-            counter++;
-        } else {
+    for (uint32_t c = 0; c < _chunk_count; c++) {
+        uint32_t begin = c * SMHT_CHUNK_BLOCKS;
+        uint32_t end = std::min(begin + SMHT_CHUNK_BLOCKS, (uint32_t) _data_count);
+        if (_chunks_ptr[c].free == end - begin) {
             if (longest < counter) {
                 longest = counter;
             }
@@ -362,6 +1491,24 @@ uint32_t SMHashTable::getLongestAllocatedBlockSize() {
                 segments++;
             }
             counter = 0;
+            continue;
+        }
+        if (_chunks_ptr[c].free == 0) {
+            counter += end - begin;
+            continue;
+        }
+        for (auto i = (uint64_t) _memory_map_ptr + begin; i < (uint64_t) _memory_map_ptr + end; i++) {
+            if (*(char *) i == 1) {
+                counter++;
+            } else {
+                if (longest < counter) {
+                    longest = counter;
+                }
+                if (counter) {
+                    segments++;
+                }
+                counter = 0;
+            }
         }
     }
     if (longest < counter) {
@@ -372,35 +1519,216 @@ uint32_t SMHashTable::getLongestAllocatedBlockSize() {
     return meminfo.max_allocated_block;
 }
 
+double SMHashTable::getFilterFalsePositiveRate() {
+    //оценка по заполнению: доля отсутствующих ключей, для которых фильтр скажет "может быть"
+    if (!(_features & SMHT_FEATURE_FILTER)) {
+        meminfo.filter_size = 0;
+        meminfo.filter_false_positive = 0;
+        return 0;
+    }
+    double sum = 0;
+    for (uint64_t bucket = _bucket_base; bucket < _bucket_base + _key_count; bucket++) {
+        uint64_t word = __atomic_load_n(&_filter_ptr[bucket], __ATOMIC_RELAXED);
+        if (word >> (SMHT_FILTER_SLOTS * 8)) {
+            sum += 1;
+            continue;
+        }
+        uint8_t seen[SMHT_FILTER_SLOTS];
+        uint32_t distinct = 0;
+        for (uint32_t i = 0; i < SMHT_FILTER_SLOTS; i++) {
+            auto fp = (uint8_t) (word >> (i * 8));
+            if (fp && std::find(seen, seen + distinct, fp) == seen + distinct) {
+                seen[distinct++] = fp;
+            }
+        }
+        sum += distinct / 255.0;
+    }
+    meminfo.filter_size = sizeof(uint64_t) * _key_count;
+    meminfo.filter_false_positive = _key_count ? sum / _key_count : 0;
+    return meminfo.filter_false_positive;
+}
+
+inline void SMHashTable::hot_sample(uint32_t op, const char *key, uint32_t size) {
+    if (!(_features & SMHT_FEATURE_HOTKEYS)) {
+        return;
+    }
+    //счетчик выборки у каждого потока свой, общую память трогаем только на выбранных операциях
+    thread_local uint32_t counter = 0;
+    if (++counter < __atomic_load_n(&_service_ptr->hot.sample, __ATOMIC_RELAXED)) {
+        return;
+    }
+    counter = 0;
+    hot_record(op, key, size);
+}
+
+void SMHashTable::hot_record(uint32_t op, const char *key, uint32_t size) {
+    struct hotkeys *hot = &_service_ptr->hot;
+    __atomic_fetch_add(&hot->ops[op], 1, __ATOMIC_RELAXED);
+    //строки sketch адресуются хешами h1 + i * h2, оценка - минимум по строкам
+    uint32_t h1 = hash_method(key, size);
+    uint32_t h2 = ((h1 >> 16) ^ (h1 * 0x9e3779b1U)) | 1;
+    uint64_t estimate = UINT64_MAX;
+    for (uint32_t i = 0; i < SMHT_HOT_ROWS; i++) {
+        uint32_t *cell = &hot->sketch[i][(h1 + i * h2) % SMHT_HOT_WIDTH];
+        estimate = std::min<uint64_t>(estimate, __atomic_add_fetch(cell, 1, __ATOMIC_RELAXED));
+    }
+
+    if (estimate < __atomic_load_n(&hot->floor, __ATOMIC_RELAXED)) {
+        //оценки только растут, и у ключа из списка она не меньше минимальной - большинство ключей отсеивается здесь
+        return;
+    }
+    size = std::min<uint32_t>(size, SMHT_HOT_KEY_SIZE - 1);
+    struct hot_entry *rarest = nullptr;
+    uint64_t rarest_count = UINT64_MAX;
+    for (auto &entry : hot->top) {
+        uint32_t seq = __atomic_load_n(&entry.seq, __ATOMIC_ACQUIRE);
+        uint64_t count = __atomic_load_n(&entry.count, __ATOMIC_RELAXED);
+        bool same = !(seq & 1) && count && entry.hash == h1 && entry.key_size == size &&
+                    std::memcmp(entry.key, key, size) == 0;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (same && __atomic_load_n(&entry.seq, __ATOMIC_RELAXED) == seq) {
+            //ключ уже в списке; гонка двух писателей может потерять приращение, для оценки это не важно
+            if (count < estimate) {
+                __atomic_store_n(&entry.count, estimate, __ATOMIC_RELAXED);
+            }
+            return;
+        }
+        if (!(seq & 1) && count < rarest_count) {
+            rarest = &entry;
+            rarest_count = count;
+        }
+    }
+    __atomic_store_n(&hot->floor, rarest_count == UINT64_MAX ? 0 : rarest_count, __ATOMIC_RELAXED);
+    if (rarest == nullptr || rarest_count >= estimate) {
+        return;
+    }
+    //вытесняем самый редкий ключ; занятую другим писателем запись пропускаем, выборка это переживет
+    uint32_t seq = __atomic_load_n(&rarest->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&rarest->seq, &seq, seq + 1, false,
+                                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    std::memcpy(rarest->key, key, size);
+    rarest->key[size] = 0;
+    rarest->key_size = size;
+    rarest->hash = h1;
+    __atomic_store_n(&rarest->count, estimate, __ATOMIC_RELAXED);
+    __atomic_store_n(&rarest->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+struct SMHashTable::hot_stats SMHashTable::hotKeys() {
+    struct hot_stats stats;
+    if (!(_features & SMHT_FEATURE_HOTKEYS)) {
+        return stats;
+    }
+    struct hotkeys *hot = &_service_ptr->hot;
+    uint64_t sample = std::max(1U, __atomic_load_n(&hot->sample, __ATOMIC_RELAXED));
+    stats.seconds = (double) (now_ns() - (int64_t) __atomic_load_n(&hot->since, __ATOMIC_RELAXED)) / 1e9;
+    for (uint32_t op = 0; op < SMHT_OPS; op++) {
+        uint64_t ops = __atomic_load_n(&hot->ops[op], __ATOMIC_RELAXED) * sample;
+        stats.rate[op] = stats.seconds > 0 ? (double) ops / stats.seconds : 0;
+    }
+    for (auto &entry : hot->top) {
+        struct hot_key item;
+        uint32_t seq = __atomic_load_n(&entry.seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        item.count = __atomic_load_n(&entry.count, __ATOMIC_RELAXED) * sample;
+        item.key.assign(entry.key, std::min<uint32_t>(entry.key_size, SMHT_HOT_KEY_SIZE - 1));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (item.count && __atomic_load_n(&entry.seq, __ATOMIC_RELAXED) == seq) {
+            stats.top.push_back(std::move(item));
+        }
+    }
+    //два писателя могут одновременно занять под один ключ разные записи: оставляем большую оценку
+    std::sort(stats.top.begin(), stats.top.end(), [](const struct hot_key &a, const struct hot_key &b) {
+        return a.key != b.key ? a.key < b.key : a.count > b.count;
+    });
+    auto same_key = [](const struct hot_key &a, const struct hot_key &b) {
+        return a.key == b.key;
+    };
+    stats.top.erase(std::unique(stats.top.begin(), stats.top.end(), same_key), stats.top.end());
+    std::sort(stats.top.begin(), stats.top.end(), [](const struct hot_key &a, const struct hot_key &b) {
+        return a.count > b.count;
+    });
+    return stats;
+}
+
+void SMHashTable::resetHotKeys() {
+    //без блокировок: приращения, попавшие на момент сброса, могут пережить его. Заодно снимает
+    //запись списка, которую оставил упавший посреди замены процесс
+    struct hotkeys *hot = &_service_ptr->hot;
+    std::memset(hot->ops, 0, sizeof(hot->ops));
+    std::memset(hot->sketch, 0, sizeof(hot->sketch));
+    std::memset(hot->top, 0, sizeof(hot->top));
+    __atomic_store_n(&hot->floor, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&hot->since, (uint64_t) now_ns(), __ATOMIC_RELEASE);
+}
+
+void SMHashTable::setHotKeySampling(uint32_t n) {
+    //оценки из старой выборки пересчитались бы с новым множителем, поэтому начинаем заново
+    __atomic_store_n(&_service_ptr->hot.sample, std::max(1U, n), __ATOMIC_RELAXED);
+    resetHotKeys();
+}
+
 struct SMHashTable::meminfo *SMHashTable::memInfo() {
+    getFilterFalsePositiveRate();
     getFreeMemorySize();
     getLongestAllocatedBlockSize();
     getLongestFreeBlockSize();
-    return &meminfo;
-}
-
-struct SMHashTable::header *SMHashTable::findParent(struct SMHashTable::header *child) {
-    char *key = (char *) ((void *) ((long) child->key_offset + (long) _data_ptr));
-    auto check = get_header(key, child->key_size - 1);
-    struct SMHashTable::header *prev;
-    if (child != check) {
-        while (check->linked_item) {
-            prev = check;
-            check = (struct header *) ((long) check->linked_item + (long) _data_ptr);
-            if (check == child) {
-                return prev;
-            }
+    //логически занято - блоки данных, резидентно - страницы сегмента, которые держит tmpfs
+    meminfo.used = _data_len - meminfo.free;
+    struct stat st{};
+    //у именованной таблицы своего дескриптора нет, сегмент открыт у основной
+    meminfo.resident = fstat((_space ? _space : this)->_mem_descriptor, &st) == 0 ? (uint64_t) st.st_blocks * 512 : 0;
+    chain_stats(_bucket_base, _bucket_base + _key_count, &meminfo.max_chain, &meminfo.avg_chain,
+                &meminfo.chained_buckets);
+    meminfo.undo_capacity = _undo_capacity;
+    meminfo.undo_used = __atomic_load_n(&_service_ptr->undo_tail, __ATOMIC_RELAXED) -
+                        __atomic_load_n(&_service_ptr->undo_head, __ATOMIC_RELAXED);
+    meminfo.index_capacity = (uint64_t) _index_nodes * SMHT_INDEX_NODE;
+    meminfo.index_used = (uint64_t) __atomic_load_n(&_service_ptr->index_live, __ATOMIC_RELAXED) * SMHT_INDEX_NODE;
+    meminfo.spilled = 0;
+    meminfo.spill_file = 0;
+    if (_features & SMHT_FEATURE_SPILL) {
+        for (uint32_t g = 0; g < 2; g++) {
+            uint64_t tail = __atomic_load_n(&_service_ptr->spill_tail[g], __ATOMIC_RELAXED);
+            uint64_t dead = __atomic_load_n(&_service_ptr->spill_dead[g], __ATOMIC_RELAXED);
+            meminfo.spilled += std::max<uint64_t>(tail, SMHT_SPILL_ALIGN + dead) - SMHT_SPILL_ALIGN - dead;
+            meminfo.spill_file += fstat(_spill_fd[g], &st) == 0 ? (uint64_t) st.st_blocks * 512 : 0;
         }
     }
-    return nullptr;
+    return &meminfo;
 }
 
 void SMHashTable::hardDefragmentation() {
+    SMC_TRACE_SCOPE_EVERY(SMTR_OP_DEFRAG);
+    SMC_PROBE(defrag_start, _data_count);
+    //на время переноса блоков останавливаем всех писателей и ждем выхода читателей;
+    //каталог держим, чтобы finish_move видел неизменные диапазоны таблиц и семя
+    if (_catalog_ptr) {
+        lock(&_catalog_ptr->mutex);
+    }
+    lock(&_service_ptr->memory_mutex);
+    lock_buckets();
+    maintenance_begin(SMHT_MAINTENANCE_DEFRAG);
+    wait_readers();
+    lock_arenas();
+    //блоки, потерянные упавшими писателями, заняты в карте, но их содержимое устарело - переносить их нельзя
+    std::vector<uint8_t> refs(_data_count);
+    struct verify_report report{};
+    mark_references(refs, std::max(1U, std::thread::hardware_concurrency()), &report);
+    for (uint64_t i = 0; i < _data_count; i++) {
+        if (refs[i] == 0) {
+            ((uint8_t *) _memory_map_ptr)[i] = 0;
+        }
+    }
     //Сдвигаем все блоки влево
     uint64_t free_block_address = 0;
     uint64_t free_block_size = 0;
 
-    for (auto i = (uint64_t) _memory_map_ptr; i < (uint64_t) _data_ptr; i++) {
+    for (auto i = (uint64_t) _memory_map_ptr; i < (uint64_t) _memory_map_ptr + _data_count; i++) {
         if (*(char *) i == 0) {
             if (free_block_size == 0) {
                 free_block_address = i;
@@ -410,91 +1738,2493 @@ void SMHashTable::hardDefragmentation() {
             if (free_block_size != 0) {
                 //нашли дырку
                 void *data_dimension = (void *) ((long) _data_ptr + (((long) i - (long) _memory_map_ptr) * _data_block_size));
-                if ((*(long *) data_dimension >> 63) & 1U) {
+                bool is_data = (*(long *) data_dimension >> 63) & 1U;
+                uint32_t alloc_block_size;
+                if (is_data) {
                     //кусок данных
-                    auto *header = (struct header *) ((*(uint32_t *) data_dimension) + (long) _header_ptr);
-                    uint32_t alloc_block_size = int_ceil_divide((header->val_size + header->key_size + sizeof(void *)), _data_block_size);
+                    auto *header = (struct header *) ((*(uint64_t *) data_dimension & ~(1UL << 63)) + (long) _header_ptr);
+                    alloc_block_size = data_blocks(header);
+                } else {
+                    //заголовок
+                    alloc_block_size = int_ceil_divide(_header_size, _data_block_size);
+                }
+                auto from = (uint32_t) (i - (uint64_t) _memory_map_ptr);
+                auto to = (uint32_t) (free_block_address - (uint64_t) _memory_map_ptr);
+                if (!is_data && to < alloc_block_size) {
+                    //заголовок со смещением 0 не отличить от пустой ссылки linked_item, как и в find_memory_block
+                    to = alloc_block_size;
+                }
+                if (to < from) {
+                    move_block(from, to, alloc_block_size, is_data);
+                }
+                //откатываем итератор назад и продолжаем искать свободный блок
+                i = (uint64_t) _memory_map_ptr + to;
+                free_block_size = 0;
+            }
+        }
+    }
+    //счетчики карты пересчитываем один раз в конце, освободившийся хвост отдаем системе
+    rebuild_summary();
+    for (uint32_t i = 0; i < _arena_count; i++) {
+        release_chunks(i);
+    }
+    unlock_arenas();
+    release_readers();
+    maintenance_end();
+    unlock_buckets();
+    unlock(&_service_ptr->memory_mutex);
+    if (_catalog_ptr) {
+        unlock(&_catalog_ptr->mutex);
+    }
+    SMC_PROBE(defrag_done, _data_count);
+}
 
-                    //смещаем данные
-                    free_memory_block((void *) i, alloc_block_size);
-                    reserve_memory_block((void *) free_block_address, alloc_block_size);
+void SMHashTable::move_block(uint32_t from, uint32_t to, uint32_t blocks, bool data) {
+    //перенос описан в журнале, после падения finish_move доводит его до конца
+    struct maintenance *m = &_service_ptr->maintenance;
+    m->from = from;
+    m->to = to;
+    m->blocks = blocks;
+    m->move_data = data;
+    m->copied = 0;
+    __atomic_store_n(&m->move_state, SMHT_MOVE_COPY, __ATOMIC_RELEASE);
+    finish_move();
+}
 
-                    void *free_block_dimension = (void *) ((long) _data_ptr +
-                                                           (((long) free_block_address - (long) _memory_map_ptr) * _data_block_size));
-                    void *occupied_block_dimension = (void *) ((long) _data_ptr +
-                                                               (((long) i - (long) _memory_map_ptr) * _data_block_size));
+void SMHashTable::finish_move() {
+    struct maintenance *m = &_service_ptr->maintenance;
+    if (m->move_state == SMHT_MOVE_COPY) {
+        //копируем кусками не длиннее дырки: кусок не перекрывает свой источник,
+        //а еще не скопированная часть источника цела - копирование можно продолжить с m->copied
+        while (m->copied < m->blocks) {
+            uint32_t step = std::min(m->from - m->to, m->blocks - m->copied);
+            std::memcpy((char *) _data_ptr + (long) (m->to + m->copied) * _data_block_size,
+                        (char *) _data_ptr + (long) (m->from + m->copied) * _data_block_size,
+                        (size_t) step * _data_block_size);
+            __atomic_store_n(&m->copied, m->copied + step, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&m->move_state, SMHT_MOVE_LINK, __ATOMIC_RELEASE);
+    }
+    if (m->move_state != SMHT_MOVE_LINK) {
+        return;
+    }
+    //ссылки считаем по уже перенесенной копии, повторный проход пишет те же значения
+    void *moved = (void *) ((long) _data_ptr + (long) m->to * _data_block_size);
+    if (m->move_data) {
+        auto *header = (struct header *) ((*(uint64_t *) moved & ~(1UL << 63)) + (long) _header_ptr);
+        long key_offset = ((long) moved - (long) _data_ptr) + sizeof(void *);
+        header->key_offset = (void *) key_offset;
+        if (!(header->flags & SMHT_ENTRY_SPILLED)) {
+            header->val_offset = (void *) (key_offset + header->key_size);
+        }
+    } else {
+        auto *nheader = (struct header *) moved;
+        long old_offset = (long) m->from * _data_block_size;
+        long new_offset = (long) m->to * _data_block_size;
+        //у блока всегда есть родитель в цепочке, меняем у него адрес потомка. Таблица ключа
+        //неизвестна, а посреди перехеширования и семя: пробуем все корзины, где он может лежать
+        char *key = (char *) ((long) nheader->key_offset + (long) _data_ptr);
+        uint64_t seeds = _service_ptr->seeds;
+        bool linked = false;
+        for (auto &range : table_ranges()) {
+            for (uint32_t seed : {(uint32_t) seeds, (uint32_t) (seeds >> 32)}) {
+                auto *parent = get_header(range.first + hash_method(key, nheader->key_size - 1, seed) % range.second);
+                while (!linked && parent->linked_item) {
+                    if ((long) parent->linked_item == old_offset) {
+                        parent->linked_item = (void *) new_offset;
+                        linked = true;
+                    }
+                    parent = (struct header *) ((long) parent->linked_item + (long) _data_ptr);
+                }
+            }
+        }
+        //Меняем в данных адрес заголовка
+        ulong new_header_offset = ((long) nheader - (long) _header_ptr);
+        new_header_offset |= 1UL << 63;
+        *(uint64_t *) ((long) nheader->key_offset + (long) _data_ptr - sizeof(void *)) = new_header_offset;
+    }
+    std::memset((char *) _memory_map_ptr + m->from, 0, m->blocks);
+    std::memset((char *) _memory_map_ptr + m->to, 1, m->blocks);
+    __atomic_store_n(&m->move_state, SMHT_MOVE_NONE, __ATOMIC_RELEASE);
+}
 
-                    long header_new_key_offset = ((long) free_block_dimension - (long) _data_ptr) + 8;
-                    long header_new_val_offset = header_new_key_offset + header->key_size;
+void SMHashTable::seal() {
+    //под всеми блокировками корзин: после выхода ни один писатель не увидит старое значение флага
+    lock_buckets();
+    __atomic_store_n(&_service_ptr->sealed, 1, __ATOMIC_RELEASE);
+    unlock_buckets();
+}
 
-                    header->key_offset = (void *) header_new_key_offset;
-                    header->val_offset = (void *) header_new_val_offset;
+void SMHashTable::unseal() {
+    __atomic_store_n(&_service_ptr->sealed, 0, __ATOMIC_RELEASE);
+}
 
-                    std::memcpy(free_block_dimension, occupied_block_dimension, alloc_block_size * _data_block_size);
-                    //откатываем итератор назад и продолжаем искать свободный блок
-                    i -= free_block_size;
-                    free_block_size = 0;
-                } else {
-                    //заголовок
-                    uint32_t alloc_block_size = int_ceil_divide(_header_size, _data_block_size);
-                    auto *header = (struct header *) data_dimension;
-                    void *free_block_dimension = (void *) ((long) _data_ptr +
-                                                           (((long) free_block_address - (long) _memory_map_ptr) * _data_block_size));
-                    void *occupied_block_dimension = (void *) ((long) _data_ptr +
-                                                               (((long) i - (long) _memory_map_ptr) * _data_block_size));
-
-                    auto parent = findParent(header);
-                    if (parent != nullptr) {
-                        //если у блока есть родитель (связный список), то нужно у родителя поменять адрес потомка
-                        parent->linked_item = (void *) ((long) free_block_dimension - (long) _data_ptr);
-                    }
+bool SMHashTable::isSealed() {
+    return __atomic_load_n(&_service_ptr->sealed, __ATOMIC_ACQUIRE) != 0;
+}
 
-                    //смещаем заголовок
-                    free_memory_block((void *) i, alloc_block_size);
-                    reserve_memory_block((void *) free_block_address, alloc_block_size);
+void SMHashTable::copy_bucket(uint32_t bucket, std::vector<std::pair<std::string, std::string>> &items) {
+    //под блокировкой корзины
+    auto *header = get_header(bucket);
+    while (header && header->val_offset) {
+        std::string key((char *) _data_ptr + (long) header->key_offset, header->key_size - 1);
+        std::string val(header->raw_size, 0);
+        if (header->flags & SMHT_ENTRY_COMPRESSED) {
+            if (decompress(header, &val[0], val.size()) < 0) {
+                val.assign(1, 0);
+            }
+        } else {
+            std::memcpy(&val[0], value_ptr(header), header->raw_size);
+        }
+        val.resize(val.size() - 1);
+        items.emplace_back(std::move(key), std::move(val));
+        header = header->linked_item ? (struct header *) ((long) header->linked_item + (long) _data_ptr) : nullptr;
+    }
+}
 
-                    //копируем заголовок
-                    std::memcpy(free_block_dimension, occupied_block_dimension, alloc_block_size * _data_block_size);
+void SMHashTable::forEach(const std::function<void(const std::string &, const std::string &)> &callback) {
+    std::vector<std::pair<std::string, std::string>> items;
+    for (uint64_t bucket = _bucket_base; bucket < _bucket_base + _key_count; bucket++) {
+        lock(bucket_mutex(bucket));
+        copy_bucket(bucket, items);
+        unlock(bucket_mutex(bucket));
+        //колбэк может сам писать в таблицу, поэтому вызываем его уже без блокировки
+        for (auto &item : items) {
+            callback(item.first, item.second);
+        }
+        items.clear();
+    }
+}
 
-                    //Меняем в данных адрес заголовка
-                    auto *nheader = (struct header *) free_block_dimension;
-                    uint32_t new_header_offset = ((long) free_block_dimension - (long) _header_ptr);
-                    void *data_ptr = ((void *) ((long) nheader->key_offset + (long) _data_ptr - 8));
+void SMHashTable::snapshot_preserve(uint32_t bucket) {
+    //под блокировкой корзины, до изменения цепочки
+    if (!(_features & SMHT_FEATURE_SNAPSHOTS) || !__atomic_load_n(&_service_ptr->snapshots, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    //новые снимки создаются под всеми блокировками корзин, пока держим свою - набор снимков не растет
+    uint64_t newest = 0;
+    for (auto &slot : _service_ptr->snapshot_slots) {
+        if (__atomic_load_n(&slot.pid, __ATOMIC_ACQUIRE) && !__atomic_load_n(&slot.broken, __ATOMIC_RELAXED)) {
+            newest = std::max(newest, slot.sequence);
+        }
+    }
+    struct bucket_version *version = &_snapshot_ptr[bucket];
+    if (version->sequence > newest) {
+        //текущее состояние появилось после всех снимков, кроме таблицы его никто не видит
+        return;
+    }
+    thread_local std::vector<std::pair<std::string, std::string>> items;
+    items.clear();
+    copy_bucket(bucket, items);
+    uint64_t size = sizeof(struct undo_record);
+    for (auto &item : items) {
+        size += 2 * sizeof(uint32_t) + item.first.size() + item.second.size();
+    }
+    size = int_ceil_divide(size, SMHT_UNDO_ALIGN) * SMHT_UNDO_ALIGN;
 
-                    std::memcpy(data_ptr, &new_header_offset, sizeof(uint32_t));
+    struct service *service = _service_ptr;
+    lock(&service->undo_mutex);
+    uint64_t position;
+    if (!undo_reserve(size, &position)) {
+        //писатель не ждет снимки: места нет - снимки, которым оно нужно, ломаются
+        snapshot_break();
+        unlock(&service->undo_mutex);
+        return;
+    }
+    auto *record = (struct undo_record *) (_undo_ptr + position % _undo_capacity);
+    record->size = size;
+    record->sequence = version->sequence;
+    record->prev = version->undo;
+    record->bucket = bucket;
+    record->count = items.size();
+    char *ptr = (char *) (record + 1);
+    for (auto &item : items) {
+        auto key_size = (uint32_t) item.first.size();
+        auto val_size = (uint32_t) item.second.size();
+        std::memcpy(ptr, &key_size, sizeof(key_size));
+        std::memcpy(ptr + sizeof(key_size), &val_size, sizeof(val_size));
+        ptr += 2 * sizeof(uint32_t);
+        std::memcpy(ptr, item.first.data(), key_size);
+        std::memcpy(ptr + key_size, item.second.data(), val_size);
+        ptr += key_size + val_size;
+    }
+    record->until = ++service->undo_sequence;
+    service->undo_tail = position + size;
+    version->undo = position + 1;
+    version->sequence = record->until;
+    unlock(&service->undo_mutex);
+}
 
-                    i -= free_block_size;
-                    free_block_size = 0;
+bool SMHashTable::snapshot_bucket(uint32_t bucket, uint32_t slot, uint64_t sequence,
+                                  std::vector<std::pair<std::string, std::string>> &items) {
+    //корзину не меняли после снимка - читаем ее саму, иначе ищем в журнале состояние на момент снимка
+    lock(bucket_mutex(bucket));
+    struct bucket_version *version = &_snapshot_ptr[bucket];
+    bool result = true;
+    if (version->sequence <= sequence) {
+        copy_bucket(bucket, items);
+    } else {
+        //журнал читаем под его мьютексом: сломанный снимок мог потерять свои записи
+        lock(&_service_ptr->undo_mutex);
+        result = !_service_ptr->snapshot_slots[slot].broken;
+        for (uint64_t position = version->undo; result; ) {
+            if (position == 0) {
+                result = false;
+                break;
+            }
+            auto *record = (struct undo_record *) (_undo_ptr + (position - 1) % _undo_capacity);
+            if (record->sequence <= sequence) {
+                const char *ptr = (const char *) (record + 1);
+                for (uint32_t i = 0; i < record->count; i++) {
+                    uint32_t key_size;
+                    uint32_t val_size;
+                    std::memcpy(&key_size, ptr, sizeof(key_size));
+                    std::memcpy(&val_size, ptr + sizeof(key_size), sizeof(val_size));
+                    ptr += 2 * sizeof(uint32_t);
+                    items.emplace_back(std::string(ptr, key_size), std::string(ptr + key_size, val_size));
+                    ptr += key_size + val_size;
                 }
+                break;
             }
+            position = record->prev;
         }
+        unlock(&_service_ptr->undo_mutex);
     }
+    unlock(bucket_mutex(bucket));
+    return result;
 }
 
-inline struct SMHashTable::header *SMHashTable::get_header(const char *key, uint32_t size) {
-    return (struct header *) ((void *) ((char *) _header_ptr + (hash_method(key, size) % _key_count * _header_size)));
+bool SMHashTable::undo_reserve(uint64_t size, uint64_t *position) {
+    //под undo_mutex; запись не переходит через конец кольца, остаток до конца пропускаем
+    struct service *service = _service_ptr;
+    if (size > _undo_capacity) {
+        return false;
+    }
+    uint64_t offset = service->undo_tail % _undo_capacity;
+    uint64_t skip = _undo_capacity - offset < size ? _undo_capacity - offset : 0;
+    if (service->undo_tail + skip + size - service->undo_head > _undo_capacity) {
+        undo_reclaim();
+    }
+    if (service->undo_tail + skip + size - service->undo_head > _undo_capacity) {
+        return false;
+    }
+    if (skip >= sizeof(struct undo_record)) {
+        auto *pad = (struct undo_record *) (_undo_ptr + offset);
+        pad->size = skip;
+        pad->until = 0;
+    }
+    service->undo_tail += skip;
+    *position = service->undo_tail;
+    return true;
 }
 
-inline void *SMHashTable::find_memory_block(size_t size, uint32_t offset) {
-    lock(&_service_ptr->memory_mutex);
-    void *ptr = find_zero_sequence((void *) ((long) _memory_map_ptr + offset), (void *) ((long) _memory_map_ptr + (long) _data_count), size);
-    if(ptr){
-        std::memset(ptr, 1, size);
+void SMHashTable::undo_reclaim() {
+    //под undo_mutex; записи идут по возрастанию until, с начала кольца уходят те, что старше всех снимков
+    struct service *service = _service_ptr;
+    uint64_t oldest = snapshot_oldest();
+    if (oldest == UINT64_MAX) {
+        service->undo_head = service->undo_tail;
+        return;
+    }
+    while (service->undo_head < service->undo_tail) {
+        uint64_t offset = service->undo_head % _undo_capacity;
+        if (_undo_capacity - offset < sizeof(struct undo_record)) {
+            //хвост кольца меньше заголовка - в нем ничего нет
+            service->undo_head += _undo_capacity - offset;
+            continue;
+        }
+        auto *record = (struct undo_record *) (_undo_ptr + offset);
+        if (record->until > oldest) {
+            break;
+        }
+        service->undo_head += record->size;
     }
-    unlock(&_service_ptr->memory_mutex);
-    return ptr;
 }
 
-inline void SMHashTable::reserve_memory_block(void *addr, uint32_t size) {
-    std::memset(addr, 1, size);
+uint64_t SMHashTable::snapshot_oldest() {
+    //под undo_mutex; слоты упавших процессов освобождаем
+    uint64_t oldest = UINT64_MAX;
+    for (auto &slot : _service_ptr->snapshot_slots) {
+        if (slot.pid && process_dead(slot.pid)) {
+            __atomic_store_n(&slot.pid, 0, __ATOMIC_RELEASE);
+            __atomic_sub_fetch(&_service_ptr->snapshots, 1, __ATOMIC_SEQ_CST);
+        }
+        if (slot.pid && !slot.broken) {
+            oldest = std::min(oldest, slot.sequence);
+        }
+    }
+    return oldest;
 }
 
-inline void SMHashTable::free_memory_block(void *addr, uint32_t size) {
-    std::memset(addr, 0, size);
+void SMHashTable::snapshot_break() {
+    //под undo_mutex; записи сломанных снимков больше никому не нужны
+    for (auto &slot : _service_ptr->snapshot_slots) {
+        if (slot.pid) {
+            __atomic_store_n(&slot.broken, 1, __ATOMIC_RELEASE);
+        }
+    }
+    _service_ptr->undo_head = _service_ptr->undo_tail;
 }
 
-void *SMHashTable::find_zero_sequence(void *from, void *to, uint32_t len) {
-    uint32_t counter = 0;
+std::string SMHashTable::index_key(const char *key, uint32_t size, uint64_t base) {
+    //впереди начало корзин таблицы старшими байтами: ключи одной таблицы лежат в дереве подряд
+    std::string result(SMHT_INDEX_PREFIX + size, 0);
+    for (uint32_t i = 0; i < SMHT_INDEX_PREFIX; i++) {
+        result[i] = (char) (base >> (8 * (SMHT_INDEX_PREFIX - 1 - i)));
+    }
+    std::memcpy(&result[SMHT_INDEX_PREFIX], key, size);
+    return result;
+}
+
+inline struct SMHashTable::index_node *SMHashTable::index_at(uint32_t node) {
+    return (struct index_node *) (_index_ptr + (uint64_t) node * SMHT_INDEX_NODE);
+}
+
+inline struct SMHashTable::index_slot *SMHashTable::index_slots(struct index_node *node) {
+    return (struct index_slot *) (node + 1);
+}
+
+inline uint64_t SMHashTable::index_head(const char *key, uint32_t size) {
+    uint64_t head = 0;
+    for (uint32_t i = 0; i < sizeof(uint64_t); i++) {
+        head = head << 8 | (i < size ? (uint8_t) key[i] : 0);
+    }
+    return head;
+}
+
+inline int SMHashTable::index_compare(struct index_node *node, uint32_t slot, const std::string &key, uint64_t head) {
+    //узел может меняться под читателем: смещение и длину ограничиваем узлом, результат проверит версия
+    struct index_slot *s = &index_slots(node)[slot];
+    uint64_t other = s->head;
+    if (head != other) {
+        return head < other ? -1 : 1;
+    }
+    uint32_t offset = std::min<uint32_t>(s->offset, SMHT_INDEX_NODE);
+    uint32_t size = std::min<uint32_t>(s->size, SMHT_INDEX_NODE - offset);
+    int result = std::memcmp(key.data(), (char *) node + offset, std::min<size_t>(key.size(), size));
+    if (result == 0 && key.size() != size) {
+        result = key.size() < size ? -1 : 1;
+    }
+    return result;
+}
+
+uint32_t SMHashTable::index_search(struct index_node *node, const std::string &key, bool upper) {
+    //первый слот больше ключа (upper) или не меньше него
+    static_assert((SMHT_INDEX_NODE - sizeof(struct index_node)) / sizeof(struct index_slot) == SMHT_INDEX_SLOTS,
+                  "slots fill the node");
+    uint64_t head = index_head(key.data(), key.size());
+    uint32_t low = 0;
+    uint32_t high = std::min<uint32_t>(node->count, SMHT_INDEX_SLOTS);
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        int result = index_compare(node, middle, key, head);
+        if (result > 0 || (upper && result == 0)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+bool SMHashTable::index_read(const std::string &from, std::vector<std::string> *keys, std::string *fence) {
+    //спуск без блокировок: версию потомка берем до повторной проверки версии родителя, поэтому узел,
+    //который меняли, пока мы по нему шли, виден и спуск начинается заново от корня.
+    //keys - ключи листа от from, fence - ближайший разделитель справа от листа, пусто - лист последний;
+    //false - дерево очищено после упавшего писателя и ждет index_rebuild(). Без keys - есть ли сам from,
+    //в очищенном дереве его нет
+    auto copy = [](struct index_node *node, uint32_t slot) {
+        struct index_slot *s = &index_slots(node)[slot];
+        uint32_t offset = std::min<uint32_t>(s->offset, SMHT_INDEX_NODE);
+        return std::string((char *) node + offset, std::min<uint32_t>(s->size, SMHT_INDEX_NODE - offset));
+    };
+    for (uint32_t spins = 1;; spins++) {
+        if (spins % SMHT_INDEX_SPINS == 0) {
+            //писатель мог умереть, оставив узел нечетным: восстановление под мьютексом очистит дерево.
+            //Попытки здесь с уступкой ядра и дороже, чем у корзин, поэтому проверяем чаще
+            lock(&_service_ptr->index_mutex);
+            unlock(&_service_ptr->index_mutex);
+        }
+        if (keys) {
+            keys->clear();
+        }
+        if (fence) {
+            fence->clear();
+        }
+        //index_broken нечетный, пока дерево очищено, и меняется до очистки: как версия узла для всего дерева
+        uint32_t broken = __atomic_load_n(&_service_ptr->index_broken, __ATOMIC_ACQUIRE);
+        if (broken & 1) {
+            return false;
+        }
+        uint32_t id = __atomic_load_n(&_service_ptr->index_root, __ATOMIC_ACQUIRE);
+        if (id == 0 || id >= _index_nodes) {
+            continue;
+        }
+        struct index_node *node = index_at(id);
+        uint32_t version = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE);
+        for (uint32_t depth = 0; depth < SMHT_INDEX_DEPTH && !(version & 1); depth++) {
+            uint32_t count = std::min<uint32_t>(node->count, SMHT_INDEX_SLOTS);
+            if (node->leaf) {
+                uint32_t position = index_search(node, from, false);
+                bool found = position < count && index_compare(node, position, from,
+                                                               index_head(from.data(), from.size())) == 0;
+                for (uint32_t i = position; keys && i < count; i++) {
+                    keys->push_back(copy(node, i));
+                }
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&node->version, __ATOMIC_RELAXED) == version &&
+                    __atomic_load_n(&_service_ptr->index_broken, __ATOMIC_RELAXED) == broken) {
+                    return keys ? true : found;
+                }
+                break;
+            }
+            uint32_t position = index_search(node, from, true);
+            uint32_t child = position == 0 ? node->first : position <= count ? index_slots(node)[position - 1].child : 0;
+            if (fence && position < count) {
+                *fence = copy(node, position);
+            }
+            if (child == 0 || child >= _index_nodes) {
+                break;
+            }
+            struct index_node *next = index_at(child);
+            uint32_t next_version = __atomic_load_n(&next->version, __ATOMIC_ACQUIRE);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&node->version, __ATOMIC_RELAXED) != version) {
+                break;
+            }
+            node = next;
+            version = next_version;
+        }
+        if (version & 1) {
+            //узел держит писатель, на одном ядре без уступки он не закончит
+            std::this_thread::yield();
+        }
+    }
+}
+
+inline void SMHashTable::index_begin(struct index_node *node) {
+    //под index_mutex, как begin_update для корзины
+    __atomic_store_n(&node->version, node->version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+inline void SMHashTable::index_end(struct index_node *node) {
+    __atomic_store_n(&node->version, node->version + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t SMHashTable::index_alloc() {
+    //под index_mutex; сначала освобожденные узлы. Версия узла продолжается, поэтому читатель,
+    //запомнивший его прежнюю, новое содержимое не примет
+    uint32_t id = _service_ptr->index_free;
+    if (id) {
+        _service_ptr->index_free = index_at(id)->first;
+    } else {
+        id = _service_ptr->index_next++;
+    }
+    struct index_node *node = index_at(id);
+    node->version = (node->version + 2) & ~1U;
+    _service_ptr->index_live++;
+    return id;
+}
+
+void SMHashTable::index_free(uint32_t id) {
+    //под index_mutex; узел уже недостижим от корня, но читатель может в нем стоять - меняем версию
+    struct index_node *node = index_at(id);
+    index_begin(node);
+    node->leaf = 1;
+    node->count = 0;
+    node->heap = SMHT_INDEX_NODE;
+    node->first = _service_ptr->index_free;
+    index_end(node);
+    _service_ptr->index_free = id;
+    _service_ptr->index_live--;
+}
+
+void SMHashTable::index_write(uint32_t id, bool leaf, uint32_t first,
+                              const std::vector<std::pair<std::string, uint32_t>> &entries) {
+    //узел переписывается целиком и плотно; версию ведет тот, кто узел меняет
+    struct index_node *node = index_at(id);
+    struct index_slot *slots = index_slots(node);
+    uint32_t heap = SMHT_INDEX_NODE;
+    for (size_t i = 0; i < entries.size(); i++) {
+        auto &key = entries[i].first;
+        heap -= key.size();
+        std::memcpy((char *) node + heap, key.data(), key.size());
+        slots[i].head = index_head(key.data(), key.size());
+        slots[i].offset = (uint16_t) heap;
+        slots[i].size = (uint16_t) key.size();
+        slots[i].child = entries[i].second;
+    }
+    node->leaf = leaf;
+    node->count = (uint16_t) entries.size();
+    node->first = first;
+    node->heap = heap;
+}
+
+bool SMHashTable::index_add(const std::string &key, bool *added) {
+    //под блокировкой корзины ключа; ключ, который в дереве уже есть, мьютекс не берет
+    *added = false;
+    if (!(_features & SMHT_FEATURE_ORDERED)) {
+        return true;
+    }
+    std::string index = index_key(key.data(), key.size(), _bucket_base);
+    if (index_read(index, nullptr, nullptr)) {
+        return true;
+    }
+    lock(&_service_ptr->index_mutex);
+    bool result = index_insert(index, added);
+    unlock(&_service_ptr->index_mutex);
+    return result;
+}
+
+void SMHashTable::index_remove(const std::string &key) {
+    if (!(_features & SMHT_FEATURE_ORDERED)) {
+        return;
+    }
+    std::string index = index_key(key.data(), key.size(), _bucket_base);
+    lock(&_service_ptr->index_mutex);
+    index_erase(index);
+    unlock(&_service_ptr->index_mutex);
+}
+
+bool SMHashTable::index_insert(const std::string &key, bool *added) {
+    //под index_mutex. Путь от корня запоминаем: переполненный узел делится пополам по байтам,
+    //разделитель уходит в родителя, и так, пока родителю хватает места или не разделится корень
+    uint32_t path[SMHT_INDEX_DEPTH];
+    uint32_t positions[SMHT_INDEX_DEPTH];
+    uint32_t depth = 0;
+    uint32_t id = _service_ptr->index_root;
+    struct index_node *leaf = index_at(id);
+    while (!leaf->leaf && depth < SMHT_INDEX_DEPTH - 1) {
+        uint32_t position = index_search(leaf, key, true);
+        path[depth] = id;
+        positions[depth++] = position;
+        id = position ? index_slots(leaf)[position - 1].child : leaf->first;
+        leaf = index_at(id);
+    }
+    uint32_t position = index_search(leaf, key, false);
+    *added = false;
+    if (position < leaf->count && index_compare(leaf, position, key, index_head(key.data(), key.size())) == 0) {
+        return true;
+    }
+    if (leaf->heap >= sizeof(struct index_node) + (leaf->count + 1U) * sizeof(struct index_slot) + key.size()) {
+        //место есть: сдвигаем слоты, ключ кладем под уже лежащие
+        struct index_slot *slots = index_slots(leaf);
+        index_begin(leaf);
+        std::memmove(&slots[position + 1], &slots[position], (leaf->count - position) * sizeof(struct index_slot));
+        leaf->heap -= key.size();
+        std::memcpy((char *) leaf + leaf->heap, key.data(), key.size());
+        slots[position].head = index_head(key.data(), key.size());
+        slots[position].offset = (uint16_t) leaf->heap;
+        slots[position].size = (uint16_t) key.size();
+        slots[position].child = 0;
+        leaf->count++;
+        index_end(leaf);
+        *added = true;
+        return true;
+    }
+    //в худшем случае делится каждый узел пути и появляется новый корень
+    if (_service_ptr->index_live + depth + 2 >= _index_nodes) {
+        return false;
+    }
+    //читатели, зашедшие в узлы пути, начнут спуск заново
+    for (uint32_t i = 0; i < depth; i++) {
+        index_begin(index_at(path[i]));
+    }
+    index_begin(leaf);
+    std::string carry = key;
+    uint32_t child = 0;
+    std::vector<std::pair<std::string, uint32_t>> entries;
+    for (uint32_t level = depth;;) {
+        struct index_node *node = index_at(id);
+        struct index_slot *slots = index_slots(node);
+        entries.clear();
+        for (uint32_t i = 0; i < node->count; i++) {
+            entries.emplace_back(std::string((char *) node + slots[i].offset, slots[i].size), slots[i].child);
+        }
+        entries.emplace(entries.begin() + position, std::move(carry), child);
+        uint64_t bytes = 0;
+        for (auto &entry : entries) {
+            bytes += sizeof(struct index_slot) + entry.first.size();
+        }
+        bool is_leaf = node->leaf;
+        if (bytes <= SMHT_INDEX_NODE - sizeof(struct index_node)) {
+            //после удалений хватило места, освобожденного в куче
+            index_write(id, is_leaf, node->first, entries);
+            break;
+        }
+        //в листе первый ключ правой половины копируется в родителя разделителем, во внутреннем узле
+        //средний разделитель уходит в родителя, а его потомок становится first правой половины
+        uint64_t half = 0;
+        size_t middle = 0;
+        while (middle + 1 < entries.size() &&
+               half + sizeof(struct index_slot) + entries[middle].first.size() <= bytes / 2) {
+            half += sizeof(struct index_slot) + entries[middle].first.size();
+            middle++;
+        }
+        middle = std::max<size_t>(middle, 1);
+        uint32_t right = index_alloc();
+        std::vector<std::pair<std::string, uint32_t>> upper(entries.begin() + middle + (is_leaf ? 0 : 1),
+                                                            entries.end());
+        index_write(right, is_leaf, is_leaf ? 0 : entries[middle].second, upper);
+        carry = entries[middle].first;
+        child = right;
+        entries.resize(middle);
+        index_write(id, is_leaf, node->first, entries);
+        if (level == 0) {
+            //разделился корень: новый корень над половинами, читатели видят его уже готовым
+            uint32_t root = index_alloc();
+            index_write(root, false, id, {{carry, right}});
+            __atomic_store_n(&_service_ptr->index_root, root, __ATOMIC_RELEASE);
+            break;
+        }
+        level--;
+        id = path[level];
+        position = positions[level];
+    }
+    for (uint32_t i = 0; i < depth; i++) {
+        index_end(index_at(path[i]));
+    }
+    index_end(leaf);
+    *added = true;
+    return true;
+}
+
+void SMHashTable::index_erase(const std::string &key) {
+    //под index_mutex; опустевший лист уходит из родителя, опустевший родитель - из своего
+    uint32_t path[SMHT_INDEX_DEPTH];
+    uint32_t positions[SMHT_INDEX_DEPTH];
+    uint32_t depth = 0;
+    uint32_t id = _service_ptr->index_root;
+    struct index_node *node = index_at(id);
+    while (!node->leaf && depth < SMHT_INDEX_DEPTH - 1) {
+        uint32_t position = index_search(node, key, true);
+        path[depth] = id;
+        positions[depth++] = position;
+        id = position ? index_slots(node)[position - 1].child : node->first;
+        node = index_at(id);
+    }
+    uint32_t position = index_search(node, key, false);
+    if (position >= node->count || index_compare(node, position, key, index_head(key.data(), key.size())) != 0) {
+        return;
+    }
+    //байты ключа остаются в куче до следующей перезаписи узла
+    struct index_slot *slots = index_slots(node);
+    index_begin(node);
+    std::memmove(&slots[position], &slots[position + 1], (node->count - position - 1) * sizeof(struct index_slot));
+    node->count--;
+    index_end(node);
+
+    bool empty = node->count == 0;
+    while (empty && depth > 0) {
+        depth--;
+        struct index_node *parent = index_at(path[depth]);
+        position = positions[depth];
+        slots = index_slots(parent);
+        //у родителя без разделителей это был единственный потомок, тогда родитель уходит следующим
+        empty = parent->count == 0;
+        if (!empty) {
+            uint32_t drop = position ? position - 1 : 0;
+            index_begin(parent);
+            if (position == 0) {
+                parent->first = slots[0].child;
+            }
+            std::memmove(&slots[drop], &slots[drop + 1], (parent->count - drop - 1) * sizeof(struct index_slot));
+            parent->count--;
+            index_end(parent);
+        }
+        index_free(id);
+        id = path[depth];
+    }
+    if (empty && !index_at(id)->leaf) {
+        //опустел весь корень
+        node = index_at(id);
+        index_begin(node);
+        node->leaf = 1;
+        node->first = 0;
+        node->heap = SMHT_INDEX_NODE;
+        index_end(node);
+    }
+    //корень с одним потомком: дерево становится ниже
+    for (;;) {
+        uint32_t root = _service_ptr->index_root;
+        node = index_at(root);
+        if (node->leaf || node->count) {
+            break;
+        }
+        __atomic_store_n(&_service_ptr->index_root, node->first, __ATOMIC_RELEASE);
+        index_free(root);
+    }
+}
+
+bool SMHashTable::index_fits(const std::vector<bulk_item> &items) {
+    //заливка начинает дерево заново; разделенный узел заполнен хотя бы на треть, остальное - запас
+    //на внутренние узлы
+    if (!(_features & SMHT_FEATURE_ORDERED)) {
+        return true;
+    }
+    uint64_t bytes = 0;
+    for (auto &item : items) {
+        if (item.key.size() + SMHT_INDEX_PREFIX > SMHT_INDEX_KEY_MAX) {
+            return false;
+        }
+        bytes += sizeof(struct index_slot) + SMHT_INDEX_PREFIX + item.key.size();
+    }
+    return int_ceil_divide(bytes * 3, SMHT_INDEX_NODE - sizeof(struct index_node)) + SMHT_INDEX_DEPTH < _index_nodes;
+}
+
+void SMHashTable::index_reset() {
+    //под index_mutex или всеми блокировками корзин; пустой лист-корень
+    if (!(_features & SMHT_FEATURE_ORDERED)) {
+        return;
+    }
+    _service_ptr->index_next = 1;
+    _service_ptr->index_free = 0;
+    _service_ptr->index_live = 0;
+    uint32_t root = index_alloc();
+    struct index_node *node = index_at(root);
+    index_begin(node);
+    node->leaf = 1;
+    node->count = 0;
+    node->first = 0;
+    node->heap = SMHT_INDEX_NODE;
+    index_end(node);
+    __atomic_store_n(&_service_ptr->index_root, root, __ATOMIC_RELEASE);
+}
+
+void SMHashTable::index_rebuild() {
+    //после упавшего писателя: ключи всех таблиц заново из корзин, писатели на это время стоят
+    if (_catalog_ptr) {
+        lock(&_catalog_ptr->mutex);
+    }
+    lock_buckets();
+    lock(&_service_ptr->index_mutex);
+    if (__atomic_load_n(&_service_ptr->index_broken, __ATOMIC_ACQUIRE) & 1) {
+        index_reset();
+        bool result = true;
+        bool added;
+        for (auto &range : table_ranges()) {
+            for (uint64_t bucket = range.first; bucket < range.first + range.second; bucket++) {
+                auto *header = get_header(bucket);
+                while (header && header->val_offset) {
+                    result = index_insert(index_key((char *) _data_ptr + (long) header->key_offset,
+                                                    header->key_size - 1, range.first), &added) && result;
+                    header = header->linked_item ? (struct header *) ((long) header->linked_item + (long) _data_ptr)
+                                                 : nullptr;
+                }
+            }
+        }
+        if (!result) {
+            std::cerr << _name << ": ordered index is full, some keys are missing from it" << std::endl;
+        }
+        __atomic_store_n(&_service_ptr->index_broken, _service_ptr->index_broken + 1, __ATOMIC_RELEASE);
+    }
+    unlock(&_service_ptr->index_mutex);
+    unlock_buckets();
+    if (_catalog_ptr) {
+        unlock(&_catalog_ptr->mutex);
+    }
+}
+
+void SMHashTable::setChainLimit(uint32_t limit) {
+    __atomic_store_n(&_service_ptr->chain_limit, limit, __ATOMIC_RELAXED);
+}
+
+uint32_t SMHashTable::bucketOf(const std::string &key) {
+    return get_bucket(key.c_str(), key.size());
+}
+
+bool SMHashTable::stampOf(const std::string &key, struct stamp *stamp) {
+    stamp->seeds = __atomic_load_n(&_service_ptr->seeds, __ATOMIC_ACQUIRE);
+    if ((uint32_t) stamp->seeds != stamp->seeds >> 32) {
+        //ключ может лежать в двух корзинах, одной версии мало
+        return false;
+    }
+    stamp->bucket = bucket_for(key.c_str(), key.size(), (uint32_t) stamp->seeds);
+    stamp->version = __atomic_load_n(&_versions_ptr[stamp->bucket], __ATOMIC_ACQUIRE);
+    return !(stamp->version & 1);
+}
+
+bool SMHashTable::stampValid(const struct stamp &stamp) {
+    //семя меняется раз в перехеширование и почти всегда в кеше ядра, дорогая только строка версий;
+    //clear() тоже сдвигает версии всех корзин
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&_versions_ptr[stamp.bucket], __ATOMIC_RELAXED) == stamp.version &&
+           __atomic_load_n(&_service_ptr->seeds, __ATOMIC_RELAXED) == stamp.seeds;
+}
+
+bool SMHashTable::rehash() {
+    return run_rehash(true);
+}
+
+uint32_t SMHashTable::chain_length(uint32_t bucket) {
+    //под блокировкой корзины
+    uint32_t length = 0;
+    for (auto *header = get_header(bucket); header && header->val_offset; length++) {
+        header = header->linked_item ? (struct header *) ((long) header->linked_item + (long) _data_ptr) : nullptr;
+    }
+    return length;
+}
+
+void SMHashTable::chain_stats(uint64_t from, uint64_t to, uint32_t *longest, double *average, uint64_t *nonempty) {
+    //без блокировок, под guard: цепочку могут менять, но память под ней не переиспользуется
+    read_guard guard(this);
+    uint64_t items = 0;
+    uint64_t used = 0;
+    *longest = 0;
+    for (uint64_t bucket = from; bucket < to; bucket++) {
+        uint32_t length = 0;
+        auto *header = get_header(bucket);
+        while (header && header->val_offset && length <= _data_count) {
+            length++;
+            auto linked = (uint64_t) __atomic_load_n(&header->linked_item, __ATOMIC_ACQUIRE);
+            header = linked ? (struct header *) ((long) _data_ptr + linked) : nullptr;
+        }
+        items += length;
+        used += length != 0;
+        *longest = std::max(*longest, length);
+    }
+    if (average) {
+        *average = used ? (double) items / used : 0;
+    }
+    if (nonempty) {
+        *nonempty = used;
+    }
+}
+
+void SMHashTable::check_chain(uint32_t chain, bool rehashing) {
+    struct service *service = _service_ptr;
+    uint32_t pid = __atomic_load_n(&service->rehash_pid, __ATOMIC_ACQUIRE);
+    if (rehashing) {
+        //перенос остановлен (pid снят) или его процесс умер - продолжаем; живость проверяем изредка.
+        //Семя перечитываем: перенос мог закончиться, пока мы держали корзины
+        thread_local uint32_t counter = 0;
+        uint64_t seeds = __atomic_load_n(&service->seeds, __ATOMIC_ACQUIRE);
+        if ((uint32_t) seeds != seeds >> 32 &&
+            (pid == 0 || (++counter % SMHT_REHASH_CHECK == 0 && process_dead(pid)))) {
+            start_rehasher(false);
+        }
+        return;
+    }
+    //длинная цепочка при обычном заполнении не повод: сравниваем с тем, что осталось после прошлого раза
+    uint32_t limit = __atomic_load_n(&service->chain_limit, __ATOMIC_RELAXED);
+    if (limit && chain > limit && chain > 2 * __atomic_load_n(&service->rehash_floor, __ATOMIC_RELAXED) &&
+        (pid == 0 || process_dead(pid))) {
+        start_rehasher(true);
+    }
+}
+
+void SMHashTable::start_rehasher(bool fresh) {
+    std::lock_guard<std::mutex> guard(_rehasher_mutex);
+    if (_rehasher_running || _rehash_stop) {
+        return;
+    }
+    if (_rehasher.joinable()) {
+        _rehasher.join();
+    }
+    _rehasher_running = true;
+    _rehasher = std::thread([this, fresh]() {
+        run_rehash(fresh);
+        _rehasher_running = false;
+    });
+}
+
+bool SMHashTable::run_rehash(bool fresh) {
+    struct service *service = _service_ptr;
+    auto self = (uint32_t) getpid();
+    uint32_t owner = __atomic_load_n(&service->rehash_pid, __ATOMIC_ACQUIRE);
+    if (owner == self || (owner != 0 && !process_dead(owner)) ||
+        !__atomic_compare_exchange_n(&service->rehash_pid, &owner, self, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    //каталог держим до конца: диапазоны корзин таблиц не должны меняться под переносом
+    if (_catalog_ptr) {
+        lock(&_catalog_ptr->mutex);
+    }
+    uint64_t seeds = __atomic_load_n(&service->seeds, __ATOMIC_ACQUIRE);
+    auto next = (uint32_t) (seeds >> 32);
+    bool done = fresh || (uint32_t) seeds != next;
+    if (done && (uint32_t) seeds == next) {
+        //с этого момента писатели кладут ключи под новое семя, читатели ищут в обеих корзинах
+        next = random_seed((uint32_t) seeds);
+        __atomic_store_n(&service->rehash_cursor, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&service->seeds, (seeds & UINT32_MAX) | (uint64_t) next << 32, __ATOMIC_SEQ_CST);
+        //ожидающие ключа спят на версии корзины старого семени: сдвигаем ее, пусть пересчитают корзину
+        for (uint64_t bucket = 0; bucket < _bucket_total; bucket++) {
+            if (__atomic_load_n(&service->waiters[bucket % SMHT_WAIT_SLOTS], __ATOMIC_SEQ_CST)) {
+                lock(bucket_mutex(bucket));
+                begin_update(bucket);
+                end_update(bucket);
+                unlock(bucket_mutex(bucket));
+            }
+        }
+    }
+
+    auto ranges = table_ranges();
+    std::vector<std::pair<std::string, uint32_t>> moves;
+    for (uint64_t bucket = service->rehash_cursor; done && bucket < _bucket_total; bucket++) {
+        if (_rehash_stop) {
+            done = false;
+            break;
+        }
+        auto range = std::upper_bound(ranges.begin(), ranges.end(), std::make_pair(bucket, UINT64_MAX)) - 1;
+        if (bucket >= range->first + range->second) {
+            continue;
+        }
+        //ключи, чья корзина под новым семенем другая; переносим уже без блокировки всей цепочки
+        lock(bucket_mutex(bucket));
+        for (auto *header = get_header(bucket); header && header->val_offset;) {
+            char *key = (char *) _data_ptr + (long) header->key_offset;
+            auto target = (uint32_t) (range->first + hash_method(key, header->key_size - 1, next) % range->second);
+            if (target != bucket) {
+                moves.emplace_back(std::string(key, header->key_size - 1), target);
+            }
+            header = header->linked_item ? (struct header *) ((long) header->linked_item + (long) _data_ptr) : nullptr;
+        }
+        unlock(bucket_mutex(bucket));
+        for (auto &move : moves) {
+            if (!rehash_key(bucket, move.second, move.first)) {
+                done = false;
+                break;
+            }
+        }
+        moves.clear();
+        if (done) {
+            __atomic_store_n(&service->rehash_cursor, bucket + 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (done) {
+        __atomic_store_n(&service->seeds, next | (uint64_t) next << 32, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&service->rehashes, 1, __ATOMIC_RELAXED);
+        uint32_t longest;
+        chain_stats(0, _bucket_total, &longest, nullptr);
+        __atomic_store_n(&service->rehash_floor, longest, __ATOMIC_RELAXED);
+    }
+    if (_catalog_ptr) {
+        unlock(&_catalog_ptr->mutex);
+    }
+    __atomic_store_n(&service->rehash_pid, 0, __ATOMIC_RELEASE);
+    return done;
+}
+
+bool SMHashTable::rehash_key(uint32_t from, uint32_t to, const std::string &key) {
+    //копия в новую корзину, потом удаление из старой: читатель, сверяющий версии обеих, видит ключ всегда
+    lock_pair(from, to);
+    struct header *header = get_header(from);
+    while (header && header->val_offset && key != (char *) _data_ptr + (long) header->key_offset) {
+        header = header->linked_item ? (struct header *) ((long) header->linked_item + (long) _data_ptr) : nullptr;
+    }
+    bool result = true;
+    if (header && header->val_offset) {
+        struct header existing{};
+        //копия уже есть: ее записал писатель или перенос, прерванный падением
+        bool copied = false;
+        for (auto *h = get_header(to); h && h->val_offset && !copied;) {
+            copied = key == (char *) _data_ptr + (long) h->key_offset;
+            h = h->linked_item ? (struct header *) ((long) h->linked_item + (long) _data_ptr) : nullptr;
+        }
+        if (!copied) {
+            existing = *header;
+            struct intent *intent = get_intent(to);
+            intent_begin(intent, to);
+            begin_update(to);
+            result = set_item(intent, get_header(to), key, value_ptr(&existing), existing.val_size,
+                              existing.raw_size, existing.flags & ~(SMHT_ENTRY_SPILLED | SMHT_ENTRY_SPILL_GEN),
+                              existing.flags & SMHT_ENTRY_SPILLED);
+            if (result) {
+                snapshot_preserve(to);
+                intent_commit(intent);
+            } else {
+                intent_rollback(intent);
+            }
+            end_update(to);
+            intent_end(intent);
+        }
+        if (result) {
+            unset_in(from, key);
+        }
+    }
+    unlock_pair(from, to);
+    retire_pending();
+    return result;
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> SMHashTable::table_ranges() {
+    //корзины основной и именованных таблиц по возрастанию начала; каталог держит вызывающий,
+    //иначе запись может читаться посреди создания - диапазоны за пределами сегмента отбрасываем
+    std::vector<std::pair<uint64_t, uint64_t>> ranges{{0, _superblock_ptr->key_count}};
+    for (uint32_t i = 0; _catalog_ptr && i < SMHT_TABLE_SLOTS; i++) {
+        struct table_entry *e = &_catalog_ptr->entries[i];
+        uint32_t state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+        if ((state == SMHT_TABLE_LIVE || state == SMHT_TABLE_DROPPING) && e->count &&
+            e->base + e->count <= _bucket_total) {
+            ranges.emplace_back(e->base, e->count);
+        }
+    }
+    std::sort(ranges.begin(), ranges.end());
+    return ranges;
+}
+
+void SMHashTable::setSpillThreshold(uint32_t bytes) {
+    if (_features & SMHT_FEATURE_SPILL) {
+        __atomic_store_n(&_service_ptr->spill_threshold, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+bool SMHashTable::compactSpill(bool force) {
+    if (!(_features & SMHT_FEATURE_SPILL)) {
+        return false;
+    }
+    struct service *service = _service_ptr;
+    lock(&service->spill_mutex);
+    uint32_t compactor = service->spill_compactor;
+    if (compactor != 0 && compactor != SMHT_SPILL_UNFINISHED && !process_dead(compactor)) {
+        unlock(&service->spill_mutex);
+        return false;
+    }
+    //компактор умер посреди переноса или не все перенес: поколение уже переключено, доносим оставшееся
+    bool resume = compactor != 0;
+    uint32_t gen = service->spill_gen;
+    uint64_t used = service->spill_tail[gen] - SMHT_SPILL_ALIGN;
+    bool move = resume || (used && (force || service->spill_dead[gen] * SMHT_SPILL_GARBAGE >= used));
+    bool spilled = used || service->spill_tail[gen ^ 1] > SMHT_SPILL_ALIGN;
+    bool promote = spilled && getFreeMemorySize() > _data_len / SMHT_SPILL_HEADROOM;
+    if (!move && !promote) {
+        unlock(&service->spill_mutex);
+        return false;
+    }
+    if (move) {
+        if (!resume) {
+            //второе поколение пусто с прошлого прохода; новые значения с этого момента пишутся в него
+            uint32_t to = gen ^ 1;
+            release_spill(to);
+            service->spill_from = gen;
+            __atomic_store_n(&service->spill_gen, to, __ATOMIC_RELEASE);
+        }
+        service->spill_compactor = (uint32_t) getpid();
+    }
+    uint32_t from = service->spill_from;
+    unlock(&service->spill_mutex);
+
+    uint64_t failed = 0;
+    for (uint64_t bucket = 0; bucket < _bucket_total; bucket++) {
+        if (promote && bucket % SMHT_CHUNK_BLOCKS == 0) {
+            //свободное место пересчитываем изредка, сводка по кускам не бесплатна
+            promote = getFreeMemorySize() > _data_len / SMHT_SPILL_HEADROOM;
+        }
+        bool hot = promote && __atomic_load_n(&_access_ptr[bucket], __ATOMIC_RELAXED);
+        if (!move && !hot) {
+            continue;
+        }
+        lock(bucket_mutex(bucket));
+        auto *header = get_header(bucket);
+        while (header && header->val_offset) {
+            if (header->flags & SMHT_ENTRY_SPILLED) {
+                bool old = ((header->flags & SMHT_ENTRY_SPILL_GEN) ? 1U : 0U) == from;
+                if (!(hot && promote_entry(bucket, header)) && move && old && !move_entry(bucket, header)) {
+                    //в файле нет места: значение остается в старом поколении, его нельзя освобождать
+                    failed++;
+                }
+            }
+            header = header->linked_item ? (struct header *) ((long) header->linked_item + (long) _data_ptr) : nullptr;
+        }
+        unlock(bucket_mutex(bucket));
+        retire_pending();
+    }
+    if (!move) {
+        return true;
+    }
+    if (failed) {
+        //старое поколение держим, оставшееся перенесет следующий проход - этот или другой процесс
+        std::cerr << _name << ": " << failed << " spilled values not moved, compaction postponed" << std::endl;
+        lock(&service->spill_mutex);
+        service->spill_compactor = SMHT_SPILL_UNFINISHED;
+        unlock(&service->spill_mutex);
+        return false;
+    }
+
+    //на старое поколение больше не ссылается ни один заголовок; ждем читателей, взявших указатель раньше
+    uint64_t epoch = __atomic_fetch_add(&service->epoch, 1, __ATOMIC_SEQ_CST);
+    while (oldest_reader_epoch() <= epoch) {
+        reap_readers();
+        usleep(SMHT_READER_WAIT);
+    }
+    lock(&service->spill_mutex);
+    release_spill(from);
+    service->spill_compactor = 0;
+    unlock(&service->spill_mutex);
+    return true;
+}
+
+void SMHashTable::startSpillCompactor(uint32_t interval_ms) {
+    if (!(_features & SMHT_FEATURE_SPILL)) {
+        return;
+    }
+    stopSpillCompactor();
+    _compactor_stop = false;
+    _compactor = std::thread([this, interval_ms]() {
+        std::unique_lock<std::mutex> guard(_compactor_mutex);
+        while (!_compactor_cv.wait_for(guard, std::chrono::milliseconds(interval_ms), [this] { return _compactor_stop; })) {
+            guard.unlock();
+            compactSpill();
+            guard.lock();
+        }
+    });
+}
+
+void SMHashTable::stopSpillCompactor() {
+    {
+        std::lock_guard<std::mutex> guard(_compactor_mutex);
+        _compactor_stop = true;
+    }
+    _compactor_cv.notify_all();
+    if (_compactor.joinable()) {
+        _compactor.join();
+    }
+}
+
+inline char *SMHashTable::value_ptr(const struct header *header) {
+    if (header->flags & SMHT_ENTRY_SPILLED) {
+        return _spill_ptr[(header->flags & SMHT_ENTRY_SPILL_GEN) ? 1 : 0] + (long) header->val_offset;
+    }
+    return (char *) _data_ptr + (long) header->val_offset;
+}
+
+inline uint32_t SMHashTable::data_blocks(const struct header *header) {
+    //блоки элемента в сегменте: обратная ссылка, ключ и значение, если оно не вытеснено
+    uint32_t stored = (header->flags & SMHT_ENTRY_SPILLED) ? 0 : header->val_size;
+    return int_ceil_divide((stored + header->key_size + sizeof(void *)), _data_block_size);
+}
+
+std::string SMHashTable::spill_path(const std::string &name, uint32_t generation) {
+    std::string file = name.substr(name.find_first_not_of('/') == std::string::npos ? 0 : name.find_first_not_of('/'));
+    std::replace(file.begin(), file.end(), '/', '_');
+    return std::string(SMHT_SPILL_DIR) + "/" + file + ".spill." + std::to_string(generation);
+}
+
+bool SMHashTable::open_spill() {
+    //файл отображаем сразу на всю емкость: растет он ftruncate, перемапливать не нужно ни одному процессу
+    for (uint32_t g = 0; g < 2; g++) {
+        std::string path = spill_path(_name, g);
+        _spill_fd[g] = open(path.c_str(), O_RDWR | O_CLOEXEC | (_created ? O_CREAT | O_TRUNC : 0), 0666);
+        if (_spill_fd[g] == -1) {
+            perror(path.c_str());
+            return false;
+        }
+        void *ptr = mmap(nullptr, _spill_capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, _spill_fd[g], 0);
+        if (ptr == MAP_FAILED) {
+            perror("mmap");
+            return false;
+        }
+        _spill_ptr[g] = (char *) ptr;
+    }
+    return true;
+}
+
+uint64_t SMHashTable::spill_append(const char *data, uint32_t size, uint32_t *flags) {
+    //вызывается под блокировкой корзины: компактор переключает поколение до обхода корзин,
+    //поэтому запись в старое поколение он увидит, когда дойдет до этой корзины
+    struct service *service = _service_ptr;
+    uint32_t gen = __atomic_load_n(&service->spill_gen, __ATOMIC_ACQUIRE);
+    uint64_t length = int_ceil_divide((uint64_t) size, SMHT_SPILL_ALIGN) * SMHT_SPILL_ALIGN;
+    uint64_t offset = __atomic_fetch_add(&service->spill_tail[gen], length, __ATOMIC_RELAXED);
+    if (offset + length > _spill_capacity) {
+        return SMHT_SPILL_NONE;
+    }
+    if (offset + length > __atomic_load_n(&service->spill_size[gen], __ATOMIC_ACQUIRE)) {
+        lock(&service->spill_mutex);
+        if (offset + length > service->spill_size[gen]) {
+            uint64_t size_to = std::min(_spill_capacity, (uint64_t) (int_ceil_divide(offset + length, SMHT_SPILL_GROW) * SMHT_SPILL_GROW));
+            if (ftruncate(_spill_fd[gen], (off_t) size_to) != 0) {
+                perror("ftruncate");
+                unlock(&service->spill_mutex);
+                return SMHT_SPILL_NONE;
+            }
+            __atomic_store_n(&service->spill_size[gen], size_to, __ATOMIC_RELEASE);
+        }
+        unlock(&service->spill_mutex);
+    }
+    std::memcpy(_spill_ptr[gen] + offset, data, size);
+    *flags = (*flags & ~SMHT_ENTRY_SPILL_GEN) | SMHT_ENTRY_SPILLED | (gen ? SMHT_ENTRY_SPILL_GEN : 0);
+    return offset;
+}
+
+void SMHashTable::spill_forget(const struct header *header) {
+    //место мертвого значения вернет компактор, здесь только счетчик для решения, когда его звать
+    if (header->flags & SMHT_ENTRY_SPILLED) {
+        uint32_t gen = (header->flags & SMHT_ENTRY_SPILL_GEN) ? 1 : 0;
+        __atomic_fetch_add(&_service_ptr->spill_dead[gen],
+                           int_ceil_divide((uint64_t) header->val_size, SMHT_SPILL_ALIGN) * SMHT_SPILL_ALIGN,
+                           __ATOMIC_RELAXED);
+    }
+}
+
+void SMHashTable::release_spill(uint32_t generation) {
+    //под spill_mutex, на поколение не ссылается ни один заголовок. Размер файла оставляем:
+    //читатель без guard прочитает нули, а не получит SIGBUS
+    struct service *service = _service_ptr;
+    if (service->spill_size[generation] &&
+        fallocate(_spill_fd[generation], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0,
+                  (off_t) service->spill_size[generation]) != 0) {
+        perror("fallocate");
+    }
+    service->spill_tail[generation] = SMHT_SPILL_ALIGN;
+    service->spill_dead[generation] = 0;
+}
+
+void SMHashTable::spill_reset() {
+    if (_features & SMHT_FEATURE_SPILL) {
+        lock(&_service_ptr->spill_mutex);
+        release_spill(0);
+        release_spill(1);
+        unlock(&_service_ptr->spill_mutex);
+    }
+}
+
+uint64_t SMHashTable::spill_cold(uint64_t need) {
+    //часы по корзинам: корзину, которую читали с прошлого круга, пропускаем и снимаем ей бит
+    uint64_t freed = 0;
+    for (uint64_t scanned = 0; freed < need && scanned < 2 * _bucket_total; scanned++) {
+        auto bucket = (uint32_t) (__atomic_fetch_add(&_service_ptr->spill_hand, 1, __ATOMIC_RELAXED) % _bucket_total);
+        if (__atomic_load_n(&_access_ptr[bucket], __ATOMIC_RELAXED)) {
+            __atomic_store_n(&_access_ptr[bucket], 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (!get_header(bucket)->val_offset) {
+            continue;
+        }
+        lock(bucket_mutex(bucket));
+        auto *header = get_header(bucket);
+        while (header && header->val_offset && freed < need) {
+            uint32_t blocks = data_blocks(header);
+            if (!(header->flags & SMHT_ENTRY_SPILLED) && spill_entry(bucket, header)) {
+                freed += blocks - data_blocks(header);
+            }
+            header = header->linked_item ? (struct header *) ((long) header->linked_item + (long) _data_ptr) : nullptr;
+        }
+        unlock(bucket_mutex(bucket));
+        retire_pending();
+    }
+    return freed;
+}
+
+bool SMHashTable::spill_entry(uint32_t bucket, struct header *header) {
+    //под блокировкой корзины: значение уходит в файл, ключ остается на месте, хвост блоков отдаем
+    uint32_t total = data_blocks(header);
+    uint32_t keep = int_ceil_divide((header->key_size + sizeof(void *)), _data_block_size);
+    if (total <= keep) {
+        return false;
+    }
+    struct header image = *header;
+    uint64_t offset = spill_append(value_ptr(header), header->val_size, &image.flags);
+    if (offset == SMHT_SPILL_NONE) {
+        return false;
+    }
+    image.val_offset = (void *) offset;
+    auto first = (uint32_t) (((long) header->key_offset - sizeof(void *)) / _data_block_size);
+    struct intent *intent = get_intent(bucket);
+    intent_begin(intent, bucket);
+    begin_update(bucket);
+    intent_write_header(intent, header, image);
+    intent_retire(intent, (void *) ((long) _memory_map_ptr + first + keep), total - keep);
+    intent_commit(intent);
+    end_update(bucket);
+    intent_end(intent);
+    return true;
+}
+
+bool SMHashTable::promote_entry(uint32_t bucket, struct header *header) {
+    //под блокировкой корзины: перезапись тем же значением кладет его в сегмент и отдает старые блоки ключа
+    std::string key((char *) _data_ptr + (long) header->key_offset, header->key_size - 1);
+    struct intent *intent = get_intent(bucket);
+    intent_begin(intent, bucket);
+    begin_update(bucket);
+    bool result = set_item(intent, get_header(bucket), key, value_ptr(header), header->val_size, header->raw_size,
+                           header->flags & ~(SMHT_ENTRY_SPILLED | SMHT_ENTRY_SPILL_GEN));
+    if (result) {
+        intent_commit(intent);
+    } else {
+        intent_rollback(intent);
+    }
+    end_update(bucket);
+    intent_end(intent);
+    return result;
+}
+
+bool SMHashTable::move_entry(uint32_t bucket, struct header *header) {
+    //под блокировкой корзины: копия в текущем поколении, старое место освободит компактор целиком
+    struct header image = *header;
+    uint64_t offset = spill_append(value_ptr(header), header->val_size, &image.flags);
+    if (offset == SMHT_SPILL_NONE) {
+        return false;
+    }
+    image.val_offset = (void *) offset;
+    struct intent *intent = get_intent(bucket);
+    intent_begin(intent, bucket);
+    begin_update(bucket);
+    intent_write_header(intent, header, image);
+    intent_commit(intent);
+    end_update(bucket);
+    intent_end(intent);
+    return true;
+}
+
+bool SMHashTable::find_header(const char *key, uint32_t size, struct header *found) {
+    //отпечатки фильтра не зависят от семени и не меняются при перехешировании
+    uint8_t fp = (_features & SMHT_FEATURE_FILTER) ? fingerprint(hash_method(key, size)) : 0;
+    auto walk = [&](uint32_t bucket) {
+        auto *header = get_header(bucket);
+        if (!header->val_offset || ((_features & SMHT_FEATURE_FILTER) && !filter_contains(bucket, fp))) {
+            return false;
+        }
+        while (true) {
+            if (std::strcmp(key, (char *) ((void *) ((long) header->key_offset + (long) _data_ptr))) == 0) {
+                std::memcpy(found, header, sizeof(struct header));
+                return true;
+            }
+            //коллизия, ищем ключ
+            if (!header->linked_item) {
+                return false;
+            }
+            header = (struct header *) ((long) header->linked_item + (long) _data_ptr);
+        }
+    };
+    for (uint32_t spins = 1;; spins++) {
+        uint64_t seeds = __atomic_load_n(&_service_ptr->seeds, __ATOMIC_ACQUIRE);
+        uint32_t bucket = bucket_for(key, size, (uint32_t) (seeds >> 32));
+        uint32_t old = (uint32_t) seeds == seeds >> 32 ? bucket : bucket_for(key, size, (uint32_t) seeds);
+        if (old == bucket && (_features & SMHT_FEATURE_FILTER) && !filter_contains(bucket, fp)) {
+            //отпечатка нет - ключа точно нет, цепочку не читаем; если тем временем началось
+            //перехеширование, ключ мог уйти из корзины - проверяем заново
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&_service_ptr->seeds, __ATOMIC_RELAXED) == seeds) {
+                return false;
+            }
+            continue;
+        }
+        //цепочки читаем без блокировки, если за это время их меняли - читаем заново;
+        //при перехешировании ключ переносится между двумя корзинами, сверяем версии обеих
+        uint32_t *version = &_versions_ptr[bucket];
+        uint32_t *old_version = &_versions_ptr[old];
+        uint32_t seq = __atomic_load_n(version, __ATOMIC_ACQUIRE);
+        uint32_t old_seq = __atomic_load_n(old_version, __ATOMIC_ACQUIRE);
+        if ((seq | old_seq) & 1) {
+            if (spins % SMHT_RECOVERY_SPINS == 0) {
+                //писатель мог умереть посреди изменения, тогда корзину никто не отпустит
+                recover_bucket(seq & 1 ? bucket : old);
+            }
+            continue;
+        }
+        bool result = walk(bucket) || (old != bucket && walk(old));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(version, __ATOMIC_RELAXED) == seq && __atomic_load_n(old_version, __ATOMIC_RELAXED) == old_seq &&
+            __atomic_load_n(&_service_ptr->seeds, __ATOMIC_RELAXED) == seeds) {
+            if (result && (_features & SMHT_FEATURE_SPILL) && !__atomic_load_n(&_access_ptr[bucket], __ATOMIC_RELAXED)) {
+                //бит обращения для вытеснения; пишем только если он снят, чтобы не гонять строку кеша
+                __atomic_store_n(&_access_ptr[bucket], 1, __ATOMIC_RELAXED);
+            }
+            return result;
+        }
+    }
+}
+
+int64_t SMHashTable::decompress(struct header *header, char *buffer, size_t size) {
+    char *val = value_ptr(header);
+    uint32_t dict_size = 0;
+    if (header->flags & SMHT_ENTRY_DICTIONARY) {
+        dict_size = __atomic_load_n(&_service_ptr->dict_size, __ATOMIC_ACQUIRE);
+    }
+    int64_t result = SMCompressor::decompress(val, header->val_size, buffer, size, (char *) _dict_ptr, dict_size);
+    if (result != header->raw_size) {
+        return -1;
+    }
+    return result;
+}
+
+inline uint32_t SMHashTable::get_bucket(const char *key, uint32_t size) {
+    //пишем всегда под новое семя, старое нужно, только пока перехеширование не закончено
+    return bucket_for(key, size, (uint32_t) (__atomic_load_n(&_service_ptr->seeds, __ATOMIC_ACQUIRE) >> 32));
+}
+
+inline uint32_t SMHashTable::bucket_for(const char *key, uint32_t size, uint32_t seed) {
+    return _bucket_base + hash_method(key, size, seed) % _key_count;
+}
+
+void SMHashTable::lock_pair(uint32_t bucket, uint32_t other) {
+    //полосы по возрастанию, как в lock_buckets
+    pthread_mutex_t *first = bucket_mutex(bucket);
+    pthread_mutex_t *second = bucket_mutex(other);
+    if (first > second) {
+        std::swap(first, second);
+    }
+    lock(first);
+    if (second != first) {
+        lock(second);
+    }
+}
+
+void SMHashTable::unlock_pair(uint32_t bucket, uint32_t other) {
+    pthread_mutex_t *first = bucket_mutex(bucket);
+    pthread_mutex_t *second = bucket_mutex(other);
+    if (second != first) {
+        unlock(second);
+    }
+    unlock(first);
+}
+
+void SMHashTable::lock_key(const char *key, uint32_t size, uint32_t *bucket, uint32_t *old) {
+    //bucket - куда пишется ключ, old - где он еще может лежать, пока идет перехеширование
+    while (true) {
+        uint64_t seeds = __atomic_load_n(&_service_ptr->seeds, __ATOMIC_ACQUIRE);
+        *bucket = bucket_for(key, size, (uint32_t) (seeds >> 32));
+        *old = (uint32_t) seeds == seeds >> 32 ? *bucket : bucket_for(key, size, (uint32_t) seeds);
+        lock_pair(*bucket, *old);
+        //перехеширование могло начаться или закончиться, пока ждали блокировку
+        if (__atomic_load_n(&_service_ptr->seeds, __ATOMIC_ACQUIRE) == seeds) {
+            return;
+        }
+        unlock_pair(*bucket, *old);
+    }
+}
+
+inline struct SMHashTable::header *SMHashTable::get_header(uint32_t bucket) {
+    return (struct header *) ((void *) ((char *) _header_ptr + (bucket * _header_size)));
+}
+
+inline struct SMHashTable::header *SMHashTable::get_header(const char *key, uint32_t size) {
+    return get_header(get_bucket(key, size));
+}
+
+inline pthread_mutex_t *SMHashTable::bucket_mutex(uint32_t bucket) {
+    return &_service_ptr->bucket_mutex[bucket % SMHT_BUCKET_LOCKS];
+}
+
+inline uint8_t SMHashTable::fingerprint(uint32_t hash) {
+    //младшие биты уже ушли на номер корзины, перемешиваем весь хеш; 0 - пустая ячейка
+    return (uint8_t) (((hash * 0x9e3779b1U) >> 24) % 255 + 1);
+}
+
+inline bool SMHashTable::filter_contains(uint32_t bucket, uint8_t fp) {
+    uint64_t word = __atomic_load_n(&_filter_ptr[bucket], __ATOMIC_ACQUIRE);
+    if (word >> (SMHT_FILTER_SLOTS * 8)) {
+        //часть отпечатков не поместилась, проверить нельзя
+        return true;
+    }
+    for (uint32_t i = 0; i < SMHT_FILTER_SLOTS; i++) {
+        if ((uint8_t) (word >> (i * 8)) == fp) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void SMHashTable::filter_add(struct header *bucket_header, const char *key, uint32_t size) {
+    //вызывается под блокировкой корзины, читатели видят слово целиком
+    if (!(_features & SMHT_FEATURE_FILTER)) {
+        return;
+    }
+    uint32_t bucket = ((long) bucket_header - (long) _header_ptr) / _header_size;
+    uint64_t word = filter_insert(_filter_ptr[bucket], fingerprint(hash_method(key, size)));
+    __atomic_store_n(&_filter_ptr[bucket], word, __ATOMIC_RELEASE);
+}
+
+inline uint64_t SMHashTable::filter_insert(uint64_t word, uint8_t fp) {
+    uint32_t i = 0;
+    while (i < SMHT_FILTER_SLOTS && (uint8_t) (word >> (i * 8)) != 0) {
+        i++;
+    }
+    if (i < SMHT_FILTER_SLOTS) {
+        word |= (uint64_t) fp << (i * 8);
+    } else if ((word >> (SMHT_FILTER_SLOTS * 8)) < SMHT_FILTER_OVERFLOW_MAX) {
+        //насыщенный счетчик больше не уменьшаем, корзина проверяется всегда до clear()
+        word += 1ULL << (SMHT_FILTER_SLOTS * 8);
+    }
+    return word;
+}
+
+void SMHashTable::filter_rebuild(uint32_t bucket) {
+    //слово собираем по цепочке целиком и пишем одним словом, читатель не увидит пропавших отпечатков
+    if (!(_features & SMHT_FEATURE_FILTER)) {
+        return;
+    }
+    uint64_t word = 0;
+    auto *header = get_header(bucket);
+    if (header->val_offset) {
+        while (true) {
+            char *key = (char *) ((long) header->key_offset + (long) _data_ptr);
+            word = filter_insert(word, fingerprint(hash_method(key, header->key_size - 1)));
+            if (!header->linked_item) {
+                break;
+            }
+            header = (struct header *) ((long) header->linked_item + (long) _data_ptr);
+        }
+    }
+    __atomic_store_n(&_filter_ptr[bucket], word, __ATOMIC_RELEASE);
+}
+
+void SMHashTable::filter_remove(uint32_t bucket, const std::string &key) {
+    if (!(_features & SMHT_FEATURE_FILTER)) {
+        return;
+    }
+    uint8_t fp = fingerprint(hash_method(key.c_str(), key.size()));
+    uint64_t word = _filter_ptr[bucket];
+    uint64_t overflow = word >> (SMHT_FILTER_SLOTS * 8);
+    uint32_t i = 0;
+    while (i < SMHT_FILTER_SLOTS && (uint8_t) (word >> (i * 8)) != fp) {
+        i++;
+    }
+    //одинаковые отпечатки взаимозаменяемы, удаляем любой
+    if (i < SMHT_FILTER_SLOTS) {
+        word &= ~(0xffULL << (i * 8));
+    } else if (overflow && overflow < SMHT_FILTER_OVERFLOW_MAX) {
+        word -= 1ULL << (SMHT_FILTER_SLOTS * 8);
+    }
+    __atomic_store_n(&_filter_ptr[bucket], word, __ATOMIC_RELEASE);
+}
+
+inline void *SMHashTable::find_memory_block(struct intent *intent, size_t size, uint32_t offset) {
+    SMC_TRACE_SCOPE(SMTR_OP_ALLOC);
+    //сначала своя арена, если в ней нет места - забираем память у соседних
+    uint32_t home = home_arena();
+    //длина поиска: сколько кусков карты пришлось просмотреть по байтам
+    uint32_t visited = 0;
+    for (uint32_t i = 0; i < _arena_count; i++) {
+        uint32_t index = (home + i) % _arena_count;
+        uint32_t from = std::max((uint32_t) (index * _arena_blocks), offset);
+        uint32_t to = std::min((index + 1) * _arena_blocks, (uint32_t) _data_count);
+        if (size > SMHT_CHUNK_BLOCKS || from >= to || to - from < size) {
+            continue;
+        }
+        struct arena *arena = &_service_ptr->arenas[index];
+        lock(&arena->mutex);
+        //next-fit: ищем от места последнего выделения, потом с начала арены
+        uint32_t hint = std::min(std::max(arena->hint, from), to);
+        uint32_t found = scan_blocks(hint, to, size, &visited);
+        if (found == SMHT_NOT_FOUND && hint > from) {
+            found = scan_blocks(from, std::min(hint + (uint32_t) size - 1, to), size, &visited);
+        }
+        void *ptr = nullptr;
+        if (found != SMHT_NOT_FOUND) {
+            ptr = (void *) ((long) _memory_map_ptr + found);
+            intent_alloc(intent, found, size);
+            reserve_memory_block(ptr, size);
+            arena->hint = found + size;
+        }
+        unlock(&arena->mutex);
+        if (ptr) {
+            SMC_TRACE_VALUE(SMTR_OP_ALLOC_SCAN, visited);
+            SMC_PROBE(alloc, size, visited, found);
+            return ptr;
+        }
+    }
+    SMC_TRACE_VALUE(SMTR_OP_ALLOC_SCAN, visited);
+    SMC_PROBE(alloc, size, visited, SMHT_NOT_FOUND);
+
+    //блок больше куска карты, ищем по всей карте
+    if (size > SMHT_CHUNK_BLOCKS && _data_count - offset >= size) {
+        lock_arenas();
+        void *ptr = find_zero_sequence((void *) ((long) _memory_map_ptr + offset), (void *) ((long) _memory_map_ptr + (long) _data_count), size);
+        if (ptr) {
+            intent_alloc(intent, (uint32_t) ((long) ptr - (long) _memory_map_ptr), size);
+            reserve_memory_block(ptr, size);
+        }
+        unlock_arenas();
+        return ptr;
+    }
+    return nullptr;
+}
+
+uint32_t SMHashTable::home_arena() {
+    //поток закрепляется за ареной при первом выделении памяти в каждой таблице: при работе с шардами
+    //он переходит между таблицами и не должен при этом каждый раз брать новую арену
+    thread_local std::unordered_map<const void *, uint32_t> arenas;
+    auto found = arenas.find(_superblock_ptr);
+    if (found == arenas.end()) {
+        if (arenas.size() >= SMHT_ARENA_TABLES) {
+            //таблицы открывают и закрывают, их адреса не копим без предела
+            arenas.clear();
+        }
+        uint32_t claim = __atomic_fetch_add(&_service_ptr->arena_claims, 1, __ATOMIC_RELAXED);
+        found = arenas.emplace(_superblock_ptr, claim).first;
+    }
+    return found->second % _arena_count;
+}
+
+void SMHashTable::lock_arenas() {
+    //всегда в одном порядке, чтобы не было взаимоблокировок
+    for (uint32_t i = 0; i < _arena_count; i++) {
+        lock(&_service_ptr->arenas[i].mutex);
+    }
+}
+
+void SMHashTable::unlock_arenas() {
+    for (uint32_t i = _arena_count; i > 0; i--) {
+        unlock(&_service_ptr->arenas[i - 1].mutex);
+    }
+}
+
+void SMHashTable::lock_buckets() {
+    for (auto &mutex : _service_ptr->bucket_mutex) {
+        lock(&mutex);
+    }
+}
+
+void SMHashTable::unlock_buckets() {
+    for (uint32_t i = SMHT_BUCKET_LOCKS; i > 0; i--) {
+        unlock(&_service_ptr->bucket_mutex[i - 1]);
+    }
+}
+
+uint32_t SMHashTable::scan_blocks(uint32_t from, uint32_t to, uint32_t size, uint32_t *visited) {
+    //идем по кускам карты, куски где нет свободной последовательности нужной длины пропускаем
+    for (uint32_t c = from / SMHT_CHUNK_BLOCKS; c < _chunk_count && c * SMHT_CHUNK_BLOCKS < to; c++) {
+        if (_chunks_ptr[c].longest < size) {
+            continue;
+        }
+        uint32_t begin = c * SMHT_CHUNK_BLOCKS;
+        uint32_t end = std::min(begin + SMHT_CHUNK_BLOCKS, (uint32_t) _data_count);
+        if (visited) {
+            (*visited)++;
+        }
+        uint32_t found = scan_chunk(c, std::max(from, begin), std::min(to, end), size);
+        if (found != SMHT_NOT_FOUND) {
+            return found;
+        }
+    }
+    return SMHT_NOT_FOUND;
+}
+
+uint32_t SMHashTable::scan_chunk(uint32_t chunk, uint32_t from, uint32_t to, uint32_t size) {
+    auto *map = (uint8_t *) _memory_map_ptr;
+    uint32_t run = 0;
+    uint32_t longest = 0;
+    for (uint32_t i = from; i < to;) {
+        //в карте только 0 и 1, целиком свободные и занятые слова проходим за раз
+        if ((i & 7) == 0 && i + 8 <= to) {
+            uint64_t word = *(uint64_t *) (map + i);
+            if (word == 0) {
+                run += 8;
+                i += 8;
+                if (run >= size) {
+                    return i - run;
+                }
+                continue;
+            }
+            if (word == 0x0101010101010101ULL) {
+                longest = std::max(longest, run);
+                run = 0;
+                i += 8;
+                continue;
+            }
+        }
+        if (map[i] == 0) {
+            run++;
+            i++;
+            if (run >= size) {
+                return i - run;
+            }
+        } else {
+            longest = std::max(longest, run);
+            run = 0;
+            i++;
+        }
+    }
+    longest = std::max(longest, run);
+    //просмотрели кусок целиком - теперь знаем точную длину самой длинной дырки
+    uint32_t begin = chunk * SMHT_CHUNK_BLOCKS;
+    if (from == begin && to == std::min(begin + SMHT_CHUNK_BLOCKS, (uint32_t) _data_count)) {
+        _chunks_ptr[chunk].longest = longest;
+    }
+    return SMHT_NOT_FOUND;
+}
+
+void SMHashTable::reserve_memory_block(void *addr, uint32_t size) {
+    //вызывается под блокировкой арены
+    auto index = (uint32_t) ((long) addr - (long) _memory_map_ptr);
+    std::memset(addr, 1, size);
+    for (uint32_t c = index / SMHT_CHUNK_BLOCKS; c * SMHT_CHUNK_BLOCKS < index + size; c++) {
+        uint32_t begin = std::max(index, c * SMHT_CHUNK_BLOCKS);
+        uint32_t end = std::min(index + size, (c + 1) * SMHT_CHUNK_BLOCKS);
+        //longest остается верхней оценкой, уточнится при следующем сканировании
+        _chunks_ptr[c].free -= end - begin;
+        _chunks_ptr[c].resident = 1;
+    }
+}
+
+void SMHashTable::free_memory_block(void *addr, uint32_t size, int64_t gen) {
+    auto index = (uint32_t) ((long) addr - (long) _memory_map_ptr);
+    uint32_t first = index / _arena_blocks;
+    uint32_t last = (index + size - 1) / _arena_blocks;
+    for (uint32_t i = first; i <= last; i++) {
+        lock(&_service_ptr->arenas[i].mutex);
+    }
+    //поколение сверяем под аренами: очистка и дефрагментация сбрасывают очередь до того, как их берут
+    if (gen >= 0 && (uint32_t) gen != __atomic_load_n(&_service_ptr->limbo_gen, __ATOMIC_ACQUIRE)) {
+        for (uint32_t i = last + 1; i > first; i--) {
+            unlock(&_service_ptr->arenas[i - 1].mutex);
+        }
+        return;
+    }
+    auto *map = (uint8_t *) _memory_map_ptr;
+    std::memset(addr, 0, size);
+    for (uint32_t c = index / SMHT_CHUNK_BLOCKS; c * SMHT_CHUNK_BLOCKS < index + size; c++) {
+        uint32_t chunk_begin = c * SMHT_CHUNK_BLOCKS;
+        uint32_t chunk_end = std::min(chunk_begin + SMHT_CHUNK_BLOCKS, (uint32_t) _data_count);
+        uint32_t begin = std::max(index, chunk_begin);
+        uint32_t end = std::min(index + size, chunk_end);
+        _chunks_ptr[c].free += end - begin;
+        //освобожденный блок мог склеиться с соседними дырками
+        while (begin > chunk_begin && map[begin - 1] == 0) {
+            begin--;
+        }
+        while (end < chunk_end && map[end] == 0) {
+            end++;
+        }
+        _chunks_ptr[c].longest = std::max(_chunks_ptr[c].longest, end - begin);
+        if (_chunks_ptr[c].free == chunk_end - chunk_begin && _chunks_ptr[c].resident) {
+            _service_ptr->arenas[chunk_begin / _arena_blocks].release_pending++;
+        }
+    }
+    //страницы отдаем пачкой: кусок, который тут же займут снова, не придется подгружать
+    for (uint32_t i = first; i <= last; i++) {
+        if (_service_ptr->arenas[i].release_pending >= SMHT_RELEASE_BATCH) {
+            release_chunks(i);
+        }
+    }
+    for (uint32_t i = last + 1; i > first; i--) {
+        unlock(&_service_ptr->arenas[i - 1].mutex);
+    }
+}
+
+void SMHashTable::retire_memory_block(void *addr, uint32_t size, uint32_t gen) {
+    //блок уже отцеплен от цепочки; если читателей нет, новых ссылок на него не появится
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&_service_ptr->active_readers, __ATOMIC_SEQ_CST) == 0) {
+        free_memory_block(addr, size, gen);
+        return;
+    }
+    struct service *service = _service_ptr;
+    lock(&service->limbo_mutex);
+    if (gen != service->limbo_gen) {
+        //очередь сбросили после снятия блока: он уже свободен или его вернет сверка
+        unlock(&service->limbo_mutex);
+        return;
+    }
+    if (service->limbo_tail - service->limbo_head == SMHT_LIMBO) {
+        reclaim(false);
+    }
+    struct retired item{};
+    item.index = (uint32_t) ((long) addr - (long) _memory_map_ptr);
+    item.size = size;
+    item.epoch = __atomic_fetch_add(&service->epoch, 1, __ATOMIC_SEQ_CST);
+    if (service->limbo_tail - service->limbo_head < SMHT_LIMBO) {
+        service->limbo[service->limbo_tail % SMHT_LIMBO] = item;
+        service->limbo_tail++;
+    } else {
+        //читатели держат старые эпохи: не ждем их, а копим в памяти процесса до следующего reclaim
+        if (_overflow_gen != gen) {
+            _overflow.clear();
+            _overflow_gen = gen;
+        }
+        _overflow.push_back(item);
+    }
+    if (service->limbo_tail - service->limbo_head >= SMHT_RECLAIM_BATCH) {
+        reclaim(false);
+    }
+    unlock(&service->limbo_mutex);
+}
+
+void SMHashTable::retire_pending() {
+    for (auto &block : _retiring) {
+        retire_memory_block((void *) ((long) _memory_map_ptr + block.index), block.size, block.gen);
+    }
+    _retiring.clear();
+}
+
+void SMHashTable::reclaim(bool all) {
+    //вызывается под limbo_mutex; блок можно отдать, если все читатели вошли после его удаления
+    struct service *service = _service_ptr;
+    uint64_t oldest = all ? UINT64_MAX : oldest_reader_epoch();
+    //эпохи в очереди не убывают, кроме перенесенных из переполнения - на них проход просто остановится раньше
+    while (service->limbo_head != service->limbo_tail) {
+        struct retired *item = &service->limbo[service->limbo_head % SMHT_LIMBO];
+        if (item->epoch >= oldest) {
+            break;
+        }
+        //сначала сдвигаем голову: упав между шагами, потеряем блок, но не освободим его дважды
+        service->limbo_head++;
+        free_memory_block((void *) ((long) _memory_map_ptr + item->index), item->size);
+    }
+    if (_overflow_gen != service->limbo_gen) {
+        _overflow.clear();
+        return;
+    }
+    //переполнение: старое отдаем, остальное переносим в освободившееся место очереди
+    size_t kept = 0;
+    for (auto &item : _overflow) {
+        if (item.epoch < oldest) {
+            free_memory_block((void *) ((long) _memory_map_ptr + item.index), item.size);
+        } else if (service->limbo_tail - service->limbo_head < SMHT_LIMBO) {
+            service->limbo[service->limbo_tail % SMHT_LIMBO] = item;
+            service->limbo_tail++;
+        } else {
+            _overflow[kept++] = item;
+        }
+    }
+    _overflow.resize(kept);
+}
+
+uint64_t SMHashTable::oldest_reader_epoch() {
+    uint64_t oldest = UINT64_MAX;
+    for (auto &reader : _service_ptr->readers) {
+        uint64_t epoch = __atomic_load_n(&reader.epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    return oldest;
+}
+
+uint32_t SMHashTable::enter_reader() {
+    struct service *service = _service_ptr;
+    //дефрагментация и очистка двигают данные, новых читателей не пускаем
+    while (true) {
+        while (__atomic_load_n(&service->exclusive, __ATOMIC_ACQUIRE)) {
+            //очистку или дефрагментацию мог бросить умерший процесс
+            if (maintenance_pending()) {
+                recover_maintenance();
+            }
+            usleep(SMHT_READER_WAIT);
+        }
+        __atomic_fetch_add(&service->active_readers, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&service->exclusive, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+        __atomic_fetch_sub(&service->active_readers, 1, __ATOMIC_SEQ_CST);
+    }
+
+    auto pid = (uint32_t) getpid();
+    auto start = (uint32_t) (((uint64_t) pthread_self() * 0x9e3779b97f4a7c15ULL) >> 32);
+    for (uint32_t i = 0;; i++) {
+        uint32_t slot = (start + i) % SMHT_READERS;
+        struct reader *reader = &service->readers[slot];
+        uint32_t expected = 0;
+        if (__atomic_load_n(&reader->pid, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&reader->pid, &expected, pid, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            //эпоху объявляем до первого чтения цепочек
+            __atomic_store_n(&reader->epoch, __atomic_load_n(&service->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            return slot;
+        }
+        if ((i + 1) % SMHT_READERS == 0) {
+            //все слоты заняты, возможно их держат умершие процессы
+            reap_readers();
+            usleep(SMHT_READER_WAIT);
+        }
+    }
+}
+
+void SMHashTable::leave_reader(uint32_t slot) {
+    struct service *service = _service_ptr;
+    struct reader *reader = &service->readers[slot];
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&reader->pid, 0, __ATOMIC_RELEASE);
+    //последний читатель забирает то, что ждало в очереди
+    if (__atomic_sub_fetch(&service->active_readers, 1, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&service->limbo_tail, __ATOMIC_RELAXED) != __atomic_load_n(&service->limbo_head, __ATOMIC_RELAXED)) {
+        lock(&service->limbo_mutex);
+        reclaim(false);
+        unlock(&service->limbo_mutex);
+    }
+}
+
+void SMHashTable::reap_readers() {
+    //слоты процессов, которые умерли не выйдя из чтения, иначе очередь никогда не освободится
+    struct service *service = _service_ptr;
+    for (auto &reader : service->readers) {
+        uint32_t pid = __atomic_load_n(&reader.pid, __ATOMIC_ACQUIRE);
+        if (!process_dead(pid)) {
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&reader.pid, &pid, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&reader.epoch, 0, __ATOMIC_RELEASE);
+            __atomic_fetch_sub(&service->active_readers, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+void SMHashTable::wait_readers() {
+    //вызывается под блокировками всех корзин, новые блоки в очередь уже не попадут
+    struct service *service = _service_ptr;
+    __atomic_store_n(&service->exclusive, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&service->active_readers, __ATOMIC_SEQ_CST) != 0) {
+        reap_readers();
+        usleep(SMHT_READER_WAIT);
+    }
+    lock(&service->limbo_mutex);
+    reclaim(true);
+    //блоки, которые писатели сняли, но еще не отдали, дальше не отдаются: их вернет очистка или сверка
+    __atomic_fetch_add(&service->limbo_gen, 1, __ATOMIC_RELEASE);
+    _overflow_gen = service->limbo_gen;
+    unlock(&service->limbo_mutex);
+}
+
+void SMHashTable::release_readers() {
+    __atomic_store_n(&_service_ptr->exclusive, 0, __ATOMIC_RELEASE);
+}
+
+inline void SMHashTable::begin_update(uint32_t bucket) {
+    //вызывается под блокировкой корзины, второй писатель сюда не попадет
+    __atomic_store_n(&_versions_ptr[bucket], _versions_ptr[bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+inline void SMHashTable::end_update(uint32_t bucket) {
+    __atomic_store_n(&_versions_ptr[bucket], _versions_ptr[bucket] + 1, __ATOMIC_RELEASE);
+    wake(bucket);
+}
+
+inline void SMHashTable::wake(uint32_t bucket) {
+    //будим только если кто-то ждет корзины с тем же остатком, иначе обходимся без системного вызова
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&_service_ptr->waiters[bucket % SMHT_WAIT_SLOTS], __ATOMIC_RELAXED)) {
+        futex(&_versions_ptr[bucket], FUTEX_WAKE, INT_MAX, nullptr);
+    }
+}
+
+bool SMHashTable::wait_for_change(const std::string &key, int timeout_ms) {
+    return wait_key(key, timeout_ms, true);
+}
+
+bool SMHashTable::wait_for_key(const std::string &key, int timeout_ms) {
+    return wait_key(key, timeout_ms, false);
+}
+
+bool SMHashTable::wait_key(const std::string &key, int timeout_ms, bool for_change) {
+    uint32_t *waiters = nullptr;
+    int64_t deadline = timeout_ms < 0 ? 0 : now_ns() + timeout_ms * 1000000LL;
+
+    struct header initial{};
+    bool initial_found = find_header(key.c_str(), key.size(), &initial);
+    bool result;
+    while (true) {
+        //ключ пишется в корзину нового семени, пока идет перехеширование ждем коротко
+        uint64_t seeds = __atomic_load_n(&_service_ptr->seeds, __ATOMIC_SEQ_CST);
+        uint32_t bucket = bucket_for(key.c_str(), key.size(), (uint32_t) (seeds >> 32));
+        bool rehashing = (uint32_t) seeds != seeds >> 32;
+        if (waiters != &_service_ptr->waiters[bucket % SMHT_WAIT_SLOTS]) {
+            //сначала объявляем себя, потом читаем версию: писатель либо увидит ожидающего, либо мы - новую версию
+            if (waiters) {
+                __atomic_fetch_sub(waiters, 1, __ATOMIC_RELEASE);
+            }
+            waiters = &_service_ptr->waiters[bucket % SMHT_WAIT_SLOTS];
+            __atomic_fetch_add(waiters, 1, __ATOMIC_SEQ_CST);
+        }
+        uint32_t *version = &_versions_ptr[bucket];
+        uint32_t seq = __atomic_load_n(version, __ATOMIC_SEQ_CST);
+        struct header current{};
+        bool found = find_header(key.c_str(), key.size(), &current);
+        if (for_change) {
+            //обновление всегда пишет значение в новый блок, смещение меняется
+            result = found != initial_found ||
+                     (found && (current.val_offset != initial.val_offset || current.val_size != initial.val_size));
+        } else {
+            result = found;
+        }
+        if (result) {
+            break;
+        }
+        //версия общая для корзины: проснулись из-за соседнего ключа - ждем дальше
+        struct timespec timeout{};
+        if (timeout_ms >= 0) {
+            int64_t left = deadline - now_ns();
+            if (left <= 0) {
+                break;
+            }
+            timeout.tv_sec = left / 1000000000LL;
+            timeout.tv_nsec = left % 1000000000LL;
+        }
+        if (rehashing && (timeout_ms < 0 || timeout.tv_sec > 0 || timeout.tv_nsec > SMHT_REHASH_POLL_MS * 1000000LL)) {
+            timeout.tv_sec = 0;
+            timeout.tv_nsec = SMHT_REHASH_POLL_MS * 1000000LL;
+        }
+        //семя сменилось после расчета корзины - ждем не там
+        if (__atomic_load_n(&_service_ptr->seeds, __ATOMIC_SEQ_CST) != seeds) {
+            continue;
+        }
+        futex(version, FUTEX_WAIT, seq, timeout_ms >= 0 || rehashing ? &timeout : nullptr);
+    }
+    __atomic_fetch_sub(waiters, 1, __ATOMIC_RELEASE);
+    return result;
+}
+
+void SMHashTable::rebuild_summary() {
+    for (uint32_t c = 0; c < _chunk_count; c++) {
+        rebuild_chunk(c);
+    }
+}
+
+void SMHashTable::rebuild_chunk(uint32_t chunk) {
+    auto *map = (uint8_t *) _memory_map_ptr;
+    uint32_t begin = chunk * SMHT_CHUNK_BLOCKS;
+    uint32_t end = std::min(begin + SMHT_CHUNK_BLOCKS, (uint32_t) _data_count);
+    uint32_t free = 0;
+    uint32_t run = 0;
+    uint32_t longest = 0;
+    for (uint32_t i = begin; i < end; i++) {
+        if (map[i] == 0) {
+            free++;
+            run++;
+        } else {
+            longest = std::max(longest, run);
+            run = 0;
+        }
+    }
+    _chunks_ptr[chunk].free = free;
+    _chunks_ptr[chunk].longest = std::max(longest, run);
+    if (free < end - begin) {
+        _chunks_ptr[chunk].resident = 1;
+    }
+}
+
+uint64_t SMHashTable::release_chunks(uint32_t arena) {
+    //вызывается под блокировкой арены: в ее кусках никто не выделяет память
+    auto page_size = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t released = 0;
+    uint32_t first = arena * _arena_blocks / SMHT_CHUNK_BLOCKS;
+    uint32_t last = std::min<uint64_t>(_chunk_count, int_ceil_divide(((uint64_t) arena + 1) * _arena_blocks,
+                                                                     SMHT_CHUNK_BLOCKS));
+    for (uint32_t c = first; c < last; c++) {
+        uint64_t begin = (uint64_t) c * SMHT_CHUNK_BLOCKS;
+        uint64_t end = std::min<uint64_t>(begin + SMHT_CHUNK_BLOCKS, _data_count);
+        if (!_chunks_ptr[c].resident || _chunks_ptr[c].free != end - begin) {
+            continue;
+        }
+        //страницы на границе с соседним куском остаются
+        uint64_t data_offset = (long) _data_ptr - (long) _segment_ptr;
+        uint64_t from = int_ceil_divide(data_offset + begin * _data_block_size, page_size) * page_size;
+        uint64_t to = (data_offset + end * _data_block_size) / page_size * page_size;
+        if (to > from) {
+            release_pages((char *) _segment_ptr + from, to - from);
+            released += to - from;
+        }
+        _chunks_ptr[c].resident = 0;
+    }
+    _service_ptr->arenas[arena].release_pending = 0;
+    return released;
+}
+
+uint64_t SMHashTable::releaseMemory() {
+    uint64_t released = 0;
+    for (uint32_t i = 0; i < _arena_count; i++) {
+        lock(&_service_ptr->arenas[i].mutex);
+        released += release_chunks(i);
+        unlock(&_service_ptr->arenas[i].mutex);
+    }
+    return released;
+}
+
+inline struct SMHashTable::intent *SMHashTable::get_intent(uint32_t bucket) {
+    return &_service_ptr->intents[bucket % SMHT_BUCKET_LOCKS];
+}
+
+void SMHashTable::intent_begin(struct intent *intent, uint32_t bucket) {
+    //журнал принадлежит полосе блокировок корзин, пишет в него только ее владелец
+    intent->pid = (uint32_t) getpid();
+    intent->bucket = bucket;
+    intent->alloc_count = 0;
+    intent->retire_count = 0;
+    intent->retire_done = 0;
+    intent->write_count = 0;
+    __atomic_store_n(&intent->state, SMHT_INTENT_ACTIVE, __ATOMIC_RELEASE);
+}
+
+inline void SMHashTable::intent_alloc(struct intent *intent, uint32_t index, uint32_t size) {
+    //под блокировкой арены и до записи в карту: блок, упавший между шагами, разберет recover_arena
+    struct block_ref *block = &intent->alloc[intent->alloc_count];
+    block->index = index;
+    block->size = size;
+    __atomic_store_n(&intent->alloc_count, intent->alloc_count + 1, __ATOMIC_RELEASE);
+}
+
+void SMHashTable::intent_write(struct intent *intent, void *addr, uint64_t value) {
+    struct word_write *write = &intent->write[intent->write_count];
+    write->offset = (long) addr - (long) _superblock_ptr;
+    write->value = value;
+    __atomic_store_n(&intent->write_count, intent->write_count + 1, __ATOMIC_RELEASE);
+}
+
+void SMHashTable::intent_write_header(struct intent *intent, struct header *target, const struct header &image) {
+    static_assert(sizeof(struct header) % sizeof(uint64_t) == 0, "header is written by words");
+    for (size_t i = 0; i < sizeof(struct header) / sizeof(uint64_t); i++) {
+        uint64_t word;
+        std::memcpy(&word, (const char *) &image + i * sizeof(uint64_t), sizeof(uint64_t));
+        intent_write(intent, (char *) target + i * sizeof(uint64_t), word);
+    }
+}
+
+void SMHashTable::intent_retire(struct intent *intent, void *addr, uint32_t size) {
+    struct block_ref *block = &intent->retire[intent->retire_count];
+    block->index = (uint32_t) ((long) addr - (long) _memory_map_ptr);
+    block->size = size;
+    __atomic_store_n(&intent->retire_count, intent->retire_count + 1, __ATOMIC_RELEASE);
+}
+
+void SMHashTable::intent_commit(struct intent *intent) {
+    //с этого момента изменение только доводится до конца. Старые блоки intent_end снимает с журнала,
+    //а отдает их вызывающий после блокировки корзины
+    __atomic_store_n(&intent->state, SMHT_INTENT_COMMIT, __ATOMIC_RELEASE);
+    for (uint32_t i = 0; i < intent->write_count; i++) {
+        *(uint64_t *) ((long) _superblock_ptr + intent->write[i].offset) = intent->write[i].value;
+    }
+}
+
+void SMHashTable::intent_apply(struct intent *intent) {
+    //записи слов повторяемы
+    for (uint32_t i = 0; i < intent->write_count; i++) {
+        *(uint64_t *) ((long) _superblock_ptr + intent->write[i].offset) = intent->write[i].value;
+    }
+    intent_release(intent);
+}
+
+void SMHashTable::intent_release(struct intent *intent) {
+    //восстановление: блокировку корзины держит lock(), отдаем сразу
+    uint32_t gen = __atomic_load_n(&_service_ptr->limbo_gen, __ATOMIC_ACQUIRE);
+    //блок отмечаем отданным до отдачи - при падении он потеряется, а не освободится дважды
+    while (intent->retire_done < intent->retire_count) {
+        struct block_ref block = intent->retire[intent->retire_done];
+        __atomic_store_n(&intent->retire_done, intent->retire_done + 1, __ATOMIC_RELEASE);
+        retire_memory_block((void *) ((long) _memory_map_ptr + block.index), block.size, gen);
+    }
+}
+
+void SMHashTable::intent_rollback(struct intent *intent) {
+    //на блоки еще никто не ссылается; карту могли не успеть заполнить, поэтому сводку куска пересчитываем
+    for (uint32_t i = intent->alloc_count; i > 0; i--) {
+        struct block_ref *block = &intent->alloc[i - 1];
+        uint32_t size = __atomic_load_n(&block->size, __ATOMIC_ACQUIRE);
+        if (size == 0) {
+            continue;
+        }
+        uint32_t first = block->index / _arena_blocks;
+        uint32_t last = (block->index + size - 1) / _arena_blocks;
+        for (uint32_t a = first; a <= last; a++) {
+            lock(&_service_ptr->arenas[a].mutex);
+        }
+        //размер мог обнулить recover_arena, если блок так и не попал в карту
+        size = block->size;
+        if (size) {
+            std::memset((char *) _memory_map_ptr + block->index, 0, size);
+            for (uint32_t c = block->index / SMHT_CHUNK_BLOCKS; c * SMHT_CHUNK_BLOCKS < block->index + size; c++) {
+                rebuild_chunk(c);
+            }
+            __atomic_store_n(&block->size, 0, __ATOMIC_RELEASE);
+        }
+        for (uint32_t a = last + 1; a > first; a--) {
+            unlock(&_service_ptr->arenas[a - 1].mutex);
+        }
+    }
+}
+
+void SMHashTable::intent_end(struct intent *intent) {
+    if (intent->state == SMHT_INTENT_COMMIT) {
+        //очередь сбрасывают только под блокировками всех корзин, так что поколение сейчас верное
+        uint32_t gen = __atomic_load_n(&_service_ptr->limbo_gen, __ATOMIC_ACQUIRE);
+        while (intent->retire_done < intent->retire_count) {
+            struct block_ref block = intent->retire[intent->retire_done];
+            __atomic_store_n(&intent->retire_done, intent->retire_done + 1, __ATOMIC_RELEASE);
+            _retiring.push_back({block.index, block.size, gen});
+        }
+    }
+    __atomic_store_n(&intent->state, SMHT_INTENT_IDLE, __ATOMIC_RELEASE);
+}
+
+void SMHashTable::maintenance_begin(uint32_t kind) {
+    struct maintenance *m = &_service_ptr->maintenance;
+    m->pid = (uint32_t) getpid();
+    m->move_state = SMHT_MOVE_NONE;
+    __atomic_store_n(&m->kind, kind, __ATOMIC_RELEASE);
+}
+
+void SMHashTable::maintenance_end() {
+    __atomic_store_n(&_service_ptr->maintenance.kind, SMHT_MAINTENANCE_NONE, __ATOMIC_RELEASE);
+}
+
+bool SMHashTable::maintenance_pending() {
+    struct maintenance *m = &_service_ptr->maintenance;
+    return __atomic_load_n(&m->kind, __ATOMIC_ACQUIRE) != SMHT_MAINTENANCE_NONE &&
+           process_dead(__atomic_load_n(&m->pid, __ATOMIC_ACQUIRE));
+}
+
+//поток, который сейчас доделывает брошенное обслуживание, сам его не запускает
+static thread_local bool maintenance_recovery = false;
+
+void SMHashTable::recover(pthread_mutex_t *mutex_ptr) {
+    //мьютекс уже согласован и наш; владелец умер внутри защищенного им участка
+    struct service *service = _service_ptr;
+    if (mutex_ptr >= service->bucket_mutex && mutex_ptr < service->bucket_mutex + SMHT_BUCKET_LOCKS) {
+        recover_intent((uint32_t) (mutex_ptr - service->bucket_mutex));
+        //блокировки корзин держит и упавшая очистка: доделываем ее, отпустив свою полосу
+        if (!maintenance_recovery && maintenance_pending()) {
+            unlock(mutex_ptr);
+            recover_maintenance();
+            lock(mutex_ptr);
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < _arena_count; i++) {
+        if (mutex_ptr == &service->arenas[i].mutex) {
+            recover_arena(i);
+            return;
+        }
+    }
+    if (mutex_ptr == &service->memory_mutex && !maintenance_recovery && maintenance_pending()) {
+        recover_maintenance_locked();
+    }
+    if (mutex_ptr == &service->index_mutex) {
+        //дерево могло остаться посреди разделения узлов: очищаем, ключи из корзин вернет первый обход.
+        //Отметку ставим до очистки - идущий обход увидит смену и не примет пустое дерево
+        if (!(service->index_broken & 1)) {
+            __atomic_store_n(&service->index_broken, service->index_broken + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+        }
+        index_reset();
+        return;
+    }
+    //limbo_mutex: очередь сдвигается так, что после падения в ней нет блоков, отданных дважды
+}
+
+void SMHashTable::recover_intent(uint32_t stripe) {
+    struct intent *intent = &_service_ptr->intents[stripe];
+    uint32_t state = __atomic_load_n(&intent->state, __ATOMIC_ACQUIRE);
+    if (state == SMHT_INTENT_IDLE) {
+        return;
+    }
+    if (state == SMHT_INTENT_ACTIVE) {
+        intent_rollback(intent);
+    } else {
+        intent_apply(intent);
+    }
+    //отпечатки могли остаться от откаченного ключа или от удаленного
+    filter_rebuild(intent->bucket);
+    if (__atomic_load_n(&_versions_ptr[intent->bucket], __ATOMIC_RELAXED) & 1) {
+        end_update(intent->bucket);
+    }
+    intent_end(intent);
+}
+
+void SMHashTable::recover_arena(uint32_t arena) {
+    //владелец умер между записью блока в журнал и в карту: блок, которого нет в карте, из журнала убираем,
+    //недописанный дописываем - его вернет откат журнала. Потом пересчитываем сводку арены
+    uint32_t from = arena * _arena_blocks;
+    uint32_t to = std::min((arena + 1) * _arena_blocks, (uint32_t) _data_count);
+    auto *map = (uint8_t *) _memory_map_ptr;
+    for (auto &intent : _service_ptr->intents) {
+        if (__atomic_load_n(&intent.state, __ATOMIC_ACQUIRE) != SMHT_INTENT_ACTIVE || !process_dead(intent.pid)) {
+            continue;
+        }
+        for (uint32_t i = 0; i < intent.alloc_count && i < SMHT_INTENT_BLOCKS; i++) {
+            struct block_ref *block = &intent.alloc[i];
+            if (block->size == 0 || block->index + block->size <= from || block->index >= to) {
+                continue;
+            }
+            if (std::find(map + block->index, map + block->index + block->size, 1) == map + block->index + block->size) {
+                __atomic_store_n(&block->size, 0, __ATOMIC_RELEASE);
+            } else {
+                std::memset(map + block->index, 1, block->size);
+            }
+        }
+    }
+    for (uint32_t c = from / SMHT_CHUNK_BLOCKS; c * SMHT_CHUNK_BLOCKS < to; c++) {
+        rebuild_chunk(c);
+    }
+    _service_ptr->arenas[arena].hint = from;
+}
+
+void SMHashTable::recover_bucket(uint32_t bucket) {
+    //читатели не берут блокировок, корзину брошенного писателя проверяем попыткой захвата
+    pthread_mutex_t *mutex_ptr = bucket_mutex(bucket);
+    int result = pthread_mutex_trylock(mutex_ptr);
+    if (result == EOWNERDEAD) {
+        if (pthread_mutex_consistent(mutex_ptr) != 0) {
+            perror("pthread_mutex_consistent");
+            return;
+        }
+        recover(mutex_ptr);
+        result = 0;
+    }
+    if (result == 0) {
+        unlock(mutex_ptr);
+    }
+}
+
+void SMHashTable::recover_maintenance() {
+    lock(&_service_ptr->memory_mutex);
+    if (maintenance_pending()) {
+        recover_maintenance_locked();
+    }
+    unlock(&_service_ptr->memory_mutex);
+}
+
+void SMHashTable::recover_maintenance_locked() {
+    //под memory_mutex; берем остальное в обычном порядке и доделываем брошенное
+    maintenance_recovery = true;
+    lock_buckets();
+    wait_readers();
+    lock_arenas();
+    struct maintenance *m = &_service_ptr->maintenance;
+    if (m->kind == SMHT_MAINTENANCE_DEFRAG) {
+        //таблица остается частично сжатой, но целой
+        finish_move();
+        rebuild_summary();
+    } else if (m->kind != SMHT_MAINTENANCE_NONE) {
+        //очистку повторяем, заливка шла в пустую таблицу - откатываем ее очисткой
+        reset();
+    }
+    maintenance_end();
+    unlock_arenas();
+    release_readers();
+    unlock_buckets();
+    maintenance_recovery = false;
+}
+
+void SMHashTable::mark_references(std::vector<uint8_t> &refs, uint32_t threads, struct verify_report *report) {
+    //вызывается без писателей; битые цепочки дальше первого плохого заголовка не читаем
+    auto mark = [&](uint64_t index, uint64_t size) {
+        for (uint64_t i = index; i < index + size && i < _data_count; i++) {
+            __atomic_fetch_add(&refs[i], 1, __ATOMIC_RELAXED);
+        }
+    };
+    for (uint32_t i = _service_ptr->limbo_head; i != _service_ptr->limbo_tail; i++) {
+        struct retired *item = &_service_ptr->limbo[i % SMHT_LIMBO];
+        mark(item->index, item->size);
+    }
+    //переполнение видно только своему процессу; чужое сверка считает потерянным
+    for (size_t i = 0; _overflow_gen == _service_ptr->limbo_gen && i < _overflow.size(); i++) {
+        mark(_overflow[i].index, _overflow[i].size);
+    }
+    //ключ должен лежать в корзине своей таблицы; посреди перехеширования - под любым из двух семян
+    auto ranges = table_ranges();
+    uint64_t seeds = _service_ptr->seeds;
+    auto home_bucket = [&ranges, seeds](uint64_t bucket, const char *key, uint32_t size) -> bool {
+        auto range = std::upper_bound(ranges.begin(), ranges.end(), std::make_pair(bucket, UINT64_MAX)) - 1;
+        if (bucket >= range->first + range->second) {
+            return false;
+        }
+        return range->first + hash_method(key, size, (uint32_t) seeds) % range->second == bucket ||
+               range->first + hash_method(key, size, (uint32_t) (seeds >> 32)) % range->second == bucket;
+    };
+    std::vector<struct verify_report> partial(threads);
+    run_parallel(threads, [&](uint32_t t) {
+        struct verify_report *r = &partial[t];
+        for (uint64_t bucket = _bucket_total * t / threads; bucket < _bucket_total * (t + 1) / threads; bucket++) {
+            auto *header = get_header(bucket);
+            if (!header->val_offset) {
+                r->bad_headers += header->linked_item != nullptr;
+                continue;
+            }
+            for (uint64_t length = 0; header && length <= _data_count; length++) {
+                auto key_offset = (uint64_t) header->key_offset;
+                auto val_offset = (uint64_t) header->val_offset;
+                uint64_t start = key_offset - sizeof(void *);
+                //у вытесненного значения в сегменте только ключ
+                bool spilled = header->flags & SMHT_ENTRY_SPILLED;
+                uint64_t end = spilled ? key_offset + header->key_size : val_offset + header->val_size;
+                char *key = (char *) _data_ptr + key_offset;
+                if (key_offset < sizeof(void *) || start % _data_block_size || end > _data_len ||
+                    header->key_size == 0 || (!spilled && val_offset != key_offset + header->key_size) ||
+                    key[header->key_size - 1] != 0 || !home_bucket(bucket, key, header->key_size - 1) ||
+                    *(uint64_t *) ((char *) _data_ptr + start) != (((long) header - (long) _header_ptr) | 1UL << 63)) {
+                    r->bad_headers++;
+                    break;
+                }
+                r->items++;
+                mark(start / _data_block_size, int_ceil_divide(end - start, _data_block_size));
+                if (!header->linked_item) {
+                    break;
+                }
+                auto linked = (uint64_t) header->linked_item;
+                if (linked % _data_block_size || linked + _header_size > _data_len) {
+                    r->bad_headers++;
+                    break;
+                }
+                mark(linked / _data_block_size, int_ceil_divide(_header_size, _data_block_size));
+                header = (struct header *) ((long) _data_ptr + linked);
+            }
+        }
+    });
+    for (auto &r : partial) {
+        report->items += r.items;
+        report->bad_headers += r.bad_headers;
+    }
+}
+
+bool SMHashTable::verify(struct verify_report *report, bool repair, uint32_t threads) {
+    if (threads == 0) {
+        threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+    threads = std::max<size_t>(1, std::min<size_t>(threads, _bucket_total));
+    struct verify_report result{};
+    //каталог не меняется, пока сверяем корзины с таблицами
+    if (_catalog_ptr) {
+        lock(&_catalog_ptr->mutex);
+    }
+    //писатели стоят, очередь отложенных блоков и карта не меняются; брошенные журналы при этом дорабатываются
+    lock(&_service_ptr->memory_mutex);
+    lock_buckets();
+    lock(&_service_ptr->limbo_mutex);
+    if (repair) {
+        //блоки, снятые писателями, но еще не отданные, сверка вернет сама - отдавать их после нее нельзя
+        reclaim(false);
+        _overflow_gen = __atomic_add_fetch(&_service_ptr->limbo_gen, 1, __ATOMIC_RELEASE);
+    }
+    lock_arenas();
+
+    //сколько раз на блок ссылаются цепочки и очередь отложенных
+    std::vector<uint8_t> refs(_data_count);
+    mark_references(refs, threads, &result);
+
+    auto *map = (uint8_t *) _memory_map_ptr;
+    std::vector<struct verify_report> compared(threads);
+    run_parallel(threads, [&](uint32_t t) {
+        struct verify_report *r = &compared[t];
+        for (uint64_t i = _data_count * t / threads; i < _data_count * (t + 1) / threads; i++) {
+            if (refs[i] == 0 && map[i] != 0) {
+                r->leaked_blocks++;
+                if (repair) {
+                    map[i] = 0;
+                }
+            } else if (refs[i] != 0 && map[i] == 0) {
+                r->lost_blocks++;
+            }
+            r->shared_blocks += refs[i] > 1;
+        }
+    });
+    for (auto &r : compared) {
+        result.leaked_blocks += r.leaked_blocks;
+        result.lost_blocks += r.lost_blocks;
+        result.shared_blocks += r.shared_blocks;
+    }
+    if (repair && result.leaked_blocks) {
+        rebuild_summary();
+    }
+    unlock_arenas();
+    unlock(&_service_ptr->limbo_mutex);
+    unlock_buckets();
+    unlock(&_service_ptr->memory_mutex);
+    if (_catalog_ptr) {
+        unlock(&_catalog_ptr->mutex);
+    }
+
+    if (report) {
+        *report = result;
+    }
+    return result.leaked_blocks == 0 && result.lost_blocks == 0 && result.shared_blocks == 0 &&
+           result.bad_headers == 0;
+}
+
+void *SMHashTable::find_zero_sequence(void *from, void *to, uint32_t len) {
+    uint32_t counter = 0;
     do {
         if (*(char *) from == 0) {
             counter++;
@@ -514,12 +4244,27 @@ void *SMHashTable::find_zero_sequence(void *from, void *to, uint32_t len) {
 }
 
 int SMHashTable::lock(pthread_mutex_t *mutex_ptr){
+#ifdef SMC_TRACE
+    //замеряем только ожидание занятой блокировки, и каждое: их мало и они дорогие
+    int result = pthread_mutex_trylock(mutex_ptr);
+    if (result == EBUSY) {
+        uint64_t start = SMTrace::now();
+        result = pthread_mutex_lock(mutex_ptr);
+        uint64_t wait = SMTrace::now() - start;
+        SMTrace::record(SMTR_OP_LOCK_WAIT, wait);
+        SMC_PROBE(lock_wait, mutex_ptr, wait);
+    }
+#else
     int result = pthread_mutex_lock(mutex_ptr);
+#endif
     if (result == EOWNERDEAD) {
         result = pthread_mutex_consistent(mutex_ptr);
         if (result != 0){
             perror("pthread_mutex_consistent");
+            return result;
         }
+        //владелец умер посреди изменения, по журналу доводим или откатываем его
+        recover(mutex_ptr);
     }
     return result;
 }
@@ -2,13 +2,26 @@
 #define SMC_SMHASHTABLE_H
 
 
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+
+#include "SMSegment.h"
+
+class SMCompressor;
+
 #define int_ceil_divide(x, y) ((x + y - 1) / y)
 
 uint32_t SuperFastHash(const char *data, uint32_t len);
 
-static inline uint32_t meiyan(const char *key, uint32_t count) {
+static inline uint32_t meiyan(const char *key, uint32_t count, uint32_t seed = 0) {
     typedef uint32_t *P;
-    uint32_t h = 0x811c9dc5;
+    uint32_t h = 0x811c9dc5 ^ seed;
     while (count >= 8) {
         h = (h ^ ((((*(P) key) << 5) | ((*(P) key) >> 27)) ^ *(P) (key + 4))) * 0xad3e7;
         count -= 8;
@@ -27,59 +40,923 @@ static inline uint32_t meiyan(const char *key, uint32_t count) {
 
 
 #define hash_method meiyan
+#define hash_method_id SMHT_HASH_MEIYAN
+
+#define SMHT_MAGIC 0x454c42415448534dULL // "SMHTABLE"
+#define SMHT_LAYOUT_VERSION 17
+#define SMHT_FEATURE_COMPRESSION (1U << 0)
+#define SMHT_FEATURE_FILTER (1U << 1)
+#define SMHT_FEATURE_HOTKEYS (1U << 2)
+#define SMHT_FEATURE_SPILL (1U << 3)
+#define SMHT_FEATURE_SNAPSHOTS (1U << 4)
+#define SMHT_FEATURE_ORDERED (1U << 5)
+#define SMHT_SUPPORTED_FEATURES (SMHT_FEATURE_COMPRESSION | SMHT_FEATURE_FILTER | SMHT_FEATURE_HOTKEYS | \
+                                 SMHT_FEATURE_SPILL | SMHT_FEATURE_SNAPSHOTS | SMHT_FEATURE_ORDERED)
+#define SMHT_ENTRY_COMPRESSED (1U << 0)
+#define SMHT_ENTRY_DICTIONARY (1U << 1)
+#define SMHT_ENTRY_SPILLED (1U << 2)
+#define SMHT_ENTRY_SPILL_GEN (1U << 3)
+#define SMHT_COMPRESSION_MIN 64
+#define SMHT_FILTER_SLOTS 7
+#define SMHT_FILTER_OVERFLOW_MAX 255
+#define SMHT_MAX_ARENAS 16
+//сколько таблиц поток помнит со своей ареной
+#define SMHT_ARENA_TABLES 64
+#define SMHT_CHUNK_BLOCKS 4096
+#define SMHT_BUCKET_LOCKS 256
+#define SMHT_NOT_FOUND UINT32_MAX
+#define SMHT_MAX_BLOCKS (1U << 31)
+#define SMHT_HASH_MEIYAN 1
+#define SMHT_ALIGN 64
+#define SMHT_READERS 128
+#define SMHT_LIMBO 4096
+#define SMHT_RECLAIM_BATCH 64
+#define SMHT_RELEASE_BATCH 8
+#define SMHT_READER_WAIT 100
+#define SMHT_WAIT_SLOTS 256
+#define SMHT_INTENT_BLOCKS 2
+#define SMHT_INTENT_WRITES 6
+#define SMHT_INTENT_IDLE 0
+#define SMHT_INTENT_ACTIVE 1
+#define SMHT_INTENT_COMMIT 2
+#define SMHT_MAINTENANCE_NONE 0
+#define SMHT_MAINTENANCE_CLEAR 1
+#define SMHT_MAINTENANCE_BULK 2
+#define SMHT_MAINTENANCE_DEFRAG 3
+#define SMHT_MOVE_NONE 0
+#define SMHT_MOVE_COPY 1
+#define SMHT_MOVE_LINK 2
+#define SMHT_RECOVERY_SPINS (1U << 20)
+#define SMHT_HOT_ROWS 4
+#define SMHT_HOT_WIDTH 2048
+#define SMHT_HOT_TOP 32
+#define SMHT_HOT_KEY_SIZE 64
+#define SMHT_HOT_SAMPLE 16
+#define SMHT_OP_GET 0
+#define SMHT_OP_SET 1
+#define SMHT_OP_UNSET 2
+#define SMHT_OPS 3
+#ifndef SMHT_SPILL_DIR
+#define SMHT_SPILL_DIR "/var/tmp"
+#endif
+#define SMHT_SPILL_CAPACITY (1ULL << 38)
+#define SMHT_SPILL_ALIGN 8
+#define SMHT_SPILL_GROW (64ULL << 20)
+#define SMHT_SPILL_LARGE (64U << 10)
+#define SMHT_SPILL_GARBAGE 2
+#define SMHT_SPILL_HEADROOM 8
+#define SMHT_SPILL_RETRIES 4
+#define SMHT_SPILL_NONE UINT64_MAX
+#define SMHT_SPILL_UNFINISHED UINT32_MAX
+#define SMHT_TABLE_SLOTS 1024
+#define SMHT_TABLE_NAME 64
+#define SMHT_TABLE_FREE 0
+#define SMHT_TABLE_LIVE 1
+#define SMHT_TABLE_DROPPING 2
+#define SMHT_TABLE_DROPPED 3
+#define SMHT_CHAIN_LIMIT 32
+#define SMHT_REHASH_CHECK 4096
+#define SMHT_REHASH_POLL_MS 1
+#define SMHT_SNAPSHOTS 64
+#define SMHT_UNDO_SHARE 4
+#define SMHT_UNDO_ALIGN 8
+#define SMHT_INDEX_NODE 4096
+#define SMHT_INDEX_SHARE 2
+#define SMHT_INDEX_PREFIX 4
+#define SMHT_INDEX_KEY_MAX 512
+#define SMHT_INDEX_DEPTH 32
+#define SMHT_INDEX_SLOTS 255
+#define SMHT_INDEX_SPINS 1024
 
 
-class SMHashTable {
+class SMHashTable : public SMSegment {
 public:
     struct meminfo {
-        uint32_t free{};
-        uint32_t max_free_block{};
-        uint32_t max_allocated_block{};
+        uint64_t free{};
+        uint64_t max_free_block{};
+        uint64_t max_allocated_block{};
         uint32_t segments{};
+        uint64_t used{};
+        uint64_t resident{};
+        uint64_t filter_size{};
+        double filter_false_positive{};
+        //второй уровень: живые значения в файле и место, которое файл занимает на диске
+        uint64_t spilled{};
+        uint64_t spill_file{};
+        //цепочки корзин этой таблицы: самая длинная, средняя по непустым корзинам и число непустых
+        uint32_t max_chain{};
+        double avg_chain{};
+        uint64_t chained_buckets{};
+        //журнал старых состояний корзин для снимков: занято и всего
+        uint64_t undo_used{};
+        uint64_t undo_capacity{};
+        //узлы упорядоченного индекса: в дереве и всего, в байтах
+        uint64_t index_used{};
+        uint64_t index_capacity{};
+    };
+
+    // Оценки по выборке 1 из sample операций, уже умноженные на sample. Ключи длиннее
+    // SMHT_HOT_KEY_SIZE - 1 обрезаются
+    struct hot_key {
+        std::string key;
+        uint64_t count{};
+    };
+
+    struct hot_stats {
+        double seconds{};
+        double rate[SMHT_OPS]{};
+        std::vector<hot_key> top;
+    };
+
+    struct verify_report {
+        uint64_t items{};
+        uint64_t leaked_blocks{};
+        uint64_t lost_blocks{};
+        uint64_t shared_blocks{};
+        uint64_t bad_headers{};
+    };
+
+    // Пока guard жив, указатели из get_value остаются валидными: освобожденные
+    // писателями блоки ждут в очереди, пока все читатели не выйдут из своей эпохи.
+    // Под guard нельзя вызывать clear(), hardDefragmentation() и compactSpill() - они ждут читателей.
+    // Писать под guard можно, писатели его не ждут, но все, что они освобождают, остается занятым
+    // до его конца: долгий guard при частых записях исчерпывает память, и set() вернет false.
+    class read_guard {
+    public:
+        explicit read_guard(SMHashTable *table);
+
+        read_guard(const read_guard &) = delete;
+
+        read_guard &operator=(const read_guard &) = delete;
+
+        ~read_guard();
+
+    private:
+        SMHashTable *_table;
+        uint32_t _slot;
     };
 
-    explicit SMHashTable(std::string name, int key_count, int data_count, int data_block_size = 512);
+    // Блоки адресуются 32-битным номером: data_count меньше 2^32, но размер сегмента ограничен только памятью.
+    // table_buckets - корзины сверх key_count для именованных таблиц openTable(), данные у всех таблиц общие
+    // Снимок таблицы на момент создания (SMHT_FEATURE_SNAPSHOTS): пока он жив, писатель перед первым
+    // после создания изменением корзины копирует ее прежнее содержимое в журнал сегмента, снимок читает
+    // корзины, измененные после него, из журнала. Писатели не ждут снимок, кроме короткого создания.
+    // Если журнал переполнен, снимки в нем ломаются: valid() и чтения возвращают false.
+    // Снимок можно читать из любого потока, но не из нескольких сразу; таблица должна его пережить
+    class snapshot_handle {
+    public:
+        explicit snapshot_handle(SMHashTable *table);
+
+        snapshot_handle(const snapshot_handle &) = delete;
+
+        snapshot_handle &operator=(const snapshot_handle &) = delete;
+
+        ~snapshot_handle();
+
+        bool valid();
+
+        // false - ключа в снимке нет или снимок сломан
+        bool get(const std::string &key, std::string *value);
+
+        // Все элементы таблицы в снимке, callback вызывается без блокировок.
+        // false - снимок сломан, тогда callback мог получить только часть элементов
+        bool forEach(const std::function<void(const std::string &, const std::string &)> &callback);
+
+    private:
+        SMHashTable *_table;
+        uint32_t _slot;
+        uint64_t _sequence;
+        uint64_t _seeds;
+    };
+
+    // Ключи таблицы по возрастанию (SMHT_FEATURE_ORDERED): B+ дерево в сегменте, общее для всех таблиц,
+    // его ведут set и unset. Обход читает дерево без блокировок по листу за раз и отдает только живые ключи:
+    // ключ, добавленный или удаленный во время обхода, может попасть в него или нет, остальные выдаются
+    // ровно один раз. Итератор - для одного потока, таблица должна его пережить
+    class range_iterator {
+    public:
+        // false - ключи кончились. value - значение на момент выдачи ключа
+        bool next(std::string *key, std::string *value = nullptr);
+
+    private:
+        friend class SMHashTable;
+
+        range_iterator(SMHashTable *table, std::string from, std::string to, bool prefix);
+
+        void fill();
+
+        SMHashTable *_table;
+        //ключи индекса: первый непрочитанный и граница - ключи меньше нее или, при _prefix, с нее начинающиеся
+        std::string _from;
+        std::string _to;
+        bool _prefix;
+        bool _done;
+        std::vector<std::string> _keys;
+        size_t _position;
+    };
+
+    explicit SMHashTable(std::string name, uint64_t key_count, uint64_t data_count, uint32_t data_block_size = 512,
+                         open_mode mode = OPEN_OR_CREATE, uint32_t features = 0, uint64_t table_buckets = 0);
+
+    explicit SMHashTable(std::string name);
+
+    ~SMHashTable();
+
+    // Удаляет сегмент и файлы второго уровня
+    static bool destroy(const std::string &name);
+
+    read_guard pin();
+
+    // Без SMHT_FEATURE_SNAPSHOTS или при занятых SMHT_SNAPSHOTS слотах снимок сразу невалиден
+    snapshot_handle snapshot();
+
+    // Именованная таблица в этом же сегменте: свои key_count корзин из запаса table_buckets, блоки данных,
+    // блокировки, эпохи и второй уровень общие с остальными таблицами. key_count = 0 - только открыть
+    // существующую, иначе создать, если ее нет. Объект таблицы живет на отображении этого и не должен
+    // его пережить. nullptr - таблицы нет, корзины кончились или каталог полон
+    std::shared_ptr<SMHashTable> openTable(const std::string &table, uint64_t key_count = 0);
+
+    // Удаляет элементы таблицы и возвращает ее корзины в запас. Открытые объекты таблицы
+    // к этому моменту должны быть закрыты во всех процессах
+    bool dropTable(const std::string &table);
+
+    std::vector<std::string> tables();
+
+    // Ключи, начинающиеся с prefix, по возрастанию байтов; пустой prefix - вся таблица.
+    // Без SMHT_FEATURE_ORDERED итератор сразу пуст. С ним set не принимает ключи длиннее
+    // SMHT_INDEX_KEY_MAX - SMHT_INDEX_PREFIX и возвращает false, когда кончились узлы индекса
+    range_iterator range(const std::string &prefix);
+
+    // Ключи из [lo, hi); пустой hi - до конца таблицы
+    range_iterator range(const std::string &lo, const std::string &hi);
+
+    // Заливка в пустую таблицу, которую еще никто не читает: ключи делятся по корзинам между потоками,
+    // блоки раздаются подряд без поиска по карте. Элементы - пары строк (first, second), диапазон
+    // должен жить до конца вызова; из повторов ключа остается последний. Для именованных таблиц
+    // пуст должен быть весь сегмент.
+    // false - таблица не пуста, у сегмента есть живые снимки или данные не помещаются, тогда таблица не меняется
+    template<typename Iterator>
+    bool bulk_load(Iterator begin, Iterator end, uint32_t threads = 0) {
+        std::vector<bulk_item> items;
+        for (; begin != end; ++begin) {
+            struct bulk_item item{};
+            item.key = std::string_view(begin->first);
+            item.val = std::string_view(begin->second);
+            items.push_back(item);
+        }
+        return bulk_load_items(items, threads);
+    }
 
     bool set(const std::string &key, const std::string &val);
 
     char *get_value(const std::string &key);
 
+    // Для двоичных значений: length - длина без завершающего нуля, nullptr - ключа нет.
+    // shared = true - указатель в сегменте и живет под pin(), иначе это буфер потока до следующего вызова
+    char *get_value(const std::string &key, size_t *length, bool *shared = nullptr);
+
+    int64_t get(const std::string &key, char *buffer, size_t size);
+
+    bool setCompressionDictionary(const std::string &dict);
+
     int unset(const std::string &key);
 
+    // Ждут set/unset ключа из другого потока или процесса; timeout_ms < 0 - без ограничения.
+    // Перенос ключа при перехешировании wait_for_change тоже видит как изменение. false - время вышло
+    bool wait_for_change(const std::string &key, int timeout_ms = -1);
+
+    bool wait_for_key(const std::string &key, int timeout_ms = -1);
+
+    // В сегменте с именованными таблицами удаляет только элементы этой таблицы, по одному
     void clear();
 
-    uint32_t getFreeMemorySize();
+    uint64_t getFreeMemorySize();
 
-    uint32_t getLongestFreeBlockSize();
+    uint64_t getLongestFreeBlockSize();
 
-    uint32_t getLongestAllocatedBlockSize();
+    uint64_t getLongestAllocatedBlockSize();
+
+    double getFilterFalsePositiveRate();
+
+    // Горячие ключи и частота операций с последнего resetHotKeys(); только с SMHT_FEATURE_HOTKEYS.
+    // top отсортирован по убыванию оценки
+    struct hot_stats hotKeys();
+
+    void resetHotKeys();
+
+    // Считать каждую n-ю операцию потока, по умолчанию SMHT_HOT_SAMPLE
+    void setHotKeySampling(uint32_t n);
 
     struct meminfo *memInfo();
 
     void hardDefragmentation();
 
+    // Отдает системе страницы данных под целиком свободными кусками карты. unset делает это сам
+    // пачками по SMHT_RELEASE_BATCH кусков на арену, здесь - сразу все. Возвращает освобожденные байты
+    uint64_t releaseMemory();
+
+    // После seal() таблица только читается: set и bulk_load возвращают false, unset - 0.
+    // Изменения, начатые до seal(), успевают закончиться
+    void seal();
+
+    void unseal();
+
+    bool isSealed();
+
+    // Второй уровень (SMHT_FEATURE_SPILL): значения лежат в файле SMHT_SPILL_DIR/<name>.spill.<поколение>,
+    // в сегменте остаются заголовок и ключ. Значения не короче threshold пишутся в файл сразу
+    // (по умолчанию SMHT_SPILL_LARGE, 0 - никогда), остальные вытесняются туда, когда set не хватает места:
+    // по кругу корзин, пропуская те, что читали с прошлого круга. get_value читает их из отображения файла
+    void setSpillThreshold(uint32_t bytes);
+
+    // Переносит живые значения файла в другое поколение и отдает место мертвых, если мертвых не меньше
+    // 1/SMHT_SPILL_GARBAGE (или force). Значения из недавно читанных корзин возвращает в сегмент,
+    // пока в нем свободно больше 1/SMHT_SPILL_HEADROOM блоков. false - делать было нечего или части значений
+    // не хватило места в файле: старое поколение тогда остается, перенос продолжит следующий вызов.
+    // Ждет читателей, поэтому под pin() этого потока не вызывается - он не вернется
+    bool compactSpill(bool force = false);
+
+    // compactSpill() раз в interval_ms в фоновом потоке этого экземпляра
+    void startSpillCompactor(uint32_t interval_ms);
+
+    void stopSpillCompactor();
+
+    // Корзины выбираются хешем со случайным семенем сегмента. Если после вставки цепочка длиннее
+    // limit (по умолчанию SMHT_CHAIN_LIMIT, 0 - никогда) и вдвое длиннее самой длинной после прошлого
+    // перехеширования, set запускает rehash() в фоновом потоке этого экземпляра
+    void setChainLimit(uint32_t limit);
+
+    // Новое семя и перенос ключей под него, для всех таблиц сегмента. Читатели не блокируются: пока
+    // перенос идет, ключ ищется в корзинах обоих семян. Писатели ждут только на двух корзинах ключа,
+    // openTable, clear основной таблицы и verify - до конца переноса. Продолжает брошенный перенос.
+    // false - перенос уже идет в другом потоке или процессе, или на копию не хватило памяти
+    bool rehash();
+
+    // Корзина, в которую сейчас пишется ключ
+    uint32_t bucketOf(const std::string &key);
+
+    // Отметка корзины ключа для копий значений вне сегмента (SMReadCache): пока stampValid() истинно,
+    // ключ не записывали и не удаляли. stampOf() берется до чтения значения и проверяется после него;
+    // false - корзину как раз меняют или идет перехеширование, копию сохранять нельзя
+    struct stamp {
+        uint64_t seeds;
+        uint32_t bucket;
+        uint32_t version;
+    };
+
+    bool stampOf(const std::string &key, struct stamp *stamp);
+
+    bool stampValid(const struct stamp &stamp);
+
+    // Обходит все элементы по корзинам. Корзина копируется под своей блокировкой, callback вызывается
+    // без блокировок; элементы, измененные во время обхода, могут попасть в него в любой из версий
+    void forEach(const std::function<void(const std::string &, const std::string &)> &callback);
+
+    // Сверяет карту памяти с цепочками: блоки, занятые в карте без ссылок (утечки), ссылки на свободные
+    // и общие блоки, битые заголовки. Писатели на это время останавливаются, читатели нет.
+    // repair возвращает утекшие блоки; true - расхождений не было
+    bool verify(struct verify_report *report = nullptr, bool repair = false, uint32_t threads = 0);
+
 protected:
+    struct superblock : segment_header {
+        uint32_t hash_id;
+        uint32_t features;
+
+        uint64_t key_count;
+        uint64_t data_count;
+        uint64_t data_block_size;
+        uint64_t header_size;
+        uint64_t memory_size;
+
+        uint64_t service_offset;
+        uint64_t versions_offset;
+        uint64_t header_offset;
+        uint64_t filter_offset;
+        uint64_t memory_map_offset;
+        uint64_t chunks_offset;
+        uint64_t dict_offset;
+        uint64_t dict_capacity;
+        uint64_t data_offset;
+
+        uint64_t arena_count;
+        uint64_t arena_blocks;
+
+        uint64_t access_offset;
+        uint64_t spill_capacity;
+
+        uint64_t catalog_offset;
+        uint64_t table_buckets;
+
+        uint64_t snapshot_offset;
+        uint64_t undo_offset;
+        uint64_t undo_capacity;
+
+        uint64_t index_offset;
+        uint64_t index_nodes;
+    };
+
     struct header {
         void *key_offset{};
         uint32_t key_size{};
+        uint32_t flags{};
 
         void *val_offset{};
         uint32_t val_size{};
+        uint32_t raw_size{};
 
         void *linked_item{};
     };
 
+    //resident - страницы данных куска могли остаться в памяти, пока кусок был занят
+    struct chunk {
+        uint32_t free;
+        uint32_t longest;
+        uint32_t resident;
+    };
+
+    struct arena {
+        alignas(SMHT_ALIGN) pthread_mutex_t mutex;
+        uint32_t hint;
+        //куски, освободившиеся целиком после последнего возврата страниц
+        uint32_t release_pending;
+    };
+
+    struct reader {
+        alignas(SMHT_ALIGN) uint32_t pid;
+        uint64_t epoch;
+    };
+
+    struct retired {
+        uint32_t index;
+        uint32_t size;
+        uint64_t epoch;
+    };
+
+    struct block_ref {
+        uint32_t index;
+        uint32_t size;
+    };
+
+    //блок, снятый писателем с журнала; отдается после блокировки корзины, если очередь не сбрасывали
+    struct retiring {
+        uint32_t index;
+        uint32_t size;
+        uint32_t gen;
+    };
+
+    struct word_write {
+        uint64_t offset;
+        uint64_t value;
+    };
+
+    //журнал изменения под блокировкой корзины: до COMMIT откатываем выделенные блоки,
+    //после - повторяем запись слов и отдаем старые блоки
+    struct intent {
+        alignas(SMHT_ALIGN) uint32_t state;
+        uint32_t pid;
+        uint32_t bucket;
+        uint32_t alloc_count;
+        uint32_t retire_count;
+        uint32_t retire_done;
+        uint32_t write_count;
+        struct block_ref alloc[SMHT_INTENT_BLOCKS];
+        struct block_ref retire[SMHT_INTENT_BLOCKS];
+        struct word_write write[SMHT_INTENT_WRITES];
+    };
+
+    //очистка, заливка и дефрагментация под всеми блокировками; move - переносимый сейчас блок
+    struct maintenance {
+        uint32_t kind;
+        uint32_t pid;
+        uint32_t move_state;
+        uint32_t move_data;
+        uint32_t from;
+        uint32_t to;
+        uint32_t blocks;
+        uint32_t copied;
+    };
+
+    //элемент списка горячих ключей: seq нечетный, пока ключ переписывают
+    struct hot_entry {
+        uint32_t seq;
+        uint32_t key_size;
+        uint32_t hash;
+        uint32_t reserved;
+        uint64_t count;
+        char key[SMHT_HOT_KEY_SIZE];
+    };
+
+    //count-min sketch по выборке операций и самые частые из оцененных ключей
+    struct hotkeys {
+        uint32_t sample;
+        uint32_t reserved;
+        uint64_t since;
+        //самая малая оценка в заполненном списке: ключи с оценкой ниже в нем точно нет
+        uint64_t floor;
+        uint64_t ops[SMHT_OPS];
+        uint32_t sketch[SMHT_HOT_ROWS][SMHT_HOT_WIDTH];
+        struct hot_entry top[SMHT_HOT_TOP];
+    };
+
+    //sequence - последовательность состояния корзины, с которой она такая; undo - позиция + 1 в журнале
+    //записи с прошлым состоянием, 0 - записи нет
+    struct bucket_version {
+        uint64_t sequence;
+        uint64_t undo;
+    };
+
+    //запись журнала: состояние корзины, действовавшее с sequence до until; prev - позиция + 1 предыдущей
+    //записи этой корзины. Запись с until = 0 - пропуск до конца кольца. За заголовком count элементов:
+    //длина ключа, длина значения, ключ, значение
+    struct undo_record {
+        uint64_t size;
+        uint64_t sequence;
+        uint64_t until;
+        uint64_t prev;
+        uint32_t bucket;
+        uint32_t count;
+    };
+
+    //pid 0 - слот свободен
+    struct snapshot_slot {
+        uint32_t pid;
+        uint32_t broken;
+        uint64_t sequence;
+    };
+
+    //узел индекса: слоты от начала узла, байты ключей от конца вниз до heap; version нечетная, пока узел
+    //меняют. В листе слот - ключ, во внутреннем узле - разделитель и потомок с ключами не меньше него,
+    //first - потомок с ключами меньше первого разделителя
+    struct index_node {
+        uint32_t version;
+        uint16_t leaf;
+        uint16_t count;
+        uint32_t first;
+        uint32_t heap;
+    };
+
+    //head - первые 8 байт ключа старшими вперед: двоичный поиск почти всегда решается без байтов ключа
+    struct index_slot {
+        uint64_t head;
+        uint16_t offset;
+        uint16_t size;
+        uint32_t child;
+    };
+
     struct service {
         pthread_mutex_t memory_mutex;
+        uint32_t dict_size;
+        uint32_t arena_claims;
+        pthread_mutex_t bucket_mutex[SMHT_BUCKET_LOCKS];
+        struct arena arenas[SMHT_MAX_ARENAS];
+
+        uint64_t epoch;
+        uint32_t active_readers;
+        uint32_t exclusive;
+        struct reader readers[SMHT_READERS];
+
+        uint32_t waiters[SMHT_WAIT_SLOTS];
+
+        //limbo_gen растет, когда очередь сбрасывают целиком: отложенное до этого уже свободно
+        pthread_mutex_t limbo_mutex;
+        uint32_t limbo_head;
+        uint32_t limbo_tail;
+        uint32_t limbo_gen;
+        struct retired limbo[SMHT_LIMBO];
+
+        struct intent intents[SMHT_BUCKET_LOCKS];
+        struct maintenance maintenance;
+
+        uint32_t sealed;
+
+        struct hotkeys hot;
+
+        //файл второго уровня: пишется только в конец поколения spill_gen, компактор переносит живое
+        //в другое поколение; spill_compactor - pid компактора или SMHT_SPILL_UNFINISHED, если перенос
+        //не удался целиком и ждет следующего прохода; spill_from - поколение, которое он освобождает
+        pthread_mutex_t spill_mutex;
+        uint32_t spill_gen;
+        uint32_t spill_threshold;
+        uint32_t spill_compactor;
+        uint32_t spill_from;
+        uint64_t spill_hand;
+        uint64_t spill_tail[2];
+        uint64_t spill_size[2];
+        uint64_t spill_dead[2];
+
+        //семя хеша корзин: младшие 32 бита - текущее, старшие - к которому идет перехеширование,
+        //без него они равны. rehash_pid - кто переносит ключи, rehash_cursor - первая непройденная корзина,
+        //rehash_floor - самая длинная цепочка после прошлого перехеширования
+        alignas(SMHT_ALIGN) uint64_t seeds;
+        uint32_t chain_limit;
+        uint32_t rehash_floor;
+        uint32_t rehash_pid;
+        uint32_t rehashes;
+        uint64_t rehash_cursor;
+
+        //снимки: undo_sequence растет на каждую запись журнала, снимок видит состояния корзин
+        //не новее своей последовательности. Журнал - кольцо, undo_head и undo_tail растут не оборачиваясь
+        alignas(SMHT_ALIGN) pthread_mutex_t undo_mutex;
+        uint32_t snapshots;
+        uint32_t reserved;
+        uint64_t undo_sequence;
+        uint64_t undo_head;
+        uint64_t undo_tail;
+        struct snapshot_slot snapshot_slots[SMHT_SNAPSHOTS];
+
+        //упорядоченный индекс меняется под index_mutex; index_next - первый еще не розданный узел,
+        //index_free - список освобожденных через first, index_live - узлы в дереве,
+        //index_broken нечетный - писатель упал посреди изменения, дерево очищено и ждет перестройки;
+        //растет при каждой очистке и перестройке, обход по нему замечает очистку под собой
+        alignas(SMHT_ALIGN) pthread_mutex_t index_mutex;
+        uint32_t index_root;
+        uint32_t index_next;
+        uint32_t index_free;
+        uint32_t index_live;
+        uint32_t index_broken;
+    };
+
+    //корзины таблицы - диапазон [base, base + count) общего массива заголовков
+    struct table_entry {
+        uint32_t state;
+        uint32_t hash;
+        uint64_t base;
+        uint64_t count;
+        char name[SMHT_TABLE_NAME];
     };
 
+    //имена таблиц открытой адресацией по хешу; удаленная запись держит свободный диапазон корзин,
+    //next - начало еще не розданных корзин запаса
+    struct catalog {
+        pthread_mutex_t mutex;
+        uint32_t tables;
+        uint32_t reserved;
+        uint64_t next;
+        struct table_entry entries[SMHT_TABLE_SLOTS];
+    };
+
+    struct bulk_item {
+        std::string_view key;
+        std::string_view val;
+        uint32_t bucket;
+        uint32_t flags;
+        uint32_t raw_size;
+        uint32_t blocks;
+        uint32_t header_blocks;
+        bool skip;
+    };
+
+    bool bulk_load_items(std::vector<bulk_item> &items, uint32_t threads);
+
+    void bulk_prepare(std::vector<bulk_item> &items, std::string &packed, uint32_t *total,
+                      const SMCompressor *compressor, uint32_t dict_size);
+
+    std::shared_ptr<SMCompressor> current_compressor(uint32_t *dict_size);
+
+    void bulk_write(std::vector<bulk_item> &items, uint32_t first_block);
+
+    inline uint32_t get_bucket(const char *key, uint32_t size);
+
+    inline uint32_t bucket_for(const char *key, uint32_t size, uint32_t seed);
+
+    void lock_pair(uint32_t bucket, uint32_t other);
+
+    void unlock_pair(uint32_t bucket, uint32_t other);
+
+    void lock_key(const char *key, uint32_t size, uint32_t *bucket, uint32_t *old);
+
+    int unset_in(uint32_t bucket, const std::string &key);
+
+    uint32_t chain_length(uint32_t bucket);
+
+    void chain_stats(uint64_t from, uint64_t to, uint32_t *longest, double *average, uint64_t *nonempty = nullptr);
+
+    void check_chain(uint32_t chain, bool rehashing);
+
+    void start_rehasher(bool fresh);
+
+    bool run_rehash(bool fresh);
+
+    bool rehash_key(uint32_t from, uint32_t to, const std::string &key);
+
+    std::vector<std::pair<uint64_t, uint64_t>> table_ranges();
+
+    inline struct header *get_header(uint32_t bucket);
+
     inline struct header *get_header(const char *key, uint32_t size);
 
-    inline void *find_memory_block(size_t size, uint32_t offset = 0);
+    inline pthread_mutex_t *bucket_mutex(uint32_t bucket);
+
+    static inline uint8_t fingerprint(uint32_t hash);
+
+    inline bool filter_contains(uint32_t bucket, uint8_t fp);
+
+    void filter_add(struct header *bucket_header, const char *key, uint32_t size);
+
+    void filter_remove(uint32_t bucket, const std::string &key);
+
+    static inline uint64_t filter_insert(uint64_t word, uint8_t fp);
+
+    void filter_rebuild(uint32_t bucket);
+
+    bool set_item(struct intent *intent, struct header *header, const std::string &key, const char *val_ptr,
+                  uint32_t val_size, uint32_t raw_size, uint32_t flags, bool spill = false);
+
+    int unset_item(struct intent *intent, struct header *header, const std::string &key);
+
+    bool find_header(const char *key, uint32_t size, struct header *found);
+
+    inline void begin_update(uint32_t bucket);
+
+    inline void end_update(uint32_t bucket);
+
+    inline void wake(uint32_t bucket);
+
+    bool wait_key(const std::string &key, int timeout_ms, bool for_change);
+
+    int64_t decompress(struct header *header, char *buffer, size_t size);
+
+    inline void *find_memory_block(struct intent *intent, size_t size, uint32_t offset = 0);
+
+    uint32_t home_arena();
+
+    void lock_arenas();
+
+    void unlock_arenas();
+
+    void lock_buckets();
+
+    void unlock_buckets();
+
+    //visited - счетчик просмотренных кусков карты
+    uint32_t scan_blocks(uint32_t from, uint32_t to, uint32_t size, uint32_t *visited = nullptr);
+
+    uint32_t scan_chunk(uint32_t chunk, uint32_t from, uint32_t to, uint32_t size);
+
+    void reserve_memory_block(void *addr, uint32_t size);
+
+    //gen >= 0 - блок отдается, только если очередь с тех пор не сбрасывали
+    void free_memory_block(void *addr, uint32_t size, int64_t gen = -1);
+
+    void retire_memory_block(void *addr, uint32_t size, uint32_t gen);
+
+    //отдает блоки, снятые intent_end(); вызывается после блокировки корзины
+    void retire_pending();
+
+    void reclaim(bool all);
+
+    uint64_t oldest_reader_epoch();
+
+    uint32_t enter_reader();
+
+    void leave_reader(uint32_t slot);
+
+    void reap_readers();
+
+    void wait_readers();
+
+    void release_readers();
+
+    void rebuild_summary();
+
+    void rebuild_chunk(uint32_t chunk);
+
+    uint64_t release_chunks(uint32_t arena);
+
+    void mark_references(std::vector<uint8_t> &refs, uint32_t threads, struct verify_report *report);
+
+    inline struct intent *get_intent(uint32_t bucket);
+
+    void intent_begin(struct intent *intent, uint32_t bucket);
+
+    inline void intent_alloc(struct intent *intent, uint32_t index, uint32_t size);
+
+    void intent_write(struct intent *intent, void *addr, uint64_t value);
+
+    void intent_write_header(struct intent *intent, struct header *target, const struct header &image);
+
+    void intent_retire(struct intent *intent, void *addr, uint32_t size);
 
-    static inline void reserve_memory_block(void *addr, uint32_t size);
+    void intent_commit(struct intent *intent);
 
-    static inline void free_memory_block(void *addr, uint32_t size);
+    void intent_apply(struct intent *intent);
+
+    void intent_release(struct intent *intent);
+
+    void intent_rollback(struct intent *intent);
+
+    void intent_end(struct intent *intent);
+
+    void maintenance_begin(uint32_t kind);
+
+    void maintenance_end();
+
+    bool maintenance_pending();
+
+    void move_block(uint32_t from, uint32_t to, uint32_t blocks, bool data);
+
+    void finish_move();
+
+    void reset();
+
+    void recover(pthread_mutex_t *mutex_ptr);
+
+    void recover_intent(uint32_t stripe);
+
+    void recover_arena(uint32_t arena);
+
+    void recover_bucket(uint32_t bucket);
+
+    void recover_maintenance();
+
+    void recover_maintenance_locked();
+
+    inline char *value_ptr(const struct header *header);
+
+    inline uint32_t data_blocks(const struct header *header);
+
+    static std::string spill_path(const std::string &name, uint32_t generation);
+
+    bool open_spill();
+
+    uint64_t spill_append(const char *data, uint32_t size, uint32_t *flags);
+
+    void spill_forget(const struct header *header);
+
+    uint64_t spill_cold(uint64_t need);
+
+    bool spill_entry(uint32_t bucket, struct header *header);
+
+    bool promote_entry(uint32_t bucket, struct header *header);
+
+    bool move_entry(uint32_t bucket, struct header *header);
+
+    void release_spill(uint32_t generation);
+
+    void spill_reset();
+
+    SMHashTable(SMHashTable *space, const struct table_entry &entry);
+
+    struct table_entry *find_table(const std::string &table);
+
+    void clear_buckets();
+
+    inline void hot_sample(uint32_t op, const char *key, uint32_t size);
+
+    void copy_bucket(uint32_t bucket, std::vector<std::pair<std::string, std::string>> &items);
+
+    void snapshot_preserve(uint32_t bucket);
+
+    bool snapshot_bucket(uint32_t bucket, uint32_t slot, uint64_t sequence,
+                         std::vector<std::pair<std::string, std::string>> &items);
+
+    bool undo_reserve(uint64_t size, uint64_t *position);
+
+    void undo_reclaim();
+
+    uint64_t snapshot_oldest();
+
+    void snapshot_break();
+
+    void hot_record(uint32_t op, const char *key, uint32_t size);
+
+    static std::string index_key(const char *key, uint32_t size, uint64_t base);
+
+    inline struct index_node *index_at(uint32_t node);
+
+    static inline struct index_slot *index_slots(struct index_node *node);
+
+    static inline uint64_t index_head(const char *key, uint32_t size);
+
+    inline int index_compare(struct index_node *node, uint32_t slot, const std::string &key, uint64_t head);
+
+    uint32_t index_search(struct index_node *node, const std::string &key, bool upper);
+
+    bool index_read(const std::string &from, std::vector<std::string> *keys, std::string *fence);
+
+    bool index_add(const std::string &key, bool *added);
+
+    void index_remove(const std::string &key);
+
+    bool index_insert(const std::string &key, bool *added);
+
+    void index_erase(const std::string &key);
+
+    void index_write(uint32_t node, bool leaf, uint32_t first, const std::vector<std::pair<std::string, uint32_t>> &entries);
+
+    static inline void index_begin(struct index_node *node);
+
+    static inline void index_end(struct index_node *node);
+
+    uint32_t index_alloc();
+
+    void index_free(uint32_t node);
+
+    bool index_fits(const std::vector<bulk_item> &items);
+
+    void index_reset();
+
+    void index_rebuild();
 
 private:
 
@@ -88,27 +965,66 @@ private:
     char eol{};
 
     size_t _key_count;
+    //корзины этой таблицы и всего сегмента; обходы карты и вытеснение идут по всем
+    size_t _bucket_base{};
+    size_t _bucket_total{};
     size_t _data_count;
     size_t _data_block_size;
-    uint32_t _memory_size;
+    uint64_t _memory_size;
+    uint32_t _features{};
+    uint32_t _arena_count{};
+    uint32_t _arena_blocks{};
+    uint32_t _chunk_count{};
 
     size_t _service_size;
     size_t _header_size;
     size_t _header_len;
     size_t _data_len;
 
-    std::string _name;
-
+    struct superblock *_superblock_ptr;
     struct service *_service_ptr;
+    uint32_t *_versions_ptr;
     void *_header_ptr;
+    uint64_t *_filter_ptr;
+    uint8_t *_access_ptr{};
     void *_memory_map_ptr;
+    struct chunk *_chunks_ptr;
+    void *_dict_ptr;
     void *_data_ptr;
+    struct catalog *_catalog_ptr{};
+    struct bucket_version *_snapshot_ptr{};
+    char *_undo_ptr{};
+    uint64_t _undo_capacity{};
+    char *_index_ptr{};
+    uint32_t _index_nodes{};
+    //сегмент, чье отображение использует именованная таблица
+    SMHashTable *_space{};
+
+    std::shared_ptr<SMCompressor> _compressor;
+    uint32_t _compressor_dict_size{};
+    std::mutex _compressor_mutex;
+
+    //блоки этого экземпляра, не поместившиеся в очередь; под limbo_mutex, действительны при _overflow_gen
+    std::vector<struct retired> _overflow;
+    uint32_t _overflow_gen{};
+    inline static thread_local std::vector<struct retiring> _retiring;
+
+    int _spill_fd[2]{-1, -1};
+    char *_spill_ptr[2]{};
+    uint64_t _spill_capacity{};
+    std::thread _compactor;
+    std::mutex _compactor_mutex;
+    std::condition_variable _compactor_cv;
+    bool _compactor_stop{};
+    std::thread _rehasher;
+    std::mutex _rehasher_mutex;
+    std::atomic<bool> _rehasher_running{};
+    std::atomic<bool> _rehash_stop{};
 
-    int _mem_descriptor;
 
     meminfo meminfo{};
 
-    struct header *findParent(struct header *child);
+    bool read_superblock(struct superblock *sb);
 
     int lock(pthread_mutex_t *mutex_ptr);
 
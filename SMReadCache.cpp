@@ -0,0 +1,92 @@
+#include "SMReadCache.h"
+
+
+SMReadCache::SMReadCache(SMHashTable *table, uint32_t slots) : _table(table) {
+    //не меньше одной пары ячеек
+    uint32_t count = 2;
+    while (count < slots) {
+        count <<= 1;
+    }
+    _slots.resize(count);
+    _mask = count - 1;
+}
+
+const std::string *SMReadCache::get(const std::string &key) {
+    uint32_t hash = meiyan(key.c_str(), key.size());
+    //ключ может лежать в одной из двух соседних ячеек
+    struct slot *set = &_slots[hash & _mask & ~1U];
+    struct slot *slot = set;
+    if (!slot->used || slot->hash != hash || slot->key != key) {
+        slot = set + 1;
+        if (!slot->used || slot->hash != hash || slot->key != key) {
+            _stats.misses++;
+            return fill(key, hash, set);
+        }
+    }
+    if (_table->stampValid(slot->stamp)) {
+        _stats.hits++;
+        slot->referenced = true;
+        return slot->found ? &slot->value : nullptr;
+    }
+    _stats.stale++;
+    return fill(key, hash, slot);
+}
+
+const char *SMReadCache::get_value(const std::string &key) {
+    auto value = get(key);
+    return value ? value->c_str() : "";
+}
+
+const std::string *SMReadCache::fill(const std::string &key, uint32_t hash, struct slot *slot) {
+    //отметку берем до чтения: запись между ними сдвинет версию, и копия не сохранится
+    SMHashTable::stamp stamp{};
+    bool stable = _table->stampOf(key, &stamp);
+    //get копирует значение целиком; если буфер мал, он ничего не пишет и отдает длину
+    _uncached.resize(_uncached.capacity());
+    int64_t length;
+    while ((length = _table->get(key, &_uncached[0], _uncached.size() + 1)) > (int64_t) _uncached.size()) {
+        _uncached.resize(length);
+    }
+    bool found = length >= 0;
+    _uncached.resize(found ? length : 0);
+    if (!stable || !_table->stampValid(stamp)) {
+        //прочитанное верно на момент чтения, но хранить его нельзя
+        if (slot->used && slot->hash == hash && slot->key == key) {
+            slot->used = false;
+        }
+        return found ? &_uncached : nullptr;
+    }
+    if (slot->used && (slot->hash != hash || slot->key != key)) {
+        //новый ключ занимает свободную ячейку пары или ту, к которой не обращались с прошлого раза;
+        //если обе в ходу, оставляем их: холодные ключи не вытесняют горячие
+        struct slot *other = slot + 1;
+        if (!other->used || !other->referenced) {
+            slot = other;
+        } else if (slot->referenced) {
+            slot->referenced = false;
+            other->referenced = false;
+            return found ? &_uncached : nullptr;
+        }
+    }
+    slot->used = true;
+    slot->referenced = false;
+    slot->hash = hash;
+    slot->found = found;
+    slot->stamp = stamp;
+    slot->key = key;
+    slot->value.swap(_uncached);
+    return found ? &slot->value : nullptr;
+}
+
+void SMReadCache::clear() {
+    for (auto &slot : _slots) {
+        slot.used = false;
+        slot.key.clear();
+        slot.value.clear();
+    }
+    _uncached.clear();
+}
+
+struct SMReadCache::stats SMReadCache::getStats() const {
+    return _stats;
+}
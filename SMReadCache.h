@@ -0,0 +1,68 @@
+#ifndef SMC_SMREADCACHE_H
+#define SMC_SMREADCACHE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "SMHashTable.h"
+
+#define SMRC_SLOTS 4096
+
+
+// Копии значений горячих ключей в памяти процесса перед SMHashTable. Попадание - сравнение ключа в своей
+// ячейке и сверка отметки корзины (SMHashTable::stamp): одно чтение строки версий из сегмента вместо
+// обхода цепочки и копирования. Любая запись в корзину ключа, clear() и перехеширование сбрасывают копию,
+// тогда значение читается из сегмента заново. Отсутствие ключа тоже запоминается.
+// Ключ живет в одной из двух ячеек по своему хешу; новый ключ вытесняет тот, к которому дольше не обращались.
+// Кеш не потокобезопасен: экземпляр на поток, таблица должна его пережить
+class SMReadCache {
+public:
+    struct stats {
+        uint64_t hits;
+        uint64_t misses;  // ключа не было в кеше
+        uint64_t stale;   // был, но корзину с тех пор меняли
+    };
+
+    // slots округляется вверх до степени двойки, не меньше 2
+    explicit SMReadCache(SMHashTable *table, uint32_t slots = SMRC_SLOTS);
+
+    SMReadCache(const SMReadCache &) = delete;
+
+    SMReadCache &operator=(const SMReadCache &) = delete;
+
+    // nullptr - ключа нет. Строка живет до следующего вызова get/clear этого кеша
+    const std::string *get(const std::string &key);
+
+    // Как SMHashTable::get_value: пустая строка, если ключа нет
+    const char *get_value(const std::string &key);
+
+    void clear();
+
+    struct stats getStats() const;
+
+protected:
+    struct slot {
+        uint32_t hash;
+        bool used;
+        bool referenced;
+        bool found;
+        SMHashTable::stamp stamp;
+        std::string key;
+        std::string value;
+    };
+
+    // Читает ключ из сегмента и, если корзину за это время не меняли, запоминает: в slot, если ключ
+    // уже там, иначе в пару, которая начинается с slot
+    const std::string *fill(const std::string &key, uint32_t hash, struct slot *slot);
+
+    SMHashTable *_table;
+    std::vector<slot> _slots;
+    uint32_t _mask;
+    //буфер чтения; если корзину меняли во время чтения, значение так в нем и отдается
+    std::string _uncached;
+    struct stats _stats{};
+};
+
+
+#endif //SMC_SMREADCACHE_H
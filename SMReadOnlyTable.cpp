@@ -0,0 +1,321 @@
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <unordered_map>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "SMReadOnlyTable.h"
+
+static std::string shm_path(const std::string &name) {
+    //posix shm в linux - файлы в /dev/shm, подмена версии делается обычным rename
+    return "/dev/shm/" + (name[0] == '/' ? name.substr(1) : name);
+}
+
+static inline uint64_t fmix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t align4(uint64_t offset) {
+    return (offset + 3) & ~3ULL;
+}
+
+bool SMReadOnlyTable::build_items(const std::string &name,
+                                  std::vector<std::pair<std::string_view, std::string_view>> &items) {
+    //повторы ключей: остается последний
+    std::unordered_map<std::string_view, uint32_t> unique;
+    unique.reserve(items.size());
+    for (uint32_t i = 0; i < items.size(); i++) {
+        unique[items[i].first] = i;
+    }
+    std::vector<uint32_t> kept;
+    kept.reserve(unique.size());
+    for (uint32_t i = 0; i < items.size(); i++) {
+        if (unique[items[i].first] == i) {
+            kept.push_back(i);
+        }
+    }
+
+    uint64_t key_count = kept.size();
+    uint64_t bucket_count = std::max<uint64_t>(1, (key_count + SMRO_BUCKET_SIZE - 1) / SMRO_BUCKET_SIZE);
+    std::vector<struct hashes> keys(key_count);
+    std::vector<uint64_t> displacement;
+    std::vector<uint32_t> slots;
+    uint64_t seed = 0;
+    bool placed = false;
+    //с неудачным seed совпадают тройки хешей или не раскладывается большая корзина - берем следующий
+    for (; seed < SMRO_MAX_SEEDS && !placed; seed++) {
+        for (uint64_t i = 0; i < key_count; i++) {
+            auto &key = items[kept[i]].first;
+            keys[i] = split(hash(key.data(), key.size(), seed), key_count, bucket_count);
+        }
+        placed = place(keys, bucket_count, displacement, slots);
+    }
+    if (!placed) {
+        std::cerr << name << ": perfect hash not found" << std::endl;
+        return false;
+    }
+    seed--;
+
+    struct superblock sb{};
+    sb.magic = SMRO_MAGIC;
+    sb.version = SMRO_LAYOUT_VERSION;
+    sb.seed = seed;
+    sb.key_count = key_count;
+    sb.bucket_count = bucket_count;
+    sb.displacement_offset = sizeof(struct superblock);
+    sb.index_offset = sb.displacement_offset + sizeof(uint64_t) * bucket_count;
+    sb.data_offset = sb.index_offset + sizeof(struct entry) * key_count;
+    uint64_t data_size = 0;
+    for (uint32_t i : kept) {
+        data_size += align4(sizeof(struct record) + items[i].first.size() + 1 + items[i].second.size() + 1);
+    }
+    sb.memory_size = sb.data_offset + data_size;
+    if (data_size >= (1ULL << SMRO_OFFSET_BITS)) {
+        std::cerr << name << ": data is too large" << std::endl;
+        return false;
+    }
+
+    //собираем во временном сегменте, читатели его не видят до rename
+    std::string temp = name + ".build." + std::to_string(getpid());
+    SMReadOnlyTable builder(temp, CREATE);
+    void *ptr = builder._mem_descriptor != -1 ? builder.map(sb.memory_size) : nullptr;
+    if (ptr == nullptr) {
+        destroy(temp);
+        return false;
+    }
+
+    std::memcpy(ptr, &sb, sizeof(struct superblock));
+    std::memcpy((char *) ptr + sb.displacement_offset, displacement.data(), sizeof(uint64_t) * bucket_count);
+    auto *index = (struct entry *) ((char *) ptr + sb.index_offset);
+    char *data = (char *) ptr + sb.data_offset;
+    uint64_t offset = 0;
+    //записи кладем в порядке слотов, соседние слоты лежат рядом и в данных
+    for (uint64_t s = 0; s < key_count; s++) {
+        auto &item = items[kept[slots[s]]];
+        struct record record{(uint32_t) item.first.size(), (uint32_t) item.second.size()};
+        char *dst = data + offset;
+        std::memcpy(dst, &record, sizeof(struct record));
+        dst += sizeof(struct record);
+        std::memcpy(dst, item.first.data(), item.first.size());
+        dst[item.first.size()] = 0;
+        dst += item.first.size() + 1;
+        std::memcpy(dst, item.second.data(), item.second.size());
+        dst[item.second.size()] = 0;
+
+        index[s].tag = keys[slots[s]].tag;
+        index[s].offset = offset;
+        offset += align4(sizeof(struct record) + item.first.size() + 1 + item.second.size() + 1);
+    }
+    builder.publish((struct superblock *) ptr);
+
+    //подмена атомарная: открытые отображения старой версии остаются рабочими
+    if (rename(shm_path(temp).c_str(), shm_path(name).c_str()) != 0) {
+        perror("rename");
+        destroy(temp);
+        return false;
+    }
+    return true;
+}
+
+bool SMReadOnlyTable::place(const std::vector<struct hashes> &keys, uint64_t bucket_count,
+                            std::vector<uint64_t> &displacement, std::vector<uint32_t> &slots) {
+    uint64_t key_count = keys.size();
+    //ключи по корзинам сортировкой подсчетом
+    std::vector<uint32_t> start(bucket_count + 1);
+    for (auto &key : keys) {
+        start[key.bucket + 1]++;
+    }
+    uint32_t largest = 0;
+    for (uint64_t b = 0; b < bucket_count; b++) {
+        largest = std::max(largest, start[b + 1]);
+        start[b + 1] += start[b];
+    }
+    std::vector<uint32_t> members(key_count);
+    std::vector<uint32_t> position(start.begin(), start.end() - 1);
+    for (uint32_t i = 0; i < key_count; i++) {
+        members[position[keys[i].bucket]++] = i;
+    }
+    //большие корзины раскладываем первыми, пока таблица пустая
+    std::vector<std::vector<uint32_t>> by_size(largest + 1);
+    for (uint32_t b = 0; b < bucket_count; b++) {
+        by_size[start[b + 1] - start[b]].push_back(b);
+    }
+
+    displacement.assign(bucket_count, 0);
+    slots.assign(key_count, UINT32_MAX);
+    std::mt19937_64 random(key_count);
+    std::vector<uint64_t> taken;
+    uint64_t free_slot = 0;
+    for (uint32_t size = largest; size > 0; size--) {
+        for (uint32_t b : by_size[size]) {
+            if (size == 1) {
+                //одиночный ключ: d0 = 0, сдвигом d1 попадаем в первый свободный слот
+                while (slots[free_slot] != UINT32_MAX) {
+                    free_slot++;
+                }
+                uint32_t key = members[start[b]];
+                displacement[b] = (free_slot + key_count - keys[key].f1) % key_count;
+                slots[free_slot] = key;
+                continue;
+            }
+            bool placed = false;
+            for (uint32_t trial = 0; trial < SMRO_MAX_TRIALS && !placed; trial++) {
+                uint64_t d = trial == 0 ? 0 : ((random() % key_count) << 32) | (random() % key_count);
+                taken.clear();
+                placed = true;
+                for (uint32_t i = start[b]; i < start[b + 1] && placed; i++) {
+                    uint64_t s = slot(keys[members[i]], d, key_count);
+                    placed = slots[s] == UINT32_MAX && std::find(taken.begin(), taken.end(), s) == taken.end();
+                    taken.push_back(s);
+                }
+                if (placed) {
+                    displacement[b] = d;
+                    for (uint32_t i = start[b]; i < start[b + 1]; i++) {
+                        slots[slot(keys[members[i]], d, key_count)] = members[i];
+                    }
+                }
+            }
+            if (!placed) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+inline uint64_t SMReadOnlyTable::hash(const char *key, size_t size, uint64_t seed) {
+    uint64_t h = fmix64(seed + 0x9e3779b97f4a7c15ULL) ^ (size * 0xc2b2ae3d27d4eb4fULL);
+    while (size >= 8) {
+        uint64_t word;
+        std::memcpy(&word, key, sizeof(word));
+        h = (h ^ fmix64(word)) * 0x9e3779b97f4a7c15ULL;
+        h = (h << 27) | (h >> 37);
+        key += 8;
+        size -= 8;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, key, size);
+    return fmix64(h ^ fmix64(tail ^ 0x165667b19e3779f9ULL));
+}
+
+inline struct SMReadOnlyTable::hashes SMReadOnlyTable::split(uint64_t hash, uint64_t key_count, uint64_t bucket_count) {
+    struct hashes h{};
+    h.bucket = (uint32_t) (((hash >> 32) * bucket_count) >> 32);
+    h.tag = (uint32_t) hash & ((1U << (64 - SMRO_OFFSET_BITS)) - 1);
+    uint64_t second = fmix64(hash ^ 0x27d4eb2f165667c5ULL);
+    //умножение со сдвигом вместо деления, остается одно деление в slot()
+    h.f1 = ((second & 0xffffffffULL) * key_count) >> 32;
+    h.f2 = ((second >> 32) * key_count) >> 32;
+    return h;
+}
+
+inline uint64_t SMReadOnlyTable::slot(const struct hashes &h, uint64_t displacement, uint64_t key_count) {
+    //d0 и d1 меньше числа ключей, сумма не переполняется при key_count < 2^32
+    return (h.f1 + (displacement >> 32) * h.f2 + (displacement & 0xffffffffULL)) % key_count;
+}
+
+SMReadOnlyTable::SMReadOnlyTable(std::string name) : SMSegment(std::move(name), READ_ONLY) {
+    if (_mem_descriptor != -1 && !attach()) {
+        detach();
+    }
+}
+
+SMReadOnlyTable::SMReadOnlyTable(std::string name, open_mode mode) : SMSegment(std::move(name), mode) {
+}
+
+bool SMReadOnlyTable::reload() {
+    //сравниваем inode: после rename под тем же именем лежит другой объект
+    struct stat st{};
+    if (stat(shm_path(_name).c_str(), &st) != 0 || (isOpen() && st.st_ino == _inode)) {
+        return false;
+    }
+    //старую версию отпускаем только когда новая уже отображена
+    void *old_ptr = _segment_ptr;
+    size_t old_size = _segment_size;
+    if (!reopen()) {
+        return false;
+    }
+    if (!attach()) {
+        _segment_ptr = old_ptr;
+        _segment_size = old_size;
+        return false;
+    }
+    if (old_ptr) {
+        munmap(old_ptr, old_size);
+    }
+    return true;
+}
+
+bool SMReadOnlyTable::attach() {
+    struct superblock sb{};
+    struct stat st{};
+    if (!wait_ready(&sb, sizeof(sb)) || fstat(_mem_descriptor, &st) != 0) {
+        return false;
+    }
+    if (sb.magic != SMRO_MAGIC || sb.version != SMRO_LAYOUT_VERSION) {
+        std::cerr << _name << ": bad magic or layout version" << std::endl;
+        return false;
+    }
+    void *ptr = map(sb.memory_size);
+    if (ptr == nullptr) {
+        return false;
+    }
+    _inode = st.st_ino;
+    _superblock_ptr = (const struct superblock *) ptr;
+    _displacement_ptr = (const uint64_t *) ((char *) ptr + sb.displacement_offset);
+    _index_ptr = (const struct entry *) ((char *) ptr + sb.index_offset);
+    _data_ptr = (const char *) ptr + sb.data_offset;
+    return true;
+}
+
+const struct SMReadOnlyTable::record *SMReadOnlyTable::find(const char *key, size_t size) const {
+    if (_superblock_ptr == nullptr || _superblock_ptr->key_count == 0) {
+        return nullptr;
+    }
+    uint64_t key_count = _superblock_ptr->key_count;
+    struct hashes h = split(hash(key, size, _superblock_ptr->seed), key_count, _superblock_ptr->bucket_count);
+    const struct entry *entry = &_index_ptr[slot(h, _displacement_ptr[h.bucket], key_count)];
+    //чужой ключ в слоте обычно отсекается по тегу, не читая данные
+    if (entry->tag != h.tag) {
+        return nullptr;
+    }
+    auto *record = (const struct record *) (_data_ptr + entry->offset);
+    if (record->key_size != size || std::memcmp((const char *) (record + 1), key, size) != 0) {
+        return nullptr;
+    }
+    return record;
+}
+
+const char *SMReadOnlyTable::get_value(const std::string &key) const {
+    const struct record *record = find(key.c_str(), key.size());
+    if (record == nullptr) {
+        return &eol;
+    }
+    return (const char *) (record + 1) + record->key_size + 1;
+}
+
+int64_t SMReadOnlyTable::get(const std::string &key, char *buffer, size_t size) const {
+    const struct record *record = find(key.c_str(), key.size());
+    if (record == nullptr) {
+        return -1;
+    }
+    //как snprintf: если буфер мал, ничего не пишем и возвращаем нужную длину
+    if (size < record->val_size + 1) {
+        return record->val_size;
+    }
+    std::memcpy(buffer, (const char *) (record + 1) + record->key_size + 1, record->val_size + 1);
+    return record->val_size;
+}
+
+uint64_t SMReadOnlyTable::size() const {
+    return _superblock_ptr ? _superblock_ptr->key_count : 0;
+}
@@ -0,0 +1,111 @@
+#ifndef SMC_SMREADONLYTABLE_H
+#define SMC_SMREADONLYTABLE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+
+#include "SMSegment.h"
+
+#define SMRO_MAGIC 0x4c4241544f524d53ULL // "SMROTABL"
+#define SMRO_LAYOUT_VERSION 2
+#define SMRO_BUCKET_SIZE 2
+#define SMRO_MAX_TRIALS (1U << 20)
+#define SMRO_MAX_SEEDS 16
+#define SMRO_OFFSET_BITS 40
+
+
+// Неизменяемая таблица для справочных данных: собирается целиком, потом только читается.
+// Минимальный совершенный хеш (CHD): один хеш, одно смещение из маленькой таблицы, одна запись индекса
+// и одно сравнение ключа. Новая версия собирается во временном сегменте и подменяет старую через rename,
+// читатели переходят на нее в reload(); указатели из get_value живут до следующего reload()
+class SMReadOnlyTable : public SMSegment {
+public:
+    // Элементы - пары строк (first, second), из повторов ключа остается последний
+    template<typename Iterator>
+    static bool build(const std::string &name, Iterator begin, Iterator end) {
+        std::vector<std::pair<std::string_view, std::string_view>> items;
+        for (; begin != end; ++begin) {
+            items.emplace_back(std::string_view(begin->first), std::string_view(begin->second));
+        }
+        return build_items(name, items);
+    }
+
+    explicit SMReadOnlyTable(std::string name);
+
+    SMReadOnlyTable(const SMReadOnlyTable &) = delete;
+
+    SMReadOnlyTable &operator=(const SMReadOnlyTable &) = delete;
+
+    bool reload();
+
+    const char *get_value(const std::string &key) const;
+
+    int64_t get(const std::string &key, char *buffer, size_t size) const;
+
+    uint64_t size() const;
+
+protected:
+    struct superblock : segment_header {
+        uint64_t seed;
+        uint64_t key_count;
+        uint64_t bucket_count;
+        uint64_t memory_size;
+
+        uint64_t displacement_offset;
+        uint64_t index_offset;
+        uint64_t data_offset;
+    };
+
+    //запись индекса: смещение записи в данных и старшие биты хеша ключа для отсева чужих ключей
+    struct entry {
+        uint64_t offset: SMRO_OFFSET_BITS;
+        uint64_t tag: 64 - SMRO_OFFSET_BITS;
+    };
+
+    struct record {
+        uint32_t key_size;
+        uint32_t val_size;
+        //дальше ключ и значение, оба с нулевым байтом
+    };
+
+    struct hashes {
+        uint32_t bucket;
+        uint32_t tag;
+        uint64_t f1;
+        uint64_t f2;
+    };
+
+private:
+    //сегмент сборки новой версии, пишется до публикации
+    SMReadOnlyTable(std::string name, open_mode mode);
+
+    static bool build_items(const std::string &name, std::vector<std::pair<std::string_view, std::string_view>> &items);
+
+    static bool place(const std::vector<struct hashes> &keys, uint64_t bucket_count, std::vector<uint64_t> &displacement,
+                      std::vector<uint32_t> &slots);
+
+    static inline uint64_t hash(const char *key, size_t size, uint64_t seed);
+
+    static inline struct hashes split(uint64_t hash, uint64_t key_count, uint64_t bucket_count);
+
+    static inline uint64_t slot(const struct hashes &h, uint64_t displacement, uint64_t key_count);
+
+    bool attach();
+
+    const struct record *find(const char *key, size_t size) const;
+
+    char eol{};
+
+    ino_t _inode{};
+
+    const struct superblock *_superblock_ptr{};
+    const uint64_t *_displacement_ptr{};
+    const struct entry *_index_ptr{};
+    const char *_data_ptr{};
+};
+
+
+#endif //SMC_SMREADONLYTABLE_H
@@ -0,0 +1,173 @@
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <climits>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "SMSegment.h"
+
+SMSegment::SMSegment(std::string name, open_mode mode) : _name(std::move(name)) {
+    // https://man7.org/linux/man-pages/man3/shm_open.3.html
+    _mem_descriptor = -1;
+    _read_only = mode == READ_ONLY;
+    if (mode == CREATE) {
+        //пересоздаем сегмент, новые страницы ftruncate отдает уже обнуленными
+        shm_unlink(_name.c_str());
+    } else {
+        _mem_descriptor = shm_open(_name.c_str(), _read_only ? O_RDONLY : O_RDWR, ALLPERMS);
+    }
+    if (_mem_descriptor == -1 && mode != ATTACH && mode != READ_ONLY) {
+        _mem_descriptor = shm_open(_name.c_str(), O_RDWR | O_CREAT | O_EXCL, ALLPERMS);
+        if (_mem_descriptor != -1) {
+            _created = true;
+        } else if (errno == EEXIST && mode == OPEN_OR_CREATE) {
+            //сегмент успел создать другой процесс
+            _mem_descriptor = shm_open(_name.c_str(), O_RDWR, ALLPERMS);
+        }
+    }
+    if (_mem_descriptor == -1) {
+        perror("shm_open");
+    }
+}
+
+SMSegment::SMSegment(std::string name, const SMSegment &owner) :
+        _name(std::move(name)), _mem_descriptor(-1), _borrowed(true),
+        _segment_ptr(owner._segment_ptr), _segment_size(owner._segment_size) {
+}
+
+SMSegment::~SMSegment() {
+    if (_segment_ptr && !_borrowed) {
+        munmap(_segment_ptr, _segment_size);
+    }
+    if (_mem_descriptor != -1) {
+        close(_mem_descriptor);
+    }
+}
+
+bool SMSegment::destroy(const std::string &name) {
+    return shm_unlink(name.c_str()) == 0;
+}
+
+bool SMSegment::isOpen() const {
+    return _segment_ptr != nullptr;
+}
+
+bool SMSegment::isCreated() const {
+    return _created;
+}
+
+bool SMSegment::wait_ready(struct segment_header *header, size_t size) {
+    //создатель мог еще не закончить инициализацию, ждем пока заголовок не станет готовым
+    for (int attempt = 0; attempt < SMS_ATTACH_ATTEMPTS; attempt++) {
+        if (pread(_mem_descriptor, header, size, 0) == (ssize_t) size && header->state == SMS_STATE_READY) {
+            return true;
+        }
+        usleep(1000);
+    }
+    std::cerr << _name << ": segment is not initialized" << std::endl;
+    return false;
+}
+
+void *SMSegment::map(size_t size) {
+    if (_created) {
+        ftruncate(_mem_descriptor, (off_t) size);
+    } else {
+        struct stat st{};
+        if (fstat(_mem_descriptor, &st) != 0 || (uint64_t) st.st_size < size) {
+            std::cerr << _name << ": segment is truncated" << std::endl;
+            detach();
+            return nullptr;
+        }
+    }
+    //страницы не трогаем, ядро подгрузит их при первом обращении
+    void *ptr = mmap(nullptr, size, _read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, _mem_descriptor, 0);
+    if (ptr == MAP_FAILED) {
+        perror("mmap");
+        detach();
+        return nullptr;
+    }
+    _segment_ptr = ptr;
+    _segment_size = size;
+    return ptr;
+}
+
+void SMSegment::publish(struct segment_header *header) {
+    //заголовок публикуем последним, до этого момента подключающиеся процессы ждут
+    __atomic_store_n(&header->state, SMS_STATE_READY, __ATOMIC_RELEASE);
+}
+
+void SMSegment::detach() {
+    if (_mem_descriptor != -1) {
+        close(_mem_descriptor);
+        _mem_descriptor = -1;
+    }
+}
+
+bool SMSegment::reopen() {
+    int descriptor = shm_open(_name.c_str(), _read_only ? O_RDONLY : O_RDWR, ALLPERMS);
+    if (descriptor == -1) {
+        perror("shm_open");
+        return false;
+    }
+    detach();
+    _mem_descriptor = descriptor;
+    _segment_ptr = nullptr;
+    _segment_size = 0;
+    return true;
+}
+
+bool SMSegment::bindNode(int node) {
+    if (_segment_ptr == nullptr || node < 0) {
+        return false;
+    }
+    //libnuma не тянем: маска узлов для mbind - битовый массив из unsigned long
+    const size_t bits = sizeof(unsigned long) * CHAR_BIT;
+    std::vector<unsigned long> mask(node / bits + 1);
+    mask[node / bits] = 1UL << (node % bits);
+    if (syscall(SYS_mbind, _segment_ptr, _segment_size, MPOL_PREFERRED, mask.data(), mask.size() * bits + 1,
+                MPOL_MF_MOVE) != 0) {
+        perror("mbind");
+        return false;
+    }
+    return true;
+}
+
+void SMSegment::release_pages(void *addr, size_t len) {
+    //addr должен быть выровнен по странице; после освобождения страницы читаются как нули
+    if (len == 0) {
+        return;
+    }
+    auto offset = (off_t) ((long) addr - (long) _segment_ptr);
+    if (fallocate(_mem_descriptor, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, (off_t) len) == 0) {
+        return;
+    }
+    if (madvise(addr, len, MADV_REMOVE) == 0) {
+        return;
+    }
+    std::memset(addr, 0, len);
+}
+
+void SMSegment::init_mutex(pthread_mutex_t *mutex_ptr, bool robust) {
+    pthread_mutexattr_t attr;
+
+    if (pthread_mutexattr_init(&attr)) {
+        std::cerr << errno << std::endl;
+    }
+    if (pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)) {
+        std::cerr << errno << std::endl;
+    }
+    //владелец умер - следующий lock получит EOWNERDEAD вместо вечного ожидания
+    if (robust && pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)) {
+        std::cerr << errno << std::endl;
+    }
+    if (pthread_mutex_init(mutex_ptr, &attr)) {
+        std::cerr << errno << std::endl;
+    }
+}
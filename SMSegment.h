@@ -0,0 +1,74 @@
+#ifndef SMC_SMSEGMENT_H
+#define SMC_SMSEGMENT_H
+
+#include <string>
+#include <cstdint>
+#include <pthread.h>
+
+#define SMS_STATE_READY 1
+#define SMS_ATTACH_ATTEMPTS 1000
+
+
+class SMSegment {
+public:
+    enum open_mode {
+        OPEN_OR_CREATE,
+        CREATE,
+        ATTACH,
+        //подключение к готовому сегменту без права записи
+        READ_ONLY
+    };
+
+    static bool destroy(const std::string &name);
+
+    bool isOpen() const;
+
+    bool isCreated() const;
+
+    // Память сегмента берется с узла node (MPOL_PREFERRED), уже занятые страницы переносятся туда же.
+    // Действует на все процессы, подключенные к сегменту
+    bool bindNode(int node);
+
+protected:
+    struct segment_header {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t state;
+    };
+
+    SMSegment(std::string name, open_mode mode);
+
+    // Пользуется отображением owner без своего shm_open и mmap; owner должен его пережить
+    SMSegment(std::string name, const SMSegment &owner);
+
+    ~SMSegment();
+
+    bool wait_ready(struct segment_header *header, size_t size);
+
+    void *map(size_t size);
+
+    void publish(struct segment_header *header);
+
+    void detach();
+
+    // Открывает заново объект под тем же именем, например после rename новой версии.
+    // Прежнее отображение забывается, отпускает его вызывающий
+    bool reopen();
+
+    void release_pages(void *addr, size_t len);
+
+    static void init_mutex(pthread_mutex_t *mutex_ptr, bool robust = false);
+
+    std::string _name;
+
+    int _mem_descriptor;
+    bool _created{};
+    bool _borrowed{};
+    bool _read_only{};
+
+    void *_segment_ptr{};
+    size_t _segment_size{};
+};
+
+
+#endif //SMC_SMSEGMENT_H
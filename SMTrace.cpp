@@ -0,0 +1,181 @@
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "SMTrace.h"
+
+//гистограммы одного потока; пишет только он, snapshot читает их под registry_mutex
+struct thread_histograms {
+    SMTrace::histogram ops[SMTR_OPS];
+};
+
+static std::mutex &registry_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+static std::vector<thread_histograms *> &registry() {
+    static std::vector<thread_histograms *> threads;
+    return threads;
+}
+
+//замеры завершившихся потоков
+static thread_histograms &retired() {
+    static thread_histograms histograms;
+    return histograms;
+}
+
+struct thread_registration {
+    thread_histograms histograms;
+
+    thread_registration() {
+        std::lock_guard<std::mutex> guard(registry_mutex());
+        registry().push_back(&histograms);
+    }
+
+    ~thread_registration() {
+        std::lock_guard<std::mutex> guard(registry_mutex());
+        auto &threads = registry();
+        threads.erase(std::find(threads.begin(), threads.end(), &histograms));
+        for (uint32_t op = 0; op < SMTR_OPS; op++) {
+            retired().ops[op].merge(histograms.ops[op]);
+        }
+    }
+};
+
+SMTrace::histogram::histogram() {
+    reset();
+}
+
+void SMTrace::histogram::record(uint64_t value) {
+    //один писатель, но snapshot читает из другого потока - поэтому атомарные загрузки и записи без барьеров
+    uint64_t *slot = &counts[bucket(value)];
+    __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&total, __atomic_load_n(&total, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&sum, __atomic_load_n(&sum, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+    if (value < __atomic_load_n(&min, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&min, value, __ATOMIC_RELAXED);
+    }
+    if (value > __atomic_load_n(&max, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&max, value, __ATOMIC_RELAXED);
+    }
+}
+
+void SMTrace::histogram::merge(const histogram &other) {
+    for (uint32_t i = 0; i < SMTR_BUCKETS; i++) {
+        counts[i] += __atomic_load_n(&other.counts[i], __ATOMIC_RELAXED);
+    }
+    total += __atomic_load_n(&other.total, __ATOMIC_RELAXED);
+    sum += __atomic_load_n(&other.sum, __ATOMIC_RELAXED);
+    min = std::min(min, __atomic_load_n(&other.min, __ATOMIC_RELAXED));
+    max = std::max(max, __atomic_load_n(&other.max, __ATOMIC_RELAXED));
+}
+
+void SMTrace::histogram::reset() {
+    for (auto &count : counts) {
+        __atomic_store_n(&count, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&total, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&sum, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&min, UINT64_MAX, __ATOMIC_RELAXED);
+    __atomic_store_n(&max, 0, __ATOMIC_RELAXED);
+}
+
+uint64_t SMTrace::histogram::count() const {
+    return total;
+}
+
+double SMTrace::histogram::mean() const {
+    return total ? (double) sum / total : 0;
+}
+
+uint64_t SMTrace::histogram::percentile(double p) const {
+    if (total == 0) {
+        return 0;
+    }
+    if (p >= 100) {
+        return max;
+    }
+    auto rank = (uint64_t) std::ceil(p / 100 * total);
+    rank = std::max(rank, (uint64_t) 1);
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < SMTR_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return std::max(lowest(i), min);
+        }
+    }
+    return max;
+}
+
+uint32_t SMTrace::histogram::bucket(uint64_t value) {
+    //до 2 * SMTR_SUB корзина на каждое значение, дальше SMTR_SUB корзин на степень двойки
+    if (value < 2 * SMTR_SUB) {
+        return (uint32_t) value;
+    }
+    uint32_t shift = 63 - __builtin_clzll(value) - SMTR_SUB_BITS;
+    if (shift > SMTR_MAX_SHIFT) {
+        return SMTR_BUCKETS - 1;
+    }
+    return SMTR_SUB * shift + (uint32_t) (value >> shift);
+}
+
+uint64_t SMTrace::histogram::lowest(uint32_t bucket) {
+    if (bucket < 2 * SMTR_SUB) {
+        return bucket;
+    }
+    uint32_t shift = bucket / SMTR_SUB - 1;
+    return (uint64_t) (SMTR_SUB + bucket % SMTR_SUB) << shift;
+}
+
+const char *SMTrace::name(uint32_t op) {
+    static const char *names[SMTR_OPS] = {"set", "get", "unset", "alloc", "defrag", "lock_wait", "alloc_scan"};
+    return op < SMTR_OPS ? names[op] : "";
+}
+
+SMTrace::histogram SMTrace::snapshot(uint32_t op) {
+    histogram result;
+    if (op >= SMTR_OPS) {
+        return result;
+    }
+    std::lock_guard<std::mutex> guard(registry_mutex());
+    result.merge(retired().ops[op]);
+    for (auto *thread : registry()) {
+        result.merge(thread->ops[op]);
+    }
+    return result;
+}
+
+void SMTrace::reset() {
+    //замеры, идущие в этот момент в других потоках, могут пережить сброс
+    std::lock_guard<std::mutex> guard(registry_mutex());
+    for (uint32_t op = 0; op < SMTR_OPS; op++) {
+        retired().ops[op].reset();
+        for (auto *thread : registry()) {
+            thread->ops[op].reset();
+        }
+    }
+}
+
+void SMTrace::setSampling(uint32_t n) {
+    __atomic_store_n(&_sample, std::max(n, 1U), __ATOMIC_RELAXED);
+}
+
+bool SMTrace::enabled() {
+#ifdef SMC_TRACE
+    return true;
+#else
+    return false;
+#endif
+}
+
+void SMTrace::record(uint32_t op, uint64_t value) {
+    //гистограммы потока создаются при первом замере, поэтому на горячем пути только указатель
+    thread_local thread_histograms *histograms = nullptr;
+    if (histograms == nullptr) {
+        thread_local thread_registration registration;
+        histograms = &registration.histograms;
+    }
+    histograms->ops[op].record(value);
+}
@@ -0,0 +1,145 @@
+#ifndef SMC_SMTRACE_H
+#define SMC_SMTRACE_H
+
+#include <cstdint>
+#include <ctime>
+
+// Замеры включаются при сборке с -DSMC_TRACE (cmake -DSMC_TRACE=ON), без него макросы ниже пустые.
+// Точки USDT (провайдер smc) ставятся, если есть <sys/sdt.h>: perf probe sdt_smc:*, bpftrace usdt:...:smc:*
+
+#define SMTR_OP_SET 0
+#define SMTR_OP_GET 1
+#define SMTR_OP_UNSET 2
+#define SMTR_OP_ALLOC 3
+#define SMTR_OP_DEFRAG 4
+#define SMTR_OP_LOCK_WAIT 5
+#define SMTR_OP_ALLOC_SCAN 6
+#define SMTR_OPS 7
+#define SMTR_SUB_BITS 4
+#define SMTR_SUB (1U << SMTR_SUB_BITS)
+#define SMTR_MAX_SHIFT 40
+#define SMTR_BUCKETS (SMTR_SUB * (SMTR_MAX_SHIFT + 2))
+#define SMTR_SAMPLE 64
+
+
+// Гистограммы длительности операций процесса. Потоки пишут каждый в свою, snapshot() складывает их.
+// Замеряется каждая n-я операция потока (setSampling), на процентили выборка не влияет, count() - число
+// замеров. Значения - наносекунды, у SMTR_OP_ALLOC_SCAN - число просмотренных кусков карты памяти
+class SMTrace {
+public:
+    // Логарифмические корзины по SMTR_SUB на каждую степень двойки, как в HdrHistogram: ошибка значения
+    // не больше 1/SMTR_SUB. Простая структура без указателей: ее можно передать из другого процесса и слить
+    struct histogram {
+        uint64_t counts[SMTR_BUCKETS];
+        uint64_t total;
+        uint64_t sum;
+        uint64_t min;
+        uint64_t max;
+
+        histogram();
+
+        void record(uint64_t value);
+
+        void merge(const histogram &other);
+
+        void reset();
+
+        uint64_t count() const;
+
+        double mean() const;
+
+        // Нижняя граница корзины, в которую попал процентиль p из [0, 100]
+        uint64_t percentile(double p) const;
+
+        static uint32_t bucket(uint64_t value);
+
+        static uint64_t lowest(uint32_t bucket);
+    };
+
+    static const char *name(uint32_t op);
+
+    // Сумма гистограмм op всех потоков процесса, в том числе завершившихся
+    static histogram snapshot(uint32_t op);
+
+    static void reset();
+
+    // Замерять каждую n-ю операцию потока, по умолчанию SMTR_SAMPLE; 1 - все
+    static void setSampling(uint32_t n);
+
+    static bool enabled();
+
+    static inline uint64_t now() {
+        struct timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    // Выпадает ли замер операции op этому потоку
+    static inline bool sampled(uint32_t op) {
+        if (++_ticks[op] < __atomic_load_n(&_sample, __ATOMIC_RELAXED)) {
+            return false;
+        }
+        _ticks[op] = 0;
+        return true;
+    }
+
+    static void record(uint32_t op, uint64_t value);
+
+    // Замер от конструктора до деструктора, если операция попала в выборку
+    class scope {
+    public:
+        // every - замерять каждый вызов, для редких операций
+        explicit scope(uint32_t op, bool every = false) : _op(op), _start(every || sampled(op) ? now() : 0) {
+        }
+
+        scope(const scope &) = delete;
+
+        scope &operator=(const scope &) = delete;
+
+        ~scope() {
+            if (_start) {
+                record(_op, now() - _start);
+            }
+        }
+
+    private:
+        uint32_t _op;
+        uint64_t _start;
+    };
+
+private:
+    inline static uint32_t _sample = SMTR_SAMPLE;
+    //счетчики выборки без конструктора: доступ к ним не проходит через обертку инициализации thread_local
+    inline static thread_local uint32_t _ticks[SMTR_OPS]{};
+};
+
+
+#ifdef SMC_TRACE
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SMC_PROBE(name, ...) STAP_PROBEV(smc, name, ##__VA_ARGS__)
+#endif
+#endif
+
+#define SMC_TRACE_CONCAT_(a, b) a##b
+#define SMC_TRACE_CONCAT(a, b) SMC_TRACE_CONCAT_(a, b)
+#define SMC_TRACE_SCOPE(op) SMTrace::scope SMC_TRACE_CONCAT(smc_trace_, __LINE__)(op)
+#define SMC_TRACE_SCOPE_EVERY(op) SMTrace::scope SMC_TRACE_CONCAT(smc_trace_, __LINE__)(op, true)
+#define SMC_TRACE_VALUE(op, value) do { if (SMTrace::sampled(op)) SMTrace::record(op, value); } while (0)
+
+#else
+
+#define SMC_TRACE_SCOPE(op) do { } while (0)
+#define SMC_TRACE_SCOPE_EVERY(op) do { } while (0)
+#define SMC_TRACE_VALUE(op, value) do { } while (0)
+
+#endif
+
+#ifndef SMC_PROBE
+#define SMC_PROBE(name, ...) do { } while (0)
+#endif
+
+
+#endif //SMC_SMTRACE_H
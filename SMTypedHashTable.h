@@ -0,0 +1,426 @@
+#ifndef SMC_SMTYPEDHASHTABLE_H
+#define SMC_SMTYPEDHASHTABLE_H
+
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+#include <algorithm>
+#include <unistd.h>
+
+#include "SMSegment.h"
+
+#define SMTT_MAGIC 0x454c424154544d53ULL // "SMTTABLE"
+#define SMTT_LAYOUT_VERSION 2
+#define SMTT_LOCKS 256
+#define SMTT_ALIGN 64
+//не меньше 1/2^SMTT_FREE_SHIFT слотов остаются пустыми, надгробия считаются занятыми
+#define SMTT_FREE_SHIFT 3
+
+#define SMTT_EMPTY 0
+#define SMTT_BUSY 1
+#define SMTT_FULL 2
+#define SMTT_DELETED 3
+
+
+template<typename K>
+struct SMTypedHash {
+    uint64_t operator()(const K &key) const {
+        uint64_t h;
+        if constexpr (std::is_integral<K>::value || std::is_enum<K>::value) {
+            h = (uint64_t) key;
+        } else {
+            //FNV-1a, размер известен на этапе компиляции и цикл разворачивается
+            h = 0xcbf29ce484222325ULL;
+            auto *bytes = (const unsigned char *) &key;
+            for (size_t i = 0; i < sizeof(K); i++) {
+                h = (h ^ bytes[i]) * 0x100000001b3ULL;
+            }
+        }
+        //fmix64 из murmur3
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+};
+
+template<typename K>
+struct SMTypedEqual {
+    bool operator()(const K &a, const K &b) const {
+        if constexpr (std::is_integral<K>::value || std::is_enum<K>::value) {
+            return a == b;
+        } else {
+            return std::memcmp(&a, &b, sizeof(K)) == 0;
+        }
+    }
+};
+
+
+template<typename K, typename V, typename Hash = SMTypedHash<K>, typename Equal = SMTypedEqual<K>>
+class SMTypedHashTable : public SMSegment {
+    static_assert(std::is_trivially_copyable<K>::value, "key must be trivially copyable");
+    static_assert(std::is_trivially_copyable<V>::value, "value must be trivially copyable");
+
+public:
+    explicit SMTypedHashTable(std::string name, uint64_t slot_count, open_mode mode = OPEN_OR_CREATE) :
+            SMSegment(std::move(name), mode) {
+        if (_mem_descriptor == -1) {
+            return;
+        }
+        struct superblock sb{};
+        if (_created) {
+            //число слотов - степень двойки, индекс считается маской
+            uint64_t capacity = 1;
+            while (capacity < slot_count) {
+                capacity <<= 1;
+            }
+            sb.magic = SMTT_MAGIC;
+            sb.version = SMTT_LAYOUT_VERSION;
+            sb.key_size = sizeof(K);
+            sb.value_size = sizeof(V);
+            sb.slot_size = sizeof(struct slot);
+            sb.capacity = capacity;
+            sb.service_offset = align(sizeof(struct superblock));
+            sb.slots_offset = align(sb.service_offset + sizeof(struct service));
+            sb.memory_size = sb.slots_offset + sb.slot_size * sb.capacity;
+        } else if (!read_superblock(&sb)) {
+            detach();
+            return;
+        }
+
+        void *ptr = map(sb.memory_size);
+        if (ptr == nullptr) {
+            return;
+        }
+        _superblock_ptr = (struct superblock *) ptr;
+        _service_ptr = (struct service *) ((char *) ptr + sb.service_offset);
+        _slots_ptr = (struct slot *) ((char *) ptr + sb.slots_offset);
+        _capacity = sb.capacity;
+        _mask = sb.capacity - 1;
+        _limit = _capacity - std::max<uint64_t>(1, _capacity >> SMTT_FREE_SHIFT);
+
+        if (_created) {
+            for (auto &mutex : _service_ptr->mutex) {
+                init_mutex(&mutex);
+            }
+            std::memcpy(_superblock_ptr, &sb, sizeof(struct superblock));
+            publish(_superblock_ptr);
+        }
+    }
+
+    explicit SMTypedHashTable(std::string name) : SMTypedHashTable(std::move(name), 0, ATTACH) {
+    }
+
+    bool set(const K &key, const V &val) {
+        uint64_t hash = _hash(key);
+        pthread_mutex_t *mutex = &_service_ptr->mutex[hash % SMTT_LOCKS];
+        for (uint32_t attempt = 0;; attempt++) {
+            pthread_mutex_lock(mutex);
+            bool result = set_item(hash, key, val);
+            pthread_mutex_unlock(mutex);
+            //места нет: один раз убираем надгробия и пробуем снова
+            if (result || attempt || !compact()) {
+                return result;
+            }
+        }
+    }
+
+    bool get(const K &key, V &val) const {
+        //читатели без блокировок, целостность слота проверяется по seq, а всей таблицы - по seq сервиса:
+        //очистка и уплотнение двигают ключи между слотами
+        while (true) {
+            uint32_t seq = __atomic_load_n(&_service_ptr->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1) {
+                continue;
+            }
+            V found_val;
+            bool found = get_item(key, found_val);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&_service_ptr->seq, __ATOMIC_RELAXED) == seq) {
+                if (found) {
+                    val = found_val;
+                }
+                return found;
+            }
+        }
+    }
+
+    bool unset(const K &key) {
+        uint64_t hash = _hash(key);
+        pthread_mutex_t *mutex = &_service_ptr->mutex[hash % SMTT_LOCKS];
+        pthread_mutex_lock(mutex);
+        struct slot *slot = find_slot(hash, key);
+        if (slot) {
+            begin_write(slot);
+            __atomic_store_n(&slot->state, SMTT_DELETED, __ATOMIC_RELAXED);
+            end_write(slot);
+            __atomic_fetch_sub(&_service_ptr->count, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(mutex);
+        return slot != nullptr;
+    }
+
+    void clear() {
+        lock_all();
+        //обнуление сбрасывает и seq слотов, поэтому читатели сверяют seq всей таблицы
+        begin_rewrite();
+        //слоты целиком лежат на своих страницах, кроме первой
+        auto page_size = (size_t) sysconf(_SC_PAGESIZE);
+        size_t from = (long) _slots_ptr - (long) _segment_ptr;
+        size_t aligned = std::min((from + page_size - 1) / page_size * page_size, _segment_size);
+        std::memset((char *) _segment_ptr + from, 0, aligned - from);
+        release_pages((char *) _segment_ptr + aligned, _segment_size - aligned);
+        _service_ptr->count = 0;
+        _service_ptr->used = 0;
+        end_rewrite();
+        unlock_all();
+    }
+
+    uint64_t size() const {
+        return __atomic_load_n(&_service_ptr->count, __ATOMIC_RELAXED);
+    }
+
+    uint64_t capacity() const {
+        return _capacity;
+    }
+
+protected:
+    struct superblock : segment_header {
+        uint32_t key_size;
+        uint32_t value_size;
+        uint64_t slot_size;
+        uint64_t capacity;
+        uint64_t memory_size;
+
+        uint64_t service_offset;
+        uint64_t slots_offset;
+    };
+
+    //used - занятые слоты вместе с надгробиями; seq нечетный, пока таблицу очищают или уплотняют
+    struct service {
+        pthread_mutex_t mutex[SMTT_LOCKS];
+        uint64_t count;
+        uint64_t used;
+        uint32_t seq;
+    };
+
+    struct slot {
+        uint32_t seq;
+        uint32_t state;
+        K key;
+        V value;
+    };
+
+private:
+    static uint64_t align(uint64_t offset) {
+        return (offset + SMTT_ALIGN - 1) / SMTT_ALIGN * SMTT_ALIGN;
+    }
+
+    bool read_superblock(struct superblock *sb) {
+        if (!wait_ready(sb, sizeof(struct superblock))) {
+            return false;
+        }
+        if (sb->magic != SMTT_MAGIC || sb->version != SMTT_LAYOUT_VERSION) {
+            std::cerr << _name << ": bad magic or layout version" << std::endl;
+            return false;
+        }
+        if (sb->key_size != sizeof(K) || sb->value_size != sizeof(V) || sb->slot_size != sizeof(struct slot)) {
+            std::cerr << _name << ": key or value type mismatch" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool get_item(const K &key, V &val) const {
+        uint64_t hash = _hash(key);
+        for (uint64_t i = 0; i < _capacity; i++) {
+            struct slot *slot = &_slots_ptr[(hash + i) & _mask];
+            while (true) {
+                uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+                if (seq & 1) {
+                    continue;
+                }
+                uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+                K slot_key;
+                V slot_val;
+                std::memcpy(&slot_key, &slot->key, sizeof(K));
+                std::memcpy(&slot_val, &slot->value, sizeof(V));
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+                    continue;
+                }
+                if (state == SMTT_EMPTY) {
+                    return false;
+                }
+                if (state == SMTT_FULL && _equal(slot_key, key)) {
+                    val = slot_val;
+                    return true;
+                }
+                break;
+            }
+        }
+        return false;
+    }
+
+    void lock_all() {
+        for (auto &mutex : _service_ptr->mutex) {
+            pthread_mutex_lock(&mutex);
+        }
+    }
+
+    void unlock_all() {
+        for (auto &mutex : _service_ptr->mutex) {
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+
+    void begin_rewrite() {
+        __atomic_store_n(&_service_ptr->seq, _service_ptr->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    void end_rewrite() {
+        __atomic_store_n(&_service_ptr->seq, _service_ptr->seq + 1, __ATOMIC_RELEASE);
+    }
+
+    bool compact() {
+        //под всеми блокировками: надгробия становятся пустыми слотами, ключи сдвигаются к своему месту
+        lock_all();
+        bool result = _service_ptr->used > _service_ptr->count;
+        //обход начинаем с изначально пустого слота, он есть всегда - _limit меньше числа слотов
+        uint64_t start = 0;
+        while (result && start < _capacity && _slots_ptr[start].state != SMTT_EMPTY) {
+            start++;
+        }
+        if (result && start < _capacity) {
+            begin_rewrite();
+            for (uint64_t i = 0; i < _capacity; i++) {
+                struct slot *slot = &_slots_ptr[i];
+                if (slot->state == SMTT_DELETED) {
+                    begin_write(slot);
+                    __atomic_store_n(&slot->state, SMTT_EMPTY, __ATOMIC_RELAXED);
+                    end_write(slot);
+                }
+            }
+            //ключ встает в первый пустой слот от своего места; он не дальше текущего, сначала пишем копию
+            for (uint64_t i = 1; i < _capacity; i++) {
+                struct slot *slot = &_slots_ptr[(start + i) & _mask];
+                if (slot->state != SMTT_FULL) {
+                    continue;
+                }
+                uint64_t hash = _hash(slot->key);
+                struct slot *target = &_slots_ptr[hash & _mask];
+                for (uint64_t j = 1; target != slot && target->state != SMTT_EMPTY; j++) {
+                    target = &_slots_ptr[(hash + j) & _mask];
+                }
+                if (target != slot) {
+                    begin_write(target);
+                    target->key = slot->key;
+                    target->value = slot->value;
+                    __atomic_store_n(&target->state, SMTT_FULL, __ATOMIC_RELAXED);
+                    end_write(target);
+                    begin_write(slot);
+                    __atomic_store_n(&slot->state, SMTT_EMPTY, __ATOMIC_RELAXED);
+                    end_write(slot);
+                }
+            }
+            _service_ptr->used = _service_ptr->count;
+            end_rewrite();
+        }
+        unlock_all();
+        return result;
+    }
+
+    static void begin_write(struct slot *slot) {
+        __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    static void end_write(struct slot *slot) {
+        __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+    }
+
+    struct slot *find_slot(uint64_t hash, const K &key) {
+        //вызывается под блокировкой полосы ключа, этот ключ никто больше не меняет
+        for (uint64_t i = 0; i < _capacity; i++) {
+            struct slot *slot = &_slots_ptr[(hash + i) & _mask];
+            uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+            if (state == SMTT_EMPTY) {
+                return nullptr;
+            }
+            if (state == SMTT_FULL && _equal(slot->key, key)) {
+                return slot;
+            }
+        }
+        return nullptr;
+    }
+
+    bool set_item(uint64_t hash, const K &key, const V &val) {
+        struct slot *slot = find_slot(hash, key);
+        if (slot) {
+            begin_write(slot);
+            slot->value = val;
+            end_write(slot);
+            return true;
+        }
+        while (true) {
+            //первый пустой или удаленный слот; его могут занять писатели других полос, тогда ищем снова
+            struct slot *free_slot = nullptr;
+            uint32_t state = SMTT_EMPTY;
+            for (uint64_t i = 0; i < _capacity && free_slot == nullptr; i++) {
+                slot = &_slots_ptr[(hash + i) & _mask];
+                state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+                if (state == SMTT_EMPTY || state == SMTT_DELETED) {
+                    free_slot = slot;
+                }
+            }
+            if (free_slot == nullptr) {
+                return false;
+            }
+            //пустой слот занимаем, только пока таблица ниже предела заполнения
+            if (state == SMTT_EMPTY && !reserve_slot()) {
+                return false;
+            }
+            if (!__atomic_compare_exchange_n(&free_slot->state, &state, SMTT_BUSY, false,
+                                             __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                if (state == SMTT_EMPTY) {
+                    __atomic_fetch_sub(&_service_ptr->used, 1, __ATOMIC_RELAXED);
+                }
+                continue;
+            }
+            begin_write(free_slot);
+            free_slot->key = key;
+            free_slot->value = val;
+            __atomic_store_n(&free_slot->state, SMTT_FULL, __ATOMIC_RELAXED);
+            end_write(free_slot);
+            __atomic_fetch_add(&_service_ptr->count, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+
+    bool reserve_slot() {
+        uint64_t used = __atomic_load_n(&_service_ptr->used, __ATOMIC_RELAXED);
+        do {
+            if (used >= _limit) {
+                return false;
+            }
+        } while (!__atomic_compare_exchange_n(&_service_ptr->used, &used, used + 1, false,
+                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        return true;
+    }
+
+    struct superblock *_superblock_ptr{};
+    struct service *_service_ptr{};
+    struct slot *_slots_ptr{};
+    uint64_t _capacity{};
+    uint64_t _mask{};
+    uint64_t _limit{};
+
+    Hash _hash;
+    Equal _equal;
+};
+
+
+#endif //SMC_SMTYPEDHASHTABLE_H
@@ -0,0 +1,428 @@
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+#include <algorithm>
+
+#include "ShardedSMHashTable.h"
+
+ShardedSMHashTable::ShardedSMHashTable(std::string name, uint32_t shard_count, uint64_t key_count,
+                                       uint64_t data_count, uint32_t data_block_size, open_mode mode,
+                                       uint32_t features, const std::vector<int> &nodes) :
+        SMSegment(std::move(name), mode) {
+    if (_mem_descriptor == -1) {
+        return;
+    }
+    struct superblock sb{};
+    if (_created) {
+        if (shard_count == 0 || shard_count > SMST_MAX_SHARDS) {
+            std::cerr << _name << ": shard_count must be in 1.." << SMST_MAX_SHARDS << std::endl;
+            SMSegment::destroy(_name);
+            detach();
+            return;
+        }
+        sb.magic = SMST_MAGIC;
+        sb.version = SMST_LAYOUT_VERSION;
+        sb.shard_count = shard_count;
+        sb.features = features;
+        sb.key_count = int_ceil_divide(key_count, shard_count);
+        sb.data_count = int_ceil_divide(data_count, shard_count);
+        sb.data_block_size = data_block_size;
+        sb.resize_state = SMST_RESIZE_NONE;
+        for (uint32_t i = 0; i < shard_count; i++) {
+            sb.node[i] = nodes.empty() ? SMST_NO_NODE : nodes[i % nodes.size()];
+        }
+        //шарды создаем до публикации каталога: подключившийся процесс застает их готовыми
+        for (uint32_t i = 0; i < shard_count; i++) {
+            if (!open_shard(sb, i, 0, sb.key_count, sb.data_count, sb.data_block_size)) {
+                for (uint32_t j = 0; j <= i; j++) {
+                    SMHashTable::destroy(shard_name(_name, j, 0));
+                }
+                SMSegment::destroy(_name);
+                detach();
+                return;
+            }
+        }
+    } else if (!read_superblock(&sb)) {
+        detach();
+        return;
+    }
+
+    void *ptr = map(sizeof(struct superblock));
+    if (ptr == nullptr) {
+        return;
+    }
+    _superblock_ptr = (struct superblock *) ptr;
+    _shard_count = sb.shard_count;
+    _shards.resize(_shard_count);
+    _retired.resize(_shard_count);
+    _generations.resize(_shard_count);
+
+    if (_created) {
+        std::memcpy(_superblock_ptr, &sb, sizeof(struct superblock));
+        init_mutex(&_superblock_ptr->resize_mutex, true);
+        publish(_superblock_ptr);
+    }
+}
+
+ShardedSMHashTable::ShardedSMHashTable(std::string name) : ShardedSMHashTable(std::move(name), 0, 0, 0, 0, ATTACH) {
+}
+
+ShardedSMHashTable::~ShardedSMHashTable() = default;
+
+bool ShardedSMHashTable::destroy(const std::string &name) {
+    {
+        ShardedSMHashTable table(name);
+        if (table.isOpen()) {
+            for (uint32_t i = 0; i < table._shard_count; i++) {
+                uint32_t generation = __atomic_load_n(&table._superblock_ptr->generation[i], __ATOMIC_ACQUIRE);
+                SMHashTable::destroy(shard_name(name, i, generation));
+                //недостроенное поколение от упавшей пересборки
+                SMHashTable::destroy(shard_name(name, i, generation + 1));
+            }
+        }
+    }
+    return SMSegment::destroy(name);
+}
+
+std::string ShardedSMHashTable::shard_name(const std::string &name, uint32_t index, uint32_t generation) {
+    return name + "." + std::to_string(index) + "." + std::to_string(generation);
+}
+
+bool ShardedSMHashTable::read_superblock(struct superblock *sb) {
+    if (!wait_ready(sb, sizeof(struct superblock))) {
+        return false;
+    }
+    if (sb->magic != SMST_MAGIC || sb->version != SMST_LAYOUT_VERSION) {
+        std::cerr << _name << ": bad magic or layout version" << std::endl;
+        return false;
+    }
+    if (sb->shard_count == 0 || sb->shard_count > SMST_MAX_SHARDS) {
+        std::cerr << _name << ": bad shard count" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::shared_ptr<SMHashTable> ShardedSMHashTable::open_shard(const struct superblock &sb, uint32_t index,
+                                                            uint32_t generation, uint64_t key_count,
+                                                            uint64_t data_count, uint64_t data_block_size) {
+    std::shared_ptr<SMHashTable> table;
+    if (key_count) {
+        table = std::make_shared<SMHashTable>(shard_name(_name, index, generation), key_count, data_count,
+                                              data_block_size, SMHashTable::CREATE, sb.features);
+        if (table->isOpen() && sb.node[index] != SMST_NO_NODE) {
+            //страницы данных еще не тронуты и лягут на нужный узел при первой записи
+            table->bindNode(sb.node[index]);
+        }
+    } else {
+        table = std::make_shared<SMHashTable>(shard_name(_name, index, generation));
+    }
+    if (!table->isOpen()) {
+        return nullptr;
+    }
+    return table;
+}
+
+std::shared_ptr<SMHashTable> ShardedSMHashTable::shard(uint32_t index) {
+    if (index >= _shard_count) {
+        return nullptr;
+    }
+    uint32_t generation = __atomic_load_n(&_superblock_ptr->generation[index], __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&_generations[index], __ATOMIC_ACQUIRE) == generation) {
+        auto table = std::atomic_load(&_shards[index]);
+        if (table) {
+            return table;
+        }
+    }
+    //шард пересобрали или он еще не открыт в этом процессе
+    std::lock_guard<std::mutex> guard(_reopen_mutex);
+    if (_generations[index] == generation && _shards[index]) {
+        return std::atomic_load(&_shards[index]);
+    }
+    std::shared_ptr<SMHashTable> table;
+    while (!(table = open_shard(*_superblock_ptr, index, generation, 0, 0, 0))) {
+        //пока открывали, поколение успели сменить еще раз и удалить
+        uint32_t current = __atomic_load_n(&_superblock_ptr->generation[index], __ATOMIC_ACQUIRE);
+        if (current == generation) {
+            return nullptr;
+        }
+        generation = current;
+    }
+    std::atomic_store(&_retired[index], std::atomic_load(&_shards[index]));
+    std::atomic_store(&_shards[index], table);
+    __atomic_store_n(&_generations[index], generation, __ATOMIC_RELEASE);
+    return table;
+}
+
+uint32_t ShardedSMHashTable::shardCount() const {
+    return _shard_count;
+}
+
+uint32_t ShardedSMHashTable::shardOf(const std::string &key) const {
+    //старшие биты хеша: младшие внутри шарда выбирают корзину
+    return (uint32_t) (((uint64_t) hash_method(key.c_str(), key.size()) * _shard_count) >> 32);
+}
+
+bool ShardedSMHashTable::set(const std::string &key, const std::string &val) {
+    uint32_t index = shardOf(key);
+    auto table = shard(index);
+    return table && set_on(index, table, key, val);
+}
+
+char *ShardedSMHashTable::get_value(const std::string &key) {
+    auto table = shard(shardOf(key));
+    if (!table) {
+        return &eol;
+    }
+    return table->get_value(key);
+}
+
+int64_t ShardedSMHashTable::get(const std::string &key, char *buffer, size_t size) {
+    auto table = shard(shardOf(key));
+    if (!table) {
+        return -1;
+    }
+    return table->get(key, buffer, size);
+}
+
+int ShardedSMHashTable::unset(const std::string &key) {
+    uint32_t index = shardOf(key);
+    auto table = shard(index);
+    return table ? unset_on(index, table, key) : 0;
+}
+
+bool ShardedSMHashTable::set_on(uint32_t index, std::shared_ptr<SMHashTable> &table, const std::string &key,
+                                const std::string &val) {
+    while (!table->set(key, val)) {
+        if (!table->isSealed()) {
+            //не поместилось
+            return false;
+        }
+        //шард пересобирают: ждем конца пересборки и повторяем в новом поколении
+        lock_resize();
+        bool resizing = _superblock_ptr->resize_state != SMST_RESIZE_NONE;
+        unlock_resize();
+        auto fresh = shard(index);
+        if (!fresh || (fresh == table && !resizing && table->isSealed())) {
+            //шард запечатали в обход resizeShard
+            return false;
+        }
+        table = fresh;
+    }
+    return true;
+}
+
+int ShardedSMHashTable::unset_on(uint32_t index, std::shared_ptr<SMHashTable> &table, const std::string &key) {
+    int result;
+    while (!(result = table->unset(key)) && table->isSealed()) {
+        lock_resize();
+        bool resizing = _superblock_ptr->resize_state != SMST_RESIZE_NONE;
+        unlock_resize();
+        auto fresh = shard(index);
+        if (!fresh || (fresh == table && !resizing && table->isSealed())) {
+            return 0;
+        }
+        table = fresh;
+    }
+    return result;
+}
+
+std::vector<std::vector<uint64_t>> ShardedSMHashTable::group(
+        uint64_t count, const std::function<const std::string &(uint64_t)> &key_at) const {
+    std::vector<std::vector<uint64_t>> groups(_shard_count);
+    for (uint64_t i = 0; i < count; i++) {
+        groups[shardOf(key_at(i))].push_back(i);
+    }
+    return groups;
+}
+
+uint64_t ShardedSMHashTable::set_many(const std::vector<std::pair<std::string, std::string>> &items) {
+    auto groups = group(items.size(), [&items](uint64_t i) -> const std::string & { return items[i].first; });
+    uint64_t stored = 0;
+    for (uint32_t s = 0; s < _shard_count; s++) {
+        if (groups[s].empty()) {
+            continue;
+        }
+        auto table = shard(s);
+        if (!table) {
+            continue;
+        }
+        for (auto i : groups[s]) {
+            stored += set_on(s, table, items[i].first, items[i].second);
+        }
+    }
+    return stored;
+}
+
+std::vector<std::string> ShardedSMHashTable::get_many(const std::vector<std::string> &keys) {
+    auto groups = group(keys.size(), [&keys](uint64_t i) -> const std::string & { return keys[i]; });
+    std::vector<std::string> values(keys.size());
+    for (uint32_t s = 0; s < _shard_count; s++) {
+        if (groups[s].empty()) {
+            continue;
+        }
+        auto table = shard(s);
+        if (!table) {
+            continue;
+        }
+        for (auto i : groups[s]) {
+            values[i] = table->get_value(keys[i]);
+        }
+    }
+    return values;
+}
+
+uint64_t ShardedSMHashTable::unset_many(const std::vector<std::string> &keys) {
+    auto groups = group(keys.size(), [&keys](uint64_t i) -> const std::string & { return keys[i]; });
+    uint64_t removed = 0;
+    for (uint32_t s = 0; s < _shard_count; s++) {
+        if (groups[s].empty()) {
+            continue;
+        }
+        auto table = shard(s);
+        if (!table) {
+            continue;
+        }
+        for (auto i : groups[s]) {
+            removed += unset_on(s, table, keys[i]) != 0;
+        }
+    }
+    return removed;
+}
+
+void ShardedSMHashTable::clear() {
+    for (uint32_t s = 0; s < _shard_count; s++) {
+        if (auto table = shard(s)) {
+            table->clear();
+        }
+    }
+}
+
+void ShardedSMHashTable::hardDefragmentation() {
+    for (uint32_t s = 0; s < _shard_count; s++) {
+        if (auto table = shard(s)) {
+            table->hardDefragmentation();
+        }
+    }
+}
+
+struct SMHashTable::meminfo *ShardedSMHashTable::memInfo() {
+    meminfo = {};
+    uint32_t opened = 0;
+    for (uint32_t s = 0; s < _shard_count; s++) {
+        auto table = shard(s);
+        if (!table) {
+            continue;
+        }
+        auto *info = table->memInfo();
+        meminfo.free += info->free;
+        meminfo.max_free_block = std::max(meminfo.max_free_block, info->max_free_block);
+        meminfo.max_allocated_block = std::max(meminfo.max_allocated_block, info->max_allocated_block);
+        meminfo.segments += info->segments;
+        meminfo.used += info->used;
+        meminfo.resident += info->resident;
+        meminfo.filter_size += info->filter_size;
+        meminfo.filter_false_positive += info->filter_false_positive;
+        meminfo.spilled += info->spilled;
+        meminfo.spill_file += info->spill_file;
+        meminfo.undo_used += info->undo_used;
+        meminfo.undo_capacity += info->undo_capacity;
+        meminfo.index_used += info->index_used;
+        meminfo.index_capacity += info->index_capacity;
+        meminfo.max_chain = std::max(meminfo.max_chain, info->max_chain);
+        //средняя цепочка - по непустым корзинам всех шардов
+        meminfo.avg_chain += info->avg_chain * (double) info->chained_buckets;
+        meminfo.chained_buckets += info->chained_buckets;
+        opened++;
+    }
+    if (opened) {
+        meminfo.filter_false_positive /= opened;
+    }
+    if (meminfo.chained_buckets) {
+        meminfo.avg_chain /= (double) meminfo.chained_buckets;
+    }
+    return &meminfo;
+}
+
+uint64_t ShardedSMHashTable::getFreeMemorySize() {
+    uint64_t free = 0;
+    for (uint32_t s = 0; s < _shard_count; s++) {
+        if (auto table = shard(s)) {
+            free += table->getFreeMemorySize();
+        }
+    }
+    return free;
+}
+
+bool ShardedSMHashTable::resizeShard(uint32_t index, uint64_t key_count, uint64_t data_count,
+                                     uint32_t data_block_size) {
+    if (index >= _shard_count) {
+        return false;
+    }
+    lock_resize();
+    auto old = shard(index);
+    if (!old) {
+        unlock_resize();
+        return false;
+    }
+    uint32_t generation = _superblock_ptr->generation[index];
+    _superblock_ptr->resize_shard = index;
+    __atomic_store_n(&_superblock_ptr->resize_state, SMST_RESIZE_COPY, __ATOMIC_RELEASE);
+    //после seal() старое поколение больше не меняется, копия в новом будет полной
+    old->seal();
+    auto fresh = open_shard(*_superblock_ptr, index, generation + 1, key_count, data_count,
+                            data_block_size ? data_block_size : _superblock_ptr->data_block_size);
+    bool result = fresh != nullptr;
+    if (result) {
+        old->forEach([&](const std::string &key, const std::string &val) {
+            result = result && fresh->set(key, val);
+        });
+    }
+    if (!result) {
+        fresh.reset();
+        SMHashTable::destroy(shard_name(_name, index, generation + 1));
+        old->unseal();
+        __atomic_store_n(&_superblock_ptr->resize_state, SMST_RESIZE_NONE, __ATOMIC_RELEASE);
+        unlock_resize();
+        return false;
+    }
+    __atomic_store_n(&_superblock_ptr->generation[index], generation + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&_superblock_ptr->resize_state, SMST_RESIZE_PUBLISHED, __ATOMIC_RELEASE);
+    //процессы, которые еще держат старое поколение, читают его до следующего обращения к шарду
+    SMHashTable::destroy(shard_name(_name, index, generation));
+    __atomic_store_n(&_superblock_ptr->resize_state, SMST_RESIZE_NONE, __ATOMIC_RELEASE);
+    unlock_resize();
+    return true;
+}
+
+void ShardedSMHashTable::lock_resize() {
+    int result = pthread_mutex_lock(&_superblock_ptr->resize_mutex);
+    if (result == EOWNERDEAD) {
+        if (pthread_mutex_consistent(&_superblock_ptr->resize_mutex) != 0) {
+            perror("pthread_mutex_consistent");
+            return;
+        }
+        //владелец умер посреди пересборки
+        recover_resize();
+    }
+}
+
+void ShardedSMHashTable::unlock_resize() {
+    pthread_mutex_unlock(&_superblock_ptr->resize_mutex);
+}
+
+void ShardedSMHashTable::recover_resize() {
+    uint32_t index = _superblock_ptr->resize_shard;
+    uint32_t generation = _superblock_ptr->generation[index];
+    if (_superblock_ptr->resize_state == SMST_RESIZE_COPY) {
+        //новое поколение не опубликовано: выбрасываем его, старое снова принимает записи
+        SMHashTable::destroy(shard_name(_name, index, generation + 1));
+        if (auto table = shard(index)) {
+            table->unseal();
+        }
+    } else if (_superblock_ptr->resize_state == SMST_RESIZE_PUBLISHED) {
+        SMHashTable::destroy(shard_name(_name, index, generation - 1));
+    }
+    __atomic_store_n(&_superblock_ptr->resize_state, SMST_RESIZE_NONE, __ATOMIC_RELEASE);
+}
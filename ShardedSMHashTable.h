@@ -0,0 +1,133 @@
+#ifndef SMC_SHARDEDSMHASHTABLE_H
+#define SMC_SHARDEDSMHASHTABLE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <cstdint>
+
+#include "SMSegment.h"
+#include "SMHashTable.h"
+
+#define SMST_MAGIC 0x44524148534d5353ULL // "SSMSHARD"
+#define SMST_LAYOUT_VERSION 1
+#define SMST_MAX_SHARDS 1024
+#define SMST_NO_NODE (-1)
+#define SMST_RESIZE_NONE 0
+#define SMST_RESIZE_COPY 1
+#define SMST_RESIZE_PUBLISHED 2
+
+
+// Федерация независимых SMHashTable: ключ уходит в шард по старшим битам хеша, у каждого шарда
+// свой сегмент name.<шард>.<поколение>, свои блокировки и свой размер. Общий сегмент name хранит
+// только каталог: число шардов и текущее поколение каждого. resizeShard() собирает новое поколение
+// шарда рядом со старым, остальные процессы переходят на него при следующем обращении к шарду.
+class ShardedSMHashTable : public SMSegment {
+public:
+    // key_count и data_count - на всю таблицу, делятся между шардами поровну.
+    // nodes - NUMA узлы, шард i берет память с nodes[i % nodes.size()]
+    explicit ShardedSMHashTable(std::string name, uint32_t shard_count, uint64_t key_count, uint64_t data_count,
+                                uint32_t data_block_size = 512, open_mode mode = OPEN_OR_CREATE,
+                                uint32_t features = 0, const std::vector<int> &nodes = {});
+
+    explicit ShardedSMHashTable(std::string name);
+
+    ~ShardedSMHashTable();
+
+    // Удаляет каталог и сегменты всех шардов
+    static bool destroy(const std::string &name);
+
+    bool set(const std::string &key, const std::string &val);
+
+    // Указатель живет как у SMHashTable::get_value и переживает одну пересборку шарда
+    char *get_value(const std::string &key);
+
+    int64_t get(const std::string &key, char *buffer, size_t size);
+
+    int unset(const std::string &key);
+
+    // Пакетные операции: ключи группируются по шардам, каждый шард открывается один раз на пакет.
+    // Возвращают число записанных / удаленных ключей; get_many для отсутствующих ключей дает пустую строку
+    uint64_t set_many(const std::vector<std::pair<std::string, std::string>> &items);
+
+    std::vector<std::string> get_many(const std::vector<std::string> &keys);
+
+    uint64_t unset_many(const std::vector<std::string> &keys);
+
+    void clear();
+
+    void hardDefragmentation();
+
+    // Сумма по шардам; для самых длинных блоков и цепочек - максимум, для доли ложных срабатываний - среднее,
+    // для средней цепочки - среднее, взвешенное по непустым корзинам шардов
+    struct SMHashTable::meminfo *memInfo();
+
+    uint64_t getFreeMemorySize();
+
+    uint32_t shardCount() const;
+
+    uint32_t shardOf(const std::string &key) const;
+
+    std::shared_ptr<SMHashTable> shard(uint32_t index);
+
+    // Пересобирает шард с новыми размерами (data_block_size = 0 - прежний): старое поколение
+    // запечатывается, его элементы копируются в новое, после публикации старый сегмент удаляется.
+    // Писатели этого шарда ждут конца пересборки, читатели читают старое поколение.
+    // false - элементы не поместились, тогда шард остается прежним
+    bool resizeShard(uint32_t index, uint64_t key_count, uint64_t data_count, uint32_t data_block_size = 0);
+
+protected:
+    struct superblock : segment_header {
+        uint32_t shard_count;
+        uint32_t features;
+        uint64_t key_count;
+        uint64_t data_count;
+        uint64_t data_block_size;
+
+        pthread_mutex_t resize_mutex;
+        uint32_t resize_shard;
+        uint32_t resize_state;
+
+        uint32_t generation[SMST_MAX_SHARDS];
+        int32_t node[SMST_MAX_SHARDS];
+    };
+
+private:
+    static std::string shard_name(const std::string &name, uint32_t index, uint32_t generation);
+
+    bool read_superblock(struct superblock *sb);
+
+    // key_count = 0 - подключиться к существующему поколению, иначе создать его заново
+    std::shared_ptr<SMHashTable> open_shard(const struct superblock &sb, uint32_t index, uint32_t generation,
+                                            uint64_t key_count, uint64_t data_count, uint64_t data_block_size);
+
+    void lock_resize();
+
+    void unlock_resize();
+
+    void recover_resize();
+
+    bool set_on(uint32_t index, std::shared_ptr<SMHashTable> &table, const std::string &key, const std::string &val);
+
+    int unset_on(uint32_t index, std::shared_ptr<SMHashTable> &table, const std::string &key);
+
+    std::vector<std::vector<uint64_t>> group(uint64_t count, const std::function<const std::string &(uint64_t)> &key_at) const;
+
+    char eol{};
+
+    struct superblock *_superblock_ptr{};
+    uint32_t _shard_count{};
+
+    //шарды текущего и предыдущего поколения: указатели из get_value старого поколения еще живы
+    std::vector<std::shared_ptr<SMHashTable>> _shards;
+    std::vector<std::shared_ptr<SMHashTable>> _retired;
+    std::vector<uint32_t> _generations;
+    std::mutex _reopen_mutex;
+
+    struct SMHashTable::meminfo meminfo{};
+};
+
+
+#endif //SMC_SHARDEDSMHASHTABLE_H
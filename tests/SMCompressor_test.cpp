@@ -0,0 +1,71 @@
+#include "TestUtils.h"
+#include "../SMCompressor.h"
+
+
+static std::string makeJson(int records) {
+    std::string json = "[";
+    for (int i = 0; i < records; i++) {
+        json += R"({"id":)" + std::to_string(i) + R"(,"name":")" + RandomGenerator::getRandomString(8) +
+                R"(","active":true,"tags":["alpha","beta"],"score":)" + std::to_string(i * 7 % 100) + "},";
+    }
+    json += "]";
+    return json;
+}
+
+TEST(SMCompressor, round_trip) {
+    SMCompressor compressor;
+    for (int len : {0, 1, 12, 13, 100, 4096, 70000}) {
+        auto src = RandomGenerator::getRandomString(len);
+        std::string dst(SMCompressor::bound(src.size()), 0);
+        auto size = compressor.compress(src.data(), src.size(), &dst[0], dst.size());
+        ASSERT_GT(size, 0U);
+
+        std::string out(src.size(), 0);
+        ASSERT_EQ((int64_t) src.size(), SMCompressor::decompress(dst.data(), size, &out[0], out.size()));
+        ASSERT_EQ(src, out);
+    }
+
+    auto json = makeJson(500);
+    std::string dst(SMCompressor::bound(json.size()), 0);
+    auto size = compressor.compress(json.data(), json.size(), &dst[0], dst.size());
+    LOG_INFO << "json " << json.size() << " -> " << size << NL;
+    ASSERT_LT(size, json.size() / 2);
+    std::string out(json.size(), 0);
+    ASSERT_EQ((int64_t) json.size(), SMCompressor::decompress(dst.data(), size, &out[0], out.size()));
+    ASSERT_EQ(json, out);
+}
+
+TEST(SMCompressor, dictionary) {
+    auto dict = makeJson(200);
+    SMCompressor plain;
+    SMCompressor compressor(dict.data(), dict.size());
+
+    auto src = makeJson(3);
+    std::string dst(SMCompressor::bound(src.size()), 0);
+    auto plain_size = plain.compress(src.data(), src.size(), &dst[0], dst.size());
+    auto size = compressor.compress(src.data(), src.size(), &dst[0], dst.size());
+    LOG_INFO << "plain " << plain_size << ", with dictionary " << size << NL;
+    ASSERT_LT(size, plain_size);
+
+    std::string out(src.size(), 0);
+    ASSERT_EQ((int64_t) src.size(),
+              SMCompressor::decompress(dst.data(), size, &out[0], out.size(), dict.data(), dict.size()));
+    ASSERT_EQ(src, out);
+    ASSERT_GT(0, SMCompressor::decompress(dst.data(), size, &out[0], out.size()));
+}
+
+TEST(SMCompressor, corrupted) {
+    SMCompressor compressor;
+    auto src = makeJson(50);
+    std::string dst(SMCompressor::bound(src.size()), 0);
+    auto size = compressor.compress(src.data(), src.size(), &dst[0], dst.size());
+
+    std::string out(src.size(), 0);
+    ASSERT_GT(0, SMCompressor::decompress(dst.data(), size, &out[0], out.size() - 1));
+    ASSERT_EQ(0U, compressor.compress(src.data(), src.size(), &dst[0], 16));
+    for (int i = 0; i < 100; i++) {
+        auto broken = dst.substr(0, size);
+        broken[RandomGenerator::getRandomInt(0, (int32_t) size - 1)] ^= (char) 0x5a;
+        SMCompressor::decompress(broken.data(), broken.size(), &out[0], out.size());
+    }
+}
@@ -1,4 +1,15 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
 #include <random>
+#include <set>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "TestUtils.h"
 #include "../SMHashTable.h"
 
@@ -21,15 +32,77 @@ protected:
 
     }
 
+    //корзина зависит от семени таблицы, коллизию ищем по ее же корзинам
+    std::string collide(const std::string &key) {
+        return findCollision([this](const char *k, uint32_t size) {
+            return table->bucketOf(std::string(k, size));
+        }, key, UINT32_MAX);
+    }
+
     SMHashTable *table{};
 };
 
 TEST(SPEED, first) {
+    SMHashTable::destroy("shared_memory_speed");
     auto *timer = new TimeProfiler();
     timer->start();
-    auto table = new SMHashTable("shared_memory", 1000, 4000, 8);
+    auto table = new SMHashTable("shared_memory_speed", 1000000, 4000000, 64, SMHashTable::CREATE);
+    LOG_INFO << "create - " << timer->get() << "s" << NL;
+    ASSERT_TRUE(table->isOpen());
+    ASSERT_TRUE(table->isCreated());
+    ASSERT_EQ(4000000UL * 64, table->getFreeMemorySize());
+    table->set("key", "value");
+
+    timer->start();
+    auto attached = new SMHashTable("shared_memory_speed", 1000000, 4000000, 64, SMHashTable::ATTACH);
+    LOG_INFO << "attach - " << timer->get() << "s" << NL;
+    ASSERT_TRUE(attached->isOpen());
+    ASSERT_FALSE(attached->isCreated());
+    ASSERT_STREQ("value", attached->get_value("key"));
 
-    LOG_INFO << "speed - " << timer->get() << "s" << NL;
+    timer->start();
+    attached->clear();
+    LOG_INFO << "clear - " << timer->get() << "s" << NL;
+    ASSERT_STREQ("", table->get_value("key"));
+    ASSERT_EQ(4000000UL * 64, table->getFreeMemorySize());
+
+    delete attached;
+    delete table;
+    ASSERT_TRUE(SMHashTable::destroy("shared_memory_speed"));
+
+    auto missing = new SMHashTable("shared_memory_speed", 1000, 4000, 8, SMHashTable::ATTACH);
+    ASSERT_FALSE(missing->isOpen());
+    delete missing;
+}
+
+TEST(SUPERBLOCK, attach) {
+    auto table = new SMHashTable("shared_memory_sb", 100, 400, 16, SMHashTable::CREATE);
+    ASSERT_TRUE(table->isCreated());
+    table->set("key", "value");
+
+    //параметры подключающегося процесса игнорируются, геометрия берется из суперблока
+    auto attached = new SMHashTable("shared_memory_sb", 5000, 2, 4);
+    ASSERT_TRUE(attached->isOpen());
+    ASSERT_FALSE(attached->isCreated());
+    ASSERT_EQ(400 * 16 - 32, attached->getFreeMemorySize());
+    ASSERT_STREQ("value", attached->get_value("key"));
+
+    auto by_name = new SMHashTable("shared_memory_sb");
+    ASSERT_TRUE(by_name->isOpen());
+    ASSERT_STREQ("value", by_name->get_value("key"));
+
+    int fd = shm_open("shared_memory_sb", O_RDWR, ALLPERMS);
+    uint64_t magic = 0;
+    ASSERT_EQ(sizeof(magic), pwrite(fd, &magic, sizeof(magic), 0));
+    close(fd);
+    auto corrupted = new SMHashTable("shared_memory_sb");
+    ASSERT_FALSE(corrupted->isOpen());
+
+    delete corrupted;
+    delete by_name;
+    delete attached;
+    delete table;
+    SMHashTable::destroy("shared_memory_sb");
 }
 
 TEST_F(SMHashTable_test, crud) {
@@ -65,9 +138,9 @@ TEST_F(SMHashTable_test, crud) {
 
 TEST_F(SMHashTable_test, collision) {
     auto key = RandomGenerator::getRandomString(8);
-    auto collision = findCollision(&meiyan, key, 1000);
-    auto collision2 = findCollision(&meiyan, key, 1000);
-    auto collision3 = findCollision(&meiyan, key, 1000);
+    auto collision = collide(key);
+    auto collision2 = collide(key);
+    auto collision3 = collide(key);
     LOG_INFO << "Key - " << key << NL;
     LOG_INFO << "Collision - " << collision << NL;
     LOG_INFO << "Collision2 - " << collision2 << NL;
@@ -86,9 +159,9 @@ TEST_F(SMHashTable_test, collision) {
 
 TEST_F(SMHashTable_test, unset_single_item) {
     auto key = RandomGenerator::getRandomString(8);
-    auto collision = findCollision(&meiyan, key, 1000);
-    auto collision2 = findCollision(&meiyan, key, 1000);
-    auto collision3 = findCollision(&meiyan, key, 1000);
+    auto collision = collide(key);
+    auto collision2 = collide(key);
+    auto collision3 = collide(key);
     LOG_INFO << "Key - " << key << NL;
     LOG_INFO << "Collision - " << collision << NL;
     LOG_INFO << "Collision2 - " << collision2 << NL;
@@ -112,9 +185,9 @@ TEST_F(SMHashTable_test, unset_single_item) {
 
 TEST_F(SMHashTable_test, unset_last_linked_item) {
     auto key = RandomGenerator::getRandomString(8);
-    auto collision = findCollision(&meiyan, key, 1000);
-    auto collision2 = findCollision(&meiyan, key, 1000);
-    auto collision3 = findCollision(&meiyan, key, 1000);
+    auto collision = collide(key);
+    auto collision2 = collide(key);
+    auto collision3 = collide(key);
     LOG_INFO << "Key - " << key << NL;
     LOG_INFO << "Collision - " << collision << NL;
     LOG_INFO << "Collision2 - " << collision2 << NL;
@@ -141,9 +214,9 @@ TEST_F(SMHashTable_test, unset_last_linked_item) {
 
 TEST_F(SMHashTable_test, unset_middle_linked_item) {
     auto key = RandomGenerator::getRandomString(8);
-    auto collision = findCollision(&meiyan, key, 1000);
-    auto collision2 = findCollision(&meiyan, key, 1000);
-    auto collision3 = findCollision(&meiyan, key, 1000);
+    auto collision = collide(key);
+    auto collision2 = collide(key);
+    auto collision3 = collide(key);
     LOG_INFO << "Key - " << key << NL;
     LOG_INFO << "Collision - " << collision << NL;
     LOG_INFO << "Collision2 - " << collision2 << NL;
@@ -172,9 +245,9 @@ TEST_F(SMHashTable_test, unset_middle_linked_item) {
 
 TEST_F(SMHashTable_test, unset_first_linked_item) {
     auto key = RandomGenerator::getRandomString(8);
-    auto collision = findCollision(&meiyan, key, 1000);
-    auto collision2 = findCollision(&meiyan, key, 1000);
-    auto collision3 = findCollision(&meiyan, key, 1000);
+    auto collision = collide(key);
+    auto collision2 = collide(key);
+    auto collision3 = collide(key);
 
     LOG_INFO << "Key - " << key << NL;
     LOG_INFO << "Collision - " << collision << NL;
@@ -199,9 +272,9 @@ TEST_F(SMHashTable_test, unset_first_linked_item) {
 
 TEST_F(SMHashTable_test, unset_chain) {
     auto key = RandomGenerator::getRandomString(8);
-    auto collision = findCollision(&meiyan, key, 1000);
-    auto collision2 = findCollision(&meiyan, key, 1000);
-    auto collision3 = findCollision(&meiyan, key, 1000);
+    auto collision = collide(key);
+    auto collision2 = collide(key);
+    auto collision3 = collide(key);
 
     LOG_INFO << "Key - " << key << NL;
     LOG_INFO << "Collision - " << collision << NL;
@@ -445,3 +518,1285 @@ TEST_F(SMHashTable_test, create_perfomance) {
     LOG_WARN << "STD::MAP - " << timer->get() << "s" << NL;
 
 }
+
+
+static std::string makeJsonBlob(int size) {
+    std::string json = "[";
+    while ((int) json.size() < size) {
+        json += R"({"id":)" + std::to_string(json.size()) + R"(,"user":")" + RandomGenerator::getRandomString(10) +
+                R"(","active":true,"roles":["reader","writer"],"balance":)" +
+                std::to_string(RandomGenerator::getRandomInt(0, 100000)) + "},";
+    }
+    json.back() = ']';
+    return json;
+}
+
+TEST(COMPRESSION, crud) {
+    auto table = new SMHashTable("shared_memory_lz", 1000, 40000, 64, SMHashTable::CREATE, SMHT_FEATURE_COMPRESSION);
+    auto blob = makeJsonBlob(4096);
+    table->set("json", blob);
+    table->set("short", "value");
+    ASSERT_STREQ(blob.c_str(), table->get_value("json"));
+    ASSERT_STREQ("value", table->get_value("short"));
+    ASSERT_LT(40000 * 64 - table->getFreeMemorySize(), blob.size() / 2);
+
+    std::string buffer(16, 0);
+    ASSERT_EQ((int64_t) blob.size(), table->get("json", &buffer[0], buffer.size()));
+    buffer.resize(blob.size() + 1);
+    ASSERT_EQ((int64_t) blob.size(), table->get("json", &buffer[0], buffer.size()));
+    ASSERT_STREQ(blob.c_str(), buffer.c_str());
+    ASSERT_EQ(-1, table->get("missing", &buffer[0], buffer.size()));
+
+    ASSERT_TRUE(table->setCompressionDictionary(makeJsonBlob(65536)));
+    ASSERT_FALSE(table->setCompressionDictionary(makeJsonBlob(1024)));
+    auto small = makeJsonBlob(1024);
+    table->set("small", small);
+    ASSERT_STREQ(small.c_str(), table->get_value("small"));
+    ASSERT_STREQ(blob.c_str(), table->get_value("json"));
+
+    auto attached = new SMHashTable("shared_memory_lz");
+    ASSERT_STREQ(small.c_str(), attached->get_value("small"));
+    table->unset("json");
+    ASSERT_STREQ("", attached->get_value("json"));
+
+    delete attached;
+    delete table;
+    SMHashTable::destroy("shared_memory_lz");
+}
+
+TEST(COMPRESSION, ratio) {
+    std::vector<std::pair<std::string, std::string>> dataset;
+    for (int i = 0; i < 500; i++) {
+        dataset.emplace_back("key-" + RandomGenerator::getRandomString(16),
+                             makeJsonBlob(RandomGenerator::getRandomInt(1024, 65536)));
+    }
+    std::string sample;
+    for (int i = 0; i < 16; i++) {
+        sample += dataset[i].second.substr(0, 4096);
+    }
+
+    for (uint32_t features : {0U, SMHT_FEATURE_COMPRESSION}) {
+        for (bool dictionary : {false, true}) {
+            if (dictionary && !features) {
+                continue;
+            }
+            auto table = new SMHashTable("shared_memory_lz", 1000, 400000, 64, SMHashTable::CREATE, features);
+            if (dictionary) {
+                table->setCompressionDictionary(sample);
+            }
+            uint64_t raw = 0;
+            auto timer = new TimeProfiler;
+            timer->start();
+            for (const auto &data: dataset) {
+                if (table->set(data.first, data.second)) {
+                    raw += data.second.size();
+                }
+            }
+            auto write_time = timer->get();
+            auto used = 400000UL * 64 - table->getFreeMemorySize();
+
+            std::string buffer(65536 + 1, 0);
+            timer->start();
+            for (const auto &data: dataset) {
+                ASSERT_EQ((int64_t) data.second.size(), table->get(data.first, &buffer[0], buffer.size()));
+            }
+            auto read_time = timer->get();
+            LOG_WARN << (features ? (dictionary ? "LZ4+DICT" : "LZ4") : "RAW")
+                     << " ratio " << (double) raw / used
+                     << ", write " << raw / write_time / 1e6 << " MB/s"
+                     << ", read " << raw / read_time / 1e6 << " MB/s" << NL;
+            delete table;
+        }
+    }
+    SMHashTable::destroy("shared_memory_lz");
+}
+
+TEST(ARENAS, concurrent_writers) {
+    uint32_t per_thread = 5000;
+    uint32_t expected_free = 0;
+    std::vector<std::pair<std::string, std::string>> dataset;
+    for (uint32_t i = 0; i < per_thread * 4; i++) {
+        dataset.emplace_back("key-" + std::to_string(i) + "-" + RandomGenerator::getRandomString(8),
+                             RandomGenerator::getRandomString(32));
+    }
+
+    //одна таблица на все прогоны: коллизии, а с ними и занятая память, зависят от ее семени
+    auto table = new SMHashTable("shared_memory_arenas", 100000, 200000, 16, SMHashTable::CREATE);
+    for (uint32_t threads : {1U, 2U, 4U}) {
+        table->clear();
+        std::vector<std::thread> writers;
+        std::atomic<uint32_t> fails{};
+        auto timer = new TimeProfiler;
+        timer->start();
+        for (uint32_t t = 0; t < threads; t++) {
+            writers.emplace_back([&, t]() {
+                for (uint32_t i = t; i < dataset.size(); i += threads) {
+                    if (!table->set(dataset[i].first, dataset[i].second)) {
+                        fails++;
+                    }
+                }
+            });
+        }
+        for (auto &writer: writers) {
+            writer.join();
+        }
+        LOG_WARN << threads << " writers - " << timer->get() << "s" << NL;
+        ASSERT_EQ(0U, fails);
+
+        for (const auto &data: dataset) {
+            ASSERT_STREQ(data.second.c_str(), table->get_value(data.first));
+        }
+        //занятая память не зависит от порядка записи
+        if (threads == 1) {
+            expected_free = table->getFreeMemorySize();
+        }
+        ASSERT_EQ(expected_free, table->getFreeMemorySize());
+    }
+    delete table;
+    SMHashTable::destroy("shared_memory_arenas");
+}
+
+TEST(ARENAS, refill_holes) {
+    auto table = new SMHashTable("shared_memory_arenas", 100000, 100000, 16, SMHashTable::CREATE);
+    std::vector<std::string> keys;
+    for (uint32_t i = 0; table->set("key-" + std::to_string(i), RandomGenerator::getRandomString(32)); i++) {
+        keys.push_back("key-" + std::to_string(i));
+    }
+    auto meminfo = table->memInfo();
+    LOG_INFO << "Stored " << keys.size() << ", free " << meminfo->free << NL;
+    ASSERT_LT(meminfo->free, 100U * 16);
+
+    //дырки в почти полной таблице должны находиться без сканирования занятых кусков
+    for (uint32_t i = 0; i < keys.size(); i += 10) {
+        table->unset(keys[i]);
+    }
+    auto free = table->getFreeMemorySize();
+    auto timer = new TimeProfiler;
+    timer->start();
+    uint32_t stored = 0;
+    for (uint32_t i = 0; i < keys.size(); i += 10) {
+        if (table->set(keys[i], RandomGenerator::getRandomString(32))) {
+            stored++;
+        }
+    }
+    LOG_WARN << "Refill " << stored << " - " << timer->get() << "s" << NL;
+    //часть дырок занята под заголовки коллизий другого размера
+    ASSERT_LE(int_ceil_divide(keys.size(), 10) * 9 / 10, stored);
+    ASSERT_GE(free, table->getFreeMemorySize());
+
+    table->hardDefragmentation();
+    auto after = table->memInfo();
+    ASSERT_EQ(after->free, after->max_free_block);
+    delete table;
+    SMHashTable::destroy("shared_memory_arenas");
+}
+
+TEST(EPOCH, retired_blocks_wait_for_readers) {
+    auto table = new SMHashTable("shared_memory_epoch", 100, 1000, 16, SMHashTable::CREATE);
+    auto memory = table->getFreeMemorySize();
+    table->set("key", "value");
+    {
+        auto guard = table->pin();
+        char *val = table->get_value("key");
+        //старое значение остается на месте, пока жив guard
+        table->set("key", "other value");
+        table->unset("key");
+        for (int i = 0; i < 50; i++) {
+            table->set("fill" + std::to_string(i), "filler");
+        }
+        ASSERT_STREQ("value", val);
+        ASSERT_STREQ("", table->get_value("key"));
+    }
+    for (int i = 0; i < 50; i++) {
+        table->unset("fill" + std::to_string(i));
+    }
+    ASSERT_EQ(memory, table->getFreeMemorySize());
+    delete table;
+    SMHashTable::destroy("shared_memory_epoch");
+}
+
+TEST(EPOCH, writer_under_own_guard_does_not_wait) {
+    auto table = new SMHashTable("shared_memory_epoch", 100, 4 * SMHT_LIMBO, 16, SMHashTable::CREATE);
+    auto memory = table->getFreeMemorySize();
+    table->set("key", "value");
+    {
+        auto guard = table->pin();
+        char *val = table->get_value("key");
+        //очередь отложенных блоков переполняется, а guard этого же потока ее не отпускает
+        for (int i = 0; i < SMHT_LIMBO + 100; i++) {
+            ASSERT_TRUE(table->set("key", std::to_string(i)));
+        }
+        ASSERT_STREQ("value", val);
+        ASSERT_TRUE(table->verify());
+    }
+    table->unset("key");
+    ASSERT_EQ(memory, table->getFreeMemorySize());
+    delete table;
+    SMHashTable::destroy("shared_memory_epoch");
+}
+
+TEST(EPOCH, readers_never_see_recycled_memory) {
+    auto table = new SMHashTable("shared_memory_epoch", 16, 4096, 16, SMHashTable::CREATE);
+    auto memory = table->getFreeMemorySize();
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> broken{0};
+
+    //значение - одна буква разной длины, при обновлении блок каждый раз меняется
+    std::thread writer([&] {
+        for (uint32_t i = 0; !stop; i++) {
+            std::string key = "key" + std::to_string(i % 32);
+            if (i % 5 == 4) {
+                table->unset(key);
+            } else {
+                table->set(key, std::string(1 + i % 97, (char) ('a' + i % 26)));
+            }
+        }
+    });
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 3; r++) {
+        readers.emplace_back([&] {
+            for (uint32_t i = 0; reads < 3000; i++) {
+                auto guard = table->pin();
+                char *val = table->get_value("key" + std::to_string(i % 32));
+                std::string copy(val);
+                std::this_thread::yield();
+                if (copy != val || copy.find_first_not_of(copy.empty() ? ' ' : copy[0]) != std::string::npos) {
+                    broken++;
+                }
+                reads++;
+            }
+        });
+    }
+    for (auto &reader : readers) {
+        reader.join();
+    }
+    stop = true;
+    writer.join();
+    LOG_INFO << "Reads " << reads << ", broken " << broken << NL;
+    ASSERT_EQ(0U, broken);
+
+    //все отложенные блоки вернулись в карту
+    for (uint32_t i = 0; i < 32; i++) {
+        table->unset("key" + std::to_string(i));
+    }
+    ASSERT_EQ(memory, table->getFreeMemorySize());
+    table->hardDefragmentation();
+    delete table;
+    SMHashTable::destroy("shared_memory_epoch");
+}
+
+TEST(FILTER, misses) {
+    //корзин мало, часть из них переполнится
+    auto table = new SMHashTable("shared_memory_filter", 1000, 100000, 16, SMHashTable::CREATE,
+                                 SMHT_FEATURE_FILTER);
+    for (int i = 0; i < 3000; i++) {
+        ASSERT_TRUE(table->set("key" + std::to_string(i), "value" + std::to_string(i)));
+    }
+    for (int i = 0; i < 3000; i++) {
+        ASSERT_STREQ(("value" + std::to_string(i)).c_str(), table->get_value("key" + std::to_string(i)));
+        ASSERT_STREQ("", table->get_value("miss" + std::to_string(i)));
+    }
+    auto meminfo = table->memInfo();
+    LOG_INFO << "Filter " << meminfo->filter_size << " bytes, false positive " << meminfo->filter_false_positive << NL;
+    ASSERT_EQ(1000U * sizeof(uint64_t), meminfo->filter_size);
+    ASSERT_GT(meminfo->filter_false_positive, 0);
+    double false_positive = meminfo->filter_false_positive;
+
+    for (int i = 0; i < 3000; i += 2) {
+        ASSERT_TRUE(table->unset("key" + std::to_string(i)));
+    }
+    for (int i = 0; i < 3000; i++) {
+        auto expected = i % 2 ? "value" + std::to_string(i) : "";
+        ASSERT_STREQ(expected.c_str(), table->get_value("key" + std::to_string(i)));
+    }
+    ASSERT_GT(false_positive, table->memInfo()->filter_false_positive);
+
+    table->clear();
+    ASSERT_EQ(0, table->memInfo()->filter_false_positive);
+    delete table;
+    SMHashTable::destroy("shared_memory_filter");
+}
+
+TEST(FILTER, miss_speed) {
+    std::vector<std::string> keys;
+    for (int i = 0; i < 200000; i++) {
+        keys.push_back("key" + std::to_string(i));
+    }
+    for (uint32_t features : {0U, SMHT_FEATURE_FILTER}) {
+        auto table = new SMHashTable("shared_memory_filter", 50000, 1000000, 16, SMHashTable::CREATE, features);
+        for (int i = 0; i < 100000; i++) {
+            table->set(keys[i], "value");
+        }
+        auto timer = new TimeProfiler;
+        timer->start();
+        uint32_t misses = 0;
+        for (int i = 100000; i < 200000; i++) {
+            misses += *table->get_value(keys[i]) == 0;
+        }
+        LOG_WARN << (features ? "With" : "Without") << " filter, 100000 misses - " << timer->get() << "s" << NL;
+        ASSERT_EQ(100000U, misses);
+        delete timer;
+        delete table;
+    }
+    SMHashTable::destroy("shared_memory_filter");
+}
+
+TEST(WATCH, wait_for_key) {
+    auto table = new SMHashTable("shared_memory_watch", 1000, 10000, 16, SMHashTable::CREATE);
+    ASSERT_FALSE(table->wait_for_key("key", 10));
+    ASSERT_FALSE(table->wait_for_change("key", 10));
+
+    std::thread producer([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        table->set("key", "value");
+    });
+    ASSERT_TRUE(table->wait_for_key("key", 5000));
+    ASSERT_STREQ("value", table->get_value("key"));
+    producer.join();
+    //ключ уже есть, ждать нечего
+    ASSERT_TRUE(table->wait_for_key("key", 0));
+
+    producer = std::thread([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        table->set("key", "other");
+    });
+    ASSERT_TRUE(table->wait_for_change("key", 5000));
+    ASSERT_STREQ("other", table->get_value("key"));
+    producer.join();
+
+    producer = std::thread([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        table->unset("key");
+    });
+    ASSERT_TRUE(table->wait_for_change("key", 5000));
+    ASSERT_STREQ("", table->get_value("key"));
+    producer.join();
+    delete table;
+    SMHashTable::destroy("shared_memory_watch");
+}
+
+TEST(WATCH, notify_latency) {
+    auto table = new SMHashTable("shared_memory_watch", 1000, 10000, 16, SMHashTable::CREATE);
+    const int rounds = 1000;
+    std::atomic<int> round{0};
+    std::vector<int64_t> latency;
+
+    //пинг-понг: производитель пишет время записи, потребитель считает задержку до пробуждения
+    std::thread consumer([&] {
+        for (int i = 0; i < rounds; i++) {
+            table->wait_for_key("ping" + std::to_string(i));
+            auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+            latency.push_back(now - std::stoll(table->get_value("ping" + std::to_string(i))));
+            table->unset("ping" + std::to_string(i));
+            round = i + 1;
+        }
+    });
+    for (int i = 0; i < rounds; i++) {
+        while (round < i) {
+            std::this_thread::yield();
+        }
+        auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+        table->set("ping" + std::to_string(i), std::to_string(now));
+    }
+    consumer.join();
+    std::sort(latency.begin(), latency.end());
+    LOG_WARN << "Notify latency p50 " << latency[rounds / 2] / 1000 << "us, p99 "
+             << latency[rounds * 99 / 100] / 1000 << "us" << NL;
+    ASSERT_EQ(rounds, (int) latency.size());
+    delete table;
+    SMHashTable::destroy("shared_memory_watch");
+}
+
+TEST(BULK, load) {
+    std::vector<std::pair<std::string, std::string>> data;
+    for (int i = 0; i < 50000; i++) {
+        data.emplace_back("key" + std::to_string(i), "value" + std::to_string(i));
+    }
+    //повтор ключа: остается последнее значение
+    data.emplace_back("key7", "again");
+    auto table = new SMHashTable("shared_memory_bulk", 10000, 300000, 16, SMHashTable::CREATE, SMHT_FEATURE_FILTER);
+    ASSERT_TRUE(table->bulk_load(data.begin(), data.end(), 4));
+    for (int i = 0; i < 50000; i++) {
+        auto expected = i == 7 ? std::string("again") : "value" + std::to_string(i);
+        ASSERT_STREQ(expected.c_str(), table->get_value("key" + std::to_string(i)));
+    }
+    ASSERT_STREQ("", table->get_value("miss"));
+    //повторная заливка только в пустую таблицу
+    ASSERT_FALSE(table->bulk_load(data.begin(), data.end()));
+
+    //после заливки таблица работает как обычно
+    for (int i = 0; i < 50000; i += 3) {
+        ASSERT_TRUE(table->unset("key" + std::to_string(i)));
+    }
+    ASSERT_TRUE(table->set("key1", "updated"));
+    ASSERT_STREQ("updated", table->get_value("key1"));
+    ASSERT_STREQ("", table->get_value("key3"));
+    table->hardDefragmentation();
+    ASSERT_STREQ("value4", table->get_value("key4"));
+    table->clear();
+    ASSERT_EQ(300000U * 16, table->getFreeMemorySize());
+    delete table;
+    SMHashTable::destroy("shared_memory_bulk");
+}
+
+TEST(BULK, compressed) {
+    std::vector<std::pair<std::string, std::string>> data;
+    for (int i = 0; i < 1000; i++) {
+        data.emplace_back("key" + std::to_string(i), makeJsonBlob(200 + i));
+    }
+    auto table = new SMHashTable("shared_memory_bulk", 1000, 100000, 16, SMHashTable::CREATE,
+                                 SMHT_FEATURE_COMPRESSION);
+    ASSERT_TRUE(table->bulk_load(data.begin(), data.end(), 2));
+    for (auto &item : data) {
+        ASSERT_EQ(item.second, table->get_value(item.first));
+    }
+    delete table;
+    SMHashTable::destroy("shared_memory_bulk");
+}
+
+TEST(BULK, speed) {
+    std::vector<std::pair<std::string, std::string>> data;
+    for (int i = 0; i < 1000000; i++) {
+        data.emplace_back("key" + std::to_string(i), std::string(32, (char) ('a' + i % 26)));
+    }
+    auto table = new SMHashTable("shared_memory_bulk", 1000000, 6000000, 16, SMHashTable::CREATE);
+    auto timer = new TimeProfiler;
+    timer->start();
+    for (auto &item : data) {
+        table->set(item.first, item.second);
+    }
+    LOG_WARN << "set x1000000 - " << timer->get() << "s" << NL;
+    table->clear();
+
+    timer->start();
+    ASSERT_TRUE(table->bulk_load(data.begin(), data.end()));
+    LOG_WARN << "bulk_load x1000000 - " << timer->get() << "s" << NL;
+    ASSERT_EQ(data[12345].second, table->get_value(data[12345].first));
+    delete timer;
+    delete table;
+    SMHashTable::destroy("shared_memory_bulk");
+}
+
+TEST(RECOVERY, killed_writer) {
+    auto table = new SMHashTable("shared_memory_recovery", 1000, 30000, 16, SMHashTable::CREATE);
+    for (int round = 0; round < 100; round++) {
+        pid_t pid = fork();
+        ASSERT_NE(-1, pid);
+        if (pid == 0) {
+            //писатель убивается в произвольном месте, в том числе посреди дефрагментации
+            SMHashTable writer("shared_memory_recovery");
+            std::mt19937 random(round);
+            for (uint64_t i = 1;; i++) {
+                std::string key = "key" + std::to_string(random() % 3000);
+                if (random() % 4) {
+                    writer.set(key, key + "-" + std::string(random() % 64, 'x'));
+                } else {
+                    writer.unset(key);
+                }
+                if (i % 5000 == 0) {
+                    writer.hardDefragmentation();
+                }
+            }
+        }
+        usleep(1000 + round * 500);
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+
+        //первая же запись в брошенную полосу доводит или откатывает изменение
+        auto *timer = new TimeProfiler();
+        timer->start();
+        ASSERT_TRUE(table->set("key0", "key0-"));
+        LOG_INFO << "first set after kill - " << timer->get() << "s" << NL;
+        delete timer;
+
+        SMHashTable::verify_report report{};
+        table->verify(&report);
+        ASSERT_EQ(0U, report.lost_blocks);
+        ASSERT_EQ(0U, report.shared_blocks);
+        ASSERT_EQ(0U, report.bad_headers);
+        for (int i = 0; i < 3000; i++) {
+            std::string key = "key" + std::to_string(i);
+            std::string value = table->get_value(key);
+            ASSERT_TRUE(value.empty() || value.compare(0, key.size() + 1, key + "-") == 0) << key << " " << value;
+        }
+    }
+    //утечь могут только блоки, брошенные между двумя соседними записями журнала
+    SMHashTable::verify_report report{};
+    table->verify(&report, true);
+    LOG_INFO << "items " << report.items << ", leaked blocks " << report.leaked_blocks << NL;
+    ASSERT_TRUE(table->verify(&report));
+    ASSERT_TRUE(table->set("after", "recovery"));
+    ASSERT_STREQ("recovery", table->get_value("after"));
+    delete table;
+    SMHashTable::destroy("shared_memory_recovery");
+}
+
+TEST(LARGE, segment_over_4gb) {
+    //больше 4 ГБ одним сегментом; страницы tmpfs выделяются при записи, занято будет немного
+    ASSERT_FALSE(SMHashTable("shared_memory_large", 1000, 1UL << 32, 16, SMHashTable::CREATE).isOpen());
+    auto table = new SMHashTable("shared_memory_large", 1000, 80000000, 64, SMHashTable::CREATE);
+    ASSERT_TRUE(table->isOpen());
+    ASSERT_EQ(80000000UL * 64, table->getFreeMemorySize());
+
+    //у каждого потока своя арена, последние лежат за границей 4 ГБ
+    std::vector<std::thread> writers;
+    for (uint32_t t = 0; t < SMHT_MAX_ARENAS; t++) {
+        writers.emplace_back([table, t]() {
+            for (uint32_t i = 0; i < 10; i++) {
+                table->set("key" + std::to_string(t * 10 + i), "value" + std::to_string(t * 10 + i));
+            }
+        });
+    }
+    for (auto &writer: writers) {
+        writer.join();
+    }
+    //ключ со значением - блок, заголовок в цепочке коллизий - еще один
+    ASSERT_GE(80000000UL * 64 - SMHT_MAX_ARENAS * 10 * 64, table->getFreeMemorySize());
+    ASSERT_LE(80000000UL * 64 - SMHT_MAX_ARENAS * 20 * 64, table->getFreeMemorySize());
+    for (uint32_t i = 0; i < SMHT_MAX_ARENAS * 10; i++) {
+        ASSERT_STREQ(("value" + std::to_string(i)).c_str(), table->get_value("key" + std::to_string(i)));
+    }
+
+    for (uint32_t i = 0; i < SMHT_MAX_ARENAS * 10; i += 2) {
+        ASSERT_NE(0, table->unset("key" + std::to_string(i)));
+    }
+    table->hardDefragmentation();
+    //все оставшиеся блоки переехали в начало сегмента
+    ASSERT_EQ(table->getFreeMemorySize(), table->getLongestFreeBlockSize());
+    for (uint32_t i = 1; i < SMHT_MAX_ARENAS * 10; i += 2) {
+        ASSERT_STREQ(("value" + std::to_string(i)).c_str(), table->get_value("key" + std::to_string(i)));
+    }
+    ASSERT_TRUE(table->verify());
+    delete table;
+    SMHashTable::destroy("shared_memory_large");
+}
+
+TEST(HOTKEYS, top_keys) {
+    auto table = new SMHashTable("shared_memory_hot", 10000, 100000, 16, SMHashTable::CREATE, SMHT_FEATURE_HOTKEYS);
+    for (int i = 0; i < 1000; i++) {
+        ASSERT_TRUE(table->set("key" + std::to_string(i), "value"));
+    }
+    table->resetHotKeys();
+    //два горячих ключа на фоне равномерного чтения остальных
+    for (int round = 0; round < 100; round++) {
+        for (int i = 0; i < 1000; i++) {
+            table->get_value("key" + std::to_string(i));
+        }
+        for (int i = 0; i < 1000; i++) {
+            table->get_value("key7");
+        }
+        for (int i = 0; i < 500; i++) {
+            table->set("key42", "value" + std::to_string(i));
+        }
+    }
+    auto stats = table->hotKeys();
+    ASSERT_GE(stats.top.size(), 2U);
+    ASSERT_EQ("key7", stats.top[0].key);
+    ASSERT_EQ("key42", stats.top[1].key);
+    //оценка по выборке: 100100 обращений к key7 +- доля выборки и коллизии sketch
+    ASSERT_GT(stats.top[0].count, 90000U);
+    ASSERT_LT(stats.top[0].count, 120000U);
+    ASSERT_GT(stats.rate[SMHT_OP_GET], 0);
+    ASSERT_GT(stats.rate[SMHT_OP_SET], 0);
+    ASSERT_EQ(0, stats.rate[SMHT_OP_UNSET]);
+
+    //таблица без SMHT_FEATURE_HOTKEYS ничего не считает
+    auto plain = new SMHashTable("shared_memory_hot_plain", 10000, 100000, 16, SMHashTable::CREATE);
+    ASSERT_TRUE(plain->set("key", "value"));
+    ASSERT_TRUE(plain->hotKeys().top.empty());
+
+    auto timer = new TimeProfiler;
+    for (auto *t : {plain, table}) {
+        timer->start();
+        for (int i = 0; i < 1000000; i++) {
+            t->get_value("key" + std::to_string(i % 1000));
+        }
+        LOG_WARN << (t == table ? "Sampled" : "Plain") << " get x1000000 - " << timer->get() << "s" << NL;
+    }
+    delete timer;
+    delete plain;
+    delete table;
+    SMHashTable::destroy("shared_memory_hot");
+    SMHashTable::destroy("shared_memory_hot_plain");
+}
+
+TEST(RELEASE, unset_and_defragmentation) {
+    auto table = new SMHashTable("shared_memory_release", 20000, 200000, 64, SMHashTable::CREATE);
+    auto base = table->memInfo()->resident;
+    std::string value(200, 'x');
+    uint64_t data = 20000UL * 4 * 64;
+    for (int i = 0; i < 20000; i++) {
+        ASSERT_TRUE(table->set("key" + std::to_string(i), value));
+    }
+    auto *info = table->memInfo();
+    ASSERT_EQ(200000UL * 64 - table->getFreeMemorySize(), info->used);
+    //каждое значение - 4 блока данных, они легли в память
+    ASSERT_GT(info->resident, base + data * 9 / 10);
+    auto peak = info->resident;
+
+    //каждый второй ключ: целиком свободных кусков нет, держим почти весь пик
+    for (int i = 0; i < 20000; i += 2) {
+        ASSERT_NE(0, table->unset("key" + std::to_string(i)));
+    }
+    ASSERT_GT(table->memInfo()->resident, peak - data / 10);
+    //дефрагментация сдвигает данные к началу и отдает хвост
+    table->hardDefragmentation();
+    ASSERT_LT(table->memInfo()->resident, peak - data * 4 / 10);
+    for (int i = 1; i < 20000; i += 2) {
+        ASSERT_EQ(value, table->get_value("key" + std::to_string(i)));
+    }
+
+    //массовое удаление отдает страницы само, пачками; остаток добирает releaseMemory
+    for (int i = 1; i < 20000; i += 2) {
+        ASSERT_NE(0, table->unset("key" + std::to_string(i)));
+    }
+    ASSERT_LT(table->memInfo()->resident, peak - data / 2);
+    ASSERT_GT(table->releaseMemory(), 0U);
+    info = table->memInfo();
+    ASSERT_EQ(0U, info->used);
+    ASSERT_LT(info->resident, peak - data * 9 / 10);
+    ASSERT_TRUE(table->set("after", "release"));
+    ASSERT_STREQ("release", table->get_value("after"));
+    ASSERT_TRUE(table->verify());
+    delete table;
+    SMHashTable::destroy("shared_memory_release");
+}
+
+TEST(SPILL, overflow_to_file) {
+    SMHashTable::destroy("shared_memory_spill");
+    auto table = new SMHashTable("shared_memory_spill", 2000, 4000, 64, SMHashTable::CREATE, SMHT_FEATURE_SPILL);
+    //данных в 5 раз больше, чем влезает в сегмент: все записи проходят, холодное уходит в файл
+    std::string value(600, 'x');
+    for (int i = 0; i < 2000; i++) {
+        value[0] = (char) ('a' + i % 26);
+        ASSERT_TRUE(table->set("key" + std::to_string(i), value)) << i;
+    }
+    auto *info = table->memInfo();
+    ASSERT_GT(info->spilled, 1000UL * 600);
+    ASSERT_GT(info->spill_file, 0UL);
+    for (int i = 0; i < 2000; i++) {
+        value[0] = (char) ('a' + i % 26);
+        ASSERT_EQ(value, table->get_value("key" + std::to_string(i))) << i;
+    }
+    ASSERT_TRUE(table->verify());
+
+    //большое значение сразу пишется в файл, в сегменте остается только ключ
+    table->setSpillThreshold(4096);
+    std::string large(100000, 'L');
+    ASSERT_TRUE(table->set("large", large));
+    ASSERT_EQ(large, table->get_value("large"));
+
+    //удаленное и перезаписанное - мусор в файле, сжатие его возвращает
+    for (int i = 0; i < 2000; i += 2) {
+        ASSERT_NE(0, table->unset("key" + std::to_string(i)));
+    }
+    ASSERT_NE(0, table->unset("large"));
+    auto before = table->memInfo()->spilled;
+    ASSERT_TRUE(table->compactSpill(true));
+    ASSERT_LE(table->memInfo()->spilled, before);
+    for (int i = 1; i < 2000; i += 2) {
+        value[0] = (char) ('a' + i % 26);
+        ASSERT_EQ(value, table->get_value("key" + std::to_string(i))) << i;
+    }
+    ASSERT_TRUE(table->verify());
+
+    //после удаления места в сегменте хватает: прочитанные значения возвращаются из файла
+    for (int i = 1; i < 2000; i += 2) {
+        ASSERT_NE(0, table->unset("key" + std::to_string(i)));
+    }
+    for (int i = 0; i < 100; i++) {
+        ASSERT_TRUE(table->set("hot" + std::to_string(i), value));
+    }
+    table->setSpillThreshold(0);
+    ASSERT_TRUE(table->compactSpill(true));
+    info = table->memInfo();
+    ASSERT_EQ(0UL, info->spilled);
+    for (int i = 0; i < 100; i++) {
+        ASSERT_EQ(value, table->get_value("hot" + std::to_string(i)));
+    }
+    ASSERT_TRUE(table->verify());
+    delete table;
+    SMHashTable::destroy("shared_memory_spill");
+}
+
+TEST(SPILL, background_compactor) {
+    SMHashTable::destroy("shared_memory_spill");
+    auto table = new SMHashTable("shared_memory_spill", 1000, 2000, 64, SMHashTable::CREATE, SMHT_FEATURE_SPILL);
+    table->startSpillCompactor(10);
+    std::string value(300, 'v');
+    //перезаписи копят мусор в файле, компактор его убирает, пока идут записи и чтения
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < 1000; i++) {
+            value[0] = (char) ('a' + (i + round) % 26);
+            ASSERT_TRUE(table->set("key" + std::to_string(i), value));
+            ASSERT_EQ(value, table->get_value("key" + std::to_string(i)));
+        }
+    }
+    table->stopSpillCompactor();
+    for (int i = 0; i < 1000; i++) {
+        value[0] = (char) ('a' + (i + 19) % 26);
+        ASSERT_EQ(value, table->get_value("key" + std::to_string(i)));
+    }
+    ASSERT_LT(table->memInfo()->spilled, 1000UL * 300 * 3);
+    ASSERT_TRUE(table->verify());
+    delete table;
+    SMHashTable::destroy("shared_memory_spill");
+}
+
+TEST(TABLES, named_tables) {
+    auto space = new SMHashTable("shared_memory_tables", 1000, 20000, 64, SMHashTable::CREATE, 0, 5000);
+    auto users = space->openTable("users", 1000);
+    auto orders = space->openTable("orders", 2000);
+    ASSERT_NE(nullptr, users);
+    ASSERT_NE(nullptr, orders);
+    ASSERT_EQ(nullptr, space->openTable("missing"));
+    //в запасе осталось 2000 корзин
+    ASSERT_EQ(nullptr, space->openTable("huge", 3000));
+    ASSERT_EQ((std::vector<std::string>{"orders", "users"}), [&] {
+        auto names = space->tables();
+        std::sort(names.begin(), names.end());
+        return names;
+    }());
+
+    //одинаковые ключи в разных таблицах не пересекаются, память общая
+    auto free = space->getFreeMemorySize();
+    for (int i = 0; i < 1000; i++) {
+        auto key = "key" + std::to_string(i);
+        ASSERT_TRUE(space->set(key, "root" + std::to_string(i)));
+        ASSERT_TRUE(users->set(key, "user" + std::to_string(i)));
+        ASSERT_TRUE(orders->set(key, "order" + std::to_string(i)));
+    }
+    ASSERT_LT(space->getFreeMemorySize(), free);
+    ASSERT_EQ(space->getFreeMemorySize(), users->getFreeMemorySize());
+    for (int i = 0; i < 1000; i++) {
+        auto key = "key" + std::to_string(i);
+        ASSERT_EQ("root" + std::to_string(i), space->get_value(key));
+        ASSERT_EQ("user" + std::to_string(i), users->get_value(key));
+        ASSERT_EQ("order" + std::to_string(i), orders->get_value(key));
+    }
+    ASSERT_NE(0, users->unset("key0"));
+    ASSERT_STREQ("", users->get_value("key0"));
+    ASSERT_STREQ("order0", orders->get_value("key0"));
+    int count = 0;
+    users->forEach([&count](const std::string &, const std::string &val) {
+        ASSERT_EQ("user", val.substr(0, 4));
+        count++;
+    });
+    ASSERT_EQ(999, count);
+    ASSERT_TRUE(space->verify());
+
+    //другой процесс открывает ту же таблицу по имени через свое единственное отображение
+    auto attached = new SMHashTable("shared_memory_tables");
+    auto attached_users = attached->openTable("users");
+    ASSERT_NE(nullptr, attached_users);
+    ASSERT_STREQ("user5", attached_users->get_value("key5"));
+    attached_users.reset();
+    delete attached;
+
+    //очистка таблицы не трогает соседей
+    users->clear();
+    ASSERT_STREQ("", users->get_value("key5"));
+    ASSERT_STREQ("root5", space->get_value("key5"));
+    ASSERT_STREQ("order5", orders->get_value("key5"));
+
+    //удаленная таблица отдает память и корзины, их получает следующая
+    orders.reset();
+    free = space->getFreeMemorySize();
+    ASSERT_TRUE(space->dropTable("orders"));
+    ASSERT_FALSE(space->dropTable("orders"));
+    ASSERT_GT(space->getFreeMemorySize(), free);
+    ASSERT_EQ(nullptr, space->openTable("orders"));
+    ASSERT_EQ(nullptr, space->openTable("logs", 3000));
+    auto logs = space->openTable("logs", 1500);
+    ASSERT_NE(nullptr, logs);
+    ASSERT_STREQ("", logs->get_value("key5"));
+    ASSERT_TRUE(logs->set("key5", "log"));
+    ASSERT_STREQ("log", logs->get_value("key5"));
+
+    //основная таблица при живых именованных чистит только себя
+    space->clear();
+    ASSERT_STREQ("", space->get_value("key5"));
+    ASSERT_STREQ("log", logs->get_value("key5"));
+    ASSERT_TRUE(space->verify());
+    logs.reset();
+    users.reset();
+    delete space;
+    SMHashTable::destroy("shared_memory_tables");
+}
+
+TEST(REHASH, flooding) {
+    auto table = new SMHashTable("shared_memory_rehash", 1000, 20000, 64, SMHashTable::CREATE);
+    table->setChainLimit(16);
+    //ключи, которые под текущим семенем попадают в одну корзину
+    std::vector<std::string> keys{"flood"};
+    while (keys.size() < 40) {
+        auto key = RandomGenerator::getRandomString(8);
+        if (table->bucketOf(key) == table->bucketOf(keys[0])) {
+            keys.push_back(key);
+        }
+    }
+    for (auto &key : keys) {
+        ASSERT_TRUE(table->set(key, "v" + key));
+    }
+    //перехеширование идет в фоне, таблица все это время читается
+    for (int i = 0; i < 5000 && table->memInfo()->max_chain > 16; i++) {
+        for (auto &key : keys) {
+            ASSERT_EQ("v" + key, table->get_value(key));
+        }
+        usleep(1000);
+    }
+    auto meminfo = table->memInfo();
+    ASSERT_LE(meminfo->max_chain, 16U);
+    ASSERT_GT(meminfo->avg_chain, 0.0);
+    uint32_t moved = 0;
+    for (auto &key : keys) {
+        ASSERT_EQ("v" + key, table->get_value(key));
+        moved += table->bucketOf(key) != table->bucketOf(keys[0]);
+    }
+    ASSERT_GT(moved, 0U);
+    ASSERT_TRUE(table->verify());
+
+    //после перехеширования ключи живут по новому семени
+    ASSERT_NE(0, table->unset(keys[1]));
+    ASSERT_STREQ("", table->get_value(keys[1]));
+    delete table;
+    SMHashTable::destroy("shared_memory_rehash");
+}
+
+TEST(REHASH, concurrent_readers) {
+    auto table = new SMHashTable("shared_memory_rehash", 1000, 100000, 64, SMHashTable::CREATE);
+    for (int i = 0; i < 5000; i++) {
+        ASSERT_TRUE(table->set("key" + std::to_string(i), "value" + std::to_string(i)));
+    }
+    std::atomic<bool> stop{};
+    std::atomic<uint64_t> misses{};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; t++) {
+        readers.emplace_back([&, t]() {
+            std::mt19937 random(t);
+            while (!stop) {
+                auto i = std::to_string(random() % 5000);
+                //рядом пишут и удаляют, без pin блоки цепочки могут переиспользовать посреди чтения
+                auto guard = table->pin();
+                misses += table->get_value("key" + i) != "value" + i;
+            }
+        });
+    }
+    //писатель меняет свои ключи посреди переноса
+    std::thread writer([&]() {
+        for (int n = 0; !stop; n++) {
+            auto key = "writer" + std::to_string(n % 100);
+            table->set(key, std::to_string(n));
+            if (n % 3 == 0) {
+                table->unset(key);
+            }
+        }
+    });
+    for (int i = 0; i < 5; i++) {
+        ASSERT_TRUE(table->rehash());
+    }
+    stop = true;
+    for (auto &reader : readers) {
+        reader.join();
+    }
+    writer.join();
+    ASSERT_EQ(0U, misses.load());
+    ASSERT_TRUE(table->verify());
+    delete table;
+    SMHashTable::destroy("shared_memory_rehash");
+}
+
+TEST(SNAPSHOT, point_in_time) {
+    auto table = new SMHashTable("shared_memory_snapshot", 100, 10000, 64, SMHashTable::CREATE,
+                                 SMHT_FEATURE_SNAPSHOTS | SMHT_FEATURE_COMPRESSION);
+    std::string big(1000, 'b');
+    for (int i = 0; i < 500; i++) {
+        ASSERT_TRUE(table->set("key" + std::to_string(i), "value" + std::to_string(i)));
+    }
+    ASSERT_TRUE(table->set("big", big));
+    {
+        auto snapshot = table->snapshot();
+        ASSERT_TRUE(snapshot.valid());
+        //снимок не видит изменений после себя, таблица видит
+        for (int i = 0; i < 500; i += 2) {
+            ASSERT_TRUE(table->set("key" + std::to_string(i), "changed"));
+        }
+        for (int i = 1; i < 500; i += 4) {
+            ASSERT_NE(0, table->unset("key" + std::to_string(i)));
+        }
+        ASSERT_TRUE(table->set("new", "value"));
+        ASSERT_TRUE(table->set("big", "small"));
+        ASSERT_STREQ("changed", table->get_value("key0"));
+        ASSERT_GT(table->memInfo()->undo_used, 0U);
+
+        std::string value;
+        ASSERT_TRUE(snapshot.get("key0", &value));
+        ASSERT_EQ("value0", value);
+        ASSERT_TRUE(snapshot.get("key1", &value));
+        ASSERT_EQ("value1", value);
+        ASSERT_TRUE(snapshot.get("big", &value));
+        ASSERT_EQ(big, value);
+        ASSERT_FALSE(snapshot.get("new", &value));
+        ASSERT_FALSE(snapshot.get("missing", &value));
+
+        //перехеширование и дефрагментация меняют корзины и блоки, но не снимок
+        ASSERT_TRUE(table->rehash());
+        table->hardDefragmentation();
+        //очистка при живом снимке идет по одному ключу
+        auto later = table->snapshot();
+        table->clear();
+        ASSERT_STREQ("", table->get_value("key3"));
+        ASSERT_TRUE(later.get("key3", &value));
+        ASSERT_EQ("value3", value);
+        ASSERT_FALSE(later.get("key1", &value));
+        ASSERT_TRUE(later.get("new", &value));
+
+        std::map<std::string, std::string> items;
+        ASSERT_TRUE(snapshot.forEach([&](const std::string &key, const std::string &val) {
+            ASSERT_TRUE(items.emplace(key, val).second);
+        }));
+        ASSERT_EQ(501U, items.size());
+        for (int i = 0; i < 500; i++) {
+            ASSERT_EQ("value" + std::to_string(i), items["key" + std::to_string(i)]);
+        }
+        ASSERT_FALSE(table->bulk_load(items.begin(), items.end()));
+    }
+    //отпущенные снимки не держат журнал, таблица без снимков чистится целиком
+    ASSERT_EQ(0U, table->memInfo()->undo_used);
+    table->clear();
+    ASSERT_TRUE(table->verify());
+
+    //без SMHT_FEATURE_SNAPSHOTS снимка нет
+    auto plain = new SMHashTable("shared_memory_plain", 100, 1000, 64, SMHashTable::CREATE);
+    ASSERT_FALSE(plain->snapshot().valid());
+    delete plain;
+    SMHashTable::destroy("shared_memory_plain");
+    delete table;
+    SMHashTable::destroy("shared_memory_snapshot");
+}
+
+TEST(SNAPSHOT, concurrent_writers) {
+    //писатель по кругу переписывает ключи по порядку номером круга: в согласованном срезе номера
+    //не растут с номером ключа и отличаются не больше чем на 1
+    const int keys = 2000;
+    auto table = new SMHashTable("shared_memory_snapshot", keys, 100000, 64, SMHashTable::CREATE,
+                                 SMHT_FEATURE_SNAPSHOTS);
+    for (int i = 0; i < keys; i++) {
+        ASSERT_TRUE(table->set("key" + std::to_string(i), "0"));
+    }
+    std::atomic<bool> stop{};
+    std::atomic<uint64_t> writes{};
+    std::thread writer([&]() {
+        for (int round = 1; !stop; round++) {
+            for (int i = 0; i < keys; i++) {
+                ASSERT_TRUE(table->set("key" + std::to_string(i), std::to_string(round)));
+                writes++;
+            }
+        }
+    });
+    for (int n = 0; n < 20; n++) {
+        auto snapshot = table->snapshot();
+        uint64_t before = writes;
+        std::vector<int> rounds(keys, -1);
+        ASSERT_TRUE(snapshot.forEach([&](const std::string &key, const std::string &val) {
+            rounds[std::stoi(key.substr(3))] = std::stoi(val);
+            //медленный экспорт: писатель за это время успевает уйти вперед
+            if (std::stoi(key.substr(3)) % 100 == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }));
+        ASSERT_GT(writes.load(), before);
+        for (int i = 1; i < keys; i++) {
+            ASSERT_LE(rounds[i], rounds[i - 1]);
+        }
+        ASSERT_LE(rounds[0] - rounds[keys - 1], 1);
+    }
+    stop = true;
+    writer.join();
+    ASSERT_TRUE(table->verify());
+    delete table;
+    SMHashTable::destroy("shared_memory_snapshot");
+}
+
+TEST(SNAPSHOT, overflow) {
+    //журнал - четверть данных: переписав все значения много раз, его переполняем, писатели не ждут
+    auto table = new SMHashTable("shared_memory_snapshot", 100, 1000, 64, SMHashTable::CREATE,
+                                 SMHT_FEATURE_SNAPSHOTS);
+    for (int i = 0; i < 100; i++) {
+        ASSERT_TRUE(table->set("key" + std::to_string(i), "value"));
+    }
+    {
+        auto first = table->snapshot();
+        //снимок в журнале места не занимает, пока корзины не меняют
+        auto second = table->snapshot();
+        for (int i = 0; i < 100; i++) {
+            ASSERT_TRUE(table->set("key" + std::to_string(i), std::string(40, 'x')));
+        }
+        ASSERT_TRUE(first.valid());
+        std::string value;
+        ASSERT_TRUE(second.get("key5", &value));
+        ASSERT_EQ("value", value);
+        for (int round = 0; round < 100 && first.valid(); round++) {
+            auto pinned = table->snapshot();
+            for (int i = 0; i < 100; i++) {
+                ASSERT_TRUE(table->set("key" + std::to_string(i), std::to_string(round)));
+            }
+        }
+        ASSERT_FALSE(first.valid());
+        ASSERT_FALSE(second.get("key5", &value));
+        ASSERT_FALSE(second.forEach([](const std::string &, const std::string &) {}));
+        //новый снимок после поломки работает
+        auto fresh = table->snapshot();
+        ASSERT_TRUE(table->set("key5", "after"));
+        ASSERT_TRUE(fresh.get("key5", &value));
+        ASSERT_NE("after", value);
+    }
+    delete table;
+    SMHashTable::destroy("shared_memory_snapshot");
+}
+
+TEST(ORDERED, prefix_and_range) {
+    auto table = new SMHashTable("shared_memory_ordered", 1000, 200000, 64, SMHashTable::CREATE,
+                                 SMHT_FEATURE_ORDERED, 1000);
+    auto collect = [](SMHashTable::range_iterator it) {
+        std::vector<std::string> keys;
+        std::string key;
+        while (it.next(&key)) {
+            keys.push_back(key);
+        }
+        return keys;
+    };
+    auto expect = [](const std::set<std::string> &keys, const std::string &lo, const std::string &hi) {
+        return std::vector<std::string>(keys.lower_bound(lo), hi.empty() ? keys.end() : keys.lower_bound(hi));
+    };
+    //иерархические ключи вразнобой, дерево несколько раз делится до корня
+    std::vector<std::string> keys;
+    for (int t = 0; t < 10; t++) {
+        for (int u = 0; u < 50; u++) {
+            for (int s = 0; s < 40; s++) {
+                keys.push_back("tenant" + std::to_string(t) + ":user" + std::to_string(u) + ":session" +
+                               std::to_string(s));
+            }
+        }
+    }
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(7));
+    std::set<std::string> expected(keys.begin(), keys.end());
+    for (auto &key : keys) {
+        ASSERT_TRUE(table->set(key, "v" + key));
+    }
+    //перезапись ключ не повторяет
+    for (size_t i = 0; i < 1000; i++) {
+        ASSERT_TRUE(table->set(keys[i], "w" + keys[i]));
+    }
+    ASSERT_GT(table->memInfo()->index_used, (uint64_t) SMHT_INDEX_NODE * 10);
+
+    ASSERT_EQ(std::vector<std::string>(expected.begin(), expected.end()), collect(table->range("")));
+    ASSERT_EQ(expect(expected, "tenant3:", "tenant3;"), collect(table->range("tenant3:")));
+    ASSERT_EQ(2000U, collect(table->range("tenant3:")).size());
+    ASSERT_EQ(40U, collect(table->range("tenant3:user7:")).size());
+    ASSERT_EQ(expect(expected, "tenant2:user10", "tenant2:user20"), collect(table->range("tenant2:user10", "tenant2:user20")));
+    ASSERT_EQ(expect(expected, "tenant8", ""), collect(table->range("tenant8", "")));
+    ASSERT_TRUE(collect(table->range("tenant10:")).empty());
+    ASSERT_TRUE(collect(table->range("tenant3", "tenant3")).empty());
+
+    //значения на момент выдачи
+    auto it = table->range("tenant1:user1:");
+    std::string key;
+    std::string value;
+    while (it.next(&key, &value)) {
+        ASSERT_EQ((std::find(keys.begin(), keys.begin() + 1000, key) != keys.begin() + 1000 ? "w" : "v") + key, value);
+    }
+
+    //удаление: опустевшие листья уходят из дерева
+    for (auto &key : keys) {
+        if (key.compare(0, 8, "tenant5:") == 0 || key.find(":session1") != std::string::npos) {
+            ASSERT_NE(0, table->unset(key));
+            expected.erase(key);
+        }
+    }
+    ASSERT_TRUE(collect(table->range("tenant5:")).empty());
+    ASSERT_EQ(std::vector<std::string>(expected.begin(), expected.end()), collect(table->range("")));
+    ASSERT_EQ(expect(expected, "tenant4:user49", "tenant6"), collect(table->range("tenant4:user49", "tenant6")));
+
+    //ключи именованной таблицы в том же дереве, но обходы таблиц их не смешивают
+    auto other = table->openTable("other", 100);
+    ASSERT_TRUE(other->set("tenant3:user7:session0", "other"));
+    ASSERT_TRUE(other->set("zzz", "other"));
+    ASSERT_EQ(std::vector<std::string>({"tenant3:user7:session0", "zzz"}), collect(other->range("")));
+    ASSERT_EQ(expected.size(), collect(table->range("")).size());
+    ASSERT_EQ(std::vector<std::string>({"zzz"}), collect(other->range("z")));
+
+    //слишком длинный ключ индекс не принимает
+    ASSERT_FALSE(table->set(std::string(SMHT_INDEX_KEY_MAX, 'k'), "value"));
+    ASSERT_TRUE(table->set(std::string(SMHT_INDEX_KEY_MAX - SMHT_INDEX_PREFIX, 'k'), "value"));
+    ASSERT_EQ(1U, collect(table->range("kkk")).size());
+
+    uint64_t used = table->memInfo()->index_used;
+    for (auto &key : collect(table->range(""))) {
+        ASSERT_NE(0, table->unset(key));
+    }
+    ASSERT_TRUE(collect(table->range("")).empty());
+    ASSERT_LT(table->memInfo()->index_used, used / 10);
+    other.reset();
+    ASSERT_TRUE(table->dropTable("other"));
+    table->clear();
+    ASSERT_TRUE(collect(table->range("")).empty());
+
+    //заливка строит индекс тоже
+    std::vector<std::pair<std::string, std::string>> items;
+    for (int i = 0; i < 5000; i++) {
+        items.emplace_back("bulk:" + std::to_string(i), std::to_string(i));
+    }
+    ASSERT_TRUE(table->bulk_load(items.begin(), items.end(), 2));
+    ASSERT_EQ(5000U, collect(table->range("bulk:")).size());
+    ASSERT_EQ(1111U, collect(table->range("bulk:1")).size());
+    ASSERT_TRUE(table->verify());
+    delete table;
+    SMHashTable::destroy("shared_memory_ordered");
+
+    //без SMHT_FEATURE_ORDERED обход пуст
+    table = new SMHashTable("shared_memory_ordered", 100, 1000, 64, SMHashTable::CREATE);
+    ASSERT_TRUE(table->set("key", "value"));
+    ASSERT_TRUE(collect(table->range("")).empty());
+    delete table;
+    SMHashTable::destroy("shared_memory_ordered");
+}
+
+TEST(ORDERED, concurrent_readers) {
+    //постоянные ключи обход всегда видит все и по одному разу, пока рядом с ними добавляют и удаляют другие
+    const int stable = 3000;
+    auto table = new SMHashTable("shared_memory_ordered", 5000, 200000, 64, SMHashTable::CREATE,
+                                 SMHT_FEATURE_ORDERED);
+    char name[32];
+    for (int i = 0; i < stable; i++) {
+        snprintf(name, sizeof(name), "a:%05d", i);
+        ASSERT_TRUE(table->set(name, "stable"));
+    }
+    std::atomic<bool> stop{};
+    std::atomic<uint64_t> writes{};
+    std::thread writer([&]() {
+        char churn[32];
+        for (int round = 0; !stop; round++) {
+            for (int i = 0; i < stable && !stop; i += 7) {
+                snprintf(churn, sizeof(churn), "a:%05d.%d", i, round % 3);
+                ASSERT_TRUE(table->set(churn, "churn"));
+                snprintf(churn, sizeof(churn), "a:%05d.%d", i, (round + 1) % 3);
+                table->unset(churn);
+                writes++;
+            }
+        }
+    });
+    for (int n = 0; n < 30; n++) {
+        auto it = table->range("a:");
+        std::string key;
+        std::string previous;
+        int seen = 0;
+        uint64_t before = writes;
+        while (it.next(&key)) {
+            ASSERT_LT(previous, key);
+            previous = key;
+            if (key.find('.') == std::string::npos) {
+                snprintf(name, sizeof(name), "a:%05d", seen++);
+                ASSERT_EQ(name, key);
+            }
+            if (seen % 500 == 0) {
+                std::this_thread::yield();
+            }
+        }
+        ASSERT_EQ(stable, seen);
+        if (n % 10 == 9) {
+            ASSERT_GT(writes.load(), before);
+        }
+    }
+    stop = true;
+    writer.join();
+    ASSERT_TRUE(table->verify());
+    delete table;
+    SMHashTable::destroy("shared_memory_ordered");
+}
+
+TEST(ORDERED, killed_writer) {
+    //писатель убивается в том числе посреди разделения узлов: обход отдает ровно живые ключи
+    auto table = new SMHashTable("shared_memory_ordered", 1000, 30000, 64, SMHashTable::CREATE,
+                                 SMHT_FEATURE_ORDERED);
+    for (int round = 0; round < 30; round++) {
+        pid_t pid = fork();
+        ASSERT_NE(-1, pid);
+        if (pid == 0) {
+            SMHashTable writer("shared_memory_ordered");
+            std::mt19937 random(round);
+            for (;;) {
+                std::string key = "key" + std::to_string(random() % 3000);
+                if (random() % 4) {
+                    writer.set(key, key);
+                } else {
+                    writer.unset(key);
+                }
+            }
+        }
+        usleep(1000 + round * 500);
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+
+        ASSERT_TRUE(table->set("key0", "key0"));
+        std::set<std::string> live;
+        for (int i = 0; i < 3000; i++) {
+            std::string key = "key" + std::to_string(i);
+            if (*table->get_value(key)) {
+                live.insert(key);
+            }
+        }
+        auto it = table->range("key");
+        std::set<std::string> seen;
+        std::string key;
+        while (it.next(&key)) {
+            ASSERT_TRUE(seen.insert(key).second) << key;
+        }
+        ASSERT_EQ(live, seen);
+    }
+    delete table;
+    SMHashTable::destroy("shared_memory_ordered");
+}
+
+TEST(ORDERED, writer_killed_during_range) {
+    //обход уже идет, когда писателя убивают: очистка дерева при восстановлении не должна терять ключи
+    auto table = new SMHashTable("shared_memory_ordered", 1000, 30000, 64, SMHashTable::CREATE,
+                                 SMHT_FEATURE_ORDERED);
+    for (int i = 0; i < 2000; i++) {
+        ASSERT_TRUE(table->set("stable" + std::to_string(i), "v"));
+    }
+    for (int round = 0; round < 30; round++) {
+        pid_t pid = fork();
+        ASSERT_NE(-1, pid);
+        if (pid == 0) {
+            SMHashTable writer("shared_memory_ordered");
+            std::mt19937 random(round);
+            for (;;) {
+                std::string key = "key" + std::to_string(random() % 3000);
+                if (random() % 4) {
+                    writer.set(key, key);
+                } else {
+                    writer.unset(key);
+                }
+            }
+        }
+        usleep(1000 + round * 500);
+        auto it = table->range("stable");
+        std::set<std::string> seen;
+        std::string key;
+        for (int i = 0; i < 500 && it.next(&key); i++) {
+            seen.insert(key);
+        }
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        //первый, кто возьмет мьютекс индекса, очистит дерево посреди обхода
+        table->unset("key0");
+        while (it.next(&key)) {
+            ASSERT_TRUE(seen.insert(key).second) << key;
+        }
+        ASSERT_EQ(2000U, seen.size());
+    }
+    delete table;
+    SMHashTable::destroy("shared_memory_ordered");
+}
@@ -0,0 +1,189 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "TestUtils.h"
+#include "../SMHashTable.h"
+#include "../tools/SMMemcachedServer.h"
+
+
+static int connect_unix(const std::string &path) {
+    struct sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool send_all(int fd, const std::string &data) {
+    for (size_t sent = 0; sent < data.size();) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+static std::string recv_exactly(int fd, size_t size) {
+    std::string result(size, '\0');
+    for (size_t got = 0; got < size;) {
+        ssize_t n = recv(fd, &result[got], size - got, 0);
+        if (n <= 0) {
+            result.resize(got);
+            break;
+        }
+        got += n;
+    }
+    return result;
+}
+
+static std::string binary_request(uint8_t opcode, const std::string &key, const std::string &extras = "",
+                                  const std::string &value = "", uint32_t opaque = 0) {
+    std::string request(SMMC_BIN_HEADER, '\0');
+    request[0] = (char) SMMC_BIN_REQUEST;
+    request[1] = (char) opcode;
+    uint16_t key_length = htons(key.size());
+    memcpy(&request[2], &key_length, sizeof(key_length));
+    request[4] = (char) extras.size();
+    uint32_t body = htonl(extras.size() + key.size() + value.size());
+    memcpy(&request[8], &body, sizeof(body));
+    memcpy(&request[12], &opaque, sizeof(opaque));
+    return request + extras + key + value;
+}
+
+TEST(MEMCACHED, text_pipeline) {
+    auto table = new SMHashTable("shared_memory_memcached", 1000, 10000, 64, SMSegment::CREATE);
+    SMMemcachedServer::options opts;
+    opts.unix_path = "/tmp/smc_memcached_test.sock";
+    opts.threads = 2;
+    auto server = new SMMemcachedServer(table, opts);
+    ASSERT_TRUE(server->start());
+
+    int fd = connect_unix(opts.unix_path);
+    ASSERT_GE(fd, 0);
+    //весь пакет одной записью, ответы приходят по порядку
+    std::string binary_value("a\0b\r\nc", 6);
+    ASSERT_TRUE(send_all(fd, "set k1 5 0 2\r\nv1\r\n"
+                             "set k2 0 0 6\r\n" + binary_value + "\r\n"
+                             "set k3 0 0 0 noreply\r\n\r\n"
+                             "get k1 missing k2 k3\r\n"
+                             "gets k1\r\n"
+                             "delete k1\r\n"
+                             "delete k1\r\n"
+                             "bogus\r\n"
+                             "get k1\r\n"));
+    std::string expected = "STORED\r\nSTORED\r\n"
+                           "VALUE k1 0 2\r\nv1\r\nVALUE k2 0 6\r\n" + binary_value + "\r\nVALUE k3 0 0\r\n\r\nEND\r\n"
+                           "VALUE k1 0 2 0\r\nv1\r\nEND\r\n"
+                           "DELETED\r\nNOT_FOUND\r\nERROR\r\nEND\r\n";
+    ASSERT_EQ(expected, recv_exactly(fd, expected.size()));
+
+    //запрос, разрезанный на несколько записей
+    ASSERT_TRUE(send_all(fd, "set split 0 0 5\r\nab"));
+    usleep(20000);
+    ASSERT_TRUE(send_all(fd, "cde\r\nget sp"));
+    usleep(20000);
+    ASSERT_TRUE(send_all(fd, "lit\r\n"));
+    expected = "STORED\r\nVALUE split 0 5\r\nabcde\r\nEND\r\n";
+    ASSERT_EQ(expected, recv_exactly(fd, expected.size()));
+    ASSERT_STREQ("abcde", table->get_value("split"));
+
+    ASSERT_TRUE(send_all(fd, "quit\r\n"));
+    ASSERT_EQ("", recv_exactly(fd, 1));
+    close(fd);
+
+    auto stats = server->getStats();
+    ASSERT_EQ(7U, stats.cmd_get);
+    ASSERT_EQ(5U, stats.get_hits);
+    ASSERT_EQ(4U, stats.cmd_set);
+    delete server;
+    delete table;
+    SMSegment::destroy("shared_memory_memcached");
+}
+
+TEST(MEMCACHED, binary) {
+    auto table = new SMHashTable("shared_memory_memcached", 1000, 10000, 64, SMSegment::CREATE);
+    SMMemcachedServer::options opts;
+    opts.tcp_port = 0;
+    auto server = new SMMemcachedServer(table, opts);
+    ASSERT_TRUE(server->start());
+    ASSERT_GT(server->tcpPort(), 0);
+
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server->tcpPort());
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(0, connect(fd, (struct sockaddr *) &addr, sizeof(addr)));
+
+    std::string extras(8, '\0');
+    //SETQ и GETQ с промахом молчат, NOOP закрывает пакет
+    ASSERT_TRUE(send_all(fd, binary_request(SMMC_BIN_SETQ, "key", extras, "value", 1) +
+                             binary_request(SMMC_BIN_GETQ, "missing", "", "", 2) +
+                             binary_request(SMMC_BIN_GETK, "key", "", "", 3) +
+                             binary_request(SMMC_BIN_DELETE, "missing", "", "", 4) +
+                             binary_request(SMMC_BIN_NOOP, "", "", "", 5)));
+    auto response = recv_exactly(fd, SMMC_BIN_HEADER + 4 + 3 + 5);
+    ASSERT_EQ((char) SMMC_BIN_RESPONSE, response[0]);
+    ASSERT_EQ(SMMC_BIN_GETK, response[1]);
+    ASSERT_EQ(3, response[12]);
+    ASSERT_EQ("keyvalue", response.substr(SMMC_BIN_HEADER + 4));
+
+    response = recv_exactly(fd, SMMC_BIN_HEADER + 9);
+    ASSERT_EQ(SMMC_BIN_DELETE, response[1]);
+    ASSERT_EQ(SMMC_STATUS_NOT_FOUND, response[7]);
+    ASSERT_EQ("Not found", response.substr(SMMC_BIN_HEADER));
+
+    response = recv_exactly(fd, SMMC_BIN_HEADER);
+    ASSERT_EQ(SMMC_BIN_NOOP, response[1]);
+    ASSERT_EQ(5, response[12]);
+    ASSERT_STREQ("value", table->get_value("key"));
+
+    ASSERT_TRUE(send_all(fd, binary_request(0x42, "")));
+    response = recv_exactly(fd, SMMC_BIN_HEADER);
+    ASSERT_EQ((char) SMMC_STATUS_UNKNOWN, response[7]);
+    close(fd);
+    delete server;
+    delete table;
+    SMSegment::destroy("shared_memory_memcached");
+}
+
+TEST(MEMCACHED, slow_reader) {
+    auto table = new SMHashTable("shared_memory_memcached", 1000, 100000, 512, SMSegment::CREATE);
+    std::string value(256 * 1024, 'x');
+    ASSERT_TRUE(table->set("big", value));
+    SMMemcachedServer::options opts;
+    opts.unix_path = "/tmp/smc_memcached_test.sock";
+    auto server = new SMMemcachedServer(table, opts);
+    ASSERT_TRUE(server->start());
+
+    int fd = connect_unix(opts.unix_path);
+    ASSERT_GE(fd, 0);
+    //ответы на 8 запросов не влезают в сокет: хвост копируется, а значение можно менять и удалять
+    std::string request;
+    for (int i = 0; i < 8; i++) {
+        request += "get big\r\n";
+    }
+    ASSERT_TRUE(send_all(fd, request));
+    usleep(100000);
+    ASSERT_NE(0, table->unset("big"));
+    table->hardDefragmentation();
+    ASSERT_TRUE(table->set("big", std::string(value.size(), 'y')));
+
+    std::string header = "VALUE big 0 " + std::to_string(value.size()) + "\r\n";
+    auto response = recv_exactly(fd, 8 * (header.size() + value.size() + 2 + 5));
+    ASSERT_EQ(8 * (header.size() + value.size() + 2 + 5), response.size());
+    ASSERT_EQ(header + value + "\r\nEND\r\n", response.substr(0, header.size() + value.size() + 7));
+    ASSERT_EQ(std::string::npos, response.find('y'));
+    close(fd);
+    delete server;
+    delete table;
+    SMSegment::destroy("shared_memory_memcached");
+}
@@ -0,0 +1,116 @@
+#include <atomic>
+#include <random>
+#include <thread>
+#include "TestUtils.h"
+#include "../SMHashTable.h"
+#include "../SMReadCache.h"
+
+
+TEST(READCACHE, coherence) {
+    auto table = new SMHashTable("shared_memory_cache", 1000, 10000, 64, SMHashTable::CREATE);
+    //писатель - другой экземпляр, как будто другой процесс
+    auto writer = new SMHashTable("shared_memory_cache");
+    SMReadCache cache(table);
+    ASSERT_TRUE(writer->set("key", "value"));
+    ASSERT_STREQ("value", cache.get_value("key"));
+    ASSERT_STREQ("value", cache.get_value("key"));
+    ASSERT_EQ(1U, cache.getStats().hits);
+
+    ASSERT_TRUE(writer->set("key", "changed"));
+    ASSERT_STREQ("changed", cache.get_value("key"));
+    ASSERT_EQ(1U, cache.getStats().stale);
+    ASSERT_NE(0, writer->unset("key"));
+    ASSERT_EQ(nullptr, cache.get("key"));
+    //отсутствие тоже запоминается и сбрасывается записью
+    ASSERT_EQ(nullptr, cache.get("key"));
+    ASSERT_EQ(2U, cache.getStats().hits);
+    ASSERT_TRUE(writer->set("key", "back"));
+    ASSERT_STREQ("back", cache.get_value("key"));
+
+    //вытеснение: в кеше из одной пары ячеек новый ключ не вытесняет оба горячих
+    ASSERT_TRUE(writer->set("a", "1"));
+    ASSERT_TRUE(writer->set("b", "2"));
+    SMReadCache pair(table, 1);
+    ASSERT_STREQ("back", pair.get_value("key"));
+    ASSERT_STREQ("back", pair.get_value("key"));
+    ASSERT_STREQ("1", pair.get_value("a"));
+    ASSERT_STREQ("1", pair.get_value("a"));
+    ASSERT_STREQ("2", pair.get_value("b"));
+    ASSERT_EQ(2U, pair.getStats().hits);
+    ASSERT_EQ(3U, pair.getStats().misses);
+    //следующий промах занимает ячейку, к которой с тех пор не обращались
+    ASSERT_STREQ("back", pair.get_value("key"));
+    ASSERT_STREQ("2", pair.get_value("b"));
+    ASSERT_STREQ("2", pair.get_value("b"));
+    ASSERT_STREQ("back", pair.get_value("key"));
+    ASSERT_STREQ("1", pair.get_value("a"));
+    ASSERT_EQ(5U, pair.getStats().hits);
+    ASSERT_EQ(5U, pair.getStats().misses);
+
+    writer->clear();
+    ASSERT_STREQ("", cache.get_value("key"));
+    ASSERT_TRUE(writer->set("key", "after rehash"));
+    ASSERT_STREQ("after rehash", cache.get_value("key"));
+    ASSERT_TRUE(writer->rehash());
+    ASSERT_STREQ("after rehash", cache.get_value("key"));
+    ASSERT_TRUE(writer->set("key", "moved"));
+    ASSERT_STREQ("moved", cache.get_value("key"));
+    delete writer;
+    delete table;
+    SMHashTable::destroy("shared_memory_cache");
+}
+
+TEST(READCACHE, skewed_speed) {
+    //чтение почти только горячих ключей, редкий писатель обновляет часть из них
+    const uint32_t keys = 100000;
+    const uint32_t reads = 2000000;
+    auto table = new SMHashTable("shared_memory_cache", keys, keys * 4, 64, SMHashTable::CREATE);
+    for (uint32_t i = 0; i < keys; i++) {
+        ASSERT_TRUE(table->set("key" + std::to_string(i), "value" + std::to_string(i)));
+    }
+    std::vector<std::string> workload;
+    std::mt19937 random(1);
+    for (uint32_t i = 0; i < 65536; i++) {
+        //90% обращений к 1% ключей
+        uint32_t key = random() % 10 ? random() % (keys / 100) : random() % keys;
+        workload.push_back("key" + std::to_string(key));
+    }
+
+    std::atomic<bool> stop{};
+    std::thread writer([&]() {
+        for (uint32_t n = 0; !stop; n++) {
+            auto i = std::to_string(n % (keys / 100));
+            table->set("key" + i, "value" + i);
+            usleep(100);
+        }
+    });
+
+    auto timer = new TimeProfiler;
+    timer->start();
+    uint64_t checksum = 0;
+    for (uint32_t i = 0; i < reads; i++) {
+        checksum += table->get_value(workload[i % workload.size()])[5];
+    }
+    double shared = timer->get();
+
+    SMReadCache cache(table);
+    timer->start();
+    uint64_t cached_checksum = 0;
+    for (uint32_t i = 0; i < reads; i++) {
+        cached_checksum += cache.get_value(workload[i % workload.size()])[5];
+    }
+    double local = timer->get();
+    stop = true;
+    writer.join();
+
+    auto stats = cache.getStats();
+    LOG_WARN << "get_value - " << shared << "s, read cache - " << local << "s, hits "
+             << (double) stats.hits / reads << ", stale " << stats.stale << NL;
+    ASSERT_EQ(checksum, cached_checksum);
+    ASSERT_GT(stats.hits, reads / 2);
+    for (uint32_t i = 0; i < keys; i += 97) {
+        ASSERT_STREQ(table->get_value("key" + std::to_string(i)), cache.get_value("key" + std::to_string(i)));
+    }
+    delete table;
+    SMHashTable::destroy("shared_memory_cache");
+}
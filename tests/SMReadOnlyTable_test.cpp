@@ -0,0 +1,91 @@
+#include <map>
+#include "TestUtils.h"
+#include "../SMHashTable.h"
+#include "../SMReadOnlyTable.h"
+
+
+TEST(SMReadOnlyTable, lookup) {
+    std::vector<std::pair<std::string, std::string>> data;
+    for (int i = 0; i < 100000; i++) {
+        data.emplace_back("key" + std::to_string(i), "value" + std::to_string(i));
+    }
+    data.emplace_back("key7", "again");
+    ASSERT_TRUE(SMReadOnlyTable::build("shared_memory_ro", data.begin(), data.end()));
+
+    SMReadOnlyTable table("shared_memory_ro");
+    ASSERT_TRUE(table.isOpen());
+    ASSERT_EQ(100000U, table.size());
+    for (int i = 0; i < 100000; i++) {
+        auto expected = i == 7 ? std::string("again") : "value" + std::to_string(i);
+        ASSERT_STREQ(expected.c_str(), table.get_value("key" + std::to_string(i)));
+    }
+    for (int i = 0; i < 100000; i++) {
+        ASSERT_STREQ("", table.get_value("miss" + std::to_string(i)));
+    }
+
+    char buffer[16];
+    ASSERT_EQ(7, table.get("key10", buffer, sizeof(buffer)));
+    ASSERT_STREQ("value10", buffer);
+    ASSERT_EQ(7, table.get("key10", buffer, 3));
+    ASSERT_EQ(-1, table.get("miss", buffer, sizeof(buffer)));
+    SMReadOnlyTable::destroy("shared_memory_ro");
+}
+
+TEST(SMReadOnlyTable, swap_version) {
+    std::map<std::string, std::string> first{{"a", "1"}, {"b", "2"}};
+    std::map<std::string, std::string> second{{"a", "10"}, {"c", "30"}};
+    ASSERT_TRUE(SMReadOnlyTable::build("shared_memory_ro", first.begin(), first.end()));
+    SMReadOnlyTable table("shared_memory_ro");
+    ASSERT_FALSE(table.reload());
+
+    //старая версия читается, пока читатель не перешел на новую
+    ASSERT_TRUE(SMReadOnlyTable::build("shared_memory_ro", second.begin(), second.end()));
+    ASSERT_STREQ("2", table.get_value("b"));
+    ASSERT_TRUE(table.reload());
+    ASSERT_STREQ("10", table.get_value("a"));
+    ASSERT_STREQ("", table.get_value("b"));
+    ASSERT_STREQ("30", table.get_value("c"));
+
+    std::map<std::string, std::string> empty;
+    ASSERT_TRUE(SMReadOnlyTable::build("shared_memory_ro", empty.begin(), empty.end()));
+    ASSERT_TRUE(table.reload());
+    ASSERT_EQ(0U, table.size());
+    ASSERT_STREQ("", table.get_value("a"));
+    SMReadOnlyTable::destroy("shared_memory_ro");
+}
+
+TEST(SMReadOnlyTable, perfomance) {
+    std::vector<std::pair<std::string, std::string>> data;
+    for (int i = 0; i < 1000000; i++) {
+        data.emplace_back("key" + std::to_string(i), std::string(32, (char) ('a' + i % 26)));
+    }
+    auto timer = new TimeProfiler;
+    timer->start();
+    ASSERT_TRUE(SMReadOnlyTable::build("shared_memory_ro", data.begin(), data.end()));
+    LOG_WARN << "Build x1000000 - " << timer->get() << "s" << NL;
+
+    auto chained = new SMHashTable("shared_memory_ro_chained", 1000000, 6000000, 16, SMHashTable::CREATE);
+    chained->bulk_load(data.begin(), data.end());
+    SMReadOnlyTable table("shared_memory_ro");
+
+    uint64_t found = 0;
+    timer->start();
+    for (auto &item : data) {
+        found += *table.get_value(item.first) != 0;
+    }
+    LOG_WARN << "Read-only get x1000000 - " << timer->get() << "s" << NL;
+    ASSERT_EQ(data.size(), found);
+
+    found = 0;
+    timer->start();
+    for (auto &item : data) {
+        found += *chained->get_value(item.first) != 0;
+    }
+    LOG_WARN << "Chained get x1000000 - " << timer->get() << "s" << NL;
+    ASSERT_EQ(data.size(), found);
+
+    delete chained;
+    delete timer;
+    SMHashTable::destroy("shared_memory_ro_chained");
+    SMReadOnlyTable::destroy("shared_memory_ro");
+}
@@ -0,0 +1,95 @@
+#include <thread>
+#include "TestUtils.h"
+#include "../SMHashTable.h"
+#include "../SMTrace.h"
+
+
+TEST(TRACE, histogram) {
+    //корзины идут подряд и покрывают все значения, ошибка не больше 1/SMTR_SUB
+    for (uint32_t i = 1; i < SMTR_BUCKETS; i++) {
+        ASSERT_LT(SMTrace::histogram::lowest(i - 1), SMTrace::histogram::lowest(i));
+        ASSERT_EQ(i, SMTrace::histogram::bucket(SMTrace::histogram::lowest(i)));
+        ASSERT_EQ(i - 1, SMTrace::histogram::bucket(SMTrace::histogram::lowest(i) - 1));
+    }
+    for (uint64_t value : {0ULL, 7ULL, 31ULL, 32ULL, 1000ULL, 123456789ULL, 1ULL << 40}) {
+        uint64_t low = SMTrace::histogram::lowest(SMTrace::histogram::bucket(value));
+        ASSERT_LE(low, value);
+        ASSERT_LE(value - low, value / SMTR_SUB);
+    }
+    ASSERT_EQ(SMTR_BUCKETS - 1, SMTrace::histogram::bucket(UINT64_MAX));
+
+    SMTrace::histogram first;
+    SMTrace::histogram second;
+    ASSERT_EQ(0U, first.percentile(50));
+    for (uint64_t i = 1; i <= 1000; i++) {
+        first.record(i);
+        second.record(i * 1000);
+    }
+    ASSERT_EQ(1000U, first.count());
+    ASSERT_NEAR(500.5, first.mean(), 0.001);
+    ASSERT_NEAR(500, first.percentile(50), 500 / SMTR_SUB);
+    ASSERT_NEAR(990, first.percentile(99), 990 / SMTR_SUB);
+    ASSERT_EQ(1000U, first.percentile(100));
+    ASSERT_EQ(1U, first.percentile(0));
+
+    //слияние, как для гистограмм из разных процессов
+    first.merge(second);
+    ASSERT_EQ(2000U, first.count());
+    ASSERT_EQ(1U, first.min);
+    ASSERT_EQ(1000000U, first.max);
+    ASSERT_NEAR(1000, first.percentile(50), 1000 / SMTR_SUB);
+    first.reset();
+    ASSERT_EQ(0U, first.count());
+}
+
+TEST(TRACE, operations) {
+    if (!SMTrace::enabled()) {
+        GTEST_SKIP() << "built without SMC_TRACE";
+    }
+    SMTrace::setSampling(1);
+    SMTrace::reset();
+    auto table = new SMHashTable("shared_memory_trace", 1000, 10000, 64, SMHashTable::CREATE);
+    for (int i = 0; i < 100; i++) {
+        ASSERT_TRUE(table->set("key" + std::to_string(i), "value" + std::to_string(i)));
+    }
+    //замеры потоков после их завершения не теряются
+    std::thread reader([&]() {
+        for (int i = 0; i < 200; i++) {
+            table->get_value("key" + std::to_string(i));
+        }
+    });
+    reader.join();
+    for (int i = 0; i < 50; i++) {
+        ASSERT_NE(0, table->unset("key" + std::to_string(i)));
+    }
+    table->hardDefragmentation();
+
+    ASSERT_EQ(100U, SMTrace::snapshot(SMTR_OP_SET).count());
+    ASSERT_EQ(200U, SMTrace::snapshot(SMTR_OP_GET).count());
+    ASSERT_EQ(50U, SMTrace::snapshot(SMTR_OP_UNSET).count());
+    ASSERT_EQ(1U, SMTrace::snapshot(SMTR_OP_DEFRAG).count());
+    //каждый set выделяет хотя бы блок данных
+    auto alloc = SMTrace::snapshot(SMTR_OP_ALLOC);
+    ASSERT_GE(alloc.count(), 100U);
+    ASSERT_EQ(alloc.count(), SMTrace::snapshot(SMTR_OP_ALLOC_SCAN).count());
+    ASSERT_GE(SMTrace::snapshot(SMTR_OP_ALLOC_SCAN).min, 1U);
+    auto set = SMTrace::snapshot(SMTR_OP_SET);
+    ASSERT_GT(set.percentile(50), 0U);
+    ASSERT_LE(set.percentile(50), set.percentile(99));
+    for (uint32_t op = 0; op < SMTR_OPS; op++) {
+        auto histogram = SMTrace::snapshot(op);
+        LOG_INFO << SMTrace::name(op) << ": " << histogram.count() << " p50 " << histogram.percentile(50)
+                 << " p99 " << histogram.percentile(99) << " max " << histogram.max << NL;
+    }
+
+    //каждая n-я операция потока
+    SMTrace::setSampling(10);
+    SMTrace::reset();
+    for (int i = 0; i < 1000; i++) {
+        table->get_value("key1");
+    }
+    ASSERT_EQ(100U, SMTrace::snapshot(SMTR_OP_GET).count());
+    SMTrace::setSampling(SMTR_SAMPLE);
+    delete table;
+    SMHashTable::destroy("shared_memory_trace");
+}
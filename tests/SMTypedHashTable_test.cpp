@@ -0,0 +1,192 @@
+#include <thread>
+#include "TestUtils.h"
+#include "../SMHashTable.h"
+#include "../SMTypedHashTable.h"
+
+
+struct record {
+    uint64_t id;
+    uint32_t balance;
+    uint16_t flags;
+    char name[16];
+};
+
+struct composite_key {
+    uint32_t tenant;
+    uint32_t user;
+};
+
+TEST(SMTypedHashTable, crud) {
+    auto table = new SMTypedHashTable<uint64_t, record>("shared_memory_typed", 1000, SMSegment::CREATE);
+    ASSERT_TRUE(table->isOpen());
+    ASSERT_EQ(1024U, table->capacity());
+
+    record val{42, 100, 1, "alice"};
+    ASSERT_TRUE(table->set(42, val));
+    record out{};
+    ASSERT_TRUE(table->get(42, out));
+    ASSERT_EQ(100U, out.balance);
+    ASSERT_STREQ("alice", out.name);
+    ASSERT_FALSE(table->get(43, out));
+
+    val.balance = 200;
+    ASSERT_TRUE(table->set(42, val));
+    ASSERT_TRUE(table->get(42, out));
+    ASSERT_EQ(200U, out.balance);
+    ASSERT_EQ(1U, table->size());
+
+    auto attached = new SMTypedHashTable<uint64_t, record>("shared_memory_typed");
+    ASSERT_TRUE(attached->isOpen());
+    ASSERT_TRUE(attached->get(42, out));
+    ASSERT_EQ(200U, out.balance);
+
+    //другие типы ключа или значения к сегменту не подключаются
+    auto mismatch = new SMTypedHashTable<uint32_t, record>("shared_memory_typed");
+    ASSERT_FALSE(mismatch->isOpen());
+
+    ASSERT_TRUE(table->unset(42));
+    ASSERT_FALSE(table->unset(42));
+    ASSERT_FALSE(attached->get(42, out));
+    ASSERT_EQ(0U, table->size());
+
+    delete mismatch;
+    delete attached;
+    delete table;
+    SMSegment::destroy("shared_memory_typed");
+}
+
+TEST(SMTypedHashTable, full_and_tombstones) {
+    auto table = new SMTypedHashTable<composite_key, uint64_t>("shared_memory_typed", 256, SMSegment::CREATE);
+    //восьмая часть слотов остается пустой
+    for (uint32_t i = 0; i < 224; i++) {
+        ASSERT_TRUE(table->set({i % 7, i}, i));
+    }
+    ASSERT_FALSE(table->set({1000, 1000}, 0));
+    for (uint32_t i = 0; i < 224; i += 2) {
+        ASSERT_TRUE(table->unset({i % 7, i}));
+    }
+    for (uint32_t i = 0; i < 112; i++) {
+        ASSERT_TRUE(table->set({1000, i}, i));
+    }
+    uint64_t out;
+    for (uint32_t i = 1; i < 224; i += 2) {
+        ASSERT_TRUE(table->get({i % 7, i}, out));
+        ASSERT_EQ(i, out);
+    }
+    for (uint32_t i = 0; i < 112; i++) {
+        ASSERT_TRUE(table->get({1000, i}, out));
+        ASSERT_EQ(i, out);
+    }
+    table->clear();
+    ASSERT_EQ(0U, table->size());
+    ASSERT_FALSE(table->get({1, 1}, out));
+    delete table;
+    SMSegment::destroy("shared_memory_typed");
+}
+
+TEST(SMTypedHashTable, churn_reclaims_tombstones) {
+    auto table = new SMTypedHashTable<uint64_t, uint64_t>("shared_memory_typed", 256, SMSegment::CREATE);
+    //окно из 100 живых ключей проходит по таблице много раз, надгробия должны убираться
+    for (uint64_t i = 0; i < 20000; i++) {
+        ASSERT_TRUE(table->set(i, i));
+        if (i >= 100) {
+            ASSERT_TRUE(table->unset(i - 100));
+        }
+    }
+    ASSERT_EQ(100U, table->size());
+    uint64_t out;
+    for (uint64_t i = 19900; i < 20000; i++) {
+        ASSERT_TRUE(table->get(i, out));
+        ASSERT_EQ(i, out);
+    }
+    ASSERT_FALSE(table->get(100, out));
+    delete table;
+    SMSegment::destroy("shared_memory_typed");
+}
+
+TEST(SMTypedHashTable, concurrent_readers) {
+    auto table = new SMTypedHashTable<uint64_t, record>("shared_memory_typed", 1 << 12, SMSegment::CREATE);
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> torn{};
+    //писатель меняет все поля значения согласованно, читатель не должен увидеть смесь
+    std::thread writer([&]() {
+        for (uint32_t round = 0; round < 2000; round++) {
+            for (uint64_t key = 0; key < 64; key++) {
+                record val{key, round, (uint16_t) round, {}};
+                std::snprintf(val.name, sizeof(val.name), "%u", round);
+                table->set(key, val);
+            }
+            if (round % 10 == 0) {
+                table->unset(round % 64);
+            }
+        }
+        stop = true;
+    });
+    std::thread reader([&]() {
+        record out{};
+        while (!stop) {
+            for (uint64_t key = 0; key < 64; key++) {
+                if (table->get(key, out)) {
+                    if (out.id != key || out.flags != (uint16_t) out.balance ||
+                        std::to_string(out.balance) != out.name) {
+                        torn++;
+                    }
+                }
+            }
+        }
+    });
+    writer.join();
+    reader.join();
+    ASSERT_EQ(0U, torn);
+    delete table;
+    SMSegment::destroy("shared_memory_typed");
+}
+
+TEST(SMTypedHashTable, perfomance) {
+    uint32_t size = 200000;
+    std::vector<uint64_t> keys;
+    for (uint32_t i = 0; i < size; i++) {
+        keys.push_back(((uint64_t) RandomGenerator::getRandomInt(0, INT32_MAX) << 32) | i);
+    }
+    record val{1, 2, 3, "record"};
+
+    auto typed = new SMTypedHashTable<uint64_t, record>("shared_memory_typed", size * 2, SMSegment::CREATE);
+    auto timer = new TimeProfiler;
+    timer->start();
+    for (auto key : keys) {
+        val.id = key;
+        typed->set(key, val);
+    }
+    LOG_WARN << "TYPED write - " << timer->get() << "s" << NL;
+    timer->start();
+    record out{};
+    uint32_t fails = 0;
+    for (auto key : keys) {
+        if (!typed->get(key, out) || out.id != key) {
+            fails++;
+        }
+    }
+    LOG_WARN << "TYPED read - " << timer->get() << "s" << NL;
+    ASSERT_EQ(0U, fails);
+
+    auto table = new SMHashTable("shared_memory_typed_str", size * 2, size * 8, 16, SMHashTable::CREATE);
+    std::string str_val(sizeof(record), 'x');
+    timer->start();
+    for (auto key : keys) {
+        table->set(std::to_string(key), str_val);
+    }
+    LOG_WARN << "STRING write - " << timer->get() << "s" << NL;
+    timer->start();
+    for (auto key : keys) {
+        if (*table->get_value(std::to_string(key)) == 0) {
+            fails++;
+        }
+    }
+    LOG_WARN << "STRING read - " << timer->get() << "s" << NL;
+    ASSERT_EQ(0U, fails);
+
+    delete table;
+    delete typed;
+    SMSegment::destroy("shared_memory_typed");
+    SMSegment::destroy("shared_memory_typed_str");
+}
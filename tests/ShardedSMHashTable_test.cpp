@@ -0,0 +1,141 @@
+#include <thread>
+#include <atomic>
+#include "TestUtils.h"
+#include "../ShardedSMHashTable.h"
+
+
+TEST(SHARDED, crud) {
+    auto table = new ShardedSMHashTable("shared_memory_sharded", 8, 80000, 400000, 32, SMSegment::CREATE);
+    ASSERT_TRUE(table->isOpen());
+    ASSERT_EQ(8U, table->shardCount());
+
+    std::vector<uint32_t> per_shard(table->shardCount());
+    for (int i = 0; i < 40000; i++) {
+        auto key = "key" + std::to_string(i);
+        ASSERT_TRUE(table->set(key, "value" + std::to_string(i)));
+        per_shard[table->shardOf(key)]++;
+    }
+    //старшие биты хеша делят ключи примерно поровну
+    for (auto count : per_shard) {
+        ASSERT_GT(count, 40000U / 8 * 9 / 10);
+        ASSERT_LT(count, 40000U / 8 * 11 / 10);
+    }
+    for (int i = 0; i < 40000; i++) {
+        ASSERT_STREQ(("value" + std::to_string(i)).c_str(), table->get_value("key" + std::to_string(i)));
+    }
+    char buffer[16];
+    ASSERT_EQ(8, table->get("key100", buffer, sizeof(buffer)));
+    ASSERT_STREQ("value100", buffer);
+    ASSERT_NE(0, table->unset("key100"));
+    ASSERT_EQ(-1, table->get("key100", buffer, sizeof(buffer)));
+
+    //второй процесс находит шарды по каталогу
+    auto attached = new ShardedSMHashTable("shared_memory_sharded");
+    ASSERT_TRUE(attached->isOpen());
+    ASSERT_STREQ("value7", attached->get_value("key7"));
+    ASSERT_STREQ("", attached->get_value("key100"));
+    delete attached;
+
+    delete table;
+    ShardedSMHashTable::destroy("shared_memory_sharded");
+    ASSERT_FALSE(SMSegment::destroy("shared_memory_sharded.0.0"));
+}
+
+TEST(SHARDED, batch) {
+    auto table = new ShardedSMHashTable("shared_memory_sharded", 4, 10000, 100000, 32, SMSegment::CREATE);
+    std::vector<std::pair<std::string, std::string>> items;
+    std::vector<std::string> keys;
+    for (int i = 0; i < 10000; i++) {
+        items.emplace_back("key" + std::to_string(i), "value" + std::to_string(i));
+        keys.push_back("key" + std::to_string(i));
+    }
+    keys.emplace_back("miss");
+    ASSERT_EQ(10000U, table->set_many(items));
+
+    auto values = table->get_many(keys);
+    ASSERT_EQ(keys.size(), values.size());
+    for (int i = 0; i < 10000; i++) {
+        ASSERT_EQ(items[i].second, values[i]);
+    }
+    ASSERT_EQ("", values.back());
+
+    keys.resize(5000);
+    ASSERT_EQ(5000U, table->unset_many(keys));
+    ASSERT_STREQ("", table->get_value("key0"));
+    ASSERT_STREQ("value5000", table->get_value("key5000"));
+    delete table;
+    ShardedSMHashTable::destroy("shared_memory_sharded");
+}
+
+TEST(SHARDED, meminfo) {
+    auto table = new ShardedSMHashTable("shared_memory_sharded", 4, 1000, 4000, 64, SMSegment::CREATE);
+    ASSERT_EQ(4000UL * 64, table->getFreeMemorySize());
+    ASSERT_TRUE(table->set("key", "value"));
+    auto *info = table->memInfo();
+    ASSERT_EQ(3999UL * 64, info->free);
+    ASSERT_EQ(1000UL * 64, info->max_free_block);
+    ASSERT_EQ(64U, info->max_allocated_block);
+    ASSERT_EQ(1U, info->segments);
+    ASSERT_EQ(1U, info->max_chain);
+    ASSERT_EQ(1.0, info->avg_chain);
+    ASSERT_EQ(1U, info->chained_buckets);
+    delete table;
+    ShardedSMHashTable::destroy("shared_memory_sharded");
+}
+
+TEST(SHARDED, resize_shard) {
+    auto table = new ShardedSMHashTable("shared_memory_sharded", 4, 4000, 8000, 32, SMSegment::CREATE);
+    auto attached = new ShardedSMHashTable("shared_memory_sharded");
+    uint32_t stored = 0;
+    for (int i = 0; i < 8000; i++) {
+        stored += table->set("key" + std::to_string(i), "value" + std::to_string(i));
+    }
+    //шарды переполнены, часть ключей не влезла
+    ASSERT_LT(stored, 8000U);
+    ASSERT_STREQ("value1", attached->get_value("key1"));
+
+    //новый шард меньше, чем нужно для его ключей - шард остается прежним
+    ASSERT_FALSE(table->resizeShard(0, 100, 100));
+    ASSERT_FALSE(table->shard(0)->isSealed());
+
+    for (uint32_t s = 0; s < table->shardCount(); s++) {
+        ASSERT_TRUE(table->resizeShard(s, 4000, 20000));
+    }
+    ASSERT_FALSE(SMSegment::destroy("shared_memory_sharded.0.0"));
+    for (int i = 0; i < 8000; i++) {
+        ASSERT_TRUE(table->set("key" + std::to_string(i), "value" + std::to_string(i)));
+    }
+    //второй экземпляр переходит на новые поколения сам
+    for (int i = 0; i < 8000; i++) {
+        ASSERT_STREQ(("value" + std::to_string(i)).c_str(), attached->get_value("key" + std::to_string(i)));
+    }
+    ASSERT_NE(0, attached->unset("key0"));
+    ASSERT_STREQ("", table->get_value("key0"));
+    delete attached;
+    delete table;
+    ShardedSMHashTable::destroy("shared_memory_sharded");
+}
+
+TEST(SHARDED, writers_during_resize) {
+    auto table = new ShardedSMHashTable("shared_memory_sharded", 2, 10000, 100000, 32, SMSegment::CREATE);
+    std::atomic<bool> stop{};
+    std::atomic<uint32_t> fails{};
+    std::thread writer([&]() {
+        for (uint32_t i = 0; !stop; i++) {
+            //пересборка не должна терять записи: после seal() писатель ждет новое поколение
+            fails += !table->set("key" + std::to_string(i % 20000), "value" + std::to_string(i % 20000));
+        }
+    });
+    for (int round = 0; round < 10; round++) {
+        ASSERT_TRUE(table->resizeShard(round % 2, 10000 + round, 100000));
+    }
+    stop = true;
+    writer.join();
+    ASSERT_EQ(0U, fails);
+    for (int i = 0; i < 20000; i++) {
+        auto value = std::string(table->get_value("key" + std::to_string(i)));
+        ASSERT_TRUE(value.empty() || value == "value" + std::to_string(i));
+    }
+    delete table;
+    ShardedSMHashTable::destroy("shared_memory_sharded");
+}
@@ -0,0 +1,849 @@
+#include <iostream>
+#include <optional>
+#include <unordered_set>
+#include <string_view>
+#include <cstring>
+#include <climits>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "SMMemcachedServer.h"
+
+
+struct SMMemcachedServer::connection {
+    int fd{-1};
+    bool listener{};
+    bool closing{};     //quit: дописать ответ и закрыть
+    uint32_t events{};
+    uint64_t swallow{}; //хвост слишком большого значения, который надо пропустить
+    std::string in;
+    size_t in_pos{};
+    std::string out;
+    size_t out_pos{};
+};
+
+// Ответ на пакет запросов: куски либо в scratch (заголовки, копии), либо прямо в сегменте
+struct SMMemcachedServer::response {
+    struct piece {
+        const char *ptr;
+        size_t offset;
+        size_t len;
+    };
+
+    std::string scratch;
+    std::vector<piece> pieces;
+    size_t bytes{};
+    //пока ответ держит указатели в сегмент, таблица закреплена
+    std::optional<SMHashTable::read_guard> guard;
+
+    void text(const char *data, size_t len) {
+        if (!pieces.empty() && pieces.back().ptr == nullptr &&
+            pieces.back().offset + pieces.back().len == scratch.size()) {
+            pieces.back().len += len;
+        } else {
+            pieces.push_back({nullptr, scratch.size(), len});
+        }
+        scratch.append(data, len);
+        bytes += len;
+    }
+
+    void text(const std::string_view &data) {
+        text(data.data(), data.size());
+    }
+
+    void shared(const char *data, size_t len) {
+        if (len > 0) {
+            pieces.push_back({data, 0, len});
+            bytes += len;
+        }
+    }
+
+    const char *base(const piece &p) const {
+        return p.ptr != nullptr ? p.ptr : scratch.data() + p.offset;
+    }
+
+    void reset() {
+        scratch.clear();
+        pieces.clear();
+        bytes = 0;
+    }
+};
+
+struct SMMemcachedServer::worker_state {
+    int epoll_fd{-1};
+    int event_fd{-1};
+    connection tcp_listener;
+    connection unix_listener;
+    std::unordered_set<connection *> connections;
+};
+
+#pragma pack(push, 1)
+struct bin_header {
+    uint8_t magic;
+    uint8_t opcode;
+    uint16_t key_length;
+    uint8_t extras_length;
+    uint8_t data_type;
+    uint16_t status;
+    uint32_t body_length;
+    uint32_t opaque;
+    uint64_t cas;
+};
+#pragma pack(pop)
+
+static struct bin_header make_bin_header(const struct bin_header &request, uint16_t status,
+                                        uint8_t extras_length, uint16_t key_length, uint32_t body_length) {
+    struct bin_header header{};
+    header.magic = SMMC_BIN_RESPONSE;
+    header.opcode = request.opcode;
+    header.key_length = htons(key_length);
+    header.extras_length = extras_length;
+    header.status = htons(status);
+    header.body_length = htonl(body_length);
+    header.opaque = request.opaque;
+    return header;
+}
+
+static std::vector<std::string_view> tokenize(const char *begin, const char *end) {
+    std::vector<std::string_view> tokens;
+    while (begin < end) {
+        while (begin < end && *begin == ' ') {
+            begin++;
+        }
+        auto token = begin;
+        while (begin < end && *begin != ' ') {
+            begin++;
+        }
+        if (begin > token) {
+            tokens.emplace_back(token, begin - token);
+        }
+    }
+    return tokens;
+}
+
+static bool parse_number(const std::string_view &token, uint64_t *value) {
+    if (token.empty() || token.size() > 19) {
+        return false;
+    }
+    uint64_t result = 0;
+    for (auto c : token) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        result = result * 10 + (c - '0');
+    }
+    *value = result;
+    return true;
+}
+
+SMMemcachedServer::SMMemcachedServer(SMHashTable *table, const options &opts) : _table(table), _options(opts) {
+    if (_options.threads == 0) {
+        _options.threads = 1;
+    }
+}
+
+SMMemcachedServer::~SMMemcachedServer() {
+    stop();
+}
+
+bool SMMemcachedServer::start() {
+    if (_table == nullptr || !_table->isOpen()) {
+        std::cerr << "SMMemcachedServer: table is not open" << std::endl;
+        return false;
+    }
+    if (_options.tcp_port < 0 && _options.unix_path.empty()) {
+        std::cerr << "SMMemcachedServer: neither TCP port nor Unix socket is set" << std::endl;
+        return false;
+    }
+    if ((_options.tcp_port >= 0 && !listen_tcp()) || (!_options.unix_path.empty() && !listen_unix())) {
+        stop();
+        return false;
+    }
+    _started = time(nullptr);
+    for (uint32_t i = 0; i < _options.threads; i++) {
+        auto state = new worker_state();
+        state->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        state->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (state->epoll_fd < 0 || state->event_fd < 0) {
+            perror("SMMemcachedServer: epoll");
+            close(state->epoll_fd);
+            close(state->event_fd);
+            delete state;
+            stop();
+            return false;
+        }
+        struct epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD, state->event_fd, &event);
+        //слушающие сокеты общие, EPOLLEXCLUSIVE будит на новое соединение один поток
+        for (auto listener : {&state->tcp_listener, &state->unix_listener}) {
+            listener->fd = listener == &state->tcp_listener ? _tcp_fd : _unix_fd;
+            listener->listener = true;
+            if (listener->fd >= 0) {
+                event.events = EPOLLIN | EPOLLEXCLUSIVE;
+                event.data.ptr = listener;
+                epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD, listener->fd, &event);
+            }
+        }
+        _workers.push_back(state);
+    }
+    for (auto state : _workers) {
+        _threads.emplace_back(&SMMemcachedServer::run, this, state);
+    }
+    return true;
+}
+
+void SMMemcachedServer::stop() {
+    for (auto state : _workers) {
+        uint64_t one = 1;
+        if (write(state->event_fd, &one, sizeof(one)) < 0) {
+            perror("SMMemcachedServer: eventfd");
+        }
+    }
+    for (auto &thread : _threads) {
+        thread.join();
+    }
+    _threads.clear();
+    for (auto state : _workers) {
+        for (auto conn : state->connections) {
+            close(conn->fd);
+            delete conn;
+        }
+        _connections -= state->connections.size();
+        close(state->epoll_fd);
+        close(state->event_fd);
+        delete state;
+    }
+    _workers.clear();
+    if (_tcp_fd >= 0) {
+        close(_tcp_fd);
+        _tcp_fd = -1;
+    }
+    if (_unix_fd >= 0) {
+        close(_unix_fd);
+        _unix_fd = -1;
+        unlink(_options.unix_path.c_str());
+    }
+}
+
+int SMMemcachedServer::tcpPort() const {
+    return _tcp_port;
+}
+
+struct SMMemcachedServer::stats SMMemcachedServer::getStats() const {
+    struct stats result{};
+    result.connections = _connections;
+    result.total_connections = _total_connections;
+    result.cmd_get = _cmd_get;
+    result.get_hits = _get_hits;
+    result.cmd_set = _cmd_set;
+    result.cmd_delete = _cmd_delete;
+    result.bytes_read = _bytes_read;
+    result.bytes_written = _bytes_written;
+    return result;
+}
+
+bool SMMemcachedServer::listen_tcp() {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(_options.tcp_port);
+    if (inet_pton(AF_INET, _options.tcp_host.c_str(), &addr.sin_addr) != 1) {
+        std::cerr << "SMMemcachedServer: bad TCP address " << _options.tcp_host << std::endl;
+        return false;
+    }
+    _tcp_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_tcp_fd < 0) {
+        perror("SMMemcachedServer: socket");
+        return false;
+    }
+    int one = 1;
+    setsockopt(_tcp_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(_tcp_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(_tcp_fd, SOMAXCONN) < 0) {
+        perror("SMMemcachedServer: TCP bind");
+        return false;
+    }
+    socklen_t len = sizeof(addr);
+    getsockname(_tcp_fd, (struct sockaddr *) &addr, &len);
+    _tcp_port = ntohs(addr.sin_port);
+    return true;
+}
+
+bool SMMemcachedServer::listen_unix() {
+    struct sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (_options.unix_path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "SMMemcachedServer: Unix socket path is too long" << std::endl;
+        return false;
+    }
+    std::strcpy(addr.sun_path, _options.unix_path.c_str());
+    _unix_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_unix_fd < 0) {
+        perror("SMMemcachedServer: socket");
+        return false;
+    }
+    //сокет от упавшего сервера
+    unlink(addr.sun_path);
+    if (bind(_unix_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(_unix_fd, SOMAXCONN) < 0) {
+        perror("SMMemcachedServer: Unix bind");
+        close(_unix_fd);
+        _unix_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void SMMemcachedServer::run(worker_state *state) {
+    struct epoll_event events[SMMC_EVENTS];
+    while (true) {
+        int count = epoll_wait(state->epoll_fd, events, SMMC_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("SMMemcachedServer: epoll_wait");
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            auto conn = (connection *) events[i].data.ptr;
+            if (conn == nullptr) {
+                return;
+            }
+            if (conn->listener) {
+                accept_all(state, conn->fd);
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                close_connection(state, conn);
+            } else if (events[i].events & EPOLLOUT) {
+                on_writable(state, conn);
+            } else if (events[i].events & EPOLLIN) {
+                on_readable(state, conn);
+            }
+        }
+    }
+}
+
+void SMMemcachedServer::accept_all(worker_state *state, int listener) {
+    while (true) {
+        int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("SMMemcachedServer: accept");
+            }
+            return;
+        }
+        if (listener == _tcp_fd) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        auto conn = new connection();
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+        struct epoll_event event{};
+        event.events = conn->events;
+        event.data.ptr = conn;
+        if (epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            perror("SMMemcachedServer: epoll_ctl");
+            close(fd);
+            delete conn;
+            continue;
+        }
+        state->connections.insert(conn);
+        _connections++;
+        _total_connections++;
+    }
+}
+
+void SMMemcachedServer::close_connection(worker_state *state, connection *conn) {
+    epoll_ctl(state->epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    close(conn->fd);
+    state->connections.erase(conn);
+    delete conn;
+    _connections--;
+}
+
+void SMMemcachedServer::update_events(worker_state *state, connection *conn) {
+    //пока хвост ответа не ушел, новые запросы не читаем: клиент, который не читает ответы, не раздувает буфер
+    uint32_t events = conn->out_pos < conn->out.size() ? EPOLLOUT : EPOLLIN;
+    if (events != conn->events) {
+        conn->events = events;
+        struct epoll_event event{};
+        event.events = events;
+        event.data.ptr = conn;
+        epoll_ctl(state->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+    }
+}
+
+void SMMemcachedServer::on_readable(worker_state *state, connection *conn) {
+    bool eof = false;
+    //за одно пробуждение читаем ограниченно, чтобы один клиент не занимал поток
+    for (int i = 0; i < 16; i++) {
+        size_t size = conn->in.size();
+        conn->in.resize(size + SMMC_READ_SIZE);
+        ssize_t n = read(conn->fd, &conn->in[size], SMMC_READ_SIZE);
+        conn->in.resize(size + std::max<ssize_t>(n, 0));
+        if (n > 0) {
+            _bytes_read += n;
+            if (n < SMMC_READ_SIZE) {
+                break;
+            }
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            eof = true;
+        }
+        break;
+    }
+    if (!process(conn) || eof || (conn->closing && conn->out_pos == conn->out.size())) {
+        close_connection(state, conn);
+        return;
+    }
+    update_events(state, conn);
+}
+
+void SMMemcachedServer::on_writable(worker_state *state, connection *conn) {
+    if (!drain(conn)) {
+        close_connection(state, conn);
+        return;
+    }
+    if (conn->out_pos == conn->out.size()) {
+        if (conn->closing) {
+            close_connection(state, conn);
+            return;
+        }
+        //запросы, отложенные до отправки хвоста
+        if (!process(conn)) {
+            close_connection(state, conn);
+            return;
+        }
+    }
+    update_events(state, conn);
+}
+
+bool SMMemcachedServer::drain(connection *conn) {
+    while (conn->out_pos < conn->out.size()) {
+        ssize_t n = send(conn->fd, conn->out.data() + conn->out_pos, conn->out.size() - conn->out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->out_pos += n;
+        _bytes_written += n;
+    }
+    conn->out.clear();
+    conn->out_pos = 0;
+    return true;
+}
+
+bool SMMemcachedServer::flush(connection *conn, response *out) {
+    size_t piece = 0;
+    size_t offset = 0;
+    //пока в буфере соединения есть хвост, новый ответ встает за ним
+    while (conn->out_pos == conn->out.size() && piece < out->pieces.size()) {
+        struct iovec iov[IOV_MAX];
+        int count = 0;
+        for (size_t i = piece; i < out->pieces.size() && count < IOV_MAX; i++, count++) {
+            size_t skip = i == piece ? offset : 0;
+            iov[count].iov_base = (void *) (out->base(out->pieces[i]) + skip);
+            iov[count].iov_len = out->pieces[i].len - skip;
+        }
+        struct msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            out->reset();
+            return false;
+        }
+        _bytes_written += n;
+        while (n > 0) {
+            size_t left = out->pieces[piece].len - offset;
+            if ((size_t) n < left) {
+                offset += n;
+                break;
+            }
+            n -= left;
+            piece++;
+            offset = 0;
+        }
+    }
+    for (; piece < out->pieces.size(); piece++, offset = 0) {
+        conn->out.append(out->base(out->pieces[piece]) + offset, out->pieces[piece].len - offset);
+    }
+    out->reset();
+    return true;
+}
+
+bool SMMemcachedServer::process(connection *conn) {
+    response out;
+    bool result = true;
+    while (conn->in_pos < conn->in.size() && !conn->closing) {
+        if (conn->out.size() - conn->out_pos >= SMMC_MAX_PENDING) {
+            break;
+        }
+        const char *begin = conn->in.data() + conn->in_pos;
+        const char *end = conn->in.data() + conn->in.size();
+        if (conn->swallow > 0) {
+            uint64_t skip = std::min<uint64_t>(conn->swallow, end - begin);
+            conn->swallow -= skip;
+            conn->in_pos += skip;
+            continue;
+        }
+        long used = (uint8_t) *begin == SMMC_BIN_REQUEST ? process_binary(conn, &out, begin, end)
+                                                         : process_text(conn, &out, begin, end);
+        if (used < 0) {
+            result = false;
+            break;
+        }
+        if (used == 0) {
+            break;
+        }
+        conn->in_pos += used;
+        if (out.bytes >= SMMC_MAX_PENDING && !flush(conn, &out)) {
+            result = false;
+            break;
+        }
+    }
+    //отправляем, пока значения еще закреплены; что не ушло - уже скопировано
+    result = flush(conn, &out) && result;
+    out.guard.reset();
+    if (conn->in_pos == conn->in.size()) {
+        conn->in.clear();
+        conn->in_pos = 0;
+    } else if (conn->in_pos >= SMMC_READ_SIZE) {
+        conn->in.erase(0, conn->in_pos);
+        conn->in_pos = 0;
+    }
+    return result;
+}
+
+long SMMemcachedServer::process_text(connection *conn, response *out, const char *begin, const char *end) {
+    auto eol = (const char *) memchr(begin, '\n', std::min<size_t>(end - begin, SMMC_MAX_LINE));
+    if (eol == nullptr) {
+        if (end - begin >= SMMC_MAX_LINE) {
+            out->text("CLIENT_ERROR line too long\r\n");
+            return -1;
+        }
+        return 0;
+    }
+    long used = eol + 1 - begin;
+    auto tokens = tokenize(begin, eol > begin && eol[-1] == '\r' ? eol - 1 : eol);
+    if (tokens.empty()) {
+        out->text("ERROR\r\n");
+        return used;
+    }
+    auto &command = tokens[0];
+
+    if (command == "get" || command == "gets") {
+        if (tokens.size() < 2) {
+            out->text("ERROR\r\n");
+            return used;
+        }
+        if (!out->guard) {
+            out->guard.emplace(_table);
+        }
+        for (size_t i = 1; i < tokens.size(); i++) {
+            if (tokens[i].size() > SMMC_MAX_KEY) {
+                out->text("CLIENT_ERROR bad command line format\r\n");
+                return used;
+            }
+        }
+        for (size_t i = 1; i < tokens.size(); i++) {
+            size_t length;
+            bool shared;
+            char *value = _table->get_value(std::string(tokens[i]), &length, &shared);
+            _cmd_get++;
+            if (value == nullptr) {
+                continue;
+            }
+            _get_hits++;
+            out->text("VALUE ");
+            out->text(tokens[i]);
+            out->text(" 0 " + std::to_string(length) + (command.size() == 4 ? " 0\r\n" : "\r\n"));
+            if (shared) {
+                out->shared(value, length);
+            } else {
+                out->text(value, length);
+            }
+            out->text("\r\n");
+        }
+        out->text("END\r\n");
+        return used;
+    }
+
+    if (command == "set") {
+        uint64_t flags, exptime, bytes;
+        bool noreply = tokens.size() == 6 && tokens[5] == "noreply";
+        if ((tokens.size() != 5 && !noreply) || tokens[1].size() > SMMC_MAX_KEY ||
+            !parse_number(tokens[2], &flags) || !parse_number(tokens[3], &exptime) ||
+            !parse_number(tokens[4], &bytes)) {
+            out->text("CLIENT_ERROR bad command line format\r\n");
+            return used;
+        }
+        if (bytes > SMMC_MAX_VALUE) {
+            out->text("SERVER_ERROR object too large for cache\r\n");
+            conn->swallow = bytes + 2;
+            return used;
+        }
+        if ((uint64_t) (end - begin) < used + bytes + 2) {
+            return 0;
+        }
+        const char *data = begin + used;
+        if (data[bytes] != '\r' || data[bytes + 1] != '\n') {
+            out->text("CLIENT_ERROR bad data chunk\r\n");
+            return -1;
+        }
+        //освобожденное записью копится, пока жив guard, поэтому закрепление снимаем
+        if (!flush(conn, out)) {
+            return -1;
+        }
+        out->guard.reset();
+        _cmd_set++;
+        bool stored = _table->set(std::string(tokens[1]), std::string(data, bytes));
+        if (!noreply) {
+            out->text(stored ? "STORED\r\n" : _table->isSealed() ? "NOT_STORED\r\n"
+                                                                 : "SERVER_ERROR out of memory storing object\r\n");
+        }
+        return used + bytes + 2;
+    }
+
+    if (command == "delete") {
+        bool noreply = tokens.size() > 2 && tokens.back() == "noreply";
+        size_t count = tokens.size() - noreply;
+        if (count < 2 || count > 3 || tokens[1].size() > SMMC_MAX_KEY || (count == 3 && tokens[2] != "0")) {
+            out->text("CLIENT_ERROR bad command line format\r\n");
+            return used;
+        }
+        if (!flush(conn, out)) {
+            return -1;
+        }
+        out->guard.reset();
+        _cmd_delete++;
+        int deleted = _table->unset(std::string(tokens[1]));
+        if (!noreply) {
+            out->text(deleted ? "DELETED\r\n" : "NOT_FOUND\r\n");
+        }
+        return used;
+    }
+
+    if (command == "flush_all") {
+        if (!flush(conn, out)) {
+            return -1;
+        }
+        //clear() ждет выхода всех читателей, под своим guard он бы не дождался
+        out->guard.reset();
+        _table->clear();
+        if (tokens.back() != "noreply") {
+            out->text("OK\r\n");
+        }
+        return used;
+    }
+
+    if (command == "version") {
+        out->text("VERSION " SMMC_VERSION "\r\n");
+        return used;
+    }
+
+    if (command == "verbosity") {
+        out->text("OK\r\n");
+        return used;
+    }
+
+    if (command == "stats") {
+        text_stats(out);
+        return used;
+    }
+
+    if (command == "quit") {
+        conn->closing = true;
+        return used;
+    }
+
+    out->text("ERROR\r\n");
+    return used;
+}
+
+long SMMemcachedServer::process_binary(connection *conn, response *out, const char *begin, const char *end) {
+    if (end - begin < SMMC_BIN_HEADER) {
+        return 0;
+    }
+    struct bin_header request;
+    std::memcpy(&request, begin, sizeof(request));
+    uint32_t body_length = ntohl(request.body_length);
+    uint16_t key_length = ntohs(request.key_length);
+    if (body_length > SMMC_MAX_VALUE + SMMC_MAX_KEY + 8 ||
+        (uint64_t) key_length + request.extras_length > body_length) {
+        auto header = make_bin_header(request, SMMC_STATUS_TOO_LARGE, 0, 0, 0);
+        out->text((const char *) &header, sizeof(header));
+        return -1;
+    }
+    if ((uint64_t) (end - begin) < SMMC_BIN_HEADER + (uint64_t) body_length) {
+        return 0;
+    }
+    long used = SMMC_BIN_HEADER + body_length;
+    const char *extras = begin + SMMC_BIN_HEADER;
+    const char *key = extras + request.extras_length;
+    const char *value = key + key_length;
+    uint32_t value_length = body_length - request.extras_length - key_length;
+
+    //заголовки идут в scratch, соседние ответы склеиваются в один кусок
+    auto header = [&](uint16_t status, uint8_t extras_length, uint16_t key_len, uint32_t body) {
+        auto header = make_bin_header(request, status, extras_length, key_len, body);
+        out->text((const char *) &header, sizeof(header));
+    };
+    auto error = [&](uint16_t status, const char *message) {
+        header(status, 0, 0, strlen(message));
+        out->text(message, strlen(message));
+    };
+
+    switch (request.opcode) {
+        case SMMC_BIN_GET:
+        case SMMC_BIN_GETQ:
+        case SMMC_BIN_GETK:
+        case SMMC_BIN_GETKQ: {
+            bool quiet = request.opcode == SMMC_BIN_GETQ || request.opcode == SMMC_BIN_GETKQ;
+            bool with_key = request.opcode == SMMC_BIN_GETK || request.opcode == SMMC_BIN_GETKQ;
+            if (!out->guard) {
+                out->guard.emplace(_table);
+            }
+            size_t length;
+            bool shared;
+            char *data = _table->get_value(std::string(key, key_length), &length, &shared);
+            _cmd_get++;
+            if (data == nullptr) {
+                if (quiet) {
+                    break;
+                }
+                if (with_key) {
+                    header(SMMC_STATUS_NOT_FOUND, 0, key_length, key_length);
+                    out->text(key, key_length);
+                } else {
+                    error(SMMC_STATUS_NOT_FOUND, "Not found");
+                }
+                break;
+            }
+            _get_hits++;
+            uint32_t flags = 0;
+            header(SMMC_STATUS_OK, sizeof(flags), with_key ? key_length : 0,
+                   sizeof(flags) + (with_key ? key_length : 0) + length);
+            out->text((const char *) &flags, sizeof(flags));
+            if (with_key) {
+                out->text(key, key_length);
+            }
+            if (shared) {
+                out->shared(data, length);
+            } else {
+                out->text(data, length);
+            }
+            break;
+        }
+        case SMMC_BIN_SET:
+        case SMMC_BIN_SETQ: {
+            if (request.extras_length != 8 || key_length == 0 || key_length > SMMC_MAX_KEY) {
+                error(SMMC_STATUS_INVALID, "Invalid arguments");
+                break;
+            }
+            if (!flush(conn, out)) {
+                return -1;
+            }
+            out->guard.reset();
+            _cmd_set++;
+            if (_table->set(std::string(key, key_length), std::string(value, value_length))) {
+                if (request.opcode == SMMC_BIN_SET) {
+                    header(SMMC_STATUS_OK, 0, 0, 0);
+                }
+            } else if (_table->isSealed()) {
+                error(SMMC_STATUS_NOT_STORED, "Not stored");
+            } else {
+                error(SMMC_STATUS_NO_MEMORY, "Out of memory");
+            }
+            break;
+        }
+        case SMMC_BIN_DELETE:
+        case SMMC_BIN_DELETEQ: {
+            if (request.extras_length != 0 || key_length == 0 || key_length > SMMC_MAX_KEY) {
+                error(SMMC_STATUS_INVALID, "Invalid arguments");
+                break;
+            }
+            if (!flush(conn, out)) {
+                return -1;
+            }
+            out->guard.reset();
+            _cmd_delete++;
+            if (_table->unset(std::string(key, key_length))) {
+                if (request.opcode == SMMC_BIN_DELETE) {
+                    header(SMMC_STATUS_OK, 0, 0, 0);
+                }
+            } else {
+                error(SMMC_STATUS_NOT_FOUND, "Not found");
+            }
+            break;
+        }
+        case SMMC_BIN_FLUSH:
+        case SMMC_BIN_FLUSHQ:
+            if (!flush(conn, out)) {
+                return -1;
+            }
+            out->guard.reset();
+            _table->clear();
+            if (request.opcode == SMMC_BIN_FLUSH) {
+                header(SMMC_STATUS_OK, 0, 0, 0);
+            }
+            break;
+        case SMMC_BIN_NOOP:
+            header(SMMC_STATUS_OK, 0, 0, 0);
+            break;
+        case SMMC_BIN_VERSION:
+            header(SMMC_STATUS_OK, 0, 0, strlen(SMMC_VERSION));
+            out->text(SMMC_VERSION);
+            break;
+        case SMMC_BIN_QUIT:
+        case SMMC_BIN_QUITQ:
+            if (request.opcode == SMMC_BIN_QUIT) {
+                header(SMMC_STATUS_OK, 0, 0, 0);
+            }
+            conn->closing = true;
+            break;
+        default:
+            error(SMMC_STATUS_UNKNOWN, "Unknown command");
+            break;
+    }
+    return used;
+}
+
+void SMMemcachedServer::text_stats(response *out) {
+    auto stat = [out](const char *name, uint64_t value) {
+        out->text(std::string("STAT ") + name + " " + std::to_string(value) + "\r\n");
+    };
+    time_t now = time(nullptr);
+    stat("pid", getpid());
+    stat("uptime", now - _started);
+    stat("time", now);
+    out->text("STAT version " SMMC_VERSION "\r\n");
+    stat("threads", _options.threads);
+    stat("curr_connections", _connections);
+    stat("total_connections", _total_connections);
+    stat("cmd_get", _cmd_get);
+    stat("cmd_set", _cmd_set);
+    stat("get_hits", _get_hits);
+    stat("get_misses", _cmd_get - _get_hits);
+    stat("cmd_delete", _cmd_delete);
+    stat("bytes_read", _bytes_read);
+    stat("bytes_written", _bytes_written);
+    stat("free_bytes", _table->getFreeMemorySize());
+    out->text("END\r\n");
+}
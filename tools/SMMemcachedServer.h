@@ -0,0 +1,147 @@
+#ifndef SMC_SMMEMCACHEDSERVER_H
+#define SMC_SMMEMCACHEDSERVER_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <sys/uio.h>
+
+#include "../SMHashTable.h"
+
+#define SMMC_VERSION "1.6.0-smc"
+#define SMMC_READ_SIZE 65536
+#define SMMC_EVENTS 256
+#define SMMC_MAX_KEY 250
+#define SMMC_MAX_VALUE (64 * 1024 * 1024)
+#define SMMC_MAX_LINE 8192
+//выше этого хвост ответа копируется, а чтение соединения приостанавливается
+#define SMMC_MAX_PENDING (4 * 1024 * 1024)
+
+#define SMMC_BIN_REQUEST 0x80
+#define SMMC_BIN_RESPONSE 0x81
+#define SMMC_BIN_HEADER 24
+
+#define SMMC_BIN_GET 0x00
+#define SMMC_BIN_SET 0x01
+#define SMMC_BIN_DELETE 0x04
+#define SMMC_BIN_QUIT 0x07
+#define SMMC_BIN_FLUSH 0x08
+#define SMMC_BIN_GETQ 0x09
+#define SMMC_BIN_NOOP 0x0a
+#define SMMC_BIN_VERSION 0x0b
+#define SMMC_BIN_GETK 0x0c
+#define SMMC_BIN_GETKQ 0x0d
+#define SMMC_BIN_SETQ 0x11
+#define SMMC_BIN_DELETEQ 0x14
+#define SMMC_BIN_QUITQ 0x17
+#define SMMC_BIN_FLUSHQ 0x18
+
+#define SMMC_STATUS_OK 0x0000
+#define SMMC_STATUS_NOT_FOUND 0x0001
+#define SMMC_STATUS_TOO_LARGE 0x0003
+#define SMMC_STATUS_INVALID 0x0004
+#define SMMC_STATUS_NOT_STORED 0x0005
+#define SMMC_STATUS_UNKNOWN 0x0081
+#define SMMC_STATUS_NO_MEMORY 0x0082
+
+
+// Сервер протокола memcached (текстового и двоичного) поверх подключенной SMHashTable: Unix сокет
+// и TCP на loopback, по epoll на поток. Все полные запросы из прочитанного буфера обрабатываются
+// пакетом и отвечаются одним sendmsg; значения get уходят в сокет прямо из сегмента под pin().
+// Флаги и exptime принимаются, но не хранятся: get всегда отдает флаги 0, cas всегда 0.
+class SMMemcachedServer {
+public:
+    struct options {
+        std::string tcp_host = "127.0.0.1";
+        int tcp_port = -1;   // -1 - без TCP, 0 - любой свободный порт
+        std::string unix_path; // пустой - без Unix сокета
+        uint32_t threads = 1;
+    };
+
+    struct stats {
+        uint64_t connections;
+        uint64_t total_connections;
+        uint64_t cmd_get;
+        uint64_t get_hits;
+        uint64_t cmd_set;
+        uint64_t cmd_delete;
+        uint64_t bytes_read;
+        uint64_t bytes_written;
+    };
+
+    // Таблица не принадлежит серверу и должна пережить stop()
+    SMMemcachedServer(SMHashTable *table, const options &opts);
+
+    ~SMMemcachedServer();
+
+    // Открывает сокеты и запускает потоки. false - сокет не открылся, причина в stderr
+    bool start();
+
+    // Останавливает потоки и закрывает соединения; Unix сокет удаляется
+    void stop();
+
+    // Фактический TCP порт, если в options был 0
+    int tcpPort() const;
+
+    struct stats getStats() const;
+
+private:
+    struct connection;
+    struct response;
+    struct worker_state;
+
+    bool listen_tcp();
+
+    bool listen_unix();
+
+    void run(worker_state *state);
+
+    void accept_all(worker_state *state, int listener);
+
+    void close_connection(worker_state *state, connection *conn);
+
+    void on_readable(worker_state *state, connection *conn);
+
+    void on_writable(worker_state *state, connection *conn);
+
+    // Разбирает все полные запросы; false - соединение надо закрыть
+    bool process(connection *conn);
+
+    // Размер разобранного запроса, 0 - запрос неполный, -1 - закрыть соединение
+    long process_text(connection *conn, response *out, const char *begin, const char *end);
+
+    long process_binary(connection *conn, response *out, const char *begin, const char *end);
+
+    // Отправляет накопленный ответ; что не ушло в сокет, копируется в буфер соединения.
+    // После flush указатели в сегмент больше не нужны и pin() можно отпускать
+    bool flush(connection *conn, response *out);
+
+    bool drain(connection *conn);
+
+    void update_events(worker_state *state, connection *conn);
+
+    void text_stats(response *out);
+
+    SMHashTable *_table;
+    struct options _options;
+    int _tcp_fd{-1};
+    int _unix_fd{-1};
+    int _tcp_port{-1};
+    std::vector<worker_state *> _workers;
+    std::vector<std::thread> _threads;
+    time_t _started{};
+
+    std::atomic<uint64_t> _connections{};
+    std::atomic<uint64_t> _total_connections{};
+    std::atomic<uint64_t> _cmd_get{};
+    std::atomic<uint64_t> _get_hits{};
+    std::atomic<uint64_t> _cmd_set{};
+    std::atomic<uint64_t> _cmd_delete{};
+    std::atomic<uint64_t> _bytes_read{};
+    std::atomic<uint64_t> _bytes_written{};
+};
+
+
+#endif //SMC_SMMEMCACHEDSERVER_H
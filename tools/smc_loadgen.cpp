@@ -0,0 +1,365 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "SMMemcachedServer.h"
+
+
+// Нагрузка на smc_memcached (или любой memcached): каждое соединение - поток, который шлет пакеты
+// по depth запросов одной записью и ждет все ответы. Задержка меряется на пакет.
+//   smc_loadgen [-p порт] [-l host] [-s unix сокет] [-c соединений] [-d глубина] [-D секунд]
+//               [-k ключей] [-v размер значения] [-g процент get] [-B двоичный протокол] [-P заполнить]
+
+struct loadgen_options {
+    std::string host = "127.0.0.1";
+    int port = 11211;
+    std::string unix_path;
+    uint32_t connections = 4;
+    uint32_t depth = 16;
+    uint32_t seconds = 10;
+    uint32_t keys = 10000;
+    uint32_t value_size = 100;
+    uint32_t get_percent = 90;
+    bool binary = false;
+    bool preload = false;
+};
+
+struct loadgen_result {
+    uint64_t gets{};
+    uint64_t hits{};
+    uint64_t sets{};
+    uint64_t errors{};
+    std::vector<uint32_t> latencies; // микросекунды на пакет
+};
+
+class loadgen_connection {
+public:
+    explicit loadgen_connection(const loadgen_options &opts) : _opts(opts) {
+        if (opts.unix_path.empty()) {
+            struct sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(opts.port);
+            inet_pton(AF_INET, opts.host.c_str(), &addr.sin_addr);
+            _fd = socket(AF_INET, SOCK_STREAM, 0);
+            int one = 1;
+            setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (connect(_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+                perror("connect");
+                close(_fd);
+                _fd = -1;
+            }
+        } else {
+            struct sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, opts.unix_path.c_str(), sizeof(addr.sun_path) - 1);
+            _fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (connect(_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+                perror("connect");
+                close(_fd);
+                _fd = -1;
+            }
+        }
+    }
+
+    ~loadgen_connection() {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+
+    bool isOpen() const {
+        return _fd >= 0;
+    }
+
+    void add_get(const std::string &key) {
+        if (_opts.binary) {
+            add_binary(SMMC_BIN_GET, key, nullptr, 0);
+        } else {
+            _request += "get " + key + "\r\n";
+        }
+        _expected.push_back(SMMC_BIN_GET);
+    }
+
+    void add_set(const std::string &key, const std::string &value) {
+        if (_opts.binary) {
+            char extras[8]{};
+            add_binary(SMMC_BIN_SET, key, extras, sizeof(extras), value);
+        } else {
+            _request += "set " + key + " 0 0 " + std::to_string(value.size()) + "\r\n" + value + "\r\n";
+        }
+        _expected.push_back(SMMC_BIN_SET);
+    }
+
+    // Отправляет пакет и читает все ответы. false - соединение сломано
+    bool run(loadgen_result *result) {
+        for (size_t sent = 0; sent < _request.size();) {
+            ssize_t n = send(_fd, _request.data() + sent, _request.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return false;
+            }
+            sent += n;
+        }
+        _request.clear();
+        for (auto opcode : _expected) {
+            bool ok = _opts.binary ? read_binary(opcode, result) : read_text(opcode, result);
+            if (!ok) {
+                return false;
+            }
+        }
+        _expected.clear();
+        return true;
+    }
+
+private:
+    void add_binary(uint8_t opcode, const std::string &key, const char *extras, uint8_t extras_length,
+                    const std::string &value = "") {
+        char header[SMMC_BIN_HEADER]{};
+        header[0] = (char) SMMC_BIN_REQUEST;
+        header[1] = (char) opcode;
+        uint16_t key_length = htons(key.size());
+        memcpy(header + 2, &key_length, sizeof(key_length));
+        header[4] = (char) extras_length;
+        uint32_t body = htonl(extras_length + key.size() + value.size());
+        memcpy(header + 8, &body, sizeof(body));
+        _request.append(header, sizeof(header));
+        _request.append(extras, extras_length);
+        _request += key;
+        _request += value;
+    }
+
+    bool fill(size_t size) {
+        while (_in.size() - _pos < size) {
+            if (_pos > 0) {
+                _in.erase(0, _pos);
+                _pos = 0;
+            }
+            char buffer[65536];
+            ssize_t n = recv(_fd, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                return false;
+            }
+            _in.append(buffer, n);
+        }
+        return true;
+    }
+
+    bool read_line(std::string *line) {
+        while (true) {
+            auto eol = _in.find("\r\n", _pos);
+            if (eol != std::string::npos) {
+                line->assign(_in, _pos, eol - _pos);
+                _pos = eol + 2;
+                return true;
+            }
+            if (!fill(_in.size() - _pos + 1)) {
+                return false;
+            }
+        }
+    }
+
+    bool read_text(uint8_t opcode, loadgen_result *result) {
+        std::string line;
+        if (opcode == SMMC_BIN_SET) {
+            result->sets++;
+            if (!read_line(&line)) {
+                return false;
+            }
+            result->errors += line != "STORED";
+            return true;
+        }
+        result->gets++;
+        while (read_line(&line)) {
+            if (line == "END") {
+                return true;
+            }
+            if (line.compare(0, 6, "VALUE ") != 0) {
+                result->errors++;
+                return true;
+            }
+            size_t length = std::stoul(line.substr(line.rfind(' ') + 1));
+            if (!fill(length + 2)) {
+                return false;
+            }
+            _pos += length + 2;
+            result->hits++;
+        }
+        return false;
+    }
+
+    bool read_binary(uint8_t opcode, loadgen_result *result) {
+        if (!fill(SMMC_BIN_HEADER)) {
+            return false;
+        }
+        uint16_t status;
+        uint32_t body;
+        memcpy(&status, _in.data() + _pos + 6, sizeof(status));
+        memcpy(&body, _in.data() + _pos + 8, sizeof(body));
+        status = ntohs(status);
+        body = ntohl(body);
+        if (!fill(SMMC_BIN_HEADER + body)) {
+            return false;
+        }
+        _pos += SMMC_BIN_HEADER + body;
+        if (opcode == SMMC_BIN_GET) {
+            result->gets++;
+            result->hits += status == SMMC_STATUS_OK;
+            result->errors += status != SMMC_STATUS_OK && status != SMMC_STATUS_NOT_FOUND;
+        } else {
+            result->sets++;
+            result->errors += status != SMMC_STATUS_OK;
+        }
+        return true;
+    }
+
+    const loadgen_options &_opts;
+    int _fd{-1};
+    std::string _request;
+    std::vector<uint8_t> _expected;
+    std::string _in;
+    size_t _pos{};
+};
+
+static void usage(const char *name) {
+    std::cerr << "usage: " << name << " [-p port] [-l host] [-s unix_socket] [-c connections] [-d depth]"
+              << " [-D seconds] [-k keys] [-v value_size] [-g get_percent] [-B] [-P]" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    loadgen_options opts;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:l:s:c:d:D:k:v:g:BPh")) != -1) {
+        switch (opt) {
+            case 'p':
+                opts.port = atoi(optarg);
+                break;
+            case 'l':
+                opts.host = optarg;
+                break;
+            case 's':
+                opts.unix_path = optarg;
+                break;
+            case 'c':
+                opts.connections = std::max(1, atoi(optarg));
+                break;
+            case 'd':
+                opts.depth = std::max(1, atoi(optarg));
+                break;
+            case 'D':
+                opts.seconds = std::max(1, atoi(optarg));
+                break;
+            case 'k':
+                opts.keys = std::max(1, atoi(optarg));
+                break;
+            case 'v':
+                opts.value_size = atoi(optarg);
+                break;
+            case 'g':
+                opts.get_percent = std::min(100, std::max(0, atoi(optarg)));
+                break;
+            case 'B':
+                opts.binary = true;
+                break;
+            case 'P':
+                opts.preload = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    std::string value(opts.value_size, 'v');
+    if (opts.preload) {
+        loadgen_connection conn(opts);
+        loadgen_result result;
+        for (uint32_t i = 0; conn.isOpen() && i < opts.keys; i++) {
+            conn.add_set("key" + std::to_string(i), value);
+            if ((i + 1) % 256 == 0 || i + 1 == opts.keys) {
+                if (!conn.run(&result)) {
+                    std::cerr << "preload failed" << std::endl;
+                    return 1;
+                }
+            }
+        }
+        if (!conn.isOpen()) {
+            return 1;
+        }
+        std::cerr << "preloaded " << result.sets - result.errors << " keys" << std::endl;
+    }
+
+    std::vector<loadgen_result> results(opts.connections);
+    std::vector<std::thread> threads;
+    std::atomic<bool> failed{};
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(opts.seconds);
+    for (uint32_t t = 0; t < opts.connections; t++) {
+        threads.emplace_back([&, t]() {
+            loadgen_connection conn(opts);
+            if (!conn.isOpen()) {
+                failed = true;
+                return;
+            }
+            std::mt19937_64 random(t + 1);
+            auto &result = results[t];
+            while (std::chrono::steady_clock::now() < deadline) {
+                for (uint32_t i = 0; i < opts.depth; i++) {
+                    auto key = "key" + std::to_string(random() % opts.keys);
+                    if (random() % 100 < opts.get_percent) {
+                        conn.add_get(key);
+                    } else {
+                        conn.add_set(key, value);
+                    }
+                }
+                auto start = std::chrono::steady_clock::now();
+                if (!conn.run(&result)) {
+                    failed = true;
+                    return;
+                }
+                result.latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start).count());
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    if (failed) {
+        std::cerr << "connection failed" << std::endl;
+        return 1;
+    }
+
+    loadgen_result total;
+    for (auto &result : results) {
+        total.gets += result.gets;
+        total.hits += result.hits;
+        total.sets += result.sets;
+        total.errors += result.errors;
+        total.latencies.insert(total.latencies.end(), result.latencies.begin(), result.latencies.end());
+    }
+    std::sort(total.latencies.begin(), total.latencies.end());
+    auto percentile = [&total](double p) {
+        return total.latencies.empty() ? 0 : total.latencies[(size_t) (p * (total.latencies.size() - 1))];
+    };
+    uint64_t ops = total.gets + total.sets;
+    std::cout << "protocol      " << (opts.binary ? "binary" : "text") << std::endl;
+    std::cout << "connections   " << opts.connections << " x depth " << opts.depth << std::endl;
+    std::cout << "requests      " << ops << " (" << ops / opts.seconds << " ops/s)" << std::endl;
+    std::cout << "gets          " << total.gets << ", hit ratio "
+              << (total.gets ? (double) total.hits / total.gets : 0) << std::endl;
+    std::cout << "sets          " << total.sets << std::endl;
+    std::cout << "errors        " << total.errors << std::endl;
+    std::cout << "batch latency p50 " << percentile(0.5) << " us, p99 " << percentile(0.99)
+              << " us, p99.9 " << percentile(0.999) << " us, max " << percentile(1) << " us" << std::endl;
+    return total.errors ? 2 : 0;
+}
@@ -0,0 +1,101 @@
+#include <iostream>
+#include <csignal>
+#include <cstdlib>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "SMMemcachedServer.h"
+
+
+// Сервер memcached поверх существующей таблицы:
+//   smc_memcached -t <таблица> [-p порт] [-s unix сокет] [-T потоков] [-c ключей:блоков[:размер блока]]
+// По умолчанию слушает 127.0.0.1:11211; -c создает таблицу, если ее еще нет
+
+static void usage(const char *name) {
+    std::cerr << "usage: " << name << " -t table [-p port] [-l host] [-s unix_socket] [-T threads]"
+              << " [-c keys:blocks[:block_size]]" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    std::string table_name;
+    std::string create;
+    SMMemcachedServer::options opts;
+    bool port_set = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:p:l:s:T:c:h")) != -1) {
+        switch (opt) {
+            case 't':
+                table_name = optarg;
+                break;
+            case 'p':
+                opts.tcp_port = atoi(optarg);
+                port_set = true;
+                break;
+            case 'l':
+                opts.tcp_host = optarg;
+                break;
+            case 's':
+                opts.unix_path = optarg;
+                break;
+            case 'T':
+                opts.threads = atoi(optarg);
+                break;
+            case 'c':
+                create = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (table_name.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!port_set && opts.unix_path.empty()) {
+        opts.tcp_port = 11211;
+    }
+
+    SMHashTable *table;
+    if (create.empty()) {
+        table = new SMHashTable(table_name);
+    } else {
+        unsigned long long keys = 0, blocks = 0, block_size = 512;
+        if (sscanf(create.c_str(), "%llu:%llu:%llu", &keys, &blocks, &block_size) < 2) {
+            usage(argv[0]);
+            return 1;
+        }
+        table = new SMHashTable(table_name, keys, blocks, block_size);
+    }
+    if (!table->isOpen()) {
+        std::cerr << "can't open table " << table_name << std::endl;
+        delete table;
+        return 1;
+    }
+
+    //ждем сигнал в основном потоке, рабочие потоки его не получают
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    auto server = new SMMemcachedServer(table, opts);
+    if (!server->start()) {
+        delete server;
+        delete table;
+        return 1;
+    }
+    if (opts.tcp_port >= 0) {
+        std::cerr << "listening on " << opts.tcp_host << ":" << server->tcpPort() << std::endl;
+    }
+    if (!opts.unix_path.empty()) {
+        std::cerr << "listening on " << opts.unix_path << std::endl;
+    }
+    int signal;
+    sigwait(&signals, &signal);
+    server->stop();
+    delete server;
+    delete table;
+    return 0;
+}